@@ -0,0 +1,37 @@
+
+; Benchmark loop
+; Repeatedly multiplies a counter by itself using shifts and adds.
+; This never halts; run it with a budget, for example:
+;    q1sim -engine threaded -steps 100000000 -time bench.raw
+bench:
+   ldb   bench_count
+   inc
+   sta   bench_count
+   sta   bench_x
+   sta   bench_y
+   clr
+   sta   bench_result
+bench_loop:
+   ldb   bench_x
+   shr
+   sta   bench_x
+   ldb   bench_y
+   jc    bench_bit_set
+   jz    bench
+   j     bench_not_set
+bench_bit_set:
+   ldc   bench_result
+   add
+   sta   bench_result
+bench_not_set:
+   shl
+   sta   bench_y
+   j     bench_loop
+bench_count:
+   db    0
+bench_x:
+   db    0
+bench_y:
+   db    0
+bench_result:
+   db    0
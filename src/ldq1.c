@@ -0,0 +1,502 @@
+/* Linker for the Q1 Computer.
+ *
+ * Links relocatable objects from asmq1 -c into a program. Objects are
+ * placed one after another in the order they are given, each at the
+ * next multiple of its alignment, and their relocations are applied
+ * once every symbol has an address.
+ */
+
+#include "q1out.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A symbol in an object. Values of defined symbols are offsets in the
+ * object's section. */
+typedef struct {
+   char *name;
+   unsigned int value;
+   int defined;
+} SymbolType;
+
+typedef struct {
+   unsigned int offset;
+   unsigned int kind;
+   unsigned int symbol;
+   unsigned int addend;
+} RelocationType;
+
+typedef struct {
+   const char *name;
+   unsigned char *data;
+   size_t size;
+   SegmentType *segments;           /* Offsets in the section. */
+   const unsigned char **segment_data;
+   unsigned int segment_count;
+   unsigned int section_size;
+   unsigned int align;
+   SymbolType *symbols;
+   unsigned int symbol_count;
+   RelocationType *relocations;
+   unsigned int relocation_count;
+   unsigned int base;               /* Address of the section. */
+} ObjectType;
+
+/* A defined symbol, sorted by name for lookup. */
+typedef struct {
+   const char *name;
+   unsigned int addr;
+   const ObjectType *object;
+} GlobalType;
+
+static ObjectType *objects;
+static unsigned int object_count;
+static GlobalType *globals;
+static unsigned int global_count;
+
+static unsigned char image[IMAGE_SIZE];
+static SegmentType *segments;
+static unsigned int segment_count;
+static unsigned int image_end;
+
+static int error_count;
+static unsigned int byte_count;
+
+static void DisplayUsage(const char *name);
+static int ReadObject(ObjectType *op);
+static const unsigned char *Take(const ObjectType *op, size_t *pos,
+                                 size_t count);
+static unsigned int GetNumber(const unsigned char *data, unsigned int bytes);
+static void PlaceObjects(unsigned int base);
+static void DefineGlobals();
+static void CopySegments();
+static void ApplyRelocations(const ObjectType *op);
+static int CompareGlobals(const void *a, const void *b);
+static int CompareName(const void *key, const void *entry);
+
+int main(int argc, char *argv[]) {
+
+   const char *output_name;
+   q1_asm_format_t output_format;
+   OutputImageType output;
+   OutputType *out;
+   OutputSymbolType *symbol_table;
+   unsigned int base;
+   unsigned int x, y, z;
+   char *end;
+
+   /* Parse arguments. */
+   objects = malloc(argc * sizeof(ObjectType));
+   object_count = 0;
+   output_name = NULL;
+   output_format = Q1_ASM_RAW;
+   base = 0;
+   for(x = 1; x < argc; x++) {
+      if(!strcmp(argv[x], "-o") && x + 1 < argc) {
+         output_name = argv[x + 1];
+         ++x;
+      } else if(!strcmp(argv[x], "-raw")) {
+         output_format = Q1_ASM_RAW;
+      } else if(!strcmp(argv[x], "-hex")) {
+         output_format = Q1_ASM_HEX;
+      } else if(!strcmp(argv[x], "-ihex")) {
+         output_format = Q1_ASM_IHEX;
+      } else if(!strcmp(argv[x], "-seg")) {
+         output_format = Q1_ASM_SEG;
+      } else if(!strcmp(argv[x], "-sym")) {
+         output_format = Q1_ASM_SYMBOLS;
+      } else if(!strcmp(argv[x], "-base") && x + 1 < argc) {
+         base = strtoul(argv[x + 1], &end, 0);
+         if(*end || base >= IMAGE_SIZE) {
+            DisplayUsage(argv[0]);
+            return -1;
+         }
+         ++x;
+      } else if(!strcmp(argv[x], "-h")) {
+         DisplayUsage(argv[0]);
+         return 0;
+      } else {
+         memset(&objects[object_count], 0, sizeof(ObjectType));
+         objects[object_count++].name = argv[x];
+      }
+   }
+   if(object_count == 0) {
+      DisplayUsage(argv[0]);
+      return -1;
+   }
+   if(output_name == NULL) {
+      switch(output_format) {
+      case Q1_ASM_HEX:
+         output_name = "out.hex";
+         break;
+      case Q1_ASM_IHEX:
+         output_name = "out.ihx";
+         break;
+      case Q1_ASM_SEG:
+         output_name = "out.seg";
+         break;
+      case Q1_ASM_SYMBOLS:
+         output_name = "out.sym";
+         break;
+      default:
+         output_name = "out.raw";
+         break;
+      }
+   }
+
+   error_count = 0;
+   byte_count = 0;
+   for(x = 0; x < object_count; x++) {
+      if(!ReadObject(&objects[x])) {
+         ++error_count;
+      }
+   }
+   if(error_count == 0) {
+      PlaceObjects(base);
+   }
+   if(error_count == 0) {
+      DefineGlobals();
+   }
+   if(error_count == 0) {
+      CopySegments();
+      for(x = 0; x < object_count; x++) {
+         ApplyRelocations(&objects[x]);
+      }
+   }
+
+   if(error_count == 0) {
+      out = malloc(sizeof(OutputType));
+      if(!OpenOutput(out, output_name)) {
+         fprintf(stderr, "ERROR: could not open %s for writing\n",
+                 output_name);
+         return -1;
+      }
+      /* Symbols are listed in the order the objects define them. */
+      symbol_table = malloc(global_count * sizeof(OutputSymbolType) + 1);
+      y = 0;
+      for(x = 0; x < object_count; x++) {
+         for(z = 0; z < objects[x].symbol_count; z++) {
+            if(objects[x].symbols[z].defined) {
+               symbol_table[y].name = objects[x].symbols[z].name;
+               symbol_table[y].addr = objects[x].base
+                                    + objects[x].symbols[z].value;
+               ++y;
+            }
+         }
+      }
+      output.data = image;
+      output.end = image_end;
+      output.segments = segments;
+      output.segment_count = segment_count;
+      output.symbols = symbol_table;
+      output.symbol_count = global_count;
+      WriteImage(out, &output, output_format);
+      if(!CloseOutput(out)) {
+         fprintf(stderr, "ERROR: could not write %s\n", output_name);
+         ++error_count;
+      }
+      free(out);
+      free(symbol_table);
+   }
+
+   printf("Errors:     %u\n", error_count);
+   printf("Byte count: %u\n", byte_count);
+
+   return error_count;
+
+}
+
+void DisplayUsage(const char *name) {
+   fprintf(stderr, "usage: %s <options> object...\n", name);
+   fprintf(stderr, "options:\n");
+   fprintf(stderr, "\t-o <filename>   Output filename\n");
+   fprintf(stderr, "\t-raw            Raw output\n");
+   fprintf(stderr, "\t-hex            Hex output\n");
+   fprintf(stderr, "\t-ihex           Intel HEX output\n");
+   fprintf(stderr, "\t-seg            Segment output with symbols\n");
+   fprintf(stderr, "\t-sym            Symbol file output\n");
+   fprintf(stderr, "\t-base <addr>    Address of the first object\n");
+}
+
+/* Read and check an object. Returns 0 on error. */
+int ReadObject(ObjectType *op) {
+
+   const unsigned char *ptr;
+   SymbolType *sp;
+   RelocationType *rp;
+   FILE *fd;
+   size_t pos;
+   long size;
+   unsigned int len;
+   unsigned int x;
+
+   fd = fopen(op->name, "rb");
+   if(fd == NULL) {
+      fprintf(stderr, "ERROR: could not open %s\n", op->name);
+      return 0;
+   }
+   fseek(fd, 0, SEEK_END);
+   size = ftell(fd);
+   fseek(fd, 0, SEEK_SET);
+   op->data = malloc(size > 0 ? size : 1);
+   op->size = size > 0 ? (size_t)size : 0;
+   if(fread(op->data, 1, op->size, fd) != op->size) {
+      fprintf(stderr, "ERROR: could not read %s\n", op->name);
+      fclose(fd);
+      return 0;
+   }
+   fclose(fd);
+
+   pos = 0;
+   ptr = Take(op, &pos, 24);
+   if(ptr == NULL || memcmp(ptr, OBJ_MAGIC, 4)
+      || ptr[4] != OBJ_VERSION) {
+      fprintf(stderr, "ERROR: %s is not a Q1 object\n", op->name);
+      return 0;
+   }
+   op->segment_count = GetNumber(&ptr[6], 2);
+   op->section_size = GetNumber(&ptr[8], 4);
+   op->align = GetNumber(&ptr[12], 4);
+   op->symbol_count = GetNumber(&ptr[16], 4);
+   op->relocation_count = GetNumber(&ptr[20], 4);
+   if(op->section_size > IMAGE_SIZE || op->align == 0
+      || op->align > IMAGE_SIZE
+      || op->symbol_count > op->size || op->relocation_count > op->size) {
+      goto invalid;
+   }
+
+   op->segments = malloc(op->segment_count * sizeof(SegmentType) + 1);
+   op->segment_data = malloc(op->segment_count * sizeof(char*) + 1);
+   for(x = 0; x < op->segment_count; x++) {
+      ptr = Take(op, &pos, 8);
+      if(ptr == NULL) {
+         goto invalid;
+      }
+      op->segments[x].start = GetNumber(&ptr[0], 4);
+      op->segments[x].size = GetNumber(&ptr[4], 4);
+      if(op->segments[x].start > op->section_size
+         || op->segments[x].size > op->section_size
+                                   - op->segments[x].start) {
+         goto invalid;
+      }
+      op->segment_data[x] = Take(op, &pos, op->segments[x].size);
+      if(op->segment_data[x] == NULL) {
+         goto invalid;
+      }
+   }
+
+   op->symbols = malloc(op->symbol_count * sizeof(SymbolType) + 1);
+   for(x = 0; x < op->symbol_count; x++) {
+      sp = &op->symbols[x];
+      ptr = Take(op, &pos, 7);
+      if(ptr == NULL) {
+         goto invalid;
+      }
+      sp->defined = ptr[0];
+      sp->value = GetNumber(&ptr[1], 4);
+      len = GetNumber(&ptr[5], 2);
+      ptr = Take(op, &pos, len);
+      if(ptr == NULL) {
+         goto invalid;
+      }
+      sp->name = malloc(len + 1);
+      memcpy(sp->name, ptr, len);
+      sp->name[len] = 0;
+   }
+
+   op->relocations = malloc(op->relocation_count * sizeof(RelocationType)
+                            + 1);
+   for(x = 0; x < op->relocation_count; x++) {
+      rp = &op->relocations[x];
+      ptr = Take(op, &pos, 13);
+      if(ptr == NULL) {
+         goto invalid;
+      }
+      rp->offset = GetNumber(&ptr[0], 4);
+      rp->kind = ptr[4];
+      rp->symbol = GetNumber(&ptr[5], 4);
+      rp->addend = GetNumber(&ptr[9], 4);
+      if((rp->kind != OBJ_BYTE && rp->kind != OBJ_WORD)
+         || rp->offset >= op->section_size
+         || rp->kind > op->section_size - rp->offset
+         || (rp->symbol != OBJ_SECTION && rp->symbol >= op->symbol_count)) {
+         goto invalid;
+      }
+   }
+
+   return 1;
+
+invalid:
+   fprintf(stderr, "ERROR: invalid object: %s\n", op->name);
+   return 0;
+
+}
+
+/* Return the next count bytes of an object, or NULL if it is too
+ * short. */
+const unsigned char *Take(const ObjectType *op, size_t *pos, size_t count) {
+   const unsigned char *result = &op->data[*pos];
+   if(count > op->size - *pos) {
+      return NULL;
+   }
+   *pos += count;
+   return result;
+}
+
+unsigned int GetNumber(const unsigned char *data, unsigned int bytes) {
+   unsigned int result = 0;
+   while(bytes > 0) {
+      --bytes;
+      result = (result << 8) | data[bytes];
+   }
+   return result;
+}
+
+/* Give each object an address. */
+void PlaceObjects(unsigned int base) {
+
+   unsigned int addr;
+   unsigned int x;
+
+   addr = base;
+   for(x = 0; x < object_count; x++) {
+      addr = (addr + objects[x].align - 1) / objects[x].align
+           * objects[x].align;
+      objects[x].base = addr;
+      addr += objects[x].section_size;
+      if(addr > IMAGE_SIZE) {
+         fprintf(stderr, "ERROR: program too large\n");
+         ++error_count;
+         return;
+      }
+   }
+
+}
+
+/* Collect the defined symbols of every object. */
+void DefineGlobals() {
+
+   const ObjectType *op;
+   unsigned int x, y;
+
+   global_count = 0;
+   for(x = 0; x < object_count; x++) {
+      global_count += objects[x].symbol_count;
+   }
+   globals = malloc(global_count * sizeof(GlobalType) + 1);
+
+   global_count = 0;
+   for(x = 0; x < object_count; x++) {
+      op = &objects[x];
+      for(y = 0; y < op->symbol_count; y++) {
+         if(op->symbols[y].defined) {
+            globals[global_count].name = op->symbols[y].name;
+            globals[global_count].addr = op->base + op->symbols[y].value;
+            globals[global_count].object = op;
+            ++global_count;
+         }
+      }
+   }
+
+   qsort(globals, global_count, sizeof(GlobalType), CompareGlobals);
+   for(x = 1; x < global_count; x++) {
+      if(!strcmp(globals[x - 1].name, globals[x].name)) {
+         fprintf(stderr, "ERROR: duplicate symbol: \"%s\" in %s and %s\n",
+                 globals[x].name, globals[x - 1].object->name,
+                 globals[x].object->name);
+         ++error_count;
+      }
+   }
+
+}
+
+/* Copy the segments of every object to the image. Segments that meet
+ * are joined. */
+void CopySegments() {
+
+   const ObjectType *op;
+   SegmentType *sp;
+   unsigned int start;
+   unsigned int size;
+   unsigned int x, y;
+
+   memset(image, 0xFF, sizeof(image));
+   segment_count = 0;
+   for(x = 0; x < object_count; x++) {
+      segment_count += objects[x].segment_count;
+   }
+   segments = malloc(segment_count * sizeof(SegmentType) + 1);
+
+   segment_count = 0;
+   for(x = 0; x < object_count; x++) {
+      op = &objects[x];
+      for(y = 0; y < op->segment_count; y++) {
+         start = op->base + op->segments[y].start;
+         size = op->segments[y].size;
+         memcpy(&image[start], op->segment_data[y], size);
+         byte_count += size;
+         image_end = start + size > image_end ? start + size : image_end;
+         sp = segment_count ? &segments[segment_count - 1] : NULL;
+         if(sp != NULL && sp->start + sp->size == start) {
+            sp->size += size;
+         } else {
+            sp = &segments[segment_count++];
+            sp->start = start;
+            sp->size = size;
+         }
+      }
+   }
+
+}
+
+/* Patch the arguments that depend on addresses. Symbols an object does
+ * not define are looked up in the others. */
+void ApplyRelocations(const ObjectType *op) {
+
+   const RelocationType *rp;
+   const SymbolType *sp;
+   const GlobalType *gp;
+   unsigned int addr;
+   unsigned int value;
+   unsigned int x;
+
+   for(x = 0; x < op->relocation_count; x++) {
+      rp = &op->relocations[x];
+      if(rp->symbol == OBJ_SECTION) {
+         value = op->base;
+      } else {
+         sp = &op->symbols[rp->symbol];
+         if(sp->defined) {
+            value = op->base + sp->value;
+         } else {
+            gp = bsearch(sp->name, globals, global_count, sizeof(GlobalType),
+                         CompareName);
+            if(gp == NULL) {
+               fprintf(stderr, "ERROR: symbol not found: \"%s\" in %s\n",
+                       sp->name, op->name);
+               ++error_count;
+               continue;
+            }
+            value = gp->addr;
+         }
+      }
+      value += rp->addend;
+      addr = op->base + rp->offset;
+      if(rp->kind == OBJ_BYTE) {
+         image[addr] = (unsigned char)value;
+      } else {
+         image[addr] = (unsigned char)(value >> 8);
+         image[addr + 1] = (unsigned char)value;
+      }
+   }
+
+}
+
+int CompareGlobals(const void *a, const void *b) {
+   return strcmp(((const GlobalType*)a)->name, ((const GlobalType*)b)->name);
+}
+
+int CompareName(const void *key, const void *entry) {
+   return strcmp((const char*)key, ((const GlobalType*)entry)->name);
+}
@@ -0,0 +1,295 @@
+/* Q1 simulator library.
+ *
+ * Each q1_cpu_t is an independent machine with its own registers,
+ * 64 KiB of memory and translation caches. No state is shared between
+ * machines, so any number of them can be created in one process and
+ * different machines can be run from different threads.
+ */
+
+#ifndef Q1_H
+#define Q1_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct q1_cpu q1_cpu_t;
+
+/* Result of q1_step and q1_run. */
+typedef enum {
+   Q1_RUNNING,       /* Stopped at the end of the budget. */
+   Q1_HALTED,        /* hlt executed. */
+   Q1_FAULT,         /* An invalid instruction was executed. */
+   Q1_BREAK          /* Stopped at a breakpoint or watchpoint. */
+} q1_status_t;
+
+/* Execution engines. All produce identical results and clock counts. */
+typedef enum {
+   Q1_ENGINE_INTERP,    /* Reference interpreter. */
+   Q1_ENGINE_THREADED,  /* Direct-threaded interpreter. */
+   Q1_ENGINE_CACHED,    /* Predecoded instructions. */
+   Q1_ENGINE_BLOCK,     /* Translated basic blocks. */
+   Q1_ENGINE_JIT,       /* Native x86-64 code for hot blocks. */
+   Q1_ENGINE_COUNT
+} q1_engine_t;
+
+typedef struct {
+   unsigned char a, b, c;
+   unsigned short x;
+   unsigned short pc;
+   unsigned char c_flag, z_flag, n_flag;
+} q1_regs_t;
+
+/* Create a machine in the power-on state using the interpreter.
+ * Returns NULL if out of memory. */
+q1_cpu_t *q1_create(void);
+
+/* Destroy a machine. */
+void q1_destroy(q1_cpu_t *cpu);
+
+/* Return to the power-on state: all registers and memory 0xFF, flags
+ * set, PC 0 and counters cleared. */
+void q1_reset(q1_cpu_t *cpu);
+
+/* Copy size bytes to memory starting at addr.
+ * Returns the number of bytes loaded, which is less than size if the
+ * data would run past the end of memory. */
+size_t q1_load(q1_cpu_t *cpu, unsigned short addr,
+               const void *data, size_t size);
+
+/* Execute one instruction. */
+q1_status_t q1_step(q1_cpu_t *cpu);
+
+/* Execute up to budget instructions (0 for no limit). */
+q1_status_t q1_run(q1_cpu_t *cpu, unsigned long long budget);
+
+/* Execute until the step or clock counter reaches a limit (0 for no
+ * limit). The check is made before each instruction, so the clock
+ * counter can pass max_clocks by up to one instruction. */
+q1_status_t q1_run_limits(q1_cpu_t *cpu, unsigned long long max_steps,
+                          unsigned long long max_clocks);
+
+/* Select the engine. Returns 0 if it was not built in. */
+int q1_set_engine(q1_cpu_t *cpu, q1_engine_t engine);
+q1_engine_t q1_get_engine(const q1_cpu_t *cpu);
+
+/* Look up an engine by name ("interp", "threaded", "cached", "block"
+ * or "jit"). Returns 0 if the name is unknown. */
+int q1_find_engine(const char *name, q1_engine_t *engine);
+const char *q1_engine_name(q1_engine_t engine);
+
+/* Registers. */
+void q1_get_regs(const q1_cpu_t *cpu, q1_regs_t *regs);
+void q1_set_regs(q1_cpu_t *cpu, const q1_regs_t *regs);
+
+/* Memory. Writes invalidate any translated code they overlap. */
+const unsigned char *q1_memory(const q1_cpu_t *cpu);
+unsigned char q1_read(const q1_cpu_t *cpu, unsigned short addr);
+void q1_write(q1_cpu_t *cpu, unsigned short addr, unsigned char value);
+
+/* Counters since the last reset. */
+unsigned long long q1_clocks(const q1_cpu_t *cpu);
+unsigned long long q1_steps(const q1_cpu_t *cpu);
+int q1_halted(const q1_cpu_t *cpu);
+
+/* Stream for invalid instruction messages (stderr by default, NULL to
+ * discard them). */
+void q1_set_log(q1_cpu_t *cpu, FILE *log);
+
+/* Breakpoints and watchpoints.
+ *
+ * Each address can have an execution breakpoint, which stops a run
+ * before the instruction there, and read and write watchpoints, which
+ * stop a run after an instruction that reads or writes it. The run then
+ * returns Q1_BREAK. Running again from a breakpoint executes the
+ * instruction there. Points are kept in a 64K map that is only looked
+ * at while some are set. With only execution breakpoints every engine
+ * keeps running: translated blocks end at each breakpoint and check the
+ * map once per block, the other engines check it before each
+ * instruction, which costs them up to 10% on examples/bench.s.
+ * Watchpoints run the machine with a checking interpreter.
+ */
+#define Q1_BREAK_EXEC   1
+#define Q1_WATCH_READ   2
+#define Q1_WATCH_WRITE  4
+
+/* Set the points at addr to a combination of the flags above, or clear
+ * them with 0. Returns 0 if out of memory. */
+int q1_set_break(q1_cpu_t *cpu, unsigned short addr, unsigned int flags);
+unsigned int q1_get_break(const q1_cpu_t *cpu, unsigned short addr);
+
+/* After a run returns Q1_BREAK, return the kind of point that stopped it
+ * (one of the flags above) and set addr to its address. */
+unsigned int q1_break_reason(const q1_cpu_t *cpu, unsigned short *addr);
+
+/* Snapshots.
+ *
+ * A q1_snapshot_t holds the registers, counters and memory of a
+ * machine. After a snapshot is saved or restored the machine records
+ * which 256-byte pages of memory it writes, so restoring the same
+ * snapshot again only copies those pages back. Restoring any other
+ * snapshot copies all of memory. A snapshot can be restored to any
+ * machine.
+ */
+typedef struct q1_snapshot q1_snapshot_t;
+
+/* Create an empty snapshot. Returns NULL if out of memory. */
+q1_snapshot_t *q1_snapshot_create(void);
+void q1_snapshot_destroy(q1_snapshot_t *snap);
+
+/* Save the current state of a machine, replacing the snapshot. */
+void q1_snapshot_save(q1_cpu_t *cpu, q1_snapshot_t *snap);
+
+/* Return a machine to a saved state. */
+void q1_snapshot_restore(q1_cpu_t *cpu, const q1_snapshot_t *snap);
+
+/* Profiles.
+ *
+ * A q1_profile_t counts the instructions executed and clocks spent at
+ * each address, how often the jump or call at each address was taken,
+ * and the clocks spent in each call path. A call path starts at a taken
+ * call and ends at the ret that returns to the address after it; a ret
+ * to any other address is treated as a jump. While a profile is
+ * attached the machine runs with a profiling interpreter, whatever its
+ * engine. A profile should only be attached to one machine at a time.
+ */
+typedef struct q1_profile q1_profile_t;
+
+/* Create an empty profile. Returns NULL if out of memory. */
+q1_profile_t *q1_profile_create(void);
+void q1_profile_destroy(q1_profile_t *prof);
+
+/* Clear all counts and call paths. */
+void q1_profile_clear(q1_profile_t *prof);
+
+/* Record the instructions a machine executes in prof, or stop recording
+ * if prof is NULL. */
+void q1_set_profile(q1_cpu_t *cpu, q1_profile_t *prof);
+
+/* Counts for the instruction at an address. */
+unsigned long long q1_profile_count(const q1_profile_t *prof,
+                                    unsigned short addr);
+unsigned long long q1_profile_clocks(const q1_profile_t *prof,
+                                     unsigned short addr);
+unsigned long long q1_profile_taken(const q1_profile_t *prof,
+                                    unsigned short addr);
+
+/* Call paths. Path 0 is the top level and addr is where it started;
+ * any other path is a call to addr from its parent path. clocks counts
+ * instructions in the path itself, not in the calls it made. Returns 0
+ * if index is out of range. */
+unsigned int q1_profile_path_count(const q1_profile_t *prof);
+int q1_profile_path(const q1_profile_t *prof, unsigned int index,
+                    unsigned int *parent, unsigned short *addr,
+                    unsigned long long *clocks);
+
+/* Traces.
+ *
+ * A q1_trace_t writes each instruction a machine executes, with the
+ * registers it changed, to a file that q1trace can read. The file is
+ * packed and written by a thread of its own. Attaching a trace writes
+ * the registers and memory of the machine, so later changes made with
+ * q1_load, q1_write or q1_set_regs are only seen by attaching it again.
+ * While a trace is attached the machine runs with a recording
+ * interpreter, whatever its engine.
+ */
+typedef struct q1_trace q1_trace_t;
+
+/* Create a trace file. Returns NULL if it could not be created. */
+q1_trace_t *q1_trace_open(const char *name);
+
+/* Finish and close a trace, which must not be attached to a machine.
+ * Returns 0 if the file could not be written. */
+int q1_trace_close(q1_trace_t *trace);
+
+/* Record the instructions a machine executes in trace, or stop
+ * recording if trace is NULL. */
+void q1_set_trace(q1_cpu_t *cpu, q1_trace_t *trace);
+
+/* History.
+ *
+ * A q1_history_t records a checkpoint of a machine every interval
+ * instructions, holding only the pages of memory written since the
+ * checkpoint before it. The machine can then be moved to any step it
+ * has reached by rebuilding the checkpoint before that step and running
+ * forward fewer than interval instructions. Attaching a history takes
+ * the first checkpoint, so changes made later with q1_load, q1_write,
+ * q1_set_regs or q1_snapshot_restore are only seen by attaching it
+ * again. While a history is attached the machine runs with a recording
+ * interpreter, whatever its engine. Steps replayed to move a machine
+ * are not recorded in its profile or trace and do not stop at its
+ * breakpoints.
+ */
+typedef struct q1_history q1_history_t;
+
+/* Create an empty history taking a checkpoint every interval
+ * instructions (0 for the default of 4096). Returns NULL if out of
+ * memory. */
+q1_history_t *q1_history_create(unsigned int interval);
+void q1_history_destroy(q1_history_t *hist);
+
+/* Record the run of a machine in hist, discarding anything it held, or
+ * stop recording if hist is NULL. */
+void q1_set_history(q1_cpu_t *cpu, q1_history_t *hist);
+
+/* Steps that can be reached: from the step at which the history was
+ * attached to the furthest step run since. If memory runs out the
+ * history stops growing. */
+void q1_history_range(const q1_history_t *hist, unsigned long long *first,
+                      unsigned long long *end);
+
+/* Move a machine to the state after step instructions, forward or
+ * back. Returns 0 if step is out of range. */
+int q1_history_seek(q1_cpu_t *cpu, unsigned long long step);
+
+/* Move a machine back to just before the last instruction that stored
+ * to addr, setting step to the number of instructions before it.
+ * Returns 0, leaving the machine where it was, if there is none. */
+int q1_history_last_write(q1_cpu_t *cpu, unsigned short addr,
+                          unsigned long long *step);
+
+/* Lockstep batches.
+ *
+ * A q1_batch_t holds Q1_BATCH_LANES machines that run the same program
+ * with different inputs. Registers are kept in byte vectors, one lane
+ * per machine, and lanes at the same PC execute each instruction
+ * together. Lanes that branch differently are run in groups until they
+ * meet again at the same PC. Each lane has its own memory and results
+ * match running the lane alone with q1_run.
+ */
+#define Q1_BATCH_LANES 32
+
+typedef struct q1_batch q1_batch_t;
+
+/* Create a batch with every lane in the power-on state.
+ * Returns NULL if out of memory. */
+q1_batch_t *q1_batch_create(void);
+void q1_batch_destroy(q1_batch_t *batch);
+
+/* Set the program for all lanes and reset them. Memory outside the
+ * program is 0xFF. */
+void q1_batch_load(q1_batch_t *batch, unsigned short addr,
+                   const void *data, size_t size);
+
+/* Return all lanes to the power-on state with the program loaded. */
+void q1_batch_reset(q1_batch_t *batch);
+
+/* Run lanes 0 to lanes - 1 until each halts, faults or reaches a limit
+ * (0 for no limit) as with q1_run_limits. */
+void q1_batch_run(q1_batch_t *batch, unsigned int lanes,
+                  unsigned long long max_steps,
+                  unsigned long long max_clocks);
+
+/* Per-lane state. */
+void q1_batch_get_regs(const q1_batch_t *batch, unsigned int lane,
+                       q1_regs_t *regs);
+void q1_batch_set_regs(q1_batch_t *batch, unsigned int lane,
+                       const q1_regs_t *regs);
+q1_status_t q1_batch_status(const q1_batch_t *batch, unsigned int lane);
+unsigned long long q1_batch_steps(const q1_batch_t *batch,
+                                  unsigned int lane);
+unsigned long long q1_batch_clocks(const q1_batch_t *batch,
+                                   unsigned int lane);
+unsigned char q1_batch_read(const q1_batch_t *batch, unsigned int lane,
+                            unsigned short addr);
+
+#endif /* Q1_H */
@@ -0,0 +1,2486 @@
+
+/* Q1 assembler library.
+ *
+ * A program is preprocessed into lines, assembled in one pass with
+ * fixups for arguments that refer to later labels, and then written in
+ * one of the output formats. All state is in the q1_asm_t.
+ */
+
+#include "q1asm.h"
+#include "q1out.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_INCLUDES 8
+
+#define BLOCK_SIZE   (1 << 16)
+#define INVALID_OP   0xFF
+#define BYTE_OP      0xFE
+#define WORD_OP      0xFD
+#define ORG_OP       0xFC
+#define ALIGN_OP     0xFB
+#define SPACE_OP     0xFA
+#define NO_SYMBOL    0xFFFFFFFFU
+
+typedef unsigned char OperationType;
+typedef unsigned int AddressType;
+
+typedef struct {
+   char *name;
+   char *value;
+   unsigned int mark;      /* Last cache record that saved this macro. */
+} MacroType;
+
+typedef struct {
+   char *arg;
+   OperationType op;
+} StatementType;
+
+/* A line of preprocessed source.
+ * raw is the offset of the line as written in source and is not
+ * terminated. text is the offset in line_text of the line with comments
+ * and extra whitespace removed, in lower case, which is parsed in place.
+ * The length of the label and the offset of the statement after it in
+ * text are found while the line is cleaned up.
+ * Lines replayed from the cache are already parsed; arg is the offset
+ * of their argument in text, or 0 if there is none. */
+typedef struct {
+   unsigned int raw;
+   unsigned int raw_length;
+   unsigned int text;
+   unsigned int label_length;
+   unsigned int body;
+   unsigned int arg;
+   StatementType statement;
+   AddressType addr;
+   unsigned char has_statement;
+   unsigned char parsed;
+} LineType;
+
+/* A growable character buffer. */
+typedef struct {
+   char *data;
+   size_t size;
+   size_t max;
+} BufferType;
+
+/* A file read while preprocessing and the hash of its contents.
+ * The size and modification time let an unchanged file be recognized
+ * without reading it; mtime is 0 if it cannot be trusted. */
+typedef struct {
+   const char *name;
+   long long size;
+   long long mtime;
+   unsigned long long hash;
+} DependencyType;
+
+/* Value of a macro after a file was preprocessed. */
+typedef struct {
+   const char *name;
+   const char *value;
+} MacroValueType;
+
+/* A file that was preprocessed and the lines, files and macros that
+ * came from it, to be saved in the cache once it has been assembled. */
+typedef struct {
+   unsigned long long key;
+   unsigned int first_line;
+   unsigned int last_line;
+   unsigned int first_dependency;
+   unsigned int last_dependency;
+   MacroValueType *macros;
+   unsigned int macro_count;
+} CacheRecordType;
+
+typedef enum {
+   EXPR_VALUE     = 'v',
+   EXPR_SYMBOL    = 's',
+   EXPR_ADD       = '+',
+   EXPR_SUBTRACT  = '-',
+   EXPR_MULTIPLY  = '*',
+   EXPR_DIVIDE    = '/'
+} ExprKind;
+
+/* Parsed argument. Subexpressions that do not depend on a later label
+ * are folded into values as they are parsed. */
+typedef struct ExprNode {
+   ExprKind kind;
+   unsigned int value;        /* Value or symbol number. */
+   struct ExprNode *left;
+   struct ExprNode *right;
+} ExprNode;
+
+/* An argument that could not be evaluated when its statement was
+ * assembled, usually because it refers to a later label. */
+typedef struct {
+   AddressType addr;
+   const ExprNode *expr;
+   OperationType op;
+} FixupType;
+
+/* A file read into memory. mtime is 0 if it is not known. */
+typedef struct {
+   const char *data;
+   size_t size;
+   void *map;
+   size_t map_size;
+   long long mtime;
+} FileType;
+
+typedef struct {
+   char *name;
+   OperationType opcode;
+   int arg_count;
+} InstructionMapType;
+
+/* A place in an object that depends on where it is loaded. */
+typedef struct {
+   AddressType addr;
+   OperationType op;
+   unsigned int symbol;    /* External symbol or OBJ_SECTION. */
+   unsigned int addend;
+} RelocationType;
+
+/* Value of an argument in an object: a number plus the address of the
+ * section some number of times and at most one external symbol. */
+typedef struct {
+   unsigned int value;
+   int sections;
+   unsigned int symbol;    /* NO_SYMBOL if none. */
+} RelocValueType;
+
+/* Symbols are numbered in the order they are first seen, whether
+ * defined by a label or referenced by an expression. */
+typedef struct {
+   char *name;
+   AddressType addr;
+   int defined;
+} SymbolNode;
+
+/* Symbol table entry mapping a name to its number. */
+typedef struct {
+   char *name;
+   unsigned int index;
+} SymbolEntry;
+
+/* Open-addressing hash table. An entry is free if its name is NULL.
+ * The table is kept at most half full. */
+typedef struct {
+   void *entries;
+   size_t entry_size;
+   unsigned int size;      /* Power of 2. */
+   unsigned int count;
+} HashTableType;
+
+/* Names and expressions are allocated from an arena and never freed. */
+#define ARENA_BLOCK_SIZE   (1 << 16)
+
+typedef struct ArenaBlock {
+   struct ArenaBlock *next;
+   size_t used;
+   size_t size;
+   char data[];
+} ArenaBlock;
+
+static InstructionMapType INSTRUCTION_MAP[] = {
+
+   /* J-class */
+   {  "j",        0x00,    1  },
+   {  "jc",       0x01,    1  },
+   {  "jz",       0x02,    1  },
+   {  "jcz",      0x03,    1  },
+   {  "jn",       0x04,    1  },
+   {  "jcn",      0x05,    1  },
+   {  "jzn",      0x06,    1  },
+   {  "jczn",     0x07,    1  },
+   {  "c",        0x08,    1  },
+   {  "cc",       0x09,    1  },
+   {  "cz",       0x0A,    1  },
+   {  "ccz",      0x0B,    1  },
+   {  "cn",       0x0C,    1  },
+   {  "ccn",      0x0D,    1  },
+   {  "czn",      0x0E,    1  },
+   {  "cczn",     0x0F,    1  },
+
+   /* LS-class */
+   {  "ldb",      0x10,    1  },
+   {  "ldc",      0x11,    1  },
+   {  "lxh",      0x12,    1  },
+   {  "lxl",      0x13,    1  },
+   {  "stb",      0x14,    1  },
+   {  "stc",      0x15,    1  },
+   {  "sxh",      0x16,    1  },
+   {  "sxl",      0x17,    1  },
+   {  "sta",      0x18,    1  },
+
+   /* A-class */
+   {  "and",      0x20,    0  },
+   {  "or",       0x21,    0  },
+   {  "shl",      0x22,    0  },
+   {  "shr",      0x23,    0  },
+   {  "add",      0x24,    0  },
+   {  "inc",      0x25,    0  },
+   {  "dec",      0x26,    0  },
+   {  "not",      0x27,    0  },
+   {  "clr",      0x28,    0  },
+
+   /* M-class */
+   {  "mab",      0x30,    0  },
+   {  "mac",      0x31,    0  },
+   {  "sax",      0x32,    0  },
+   {  "sbx",      0x33,    0  },
+   {  "scx",      0x34,    0  },
+   {  "lbx",      0x35,    0  },
+   {  "lcx",      0x36,    0  },
+   {  "ret",      0x37,    0  },
+   {  "hlt",      0x38,    0  },
+
+   /* Pseudo-instructions */
+   {  "db",       BYTE_OP, 1  },
+   {  "dw",       WORD_OP, 1  },
+   {  "org",      ORG_OP,  1  },
+   {  "align",    ALIGN_OP, 1 },
+   {  "ds",       SPACE_OP, 1 }
+
+};
+
+/* Cache entries, one per file and macro environment.
+ * Numbers are little endian; strings are a length (4) and the bytes.
+ *    header:     "Q1AC", version (4), key (8)
+ *    files:      count (4), then name, size (8), modification time (8)
+ *                and content hash (8) of each
+ *    macros:     count (4), then name and value of each
+ *    lines:      count (4), the raw lines, the clean lines each ending
+ *                with a 0, then raw length (4), clean length (4), label
+ *                length (4), has statement (1), opcode (1) and argument
+ *                offset (4) of each
+ * The first file is the one the entry is for; the rest are the files
+ * it included. An entry is used only if none of them has changed.
+ */
+#define CACHE_MAGIC        "Q1AC"
+#define CACHE_VERSION      1
+#define HASH64_INIT        14695981039346656037ULL
+
+static const size_t instruction_count
+   = sizeof(INSTRUCTION_MAP) / sizeof(INSTRUCTION_MAP[0]);
+
+/* Perfect hash of the instruction names. A name of up to 8 characters
+ * packed into a number is multiplied by a seed and the top bits select a
+ * slot; InitInstructions picks a seed that gives every name its own
+ * slot, so a lookup is one multiply and one compare. */
+#define INSTRUCTION_BITS   8
+#define INSTRUCTION_SLOTS  (1 << INSTRUCTION_BITS)
+static unsigned long long instruction_seed;
+static unsigned long long instruction_keys[INSTRUCTION_SLOTS];
+static unsigned char instruction_slots[INSTRUCTION_SLOTS];
+
+/* Lines are cleaned up 16 bytes at a time until a character that needs
+ * more than copying and lowering. */
+typedef unsigned char ChunkType __attribute__((vector_size(16)));
+
+struct q1_asm {
+
+   unsigned int error_count;
+   BufferType messages;
+   HashTableType symbols;
+   SymbolNode *symbol_list;
+   unsigned int symbol_count;
+   unsigned int symbol_max;
+   HashTableType macros;
+   ArenaBlock *arena;
+
+   /* Preprocessed source and its lines. */
+   BufferType source;
+   BufferType line_text;
+   LineType *lines;
+   unsigned int line_count;
+   unsigned int line_max;
+
+   /* Hash of all macro names and values, for cache keys. */
+   unsigned long long macro_digest;
+
+   /* Cache state. Dependencies and macro names are logged in the order
+    * they are seen so that a record covers a range of each log. */
+   const char *cache_dir;
+   DependencyType *dependencies;
+   unsigned int dependency_count;
+   unsigned int dependency_max;
+   const char **macro_log;
+   unsigned int macro_log_count;
+   unsigned int macro_log_max;
+   CacheRecordType *cache_records;
+   unsigned int cache_record_count;
+   unsigned int cache_record_max;
+
+   /* Copy of the current preprocessor line. */
+   char *scratch;
+   size_t scratch_max;
+   AddressType current_address;
+   unsigned int byte_count;
+
+   /* Assembled bytes, indexed by address. Addresses that are not in a
+    * segment hold 0xFF, the power-on state of memory. */
+   unsigned char image[IMAGE_SIZE];
+   unsigned char image_used[IMAGE_SIZE / 8];
+   AddressType image_end;
+   int image_overflow;
+   int image_overlap;
+
+   /* Segments in the order they were started. */
+   SegmentType *segments;
+   unsigned int segment_count;
+   unsigned int segment_max;
+
+   /* Object output. The unit is one section starting at offset 0 and
+    * symbols that are not defined are external, so arguments that refer
+    * to symbols are left as fixups to become relocations. */
+   int object_mode;
+   AddressType section_size;
+   unsigned int section_align;
+   RelocationType *relocations;
+   unsigned int relocation_count;
+   unsigned int relocation_max;
+
+   FixupType *fixups;
+   unsigned int fixup_count;
+   unsigned int fixup_max;
+
+   /* Position in the argument being parsed. */
+   const char *parse_ptr;
+
+};
+
+static void InitInstructions(void);
+static void Error(q1_asm_t *as, const char *format, ...);
+static void Warn(q1_asm_t *as, const char *format, ...);
+static void AddMessage(q1_asm_t *as, const char *prefix, const char *format,
+                       va_list ap);
+static void DoPreprocess(q1_asm_t *as, const char *filename,
+                         const char *data, size_t size);
+static void DoPreprocessFile(q1_asm_t *as, const char *filename,
+                             const char *data, size_t size, int level);
+static int ReadFile(const char *filename, FileType *file);
+static void CloseFile(FileType *file);
+static char *CopyLine(q1_asm_t *as, const char *line, size_t len);
+static char *ReserveBuffer(BufferType *buffer, size_t len);
+static size_t AppendBuffer(BufferType *buffer, const char *data, size_t len);
+static const char *LineRaw(const q1_asm_t *as, const LineType *lp);
+static char *LineText(const q1_asm_t *as, const LineType *lp);
+static void AppendLine(q1_asm_t *as, const char *line, size_t len);
+static size_t CleanLine(char *out, const char *line, size_t len,
+                        LineType *lp);
+static void AddDependency(q1_asm_t *as, const char *name,
+                          const FileType *file, unsigned long long hash);
+static int CheckDependency(const DependencyType *dp);
+static void LogMacro(q1_asm_t *as, const char *name);
+static unsigned long long CacheKey(const q1_asm_t *as, const char *filename,
+                                   int level);
+static char *CachePath(const q1_asm_t *as, unsigned long long key);
+static int LoadCache(q1_asm_t *as, unsigned long long key);
+static int ReadCache(q1_asm_t *as, const char *data, size_t size,
+                     unsigned long long key, int replay);
+static int ValidOperation(unsigned int op);
+static void RecordCache(q1_asm_t *as, unsigned long long key,
+                        unsigned int first_line,
+                        unsigned int first_dependency,
+                        unsigned int first_macro);
+static void SaveCache(q1_asm_t *as);
+static void WriteCacheEntry(q1_asm_t *as, const CacheRecordType *rp);
+static void PutNumber(FILE *fd, unsigned long long value,
+                      unsigned int bytes);
+static void PutString(FILE *fd, const char *str, size_t len);
+static void ProcessDefineStart(q1_asm_t *as, const char *line, char **name);
+static void ProcessDefine(q1_asm_t *as, const char *line, const char *name);
+static void ProcessDefineEnd(q1_asm_t *as, char **name);
+static void ProcessMacro(q1_asm_t *as, const char *name);
+static void DoAssemble(q1_asm_t *as);
+static void EmitByte(q1_asm_t *as, unsigned int value);
+static void SetAddress(q1_asm_t *as, const StatementType *statement);
+static void EmitArgument(q1_asm_t *as, const char *arg, OperationType op);
+static void ResolveFixups(q1_asm_t *as);
+static void AddRelocation(q1_asm_t *as, const FixupType *fp,
+                          const RelocValueType *rp);
+static void WriteOutput(const q1_asm_t *as, OutputType *out,
+                        q1_asm_format_t format);
+static void WriteObject(const q1_asm_t *as, OutputType *out);
+static void WriteListing(const q1_asm_t *as, OutputType *out);
+static StatementType ParseStatement(q1_asm_t *as, char *line);
+static const InstructionMapType *FindInstruction(const char *name,
+                                                 size_t len);
+static unsigned long long PackName(const char *name, size_t len);
+static void DefineLabel(q1_asm_t *as, const char *name, size_t len);
+static void StripWhitespace(char *line);
+static int AddSymbol(q1_asm_t *as, const char *name, size_t len,
+                     unsigned int value);
+static unsigned int InternSymbol(q1_asm_t *as, const char *name, size_t len);
+static int AddMacro(q1_asm_t *as, const char *name);
+static MacroType *FindMacro(q1_asm_t *as, const char *name);
+static void AppendMacro(q1_asm_t *as, const char *name, const char *value);
+static void SetMacro(q1_asm_t *as, const char *name, const char *value,
+                     size_t len);
+static unsigned long long MacroHash(const MacroType *mp);
+static void *ArenaAlloc(q1_asm_t *as, size_t size);
+static char *ArenaCopy(q1_asm_t *as, const char *str, size_t len);
+static unsigned int Hash(const char *str, size_t len);
+static unsigned long long Hash64(unsigned long long hash, const void *data,
+                                 size_t len);
+static void CreateTable(HashTableType *table, size_t entry_size,
+                        unsigned int count);
+static void *FindEntry(const HashTableType *table, const char *name,
+                       size_t len);
+static void *InsertEntry(q1_asm_t *as, HashTableType *table,
+                         const char *name, size_t len);
+static ExprNode *ParseExpression(q1_asm_t *as, const char *str);
+static ExprNode *ParseSum(q1_asm_t *as);
+static ExprNode *ParseProduct(q1_asm_t *as);
+static ExprNode *ParseFactor(q1_asm_t *as);
+static ExprNode *MakeValue(q1_asm_t *as, unsigned int value);
+static ExprNode *MakeOperation(q1_asm_t *as, ExprKind kind, ExprNode *left,
+                               ExprNode *right);
+static unsigned int Apply(q1_asm_t *as, ExprKind kind, unsigned int left,
+                          unsigned int right);
+static unsigned int Evaluate(q1_asm_t *as, const ExprNode *np);
+static int EvaluateRelocatable(q1_asm_t *as, const ExprNode *np,
+                               RelocValueType *result);
+
+q1_asm_t *q1_asm_create(void) {
+
+   static pthread_once_t instruction_once = PTHREAD_ONCE_INIT;
+   q1_asm_t *as;
+
+   pthread_once(&instruction_once, InitInstructions);
+
+   as = calloc(1, sizeof(q1_asm_t));
+   if(as == NULL) {
+      return NULL;
+   }
+   memset(as->image, 0xFF, sizeof(as->image));
+   as->section_align = 1;
+   CreateTable(&as->macros, sizeof(MacroType), 0);
+
+   return as;
+
+}
+
+void q1_asm_destroy(q1_asm_t *as) {
+
+   ArenaBlock *bp;
+   MacroType *mp;
+   unsigned int x;
+
+   if(as == NULL) {
+      return;
+   }
+
+   for(x = 0; x < as->macros.size; x++) {
+      mp = &((MacroType*)as->macros.entries)[x];
+      if(mp->name) {
+         free(mp->value);
+      }
+   }
+   free(as->macros.entries);
+   free(as->symbols.entries);
+   free(as->symbol_list);
+   free(as->source.data);
+   free(as->line_text.data);
+   free(as->lines);
+   free(as->dependencies);
+   free(as->macro_log);
+   free(as->cache_records);
+   free(as->scratch);
+   free(as->segments);
+   free(as->relocations);
+   free(as->fixups);
+   free(as->messages.data);
+   while(as->arena) {
+      bp = as->arena;
+      as->arena = bp->next;
+      free(bp);
+   }
+   free(as);
+
+}
+
+void q1_asm_set_object(q1_asm_t *as, int object) {
+   as->object_mode = object != 0;
+}
+
+void q1_asm_set_cache(q1_asm_t *as, const char *dir) {
+   as->cache_dir = dir;
+}
+
+unsigned int q1_asm_assemble(q1_asm_t *as, const char *name,
+                             const char *source, size_t size) {
+
+   if(as->symbols.entries) {
+      Error(as, "already assembled");
+      return as->error_count;
+   }
+
+   DoPreprocess(as, name, source, size);
+
+   /* There is at most one label per line. */
+   CreateTable(&as->symbols, sizeof(SymbolEntry), as->line_count);
+   DoAssemble(as);
+   if(as->error_count == 0) {
+      ResolveFixups(as);
+   }
+   if(as->cache_dir && as->error_count == 0) {
+      SaveCache(as);
+   }
+
+   return as->error_count;
+
+}
+
+int q1_asm_write(q1_asm_t *as, q1_asm_format_t format, const char *name) {
+
+   OutputType *out;
+   int rc;
+
+   if(format == Q1_ASM_OBJECT && !as->object_mode) {
+      Error(as, "not assembled as an object");
+      return 0;
+   }
+
+   out = malloc(sizeof(OutputType));
+   if(out == NULL || !OpenOutput(out, name)) {
+      Error(as, "could not open %s for writing", name);
+      free(out);
+      return 0;
+   }
+   WriteOutput(as, out, format);
+   rc = CloseOutput(out);
+   if(!rc) {
+      Error(as, "could not write %s", name);
+   }
+   free(out);
+
+   return rc;
+
+}
+
+unsigned int q1_asm_error_count(const q1_asm_t *as) {
+   return as->error_count;
+}
+
+const char *q1_asm_messages(const q1_asm_t *as) {
+   return as->messages.data ? as->messages.data : "";
+}
+
+const unsigned char *q1_asm_image(const q1_asm_t *as, size_t *end) {
+   if(end) {
+      *end = as->image_end;
+   }
+   return as->image;
+}
+
+unsigned int q1_asm_byte_count(const q1_asm_t *as) {
+   return as->byte_count;
+}
+
+unsigned int q1_asm_segment_count(const q1_asm_t *as) {
+   return as->segment_count;
+}
+
+int q1_asm_segment(const q1_asm_t *as, unsigned int index,
+                   unsigned short *start, size_t *size) {
+   if(index >= as->segment_count) {
+      return 0;
+   }
+   *start = (unsigned short)as->segments[index].start;
+   *size = as->segments[index].size;
+   return 1;
+}
+
+unsigned int q1_asm_symbol_count(const q1_asm_t *as) {
+   return as->symbol_count;
+}
+
+const char *q1_asm_symbol(const q1_asm_t *as, unsigned int index,
+                          unsigned short *addr, int *defined) {
+   const SymbolNode *sp;
+   if(index >= as->symbol_count) {
+      return NULL;
+   }
+   sp = &as->symbol_list[index];
+   if(addr) {
+      *addr = (unsigned short)sp->addr;
+   }
+   if(defined) {
+      *defined = sp->defined;
+   }
+   return sp->name;
+}
+
+int q1_asm_find_symbol(const q1_asm_t *as, const char *name,
+                       unsigned short *addr) {
+   const SymbolEntry *ep;
+   const SymbolNode *sp;
+   if(as->symbols.entries == NULL) {
+      return 0;
+   }
+   ep = FindEntry(&as->symbols, name, strlen(name));
+   if(ep == NULL) {
+      return 0;
+   }
+   sp = &as->symbol_list[ep->index];
+   if(!sp->defined) {
+      return 0;
+   }
+   if(addr) {
+      *addr = (unsigned short)sp->addr;
+   }
+   return 1;
+}
+
+void Error(q1_asm_t *as, const char *format, ...) {
+   va_list ap;
+   ++as->error_count;
+   va_start(ap, format);
+   AddMessage(as, "ERROR: ", format, ap);
+   va_end(ap);
+}
+
+void Warn(q1_asm_t *as, const char *format, ...) {
+   va_list ap;
+   va_start(ap, format);
+   AddMessage(as, "WARN: ", format, ap);
+   va_end(ap);
+}
+
+/* Add a line to the messages, which are kept terminated. */
+void AddMessage(q1_asm_t *as, const char *prefix, const char *format,
+                va_list ap) {
+
+   va_list copy;
+   char *end;
+   int len;
+
+   AppendBuffer(&as->messages, prefix, strlen(prefix));
+   va_copy(copy, ap);
+   len = vsnprintf(NULL, 0, format, copy);
+   va_end(copy);
+   end = ReserveBuffer(&as->messages, len + 2);
+   vsnprintf(end, len + 1, format, ap);
+   end[len] = '\n';
+   end[len + 1] = 0;
+   as->messages.size += len + 1;
+
+}
+
+/* Assemble the source in one pass.
+ * Statement sizes do not depend on their arguments, so labels get their
+ * final addresses as they are seen. Arguments that refer to later
+ * labels are recorded as fixups and patched by ResolveFixups.
+ */
+void DoAssemble(q1_asm_t *as) {
+
+   LineType *lp;
+   char *line;
+   char *text;
+   size_t label_length;
+   unsigned int x;
+
+   as->current_address = 0;
+   for(x = 0; x < as->line_count; x++) {
+      lp = &as->lines[x];
+      line = LineText(as, lp);
+      if(lp->parsed) {
+         label_length = lp->label_length;
+         lp->statement.arg = lp->arg ? line + lp->arg : NULL;
+      } else {
+         label_length = lp->label_length;
+         text = line + lp->body;
+         if(text[0]) {
+            lp->statement = ParseStatement(as, text);
+            lp->has_statement = 1;
+         }
+      }
+      if(!lp->has_statement) {
+         DefineLabel(as, line, label_length);
+         continue;
+      }
+      switch(lp->statement.op) {
+      case ORG_OP:
+      case ALIGN_OP:
+         /* A label on the line names the new address. */
+         SetAddress(as, &lp->statement);
+         DefineLabel(as, line, label_length);
+         lp->addr = as->current_address;
+         continue;
+      case SPACE_OP:
+         DefineLabel(as, line, label_length);
+         lp->addr = as->current_address;
+         SetAddress(as, &lp->statement);
+         continue;
+      case BYTE_OP:
+      case WORD_OP:
+         DefineLabel(as, line, label_length);
+         lp->addr = as->current_address;
+         break;
+      default:
+         DefineLabel(as, line, label_length);
+         lp->addr = as->current_address;
+         EmitByte(as, lp->statement.op);
+         break;
+      }
+      if(lp->statement.arg) {
+         EmitArgument(as, lp->statement.arg, lp->statement.op);
+      }
+   }
+
+}
+
+void EmitByte(q1_asm_t *as, unsigned int value) {
+
+   const AddressType addr = as->current_address;
+   SegmentType *sp;
+
+   ++as->current_address;
+   ++as->byte_count;
+   as->section_size = as->current_address > as->section_size
+                ? as->current_address : as->section_size;
+
+   if(addr >= IMAGE_SIZE) {
+      if(!as->image_overflow) {
+         Error(as, "program too large");
+         as->image_overflow = 1;
+      }
+      return;
+   }
+   if(as->image_used[addr >> 3] & (1 << (addr & 7))) {
+      if(!as->image_overlap) {
+         Error(as, "address %04X already used", addr);
+         as->image_overlap = 1;
+      }
+      return;
+   }
+   as->image_used[addr >> 3] |= 1 << (addr & 7);
+   as->image[addr] = (unsigned char)value;
+   as->image_end = addr + 1 > as->image_end ? addr + 1 : as->image_end;
+
+   /* Extend the current segment or start a new one. */
+   sp = as->segment_count ? &as->segments[as->segment_count - 1] : NULL;
+   if(sp == NULL || sp->start + sp->size != addr) {
+      if(as->segment_count == as->segment_max) {
+         as->segment_max = as->segment_max ? as->segment_max * 2 : 16;
+         as->segments = realloc(as->segments,
+                                as->segment_max * sizeof(SegmentType));
+      }
+      sp = &as->segments[as->segment_count++];
+      sp->start = addr;
+      sp->size = 0;
+   }
+   ++sp->size;
+
+}
+
+/* Handle org, align and ds. These move the current address without
+ * emitting anything, so the space they skip is not part of a segment.
+ * Their arguments may not refer to later labels. In an object, org sets
+ * the offset in the section and labels are only constant relative to
+ * each other. */
+void SetAddress(q1_asm_t *as, const StatementType *statement) {
+
+   const ExprNode *expr;
+   RelocValueType rv;
+   unsigned int value;
+   unsigned int a, b, t;
+
+   if(!statement->arg) {
+      return;
+   }
+   expr = ParseExpression(as, statement->arg);
+   value = expr->value;
+   if(expr->kind != EXPR_VALUE) {
+      if(as->object_mode
+         && (!EvaluateRelocatable(as, expr, &rv) || rv.sections)) {
+         Error(as, "argument is not a constant");
+         return;
+      }
+      if(!as->object_mode || rv.symbol != NO_SYMBOL) {
+         Error(as, "argument refers to a later label");
+         return;
+      }
+      value = rv.value;
+   }
+
+   switch(statement->op) {
+   case ORG_OP:
+      if(value >= IMAGE_SIZE) {
+         Error(as, "address out of range: %u", value);
+         return;
+      }
+      as->current_address = value;
+      as->image_overlap = 0;
+      break;
+   case ALIGN_OP:
+      if(value == 0) {
+         Error(as, "invalid alignment: 0");
+         return;
+      }
+      if(as->object_mode) {
+         /* The section is loaded at a multiple of every alignment. */
+         if(value > IMAGE_SIZE) {
+            Error(as, "invalid alignment: %u", value);
+            return;
+         }
+         for(a = as->section_align, b = value; b != 0; a = b, b = t) {
+            t = a % b;
+         }
+         if((unsigned long long)as->section_align / a * value > IMAGE_SIZE) {
+            Error(as, "invalid alignment: %u", value);
+            return;
+         }
+         as->section_align = as->section_align / a * value;
+      }
+      as->current_address = (as->current_address + value - 1) / value * value;
+      break;
+   default:
+      as->current_address += value;
+      break;
+   }
+   if(statement->op != ORG_OP) {
+      as->section_size = as->current_address > as->section_size
+                   ? as->current_address : as->section_size;
+   }
+
+}
+
+/* Emit a statement argument: one byte for db and two for everything
+ * else. */
+void EmitArgument(q1_asm_t *as, const char *arg, OperationType op) {
+
+   ExprNode *expr;
+   unsigned int value;
+
+   expr = ParseExpression(as, arg);
+   value = expr->value;
+   if(expr->kind != EXPR_VALUE) {
+      if(as->fixup_count == as->fixup_max) {
+         as->fixup_max = as->fixup_max ? as->fixup_max * 2 : 64;
+         as->fixups = realloc(as->fixups, as->fixup_max * sizeof(FixupType));
+      }
+      as->fixups[as->fixup_count].addr = as->current_address;
+      as->fixups[as->fixup_count].expr = expr;
+      as->fixups[as->fixup_count].op = op;
+      ++as->fixup_count;
+      value = 0;
+   }
+
+   if(op == BYTE_OP) {
+      EmitByte(as, value);
+   } else {
+      EmitByte(as, value >> 8);
+      EmitByte(as, value);
+   }
+
+}
+
+/* Patch the arguments that referred to later labels. In an object,
+ * arguments that depend on where the section is loaded or on an
+ * external symbol become relocations. */
+void ResolveFixups(q1_asm_t *as) {
+
+   RelocValueType rv;
+   unsigned int value;
+   unsigned int x;
+
+   for(x = 0; x < as->fixup_count; x++) {
+      if(as->object_mode) {
+         if(!EvaluateRelocatable(as, as->fixups[x].expr, &rv)
+            || rv.sections < 0 || rv.sections > 1
+            || (rv.sections && rv.symbol != NO_SYMBOL)) {
+            Error(as, "invalid relocatable expression");
+            continue;
+         }
+         if(rv.sections || rv.symbol != NO_SYMBOL) {
+            AddRelocation(as, &as->fixups[x], &rv);
+         }
+         value = rv.value;
+      } else {
+         value = Evaluate(as, as->fixups[x].expr);
+      }
+      if(as->fixups[x].op == BYTE_OP) {
+         as->image[as->fixups[x].addr] = (unsigned char)value;
+      } else {
+         as->image[as->fixups[x].addr] = (unsigned char)(value >> 8);
+         as->image[as->fixups[x].addr + 1] = (unsigned char)value;
+      }
+   }
+
+}
+
+void AddRelocation(q1_asm_t *as, const FixupType *fp,
+                   const RelocValueType *rp) {
+
+   RelocationType *relocation;
+
+   if(as->relocation_count == as->relocation_max) {
+      as->relocation_max = as->relocation_max ? as->relocation_max * 2 : 64;
+      as->relocations = realloc(as->relocations,
+                                as->relocation_max * sizeof(RelocationType));
+   }
+   relocation = &as->relocations[as->relocation_count++];
+   relocation->addr = fp->addr;
+   relocation->op = fp->op;
+   relocation->symbol = rp->sections ? OBJ_SECTION : rp->symbol;
+   relocation->addend = rp->value;
+
+}
+
+/* Write the assembled image in the selected format. */
+void WriteOutput(const q1_asm_t *as, OutputType *out,
+                 q1_asm_format_t format) {
+
+   OutputImageType output;
+   OutputSymbolType *symbol_table;
+   unsigned int x;
+
+   switch(format) {
+   case Q1_ASM_LISTING:
+      WriteListing(as, out);
+      break;
+   case Q1_ASM_OBJECT:
+      WriteObject(as, out);
+      break;
+   default:
+      symbol_table = malloc(as->symbol_count * sizeof(OutputSymbolType)
+                            + 1);
+      output.symbol_count = 0;
+      for(x = 0; x < as->symbol_count; x++) {
+         if(as->symbol_list[x].defined) {
+            symbol_table[output.symbol_count].name = as->symbol_list[x].name;
+            symbol_table[output.symbol_count].addr = as->symbol_list[x].addr;
+            ++output.symbol_count;
+         }
+      }
+      output.data = as->image;
+      output.end = as->image_end;
+      output.segments = as->segments;
+      output.segment_count = as->segment_count;
+      output.symbols = symbol_table;
+      WriteImage(out, &output, format);
+      free(symbol_table);
+      break;
+   }
+
+}
+
+/* Write the unit as a relocatable object. Every symbol is written so
+ * that relocations can refer to externals by number. */
+void WriteObject(const q1_asm_t *as, OutputType *out) {
+
+   const SymbolNode *sp;
+   const RelocationType *rp;
+   unsigned int x;
+   size_t len;
+
+   OutputBytes(out, OBJ_MAGIC, 4);
+   OutputNumber(out, OBJ_VERSION, 1);
+   OutputNumber(out, 0, 1);
+   OutputNumber(out, as->segment_count, 2);
+   OutputNumber(out, as->section_size, 4);
+   OutputNumber(out, as->section_align, 4);
+   OutputNumber(out, as->symbol_count, 4);
+   OutputNumber(out, as->relocation_count, 4);
+
+   for(x = 0; x < as->segment_count; x++) {
+      OutputNumber(out, as->segments[x].start, 4);
+      OutputNumber(out, as->segments[x].size, 4);
+      OutputBytes(out, &as->image[as->segments[x].start],
+                  as->segments[x].size);
+   }
+
+   for(x = 0; x < as->symbol_count; x++) {
+      sp = &as->symbol_list[x];
+      len = strlen(sp->name);
+      OutputNumber(out, sp->defined, 1);
+      OutputNumber(out, sp->defined ? sp->addr : 0, 4);
+      OutputNumber(out, len, 2);
+      OutputBytes(out, sp->name, len);
+   }
+
+   for(x = 0; x < as->relocation_count; x++) {
+      rp = &as->relocations[x];
+      OutputNumber(out, rp->addr, 4);
+      OutputNumber(out, rp->op == BYTE_OP ? OBJ_BYTE : OBJ_WORD, 1);
+      OutputNumber(out, rp->symbol, 4);
+      OutputNumber(out, rp->addend, 4);
+   }
+
+}
+
+/* Write a listing from the recorded statements. */
+void WriteListing(const q1_asm_t *as, OutputType *out) {
+
+   const LineType *lp;
+   const unsigned char *bytes;
+   unsigned int first;
+   unsigned int x;
+   size_t len;
+
+   first = 0;
+   for(x = 0; x < as->line_count; x++) {
+
+      lp = &as->lines[x];
+      if(!lp->has_statement) {
+         continue;
+      }
+
+      /* Lines without a statement are listed with the next statement. */
+      for(; first < x; first++) {
+         OutputBytes(out, "                    ", 20);
+         OutputBytes(out, LineRaw(as, &as->lines[first]),
+                     as->lines[first].raw_length);
+         OutputChar(out, '\n');
+      }
+      first = x + 1;
+
+      OutputHex(out, lp->addr, 4);
+      OutputChar(out, ' ');
+      bytes = &as->image[lp->addr];
+      switch(lp->statement.op) {
+      case ORG_OP:
+      case ALIGN_OP:
+      case SPACE_OP:
+         len = 1;
+         break;
+      case BYTE_OP:
+         len = 3;
+         if(lp->statement.arg) {
+            OutputHex(out, bytes[0], 2);
+         }
+         break;
+      case WORD_OP:
+         len = 6;
+         if(lp->statement.arg) {
+            OutputChar(out, ' ');
+            OutputHex(out, bytes[0], 2);
+            OutputChar(out, ' ');
+            OutputHex(out, bytes[1], 2);
+         }
+         break;
+      default:
+         OutputHex(out, bytes[0], 2);
+         len = 3;
+         if(lp->statement.arg) {
+            OutputChar(out, ' ');
+            OutputHex(out, bytes[1], 2);
+            OutputChar(out, ' ');
+            OutputHex(out, bytes[2], 2);
+            len = 9;
+         }
+         break;
+      }
+      OutputBytes(out, "                ", 16 - len);
+      OutputBytes(out, LineRaw(as, lp), lp->raw_length);
+      OutputChar(out, '\n');
+
+   }
+
+   for(; first < as->line_count; first++) {
+      OutputBytes(out, "                    ", 20);
+      OutputBytes(out, LineRaw(as, &as->lines[first]),
+                  as->lines[first].raw_length);
+      OutputChar(out, '\n');
+   }
+
+}
+
+void DefineLabel(q1_asm_t *as, const char *name, size_t len) {
+   if(len > 0 && !AddSymbol(as, name, len, as->current_address)) {
+      Error(as, "duplicate symbol: \"%.*s\"", (int)len, name);
+   }
+}
+
+StatementType ParseStatement(q1_asm_t *as, char *line) {
+
+   StatementType result;
+   const InstructionMapType *instr;
+   const char *arg;
+   size_t len;
+
+   result.op = INVALID_OP;
+   result.arg = 0;
+
+   /* Look up the instruction. */
+   for(len = 0; line[len] && !isspace(line[len]); len++);
+   instr = FindInstruction(line, len);
+   arg = line[len] ? &line[len + 1] : NULL;
+
+   /* If the instruction wasn't found log an error. */
+   if(instr == NULL) {
+      Error(as, "invalid instruction: \"%.*s\"", (int)len, line);
+      return result;
+   }
+
+   /* Make sure the right number of arguments were given. */
+   if(arg && instr->arg_count == 0) {
+      Error(as, "argument given for %s", instr->name);
+      return result;
+   }
+   if(!arg && instr->arg_count > 0) {
+      Error(as, "no argument given for %s", instr->name);
+      return result;
+   }
+
+   result.op = instr->opcode;
+   result.arg = (char*)arg;
+
+   return result;
+
+}
+
+/* Choose the seed for the instruction hash. */
+void InitInstructions(void) {
+
+   unsigned long long key;
+   unsigned int slot;
+   unsigned int x;
+
+   instruction_seed = 0x9E3779B97F4A7C15ULL;
+   for(;;) {
+      memset(instruction_slots, 0, sizeof(instruction_slots));
+      for(x = 0; x < instruction_count; x++) {
+         key = PackName(INSTRUCTION_MAP[x].name,
+                        strlen(INSTRUCTION_MAP[x].name));
+         slot = (key * instruction_seed) >> (64 - INSTRUCTION_BITS);
+         if(instruction_slots[slot]) {
+            break;
+         }
+         instruction_slots[slot] = x + 1;
+         instruction_keys[slot] = key;
+      }
+      if(x == instruction_count) {
+         return;
+      }
+      instruction_seed += 0x5851F42D4C957F2EULL;
+   }
+
+}
+
+/* Look up an instruction by name. Returns NULL if there is none. */
+const InstructionMapType *FindInstruction(const char *name, size_t len) {
+
+   unsigned long long key;
+   unsigned int slot;
+
+   if(len == 0 || len > sizeof(key)) {
+      return NULL;
+   }
+   key = PackName(name, len);
+   slot = (key * instruction_seed) >> (64 - INSTRUCTION_BITS);
+   if(instruction_slots[slot] == 0 || instruction_keys[slot] != key) {
+      return NULL;
+   }
+   return &INSTRUCTION_MAP[instruction_slots[slot] - 1];
+
+}
+
+/* Pack a name of up to 8 characters into a number. */
+unsigned long long PackName(const char *name, size_t len) {
+   unsigned long long key = 0;
+   size_t x;
+   for(x = 0; x < len; x++) {
+      key = (key << 8) | (unsigned char)name[x];
+   }
+   return key;
+}
+
+/* Reduce each run of whitespace to its first character. */
+void StripWhitespace(char *line) {
+
+   size_t x, y;
+
+   y = 0;
+   for(x = 0; line[x]; x++) {
+      if(!isspace(line[x]) || y == 0 || !isspace(line[y - 1])) {
+         line[y++] = line[x];
+      }
+   }
+   line[y] = 0;
+
+}
+
+int AddSymbol(q1_asm_t *as, const char *name, size_t len,
+              unsigned int value) {
+
+   SymbolNode *sp;
+   unsigned int index;
+
+   index = InternSymbol(as, name, len);
+   sp = &as->symbol_list[index];
+   if(sp->defined) {
+      return 0;
+   }
+   sp->addr = value;
+   sp->defined = 1;
+
+   return 1;
+
+}
+
+/* Return the number of a symbol, adding it if it has not been seen. */
+unsigned int InternSymbol(q1_asm_t *as, const char *name, size_t len) {
+
+   SymbolEntry *ep;
+
+   ep = FindEntry(&as->symbols, name, len);
+   if(ep) {
+      return ep->index;
+   }
+
+   if(as->symbol_count == as->symbol_max) {
+      as->symbol_max = as->symbol_max ? as->symbol_max * 2 : 256;
+      as->symbol_list = realloc(as->symbol_list,
+                                as->symbol_max * sizeof(SymbolNode));
+   }
+   ep = InsertEntry(as, &as->symbols, name, len);
+   ep->index = as->symbol_count;
+   as->symbol_list[as->symbol_count].name = ep->name;
+   as->symbol_list[as->symbol_count].addr = 0;
+   as->symbol_list[as->symbol_count].defined = 0;
+   return as->symbol_count++;
+
+}
+
+int AddMacro(q1_asm_t *as, const char *name) {
+
+   MacroType *mp;
+
+   mp = InsertEntry(as, &as->macros, name, strlen(name));
+   if(mp == NULL) {
+      return 0;
+   }
+   mp->value = NULL;
+   mp->mark = 0;
+   as->macro_digest ^= MacroHash(mp);
+   LogMacro(as, mp->name);
+
+   return 1;
+
+}
+
+MacroType *FindMacro(q1_asm_t *as, const char *name) {
+   return FindEntry(&as->macros, name, strlen(name));
+}
+
+void AppendMacro(q1_asm_t *as, const char *name, const char *value) {
+
+   MacroType *mp;
+   size_t len;
+
+   mp = FindMacro(as, name);
+   as->macro_digest ^= MacroHash(mp);
+
+   len = strlen(value) + 2;
+   if(mp->value) {
+      len += strlen(mp->value);
+      mp->value = realloc(mp->value, len);
+   } else {
+      mp->value = malloc(len);
+      mp->value[0] = 0;
+   }
+   strcat(mp->value, value);
+   strcat(mp->value, "\n");
+   as->macro_digest ^= MacroHash(mp);
+   LogMacro(as, mp->name);
+
+}
+
+/* Set the value of a macro, defining it if necessary. */
+void SetMacro(q1_asm_t *as, const char *name, const char *value,
+              size_t len) {
+
+   MacroType *mp;
+
+   mp = FindMacro(as, name);
+   if(mp == NULL) {
+      AddMacro(as, name);
+      mp = FindMacro(as, name);
+   }
+   as->macro_digest ^= MacroHash(mp);
+   free(mp->value);
+   mp->value = NULL;
+   if(len > 0) {
+      mp->value = strndup(value, len);
+   }
+   as->macro_digest ^= MacroHash(mp);
+   LogMacro(as, mp->name);
+
+}
+
+unsigned long long MacroHash(const MacroType *mp) {
+   unsigned long long hash;
+   hash = Hash64(HASH64_INIT, mp->name, strlen(mp->name) + 1);
+   if(mp->value) {
+      hash = Hash64(hash, mp->value, strlen(mp->value));
+   }
+   return hash;
+}
+
+/* Allocate from the arena. Allocations are aligned for pointers. */
+void *ArenaAlloc(q1_asm_t *as, size_t size) {
+
+   ArenaBlock *bp;
+   size_t block_size;
+   void *result;
+
+   size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+   if(as->arena == NULL || as->arena->used + size > as->arena->size) {
+      block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+      bp = malloc(sizeof(ArenaBlock) + block_size);
+      bp->next = as->arena;
+      bp->used = 0;
+      bp->size = block_size;
+      as->arena = bp;
+   }
+
+   result = &as->arena->data[as->arena->used];
+   as->arena->used += size;
+   return result;
+
+}
+
+/* Copy a string to the arena. */
+char *ArenaCopy(q1_asm_t *as, const char *str, size_t len) {
+   char *result = ArenaAlloc(as, len + 1);
+   memcpy(result, str, len);
+   result[len] = 0;
+   return result;
+}
+
+/* FNV-1a. */
+unsigned int Hash(const char *str, size_t len) {
+   unsigned int hash = 2166136261U;
+   size_t x;
+   for(x = 0; x < len; x++) {
+      hash = (hash ^ (unsigned char)str[x]) * 16777619U;
+   }
+   return hash;
+}
+
+/* 64-bit FNV-1a, continuing from hash. */
+unsigned long long Hash64(unsigned long long hash, const void *data,
+                          size_t len) {
+   const unsigned char *ptr = data;
+   size_t x;
+   for(x = 0; x < len; x++) {
+      hash = (hash ^ ptr[x]) * 1099511628211ULL;
+   }
+   return hash;
+}
+
+/* Create a table with room for count entries. Entries must start with
+ * the name pointer. */
+void CreateTable(HashTableType *table, size_t entry_size,
+                 unsigned int count) {
+   table->size = 64;
+   while(table->size < count * 2) {
+      table->size *= 2;
+   }
+   table->entry_size = entry_size;
+   table->count = 0;
+   table->entries = calloc(table->size, entry_size);
+}
+
+/* Return the entry for a name, or NULL if there is none. */
+void *FindEntry(const HashTableType *table, const char *name, size_t len) {
+
+   const unsigned int mask = table->size - 1;
+   unsigned int index;
+   char *entry;
+   char *entry_name;
+
+   index = Hash(name, len) & mask;
+   for(;;) {
+      entry = (char*)table->entries + index * table->entry_size;
+      entry_name = *(char**)entry;
+      if(entry_name == NULL) {
+         return NULL;
+      }
+      if(!strncmp(entry_name, name, len) && entry_name[len] == 0) {
+         return entry;
+      }
+      index = (index + 1) & mask;
+   }
+
+}
+
+/* Add a name, returning its new entry or NULL if it already exists. */
+void *InsertEntry(q1_asm_t *as, HashTableType *table, const char *name,
+                  size_t len) {
+
+   HashTableType old;
+   unsigned int mask;
+   unsigned int index;
+   unsigned int x;
+   char *entry;
+   char *entry_name;
+
+   if(FindEntry(table, name, len)) {
+      return NULL;
+   }
+
+   if(table->count * 2 >= table->size) {
+      old = *table;
+      table->size *= 2;
+      table->entries = calloc(table->size, table->entry_size);
+      mask = table->size - 1;
+      for(x = 0; x < old.size; x++) {
+         entry = (char*)old.entries + x * old.entry_size;
+         entry_name = *(char**)entry;
+         if(entry_name) {
+            index = Hash(entry_name, strlen(entry_name)) & mask;
+            while(*(char**)((char*)table->entries
+                            + index * table->entry_size)) {
+               index = (index + 1) & mask;
+            }
+            memcpy((char*)table->entries + index * table->entry_size,
+                   entry, table->entry_size);
+         }
+      }
+      free(old.entries);
+   }
+
+   mask = table->size - 1;
+   index = Hash(name, len) & mask;
+   for(;;) {
+      entry = (char*)table->entries + index * table->entry_size;
+      if(*(char**)entry == NULL) {
+         break;
+      }
+      index = (index + 1) & mask;
+   }
+   *(char**)entry = ArenaCopy(as, name, len);
+   ++table->count;
+   return entry;
+
+}
+
+/* Parse an argument.
+ * expr    := product { ('+' | '-') product }
+ * product := factor { ('*' | '/') factor }
+ * factor  := number | '$' hex | '%' binary | symbol | '(' expr ')'
+ * Errors are reported and counted here; the result is always usable.
+ */
+ExprNode *ParseExpression(q1_asm_t *as, const char *str) {
+
+   ExprNode *result;
+
+   as->parse_ptr = str;
+   result = ParseSum(as);
+   while(isspace(*as->parse_ptr)) {
+      ++as->parse_ptr;
+   }
+   if(*as->parse_ptr) {
+      Error(as, "invalid expression");
+   }
+   return result;
+
+}
+
+ExprNode *ParseSum(q1_asm_t *as) {
+
+   ExprNode *result;
+   ExprKind kind;
+
+   result = ParseProduct(as);
+   for(;;) {
+      while(isspace(*as->parse_ptr)) {
+         ++as->parse_ptr;
+      }
+      if(*as->parse_ptr != '+' && *as->parse_ptr != '-') {
+         return result;
+      }
+      kind = (ExprKind)*as->parse_ptr++;
+      result = MakeOperation(as, kind, result, ParseProduct(as));
+   }
+
+}
+
+ExprNode *ParseProduct(q1_asm_t *as) {
+
+   ExprNode *result;
+   ExprKind kind;
+
+   result = ParseFactor(as);
+   for(;;) {
+      while(isspace(*as->parse_ptr)) {
+         ++as->parse_ptr;
+      }
+      if(*as->parse_ptr != '*' && *as->parse_ptr != '/') {
+         return result;
+      }
+      kind = (ExprKind)*as->parse_ptr++;
+      result = MakeOperation(as, kind, result, ParseFactor(as));
+   }
+
+}
+
+ExprNode *ParseFactor(q1_asm_t *as) {
+
+   ExprNode *result;
+   const char *start;
+   char *end;
+   unsigned int index;
+
+   while(isspace(*as->parse_ptr)) {
+      ++as->parse_ptr;
+   }
+   switch(*as->parse_ptr) {
+   case '0': case '1': case '2': case '3': case '4':
+   case '5': case '6': case '7': case '8': case '9':
+      result = MakeValue(as, strtoul(as->parse_ptr, &end, 10));
+      as->parse_ptr = end;
+      return result;
+   case '$':
+      result = MakeValue(as, strtoul(as->parse_ptr + 1, &end, 16));
+      as->parse_ptr = end;
+      return result;
+   case '%':
+      result = MakeValue(as, strtoul(as->parse_ptr + 1, &end, 2));
+      as->parse_ptr = end;
+      return result;
+   case '(':
+      ++as->parse_ptr;
+      result = ParseSum(as);
+      if(*as->parse_ptr == ')') {
+         ++as->parse_ptr;
+      } else {
+         Error(as, "expected ')'");
+      }
+      return result;
+   case 0:
+   case ')':
+   case '+':
+   case '-':
+   case '*':
+   case '/':
+      Error(as, "expected value");
+      return MakeValue(as, 0);
+   default:
+      break;
+   }
+
+   /* Symbol. Labels already seen have their final address unless the
+    * output is an object. */
+   start = as->parse_ptr++;
+   while((*as->parse_ptr >= 'a' && *as->parse_ptr <= 'z')
+         || (*as->parse_ptr >= '0' && *as->parse_ptr <= '9')
+         || *as->parse_ptr == '_') {
+      ++as->parse_ptr;
+   }
+   index = InternSymbol(as, start, as->parse_ptr - start);
+   if(as->symbol_list[index].defined && !as->object_mode) {
+      return MakeValue(as, as->symbol_list[index].addr);
+   }
+   result = ArenaAlloc(as, sizeof(ExprNode));
+   result->kind = EXPR_SYMBOL;
+   result->value = index;
+   result->left = NULL;
+   result->right = NULL;
+   return result;
+
+}
+
+ExprNode *MakeValue(q1_asm_t *as, unsigned int value) {
+   ExprNode *result = ArenaAlloc(as, sizeof(ExprNode));
+   result->kind = EXPR_VALUE;
+   result->value = value;
+   result->left = NULL;
+   result->right = NULL;
+   return result;
+}
+
+/* Combine two subexpressions, folding them if both are values. */
+ExprNode *MakeOperation(q1_asm_t *as, ExprKind kind, ExprNode *left,
+                        ExprNode *right) {
+
+   ExprNode *result;
+
+   if(left->kind == EXPR_VALUE && right->kind == EXPR_VALUE) {
+      left->value = Apply(as, kind, left->value, right->value);
+      return left;
+   }
+
+   result = ArenaAlloc(as, sizeof(ExprNode));
+   result->kind = kind;
+   result->value = 0;
+   result->left = left;
+   result->right = right;
+   return result;
+
+}
+
+unsigned int Apply(q1_asm_t *as, ExprKind kind, unsigned int left,
+                   unsigned int right) {
+   switch(kind) {
+   case EXPR_ADD:
+      return left + right;
+   case EXPR_SUBTRACT:
+      return left - right;
+   case EXPR_MULTIPLY:
+      return left * right;
+   default:
+      if(right == 0) {
+         Error(as, "division by zero");
+         return left;
+      }
+      return left / right;
+   }
+}
+
+unsigned int Evaluate(q1_asm_t *as, const ExprNode *np) {
+
+   const SymbolNode *sp;
+
+   switch(np->kind) {
+   case EXPR_VALUE:
+      return np->value;
+   case EXPR_SYMBOL:
+      sp = &as->symbol_list[np->value];
+      if(!sp->defined) {
+         Error(as, "symbol not found: \"%s\"", sp->name);
+         return 0;
+      }
+      return sp->addr;
+   default:
+      return Apply(as, np->kind, Evaluate(as, np->left),
+                   Evaluate(as, np->right));
+   }
+
+}
+
+/* Evaluate an argument in an object. Labels are offsets from the start
+ * of the section and symbols that are not defined are external.
+ * Returns 0 if the argument multiplies or divides an address or refers
+ * to more than one external symbol. */
+int EvaluateRelocatable(q1_asm_t *as, const ExprNode *np,
+                        RelocValueType *result) {
+
+   const SymbolNode *sp;
+   RelocValueType left;
+   RelocValueType right;
+
+   switch(np->kind) {
+   case EXPR_VALUE:
+      result->value = np->value;
+      result->sections = 0;
+      result->symbol = NO_SYMBOL;
+      return 1;
+   case EXPR_SYMBOL:
+      sp = &as->symbol_list[np->value];
+      result->value = sp->defined ? sp->addr : 0;
+      result->sections = sp->defined;
+      result->symbol = sp->defined ? NO_SYMBOL : np->value;
+      return 1;
+   default:
+      break;
+   }
+
+   if(!EvaluateRelocatable(as, np->left, &left)
+      || !EvaluateRelocatable(as, np->right, &right)) {
+      return 0;
+   }
+   switch(np->kind) {
+   case EXPR_ADD:
+      if(left.symbol != NO_SYMBOL && right.symbol != NO_SYMBOL) {
+         return 0;
+      }
+      result->sections = left.sections + right.sections;
+      result->symbol = left.symbol != NO_SYMBOL ? left.symbol : right.symbol;
+      break;
+   case EXPR_SUBTRACT:
+      if(right.symbol != NO_SYMBOL) {
+         return 0;
+      }
+      result->sections = left.sections - right.sections;
+      result->symbol = left.symbol;
+      break;
+   default:
+      if(left.sections || right.sections
+         || left.symbol != NO_SYMBOL || right.symbol != NO_SYMBOL) {
+         return 0;
+      }
+      result->sections = 0;
+      result->symbol = NO_SYMBOL;
+      break;
+   }
+   result->value = Apply(as, np->kind, left.value, right.value);
+   return 1;
+
+}
+
+void DoPreprocess(q1_asm_t *as, const char *filename, const char *data,
+                  size_t size) {
+   DoPreprocessFile(as, filename, data, size, 0);
+}
+
+/* Preprocess a file, or data if it is not NULL. Data is not cached
+ * since it may not match the file of the same name. */
+void DoPreprocessFile(q1_asm_t *as, const char *filename, const char *data,
+                      size_t size, int level) {
+
+   FileType file;
+   const char *line;
+   const char *end;
+   const char *next;
+   char *include;
+   char *current_define;
+   unsigned long long key;
+   unsigned int first_line;
+   unsigned int first_dependency;
+   unsigned int first_macro;
+   unsigned int errors;
+   int use_cache;
+
+   if(level >= MAX_INCLUDES) {
+      Error(as, "exceeded %d levels", MAX_INCLUDES);
+      return;
+   }
+
+   key = 0;
+   use_cache = as->cache_dir && data == NULL;
+   if(use_cache) {
+      key = CacheKey(as, filename, level);
+      if(LoadCache(as, key)) {
+         return;
+      }
+   }
+
+   if(data) {
+      file.data = data;
+      file.size = size;
+      file.map = NULL;
+   } else if(!ReadFile(filename, &file)) {
+      Error(as, "could not open %s for reading", filename);
+      return;
+   }
+
+   first_line = as->line_count;
+   first_dependency = as->dependency_count;
+   first_macro = as->macro_log_count;
+   errors = as->error_count;
+   if(use_cache) {
+      AddDependency(as, filename, &file,
+                    Hash64(HASH64_INIT, file.data, file.size));
+   }
+
+   current_define = NULL;
+   end = file.data + file.size;
+   for(line = file.data; line < end; line = next) {
+      next = memchr(line, '\n', end - line);
+      next = next ? next : end;
+      if(line[0] == '#') {
+         CopyLine(as, line, next - line);
+         StripWhitespace(as->scratch);
+         if(       !strncmp(as->scratch, "#include ", 9)) {
+            include = strdup(&as->scratch[10]);
+            DoPreprocessFile(as, include, NULL, 0, level + 1);
+            free(include);
+         } else if(!strncmp(as->scratch, "#define ", 8)) {
+            ProcessDefineStart(as, &as->scratch[9], &current_define);
+         } else if(!strncmp(as->scratch, "#end", 4)) {
+            ProcessDefineEnd(as, &current_define);
+         } else if(!strncmp(as->scratch, "#macro ", 7)) {
+            ProcessMacro(as, &as->scratch[8]);
+         } else {
+            Error(as, "preprocessor: \"%s\"", as->scratch);
+         }
+      } else if(current_define) {
+         ProcessDefine(as, CopyLine(as, line, next - line), current_define);
+      } else {
+         AppendLine(as, line, next - line);
+      }
+      if(next < end) {
+         ++next;
+      }
+   }
+
+   if(data == NULL) {
+      CloseFile(&file);
+   }
+
+   if(use_cache && as->error_count == errors) {
+      RecordCache(as, key, first_line, first_dependency, first_macro);
+   }
+
+}
+
+/* Map a file, or read it if it cannot be mapped. Returns 0 on error. */
+int ReadFile(const char *filename, FileType *file) {
+
+   struct stat st;
+   char *buffer;
+   size_t max_size;
+   ssize_t count;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+   if(fd < 0) {
+      return 0;
+   }
+
+   file->map = NULL;
+   file->map_size = 0;
+   file->mtime = 0;
+   if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      file->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+   }
+   if(file->mtime != 0 && st.st_size > 0) {
+      file->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(file->map != MAP_FAILED) {
+         file->map_size = st.st_size;
+         file->data = file->map;
+         file->size = st.st_size;
+         close(fd);
+         return 1;
+      }
+      file->map = NULL;
+   }
+
+   max_size = BLOCK_SIZE;
+   buffer = malloc(max_size);
+   file->size = 0;
+   while((count = read(fd, buffer + file->size, max_size - file->size)) > 0) {
+      file->size += count;
+      if(file->size == max_size) {
+         max_size *= 2;
+         buffer = realloc(buffer, max_size);
+      }
+   }
+   close(fd);
+   file->data = buffer;
+   if(count < 0) {
+      CloseFile(file);
+      return 0;
+   }
+   return 1;
+
+}
+
+void CloseFile(FileType *file) {
+   if(file->map) {
+      munmap(file->map, file->map_size);
+   } else {
+      free((char*)file->data);
+   }
+}
+
+/* Copy a line to the scratch buffer. */
+char *CopyLine(q1_asm_t *as, const char *line, size_t len) {
+   if(len + 1 > as->scratch_max) {
+      as->scratch_max = len + 1 > BLOCK_SIZE ? len + 1 : BLOCK_SIZE;
+      as->scratch = realloc(as->scratch, as->scratch_max);
+   }
+   memcpy(as->scratch, line, len);
+   as->scratch[len] = 0;
+   return as->scratch;
+}
+
+/* Make room for len more bytes in a buffer. Returns the end of the
+ * data, where they go. */
+char *ReserveBuffer(BufferType *buffer, size_t len) {
+   if(buffer->size + len > buffer->max) {
+      buffer->max = buffer->max ? buffer->max : BLOCK_SIZE;
+      while(buffer->size + len > buffer->max) {
+         buffer->max *= 2;
+      }
+      buffer->data = realloc(buffer->data, buffer->max);
+   }
+   return &buffer->data[buffer->size];
+}
+
+/* Append to a buffer. Returns the offset of the data. */
+size_t AppendBuffer(BufferType *buffer, const char *data, size_t len) {
+   const size_t offset = buffer->size;
+   char *end = ReserveBuffer(buffer, len);
+   if(len > 0) {
+      memcpy(end, data, len);
+      buffer->size += len;
+   }
+   return offset;
+}
+
+/* Add a line of source. Its clean text goes straight to line_text. */
+void AppendLine(q1_asm_t *as, const char *line, size_t len) {
+
+   LineType *lp;
+   char *text;
+
+   if(as->line_count == as->line_max) {
+      as->line_max = as->line_max ? as->line_max * 2 : 1024;
+      as->lines = realloc(as->lines, as->line_max * sizeof(LineType));
+   }
+   lp = &as->lines[as->line_count++];
+   memset(lp, 0, sizeof(LineType));
+   lp->raw = AppendBuffer(&as->source, line, len);
+   lp->raw_length = len;
+   lp->text = as->line_text.size;
+   text = ReserveBuffer(&as->line_text, len + 1);
+   as->line_text.size += CleanLine(text, line, len, lp) + 1;
+
+}
+
+/* Clean up a line in one pass. Comments and leading and trailing
+ * whitespace are removed, each run of whitespace is reduced to its first
+ * character and letters are made lower case. A 0 ends the line early.
+ * The label and the start of the statement after it are noted in lp.
+ * out must have room for len + 1 bytes.
+ * Returns the length of the clean line, which is terminated.
+ */
+size_t CleanLine(char *out, const char *line, size_t len, LineType *lp) {
+
+   const char *end = line + len;
+   ChunkType chunk;
+   ChunkType stop;
+   unsigned long long words[2];
+   size_t used;
+   size_t colon;
+   unsigned int x;
+   char ch;
+
+   while(line < end && isspace(*line)) {
+      ++line;
+   }
+
+   used = 0;
+   colon = 0;
+   while(line < end) {
+
+      /* Copy and lower a chunk, then skip to the first character in it
+       * that needs attention. out never gets ahead of line, so there is
+       * room for the whole chunk. */
+      if(end - line >= 16) {
+         memcpy(&chunk, line, 16);
+         stop = (ChunkType)((chunk == ';') | (chunk == ':') | (chunk == 0)
+                          | (chunk == ' ')
+                          | ((chunk >= '\t') & (chunk <= '\r')));
+         chunk |= (ChunkType)((chunk >= 'A') & (chunk <= 'Z')) & 0x20;
+         memcpy(&out[used], &chunk, 16);
+         memcpy(words, &stop, 16);
+         if((words[0] | words[1]) == 0) {
+            used += 16;
+            line += 16;
+            continue;
+         }
+         for(x = 0; !stop[x]; x++);
+         used += x;
+         line += x;
+      }
+
+      ch = *line;
+      if(ch == ';' || ch == 0) {
+         break;
+      } else if(isspace(ch)) {
+         out[used++] = ch;
+         do {
+            ++line;
+         } while(line < end && isspace(*line));
+         continue;
+      } else if(ch == ':' && !colon) {
+         colon = used + 1;
+      } else if(ch >= 'A' && ch <= 'Z') {
+         ch = ch - 'A' + 'a';
+      }
+      out[used++] = ch;
+      ++line;
+
+   }
+
+   if(used > 0 && isspace(out[used - 1])) {
+      --used;
+   }
+   out[used] = 0;
+
+   if(colon) {
+      lp->label_length = colon - 1;
+      lp->body = colon + (isspace(out[colon]) ? 1 : 0);
+   }
+   return used;
+
+}
+
+const char *LineRaw(const q1_asm_t *as, const LineType *lp) {
+   return as->source.data + lp->raw;
+}
+
+char *LineText(const q1_asm_t *as, const LineType *lp) {
+   return as->line_text.data + lp->text;
+}
+
+void AddDependency(q1_asm_t *as, const char *name, const FileType *file,
+                   unsigned long long hash) {
+
+   DependencyType *dp;
+
+   if(as->dependency_count == as->dependency_max) {
+      as->dependency_max = as->dependency_max ? as->dependency_max * 2 : 64;
+      as->dependencies = realloc(as->dependencies,
+                                 as->dependency_max * sizeof(DependencyType));
+   }
+   dp = &as->dependencies[as->dependency_count++];
+   dp->name = ArenaCopy(as, name, strlen(name));
+   dp->size = file->size;
+   dp->hash = hash;
+
+   /* A file changed in the same second it was read might not get a new
+    * modification time, so it is always hashed. */
+   dp->mtime = file->mtime;
+   if(dp->mtime / 1000000000 + 1 >= (long long)time(NULL)) {
+      dp->mtime = 0;
+   }
+
+}
+
+/* Check whether a file is unchanged. */
+int CheckDependency(const DependencyType *dp) {
+
+   struct stat st;
+   FileType file;
+   int rc;
+
+   if(dp->mtime != 0 && stat(dp->name, &st) == 0 && st.st_size == dp->size
+      && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == dp->mtime) {
+      return 1;
+   }
+
+   if(!ReadFile(dp->name, &file)) {
+      return 0;
+   }
+   rc = Hash64(HASH64_INIT, file.data, file.size) == dp->hash;
+   CloseFile(&file);
+   return rc;
+
+}
+
+/* Note a macro that was defined or changed. */
+void LogMacro(q1_asm_t *as, const char *name) {
+   if(as->cache_dir == NULL) {
+      return;
+   }
+   if(as->macro_log_count == as->macro_log_max) {
+      as->macro_log_max = as->macro_log_max ? as->macro_log_max * 2 : 64;
+      as->macro_log = realloc(as->macro_log,
+                              as->macro_log_max * sizeof(char*));
+   }
+   as->macro_log[as->macro_log_count++] = name;
+}
+
+/* The output of a file depends on its name, its include level, its
+ * contents and the macros defined before it. Only the first three are
+ * known before reading the cache entry; contents are checked after. */
+unsigned long long CacheKey(const q1_asm_t *as, const char *filename,
+                            int level) {
+   unsigned long long key;
+   key = Hash64(HASH64_INIT, filename, strlen(filename) + 1);
+   key = Hash64(key, &level, sizeof(level));
+   key = Hash64(key, &as->macro_digest, sizeof(as->macro_digest));
+   return key;
+}
+
+char *CachePath(const q1_asm_t *as, unsigned long long key) {
+   const size_t len = strlen(as->cache_dir) + 22;
+   char *path = malloc(len);
+   snprintf(path, len, "%s/%016llx.q1c", as->cache_dir, key);
+   return path;
+}
+
+/* Replay a file from the cache if it has an entry for the key and none
+ * of the files the entry came from have changed. */
+int LoadCache(q1_asm_t *as, unsigned long long key) {
+
+   FileType file;
+   char *path;
+   int rc;
+
+   path = CachePath(as, key);
+   rc = ReadFile(path, &file);
+   free(path);
+   if(!rc) {
+      return 0;
+   }
+
+   rc = ReadCache(as, file.data, file.size, key, 0);
+   if(rc) {
+      ReadCache(as, file.data, file.size, key, 1);
+   }
+   CloseFile(&file);
+   return rc;
+
+}
+
+/* Check a cache entry, then with replay set, add its contents.
+ * Returns 0 if the entry is damaged or out of date. Replay trusts what
+ * the check accepted, so every offset and operation is checked first. */
+int ReadCache(q1_asm_t *as, const char *data, size_t size,
+              unsigned long long key, int replay) {
+
+   const unsigned char *ptr = (const unsigned char*)data;
+   const unsigned char *end = ptr + size;
+   DependencyType dep;
+   const char *strings[2];
+   size_t lengths[2];
+   unsigned long long hash;
+   unsigned int count;
+   unsigned int raw, text;
+   unsigned int raw_length, text_length;
+   unsigned int label_length, arg;
+   unsigned int has_statement, op;
+   unsigned int x, y;
+   LineType *lp;
+   char *name;
+   int rc;
+
+#define NEED(n)   if((size_t)(end - ptr) < (n)) return 0
+#define NUMBER(v, n) \
+   NEED(n); \
+   for((v) = 0, y = (n); y > 0; y--) (v) = ((v) << 8) | ptr[y - 1]; \
+   ptr += (n)
+#define STRING(i) \
+   NUMBER(lengths[i], 4); \
+   NEED(lengths[i]); \
+   strings[i] = (const char*)ptr; \
+   ptr += lengths[i]
+
+   NEED(4);
+   if(memcmp(ptr, CACHE_MAGIC, 4)) {
+      return 0;
+   }
+   ptr += 4;
+   NUMBER(count, 4);
+   NUMBER(hash, 8);
+   if(count != CACHE_VERSION || hash != key) {
+      return 0;
+   }
+
+   NUMBER(count, 4);
+   for(x = 0; x < count; x++) {
+      STRING(0);
+      NUMBER(dep.size, 8);
+      NUMBER(dep.mtime, 8);
+      NUMBER(dep.hash, 8);
+      if(replay) {
+         dep.name = ArenaCopy(as, strings[0], lengths[0]);
+         if(as->dependency_count == as->dependency_max) {
+            as->dependency_max = as->dependency_max
+                               ? as->dependency_max * 2 : 64;
+            as->dependencies = realloc(as->dependencies,
+                                       as->dependency_max
+                                       * sizeof(DependencyType));
+         }
+         as->dependencies[as->dependency_count++] = dep;
+      } else {
+         /* The entry may still be rejected, so the name is not kept. */
+         name = malloc(lengths[0] + 1);
+         memcpy(name, strings[0], lengths[0]);
+         name[lengths[0]] = 0;
+         dep.name = name;
+         rc = CheckDependency(&dep);
+         free(name);
+         if(!rc) {
+            return 0;
+         }
+      }
+   }
+
+   NUMBER(count, 4);
+   for(x = 0; x < count; x++) {
+      STRING(0);
+      STRING(1);
+      if(replay) {
+         SetMacro(as, ArenaCopy(as, strings[0], lengths[0]), strings[1],
+                  lengths[1]);
+      }
+   }
+
+   /* The text of all lines is added at once, then the lines are set to
+    * point into it. */
+   NUMBER(count, 4);
+   STRING(0);
+   STRING(1);
+   NEED((size_t)count * 18);
+   raw = text = 0;
+   if(replay) {
+      raw = AppendBuffer(&as->source, strings[0], lengths[0]);
+      text = AppendBuffer(&as->line_text, strings[1], lengths[1]);
+      if(as->line_count + count > as->line_max) {
+         while(as->line_count + count > as->line_max) {
+            as->line_max = as->line_max ? as->line_max * 2 : 1024;
+         }
+         as->lines = realloc(as->lines, as->line_max * sizeof(LineType));
+      }
+   }
+   for(x = 0; x < count; x++) {
+      NUMBER(raw_length, 4);
+      NUMBER(text_length, 4);
+      if(!replay) {
+         NUMBER(label_length, 4);
+         NUMBER(has_statement, 1);
+         NUMBER(op, 1);
+         NUMBER(arg, 4);
+         if(raw_length > lengths[0] - raw || text_length >= lengths[1] - text
+            || strings[1][text + text_length] != 0
+            || label_length > text_length || (arg && arg >= text_length)
+            || has_statement > 1 || (has_statement && !ValidOperation(op))) {
+            return 0;
+         }
+         raw += raw_length;
+         text += text_length + 1;
+         continue;
+      }
+      lp = &as->lines[as->line_count++];
+      memset(lp, 0, sizeof(LineType));
+      lp->raw = raw;
+      lp->raw_length = raw_length;
+      lp->text = text;
+      lp->parsed = 1;
+      NUMBER(lp->label_length, 4);
+      NUMBER(lp->has_statement, 1);
+      NUMBER(lp->statement.op, 1);
+      NUMBER(lp->arg, 4);
+      raw += raw_length;
+      text += text_length + 1;
+   }
+
+#undef NEED
+#undef NUMBER
+#undef STRING
+
+   return ptr == end && (replay || (raw == lengths[0] && text == lengths[1]));
+
+}
+
+/* Check that an operation from the cache is in the instruction map. */
+int ValidOperation(unsigned int op) {
+   size_t x;
+   for(x = 0; x < instruction_count; x++) {
+      if(INSTRUCTION_MAP[x].opcode == op) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Remember what came from a file so it can be saved in the cache. */
+void RecordCache(q1_asm_t *as, unsigned long long key,
+                 unsigned int first_line, unsigned int first_dependency,
+                 unsigned int first_macro) {
+
+   CacheRecordType *rp;
+   MacroType *mp;
+   unsigned int x;
+
+   if(as->cache_record_count == as->cache_record_max) {
+      as->cache_record_max = as->cache_record_max
+                           ? as->cache_record_max * 2 : 16;
+      as->cache_records = realloc(as->cache_records,
+                                  as->cache_record_max
+                                  * sizeof(CacheRecordType));
+   }
+   rp = &as->cache_records[as->cache_record_count++];
+   rp->key = key;
+   rp->first_line = first_line;
+   rp->last_line = as->line_count;
+   rp->first_dependency = first_dependency;
+   rp->last_dependency = as->dependency_count;
+
+   /* Save the values now, since later files may change them. */
+   rp->macros = ArenaAlloc(as, (as->macro_log_count - first_macro)
+                           * sizeof(MacroValueType));
+   rp->macro_count = 0;
+   for(x = first_macro; x < as->macro_log_count; x++) {
+      mp = FindMacro(as, as->macro_log[x]);
+      if(mp->mark != as->cache_record_count) {
+         mp->mark = as->cache_record_count;
+         rp->macros[rp->macro_count].name = mp->name;
+         rp->macros[rp->macro_count].value
+            = mp->value ? ArenaCopy(as, mp->value, strlen(mp->value)) : "";
+         ++rp->macro_count;
+      }
+   }
+
+}
+
+void SaveCache(q1_asm_t *as) {
+   unsigned int x;
+   if(mkdir(as->cache_dir, 0777) != 0 && errno != EEXIST) {
+      Warn(as, "could not create %s", as->cache_dir);
+      return;
+   }
+   for(x = 0; x < as->cache_record_count; x++) {
+      WriteCacheEntry(as, &as->cache_records[x]);
+   }
+}
+
+/* Write an entry to a temporary file and move it into place, so that
+ * a concurrent run never sees part of an entry. The temporary name is
+ * unique so that assemblers in one process do not collide. */
+void WriteCacheEntry(q1_asm_t *as, const CacheRecordType *rp) {
+
+   const LineType *lp;
+   const LineType *first;
+   const LineType *last;
+   const DependencyType *dp;
+   char *path;
+   char *temp;
+   FILE *fd;
+   unsigned int x;
+   int tfd;
+   int rc;
+
+   path = CachePath(as, rp->key);
+   temp = malloc(strlen(path) + 8);
+   sprintf(temp, "%s.XXXXXX", path);
+   tfd = mkstemp(temp);
+   if(tfd >= 0) {
+      fchmod(tfd, 0644);
+   }
+   fd = tfd >= 0 ? fdopen(tfd, "wb") : NULL;
+   if(fd == NULL) {
+      Warn(as, "could not write %s", temp);
+      if(tfd >= 0) {
+         close(tfd);
+         unlink(temp);
+      }
+      free(temp);
+      free(path);
+      return;
+   }
+
+   fwrite(CACHE_MAGIC, 1, 4, fd);
+   PutNumber(fd, CACHE_VERSION, 4);
+   PutNumber(fd, rp->key, 8);
+
+   PutNumber(fd, rp->last_dependency - rp->first_dependency, 4);
+   for(x = rp->first_dependency; x < rp->last_dependency; x++) {
+      dp = &as->dependencies[x];
+      PutString(fd, dp->name, strlen(dp->name));
+      PutNumber(fd, dp->size, 8);
+      PutNumber(fd, dp->mtime, 8);
+      PutNumber(fd, dp->hash, 8);
+   }
+
+   PutNumber(fd, rp->macro_count, 4);
+   for(x = 0; x < rp->macro_count; x++) {
+      PutString(fd, rp->macros[x].name, strlen(rp->macros[x].name));
+      PutString(fd, rp->macros[x].value, strlen(rp->macros[x].value));
+   }
+
+   /* The lines of a file are next to each other in the buffers. */
+   PutNumber(fd, rp->last_line - rp->first_line, 4);
+   if(rp->last_line > rp->first_line) {
+      first = &as->lines[rp->first_line];
+      last = &as->lines[rp->last_line - 1];
+      PutString(fd, LineRaw(as, first),
+                last->raw + last->raw_length - first->raw);
+      PutString(fd, LineText(as, first),
+                last->text + strlen(LineText(as, last)) + 1 - first->text);
+   } else {
+      PutString(fd, "", 0);
+      PutString(fd, "", 0);
+   }
+   for(x = rp->first_line; x < rp->last_line; x++) {
+      lp = &as->lines[x];
+      PutNumber(fd, lp->raw_length, 4);
+      PutNumber(fd, strlen(LineText(as, lp)), 4);
+      PutNumber(fd, lp->label_length, 4);
+      PutNumber(fd, lp->has_statement, 1);
+      PutNumber(fd, lp->statement.op, 1);
+      PutNumber(fd, lp->statement.arg
+                    ? lp->statement.arg - LineText(as, lp) : 0, 4);
+   }
+
+   rc = ferror(fd);
+   rc = fclose(fd) || rc;
+   if(rc || rename(temp, path) != 0) {
+      Warn(as, "could not write %s", path);
+      unlink(temp);
+   }
+   free(temp);
+   free(path);
+
+}
+
+void PutNumber(FILE *fd, unsigned long long value, unsigned int bytes) {
+   while(bytes > 0) {
+      fputc((int)(value & 0xFF), fd);
+      value >>= 8;
+      --bytes;
+   }
+}
+
+void PutString(FILE *fd, const char *str, size_t len) {
+   PutNumber(fd, len, 4);
+   fwrite(str, 1, len, fd);
+}
+
+void ProcessDefineStart(q1_asm_t *as, const char *line, char **name) {
+
+   size_t len;
+
+   if(*name) {
+      Error(as, "\"#define\" without \"#end\"");
+      return;
+   }
+
+   len = strlen(line);
+   *name = malloc(len + 1);
+   strcpy(*name, line);
+
+   AddMacro(as, *name);
+
+}
+
+void ProcessDefine(q1_asm_t *as, const char *line, const char *name) {
+   AppendMacro(as, name, line);
+}
+
+void ProcessDefineEnd(q1_asm_t *as, char **name) {
+
+   if(!*name) {
+      Error(as, "\"#end\" not inside a \"#define\"");
+      return;
+   }
+
+   free(*name);
+   *name = NULL;
+
+}
+
+void ProcessMacro(q1_asm_t *as, const char *name) {
+
+   MacroType *mp;
+   const char *value;
+   const char *next;
+
+   mp = FindMacro(as, name);
+   if(!mp) {
+      Error(as, "macro \"%s\" not found", name);
+      return;
+   }
+
+   /* Values end with a newline. */
+   if(mp->value) {
+      for(value = mp->value; *value; value = next + 1) {
+         next = strchr(value, '\n');
+         AppendLine(as, value, next - value);
+      }
+   }
+
+}
+
@@ -0,0 +1,83 @@
+/* Q1 assembler library.
+ *
+ * Each q1_asm_t holds all of the state for assembling one program: its
+ * lines, symbols, macros, image and messages. Nothing is shared between
+ * assemblers, so any number of programs can be assembled in one process
+ * and different assemblers can be used from different threads.
+ */
+
+#ifndef Q1ASM_H
+#define Q1ASM_H
+
+#include <stddef.h>
+
+typedef struct q1_asm q1_asm_t;
+
+/* Output formats for q1_asm_write. */
+typedef enum {
+   Q1_ASM_LISTING,      /* Addresses and bytes next to the source. */
+   Q1_ASM_RAW,          /* Bytes starting at address 0. */
+   Q1_ASM_HEX,          /* One byte per line starting at address 0. */
+   Q1_ASM_IHEX,         /* Intel HEX records. */
+   Q1_ASM_SEG,          /* Binary segments and symbols. */
+   Q1_ASM_SYMBOLS,      /* Labels and their addresses as text. */
+   Q1_ASM_OBJECT        /* Relocatable object for ldq1. */
+} q1_asm_format_t;
+
+/* Create an assembler. Returns NULL if out of memory. */
+q1_asm_t *q1_asm_create(void);
+
+/* Destroy an assembler and everything it returned. */
+void q1_asm_destroy(q1_asm_t *as);
+
+/* Assemble a relocatable object rather than a program at fixed
+ * addresses. Must be set before q1_asm_assemble to write
+ * Q1_ASM_OBJECT. */
+void q1_asm_set_object(q1_asm_t *as, int object);
+
+/* Save preprocessed files in dir and reuse them in later runs (see
+ * asmq1 -cache). NULL, the default, turns the cache off. dir is not
+ * copied. */
+void q1_asm_set_cache(q1_asm_t *as, const char *dir);
+
+/* Assemble a program once per assembler. If source is NULL the file
+ * name is read, otherwise size bytes of source are assembled and name is
+ * only used to identify it to the cache. Files it includes are read by
+ * name. Returns the number of errors. */
+unsigned int q1_asm_assemble(q1_asm_t *as, const char *name,
+                             const char *source, size_t size);
+
+/* Write the result to a file. Returns 0 on error. */
+int q1_asm_write(q1_asm_t *as, q1_asm_format_t format, const char *name);
+
+/* Errors so far, including ones from q1_asm_write. */
+unsigned int q1_asm_error_count(const q1_asm_t *as);
+
+/* Error and warning messages so far, one per line. */
+const char *q1_asm_messages(const q1_asm_t *as);
+
+/* The assembled memory image: 64 KiB with 0xFF at addresses nothing was
+ * assembled to. end is set to one past the last address used. */
+const unsigned char *q1_asm_image(const q1_asm_t *as, size_t *end);
+
+/* Number of bytes assembled. */
+unsigned int q1_asm_byte_count(const q1_asm_t *as);
+
+/* Runs of bytes assembled to consecutive addresses, in the order they
+ * were started. Returns 0 if index is out of range. */
+unsigned int q1_asm_segment_count(const q1_asm_t *as);
+int q1_asm_segment(const q1_asm_t *as, unsigned int index,
+                   unsigned short *start, size_t *size);
+
+/* Symbols in the order they were first seen. Returns the name, or NULL
+ * if index is out of range. defined is 0 for a symbol that was only
+ * referred to. */
+unsigned int q1_asm_symbol_count(const q1_asm_t *as);
+const char *q1_asm_symbol(const q1_asm_t *as, unsigned int index,
+                          unsigned short *addr, int *defined);
+
+/* Look up the address of a label. Returns 0 if it is not defined. */
+int q1_asm_find_symbol(const q1_asm_t *as, const char *name,
+                       unsigned short *addr);
+
+#endif /* Q1ASM_H */
@@ -0,0 +1,527 @@
+/* Q1 simulator library: lockstep execution of many machines.
+ *
+ * Registers are byte vectors with one lane per machine and memory is
+ * stored by address with the lanes for each address next to each other,
+ * so loads and stores at constant addresses are single vector
+ * operations. The batch runs the lanes at the lowest PC whose
+ * instruction bytes agree (lanes with self-modified code are split off)
+ * under a lane mask until they branch differently or catch up with
+ * another group of lanes.
+ *
+ * This uses GCC vector extensions. The vectors are 32 bytes wide to
+ * match AVX2; without -mavx2 the compiler splits each operation into
+ * two SSE2 operations.
+ */
+
+#include "q1.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES  Q1_BATCH_LANES
+#define PAGES  256
+
+#define ALONE_STEPS  (1 << 16)
+#define SHARE_STEPS  (1 << 12)
+
+typedef unsigned char VecType __attribute__((vector_size(LANES)));
+typedef unsigned long long WideType __attribute__((vector_size(LANES)));
+
+struct q1_batch {
+   VecType memory[1 << 16];         /* memory[addr][lane] */
+   VecType a, b, c, xh, xl;
+   VecType cf, zf, nf;              /* 0 or 1 in each lane. */
+   unsigned short pc[LANES];
+   unsigned char status[LANES];
+   unsigned long long steps[LANES];
+   unsigned long long clocks[LANES];
+   unsigned char dirty[PAGES / 8];  /* 256-byte pages stored to. */
+   unsigned char image[1 << 16];    /* Memory after loading. */
+   unsigned char buffer[1 << 16];
+   q1_cpu_t *alone;                 /* Runs the last lane left. */
+};
+
+#define BLEND(old, value, m)  (((value) & (m)) | ((old) & ~(m)))
+#define MARK(bp, addr) \
+   (bp)->dirty[(addr) >> 11] |= 1 << (((addr) >> 8) & 7)
+
+static const VecType ZERO;
+
+/* Test if any lane is non-zero. */
+#define ANY(v) \
+   ((((WideType)(v))[0] | ((WideType)(v))[1] \
+   | ((WideType)(v))[2] | ((WideType)(v))[3]) != 0)
+
+static int Runnable(const q1_batch_t *bp, unsigned int lane,
+                    unsigned long long max_steps,
+                    unsigned long long max_clocks) {
+   return bp->status[lane] == Q1_RUNNING
+       && (!max_steps || bp->steps[lane] < max_steps)
+       && (!max_clocks || bp->clocks[lane] < max_clocks);
+}
+
+/* Test if two lanes see the same instruction at pc. */
+static int SameCode(const q1_batch_t *bp, unsigned short pc,
+                    unsigned int x, unsigned int y) {
+   const VecType *mp = bp->memory;
+   if(mp[pc][x] != mp[pc][y]) {
+      return 0;
+   }
+   if((mp[pc][x] >> 4) < 2) {
+      return mp[(unsigned short)(pc + 1)][x] == mp[(unsigned short)(pc + 1)][y]
+          && mp[(unsigned short)(pc + 2)][x] == mp[(unsigned short)(pc + 2)][y];
+   }
+   return 1;
+}
+
+q1_batch_t *q1_batch_create(void) {
+   void *ptr;
+   q1_batch_t *bp;
+   if(posix_memalign(&ptr, 64, sizeof(q1_batch_t))) {
+      return NULL;
+   }
+   bp = ptr;
+   bp->alone = q1_create();
+   if(bp->alone) {
+      q1_set_log(bp->alone, NULL);
+      if(!q1_set_engine(bp->alone, Q1_ENGINE_JIT)) {
+         q1_set_engine(bp->alone, Q1_ENGINE_THREADED);
+      }
+   }
+   memset(bp->image, 0xFF, sizeof(bp->image));
+   memset(bp->dirty, 0xFF, sizeof(bp->dirty));
+   q1_batch_reset(bp);
+   return bp;
+}
+
+void q1_batch_destroy(q1_batch_t *bp) {
+   if(bp) {
+      q1_destroy(bp->alone);
+      free(bp);
+   }
+}
+
+void q1_batch_load(q1_batch_t *bp, unsigned short addr,
+                   const void *data, size_t size) {
+   if(size > sizeof(bp->image) - addr) {
+      size = sizeof(bp->image) - addr;
+   }
+   memset(bp->image, 0xFF, sizeof(bp->image));
+   memcpy(&bp->image[addr], data, size);
+   memset(bp->dirty, 0xFF, sizeof(bp->dirty));
+   q1_batch_reset(bp);
+}
+
+/* Only pages that were stored to are copied back from the image. */
+void q1_batch_reset(q1_batch_t *bp) {
+   unsigned int page;
+   unsigned int x;
+   for(page = 0; page < PAGES; page++) {
+      if(bp->dirty[page >> 3] & (1 << (page & 7))) {
+         for(x = page << 8; x < (page + 1) << 8; x++) {
+            bp->memory[x] = ZERO + bp->image[x];
+         }
+      }
+   }
+   memset(bp->dirty, 0, sizeof(bp->dirty));
+   bp->a = ZERO + 0xFF;
+   bp->b = ZERO + 0xFF;
+   bp->c = ZERO + 0xFF;
+   bp->xh = ZERO + 0xFF;
+   bp->xl = ZERO + 0xFF;
+   bp->cf = ZERO + 1;
+   bp->zf = ZERO + 1;
+   bp->nf = ZERO + 1;
+   memset(bp->pc, 0, sizeof(bp->pc));
+   memset(bp->status, Q1_RUNNING, sizeof(bp->status));
+   memset(bp->steps, 0, sizeof(bp->steps));
+   memset(bp->clocks, 0, sizeof(bp->clocks));
+}
+
+/* Run a lane by itself on a scalar machine.
+ * Once the other lanes have stopped the vector code gains nothing, and
+ * a lane that loops for its whole budget would otherwise run at a
+ * fraction of the scalar speed. Moving the lane costs about as much as
+ * a few thousand instructions, so this is only done after the lane has
+ * run alone for ALONE_STEPS instructions.
+ */
+static void RunAlone(q1_batch_t *bp, unsigned int lane,
+                     unsigned long long max_steps,
+                     unsigned long long max_clocks) {
+
+   q1_cpu_t *cpu = bp->alone;
+   const unsigned char *memory;
+   q1_regs_t regs;
+   unsigned int x;
+
+   for(x = 0; x < (1 << 16); x++) {
+      bp->buffer[x] = bp->memory[x][lane];
+   }
+   q1_reset(cpu);
+   q1_load(cpu, 0, bp->buffer, sizeof(bp->buffer));
+   q1_batch_get_regs(bp, lane, &regs);
+   q1_set_regs(cpu, &regs);
+
+   /* The machine counts from zero. */
+   bp->status[lane] = q1_run_limits(cpu,
+      max_steps ? max_steps - bp->steps[lane] : 0,
+      max_clocks ? max_clocks - bp->clocks[lane] : 0);
+   bp->steps[lane] += q1_steps(cpu);
+   bp->clocks[lane] += q1_clocks(cpu);
+
+   q1_get_regs(cpu, &regs);
+   q1_batch_set_regs(bp, lane, &regs);
+   memory = q1_memory(cpu);
+   for(x = 0; x < (1 << 16); x++) {
+      if(memory[x] != bp->buffer[x]) {
+         bp->memory[x][lane] = memory[x];
+         MARK(bp, x);
+      }
+   }
+
+}
+
+void q1_batch_run(q1_batch_t *bp, unsigned int lanes,
+                  unsigned long long max_steps,
+                  unsigned long long max_clocks) {
+
+   VecType *const memory = bp->memory;
+   VecType a = bp->a;
+   VecType b = bp->b;
+   VecType c = bp->c;
+   VecType xh = bp->xh;
+   VecType xl = bp->xl;
+   VecType cf = bp->cf;
+   VecType zf = bp->zf;
+   VecType nf = bp->nf;
+   VecType mask, taken, value;
+   unsigned long long left, slack;
+   unsigned long long alone_start = ~0ULL;
+   unsigned long long run, run_clocks;
+   unsigned int other;
+   unsigned int running;
+   unsigned int first;
+   unsigned int lane;
+   unsigned short pc, addr, next, x;
+   unsigned char op;
+   int pcs_set;
+   int rotate = 0;
+
+#define RESULT(v, carry_out) \
+   value = (v); \
+   a = BLEND(a, value, mask); \
+   cf = BLEND(cf, (carry_out), mask); \
+   zf = BLEND(zf, (VecType)(value == 0) & 1, mask); \
+   nf = BLEND(nf, value >> 7, mask)
+#define EACH_LANE \
+   for(lane = 0; lane < LANES; lane++) if(mask[lane])
+
+   if(lanes > LANES) {
+      lanes = LANES;
+   }
+
+   for(;;) {
+
+      /* Select the running lanes at the lowest PC. If the last group
+       * used its whole share without reaching the others, a group stuck
+       * in a loop could starve them, so give the lanes that are furthest
+       * behind a turn instead. */
+      first = LANES;
+      running = 0;
+      for(lane = 0; lane < lanes; lane++) {
+         if(Runnable(bp, lane, max_steps, max_clocks)) {
+            ++running;
+            if(first == LANES) {
+               first = lane;
+            } else if(rotate) {
+               if(bp->steps[lane] < bp->steps[first]) {
+                  first = lane;
+               }
+            } else if(bp->pc[lane] < bp->pc[first]) {
+               first = lane;
+            }
+         }
+      }
+      if(first == LANES) {
+         break;
+      }
+      rotate = 0;
+      if(running != 1) {
+         alone_start = ~0ULL;
+      } else if(alone_start == ~0ULL) {
+         alone_start = bp->steps[first];
+      }
+      if(running == 1 && bp->steps[first] - alone_start >= ALONE_STEPS
+         && bp->alone) {
+         bp->a = a;
+         bp->b = b;
+         bp->c = c;
+         bp->xh = xh;
+         bp->xl = xl;
+         bp->cf = cf;
+         bp->zf = zf;
+         bp->nf = nf;
+         RunAlone(bp, first, max_steps, max_clocks);
+         a = bp->a;
+         b = bp->b;
+         c = bp->c;
+         xh = bp->xh;
+         xl = bp->xl;
+         cf = bp->cf;
+         zf = bp->zf;
+         nf = bp->nf;
+         continue;
+      }
+      pc = bp->pc[first];
+      mask = ZERO;
+      other = 1 << 16;
+      left = running == 1 ? ALONE_STEPS : SHARE_STEPS;
+      for(lane = 0; lane < lanes; lane++) {
+         if(!Runnable(bp, lane, max_steps, max_clocks)) {
+            continue;
+         }
+         if(bp->pc[lane] != pc || !SameCode(bp, pc, first, lane)) {
+            if(bp->pc[lane] > pc && bp->pc[lane] < other) {
+               other = bp->pc[lane];
+            }
+            continue;
+         }
+         mask[lane] = 0xFF;
+         if(max_steps) {
+            slack = max_steps - bp->steps[lane];
+            left = slack < left ? slack : left;
+         }
+         if(max_clocks) {
+            slack = (max_clocks - bp->clocks[lane]) / 21;
+            slack = slack ? slack : 1;
+            left = slack < left ? slack : left;
+         }
+      }
+
+      /* Run the selected lanes until they split or reach other lanes. */
+      run = 0;
+      run_clocks = 0;
+      pcs_set = 0;
+      for(;;) {
+
+         op = memory[pc][first];
+         if(ANY((memory[pc] ^ op) & mask)) {
+            break;
+         }
+         next = pc + 1;
+         addr = 0;
+         if((op >> 4) < 2) {
+            addr = (unsigned short)memory[next][first] << 8;
+            if(ANY((memory[next] ^ (unsigned char)(addr >> 8)) & mask)) {
+               break;
+            }
+            ++next;
+            addr |= memory[next][first];
+            if(ANY((memory[next] ^ (unsigned char)addr) & mask)) {
+               break;
+            }
+            ++next;
+         }
+
+         ++run;
+         switch(op) {
+         case 0x00: case 0x01: case 0x02: case 0x03:
+         case 0x04: case 0x05: case 0x06: case 0x07:
+         case 0x08: case 0x09: case 0x0A: case 0x0B:
+         case 0x0C: case 0x0D: case 0x0E: case 0x0F:
+            run_clocks += 7 * 3;
+            taken = mask;
+            if(op & 1) {
+               taken &= -cf;
+            }
+            if(op & 2) {
+               taken &= -zf;
+            }
+            if(op & 4) {
+               taken &= -nf;
+            }
+            if(op & 8) {
+               xh = BLEND(xh, ZERO + (unsigned char)(next >> 8), taken);
+               xl = BLEND(xl, ZERO + (unsigned char)next, taken);
+            }
+            if(ANY(taken ^ mask)) {
+               if(ANY(taken)) {
+                  EACH_LANE {
+                     bp->pc[lane] = taken[lane] ? addr : next;
+                  }
+                  pcs_set = 1;
+                  goto split;
+               }
+            } else {
+               next = addr;
+            }
+            break;
+         case 0x10:  b = BLEND(b, memory[addr], mask);   goto load;
+         case 0x11:  c = BLEND(c, memory[addr], mask);   goto load;
+         case 0x12:  xh = BLEND(xh, memory[addr], mask); goto load;
+         case 0x13:  xl = BLEND(xl, memory[addr], mask); goto load;
+         case 0x14:  value = b;  goto store;
+         case 0x15:  value = c;  goto store;
+         case 0x16:  value = xh; goto store;
+         case 0x17:  value = xl; goto store;
+         case 0x18:  value = a;  goto store;
+         case 0x20:  RESULT(b & c, ZERO);                      goto math;
+         case 0x21:  RESULT(b | c, ZERO);                      goto math;
+         case 0x22:  RESULT(b << 1, b >> 7);                   goto math;
+         case 0x23:  RESULT(b >> 1, b & 1);                    goto math;
+         case 0x24:  RESULT(b + c, (VecType)(b + c < b) & 1);  goto math;
+         case 0x25:  RESULT(b + 1, (VecType)(b == 0xFF) & 1);  goto math;
+         case 0x26:  RESULT(b - 1, (VecType)(b == 0) & 1);     goto math;
+         case 0x27:  RESULT(~b, ZERO);                         goto math;
+         case 0x28:  RESULT(ZERO, ZERO);                       goto math;
+         case 0x30:  b = BLEND(b, a, mask);                    goto math;
+         case 0x31:  c = BLEND(c, a, mask);                    goto math;
+         case 0x32:  value = a;  goto store_x;
+         case 0x33:  value = b;  goto store_x;
+         case 0x34:  value = c;  goto store_x;
+         case 0x35:
+            EACH_LANE {
+               x = ((unsigned short)xh[lane] << 8) | xl[lane];
+               b[lane] = memory[x][lane];
+            }
+            goto math;
+         case 0x36:
+            EACH_LANE {
+               x = ((unsigned short)xh[lane] << 8) | xl[lane];
+               c[lane] = memory[x][lane];
+            }
+            goto math;
+         case 0x37:
+            run_clocks += 3 * 3;
+            next = ((unsigned short)xh[first] << 8) | xl[first];
+            if(ANY(((xh ^ (unsigned char)(next >> 8))
+                    | (xl ^ (unsigned char)next)) & mask)) {
+               EACH_LANE {
+                  bp->pc[lane] = ((unsigned short)xh[lane] << 8) | xl[lane];
+               }
+               pcs_set = 1;
+               goto split;
+            }
+            break;
+         case 0x38:
+            run_clocks += 3 * 3;
+            EACH_LANE {
+               bp->status[lane] = Q1_HALTED;
+               bp->pc[lane] = next;
+            }
+            pcs_set = 1;
+            goto split;
+         default:
+            switch(op >> 4) {
+            case 1:
+               run_clocks += 7 * 3;
+               break;
+            case 2:
+            case 3:
+               run_clocks += 3 * 3;
+               break;
+            default:
+               break;
+            }
+            EACH_LANE {
+               bp->status[lane] = Q1_FAULT;
+               bp->pc[lane] = next;
+            }
+            pcs_set = 1;
+            goto split;
+         }
+         goto done;
+
+load:
+         run_clocks += 7 * 3;
+         goto done;
+store:
+         memory[addr] = BLEND(memory[addr], value, mask);
+         MARK(bp, addr);
+         run_clocks += 7 * 3;
+         goto done;
+store_x:
+         EACH_LANE {
+            x = ((unsigned short)xh[lane] << 8) | xl[lane];
+            memory[x][lane] = value[lane];
+            MARK(bp, x);
+         }
+         goto math;
+math:
+         run_clocks += 3 * 3;
+done:
+         pc = next;
+         if(--left == 0 || pc >= other) {
+            break;
+         }
+
+      }
+
+      rotate = left == 0 && running != 1;
+
+split:
+      EACH_LANE {
+         bp->steps[lane] += run;
+         bp->clocks[lane] += run_clocks;
+         if(!pcs_set) {
+            bp->pc[lane] = pc;
+         }
+      }
+
+   }
+
+#undef RESULT
+#undef EACH_LANE
+
+   bp->a = a;
+   bp->b = b;
+   bp->c = c;
+   bp->xh = xh;
+   bp->xl = xl;
+   bp->cf = cf;
+   bp->zf = zf;
+   bp->nf = nf;
+
+}
+
+void q1_batch_get_regs(const q1_batch_t *bp, unsigned int lane,
+                       q1_regs_t *regs) {
+   regs->a = bp->a[lane];
+   regs->b = bp->b[lane];
+   regs->c = bp->c[lane];
+   regs->x = ((unsigned short)bp->xh[lane] << 8) | bp->xl[lane];
+   regs->pc = bp->pc[lane];
+   regs->c_flag = bp->cf[lane];
+   regs->z_flag = bp->zf[lane];
+   regs->n_flag = bp->nf[lane];
+}
+
+void q1_batch_set_regs(q1_batch_t *bp, unsigned int lane,
+                       const q1_regs_t *regs) {
+   bp->a[lane] = regs->a;
+   bp->b[lane] = regs->b;
+   bp->c[lane] = regs->c;
+   bp->xh[lane] = regs->x >> 8;
+   bp->xl[lane] = regs->x & 0xFF;
+   bp->pc[lane] = regs->pc;
+   bp->cf[lane] = regs->c_flag != 0;
+   bp->zf[lane] = regs->z_flag != 0;
+   bp->nf[lane] = regs->n_flag != 0;
+}
+
+q1_status_t q1_batch_status(const q1_batch_t *bp, unsigned int lane) {
+   return (q1_status_t)bp->status[lane];
+}
+
+unsigned long long q1_batch_steps(const q1_batch_t *bp, unsigned int lane) {
+   return bp->steps[lane];
+}
+
+unsigned long long q1_batch_clocks(const q1_batch_t *bp, unsigned int lane) {
+   return bp->clocks[lane];
+}
+
+unsigned char q1_batch_read(const q1_batch_t *bp, unsigned int lane,
+                            unsigned short addr) {
+   return bp->memory[addr][lane];
+}
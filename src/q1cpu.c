@@ -0,0 +1,1084 @@
+/* Q1 simulator library: machine state and execution engines.
+ * Joe Wingbermuehle
+ * 20080528
+ */
+
+#include "q1cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void InvalidateBlocks(q1_cpu_t *cpu, unsigned short addr);
+static int CheckWatch(q1_cpu_t *cpu);
+
+/* Invalidate predecoded instructions and blocks overlapping addr. */
+void Q1InvalidateCode(q1_cpu_t *cpu, unsigned short addr) {
+   unsigned short x;
+   for(x = addr - 2; x != (unsigned short)(addr + 1); x++) {
+      cpu->decode_dirty[x >> 3] |= 1 << (x & 7);
+   }
+   if(cpu->cache && cpu->cache->code_map[addr]) {
+      InvalidateBlocks(cpu, addr);
+   }
+}
+
+/* Store a byte, invalidating any translated code it overlaps. */
+static void Store(q1_cpu_t *cpu, unsigned short addr, unsigned char value) {
+   cpu->memory[addr] = value;
+   cpu->pages[addr >> 8] = 1;
+   if(cpu->decoded) {
+      Q1InvalidateCode(cpu, addr);
+   }
+}
+
+static void ldb(q1_cpu_t *cpu) {
+   cpu->regb = cpu->memory[cpu->operand];
+}
+
+static void ldc(q1_cpu_t *cpu) {
+   cpu->regc = cpu->memory[cpu->operand];
+}
+
+static void lxh(q1_cpu_t *cpu) {
+   cpu->regxh = cpu->memory[cpu->operand];
+}
+
+static void lxl(q1_cpu_t *cpu) {
+   cpu->regxl = cpu->memory[cpu->operand];
+}
+
+static void stb(q1_cpu_t *cpu) {
+   Store(cpu, cpu->operand, cpu->regb);
+}
+
+static void stc(q1_cpu_t *cpu) {
+   Store(cpu, cpu->operand, cpu->regc);
+}
+
+static void sxh(q1_cpu_t *cpu) {
+   Store(cpu, cpu->operand, cpu->regxh);
+}
+
+static void sxl(q1_cpu_t *cpu) {
+   Store(cpu, cpu->operand, cpu->regxl);
+}
+
+static void sta(q1_cpu_t *cpu) {
+   Store(cpu, cpu->operand, cpu->rega);
+}
+
+static void and(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb & cpu->regc;
+   cpu->c_flag = 0;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void or(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb | cpu->regc;
+   cpu->c_flag = 0;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void shl(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb << 1;
+   cpu->c_flag = cpu->regb >> 7;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void shr(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb >> 1;
+   cpu->c_flag = cpu->regb & 1;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void add(q1_cpu_t *cpu) {
+   unsigned short temp = cpu->regb + cpu->regc;
+   cpu->rega = (unsigned char)temp;
+   cpu->c_flag = temp > 255;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void inc(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb + 1;
+   cpu->c_flag = cpu->regb == 255;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void dec(q1_cpu_t *cpu) {
+   cpu->rega = cpu->regb - 1;
+   cpu->c_flag = cpu->regb == 0;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void not(q1_cpu_t *cpu) {
+   cpu->rega = ~cpu->regb;
+   cpu->c_flag = 0;
+   cpu->z_flag = cpu->rega == 0;
+   cpu->n_flag = cpu->rega >> 7;
+}
+
+static void clr(q1_cpu_t *cpu) {
+   cpu->rega = 0;
+   cpu->c_flag = 0;
+   cpu->z_flag = 1;
+   cpu->n_flag = 0;
+}
+
+static void mab(q1_cpu_t *cpu) {
+   cpu->regb = cpu->rega;
+}
+
+static void mac(q1_cpu_t *cpu) {
+   cpu->regc = cpu->rega;
+}
+
+static void sax(q1_cpu_t *cpu) {
+   Store(cpu, (cpu->regxh << 8) | cpu->regxl, cpu->rega);
+}
+
+static void sbx(q1_cpu_t *cpu) {
+   Store(cpu, (cpu->regxh << 8) | cpu->regxl, cpu->regb);
+}
+
+static void scx(q1_cpu_t *cpu) {
+   Store(cpu, (cpu->regxh << 8) | cpu->regxl, cpu->regc);
+}
+
+static void lbx(q1_cpu_t *cpu) {
+   cpu->regb = cpu->memory[(cpu->regxh << 8) | cpu->regxl];
+}
+
+static void lcx(q1_cpu_t *cpu) {
+   cpu->regc = cpu->memory[(cpu->regxh << 8) | cpu->regxl];
+}
+
+static void ret(q1_cpu_t *cpu) {
+   cpu->preg = (cpu->regxh << 8) | cpu->regxl;
+}
+
+static void hlt(q1_cpu_t *cpu) {
+   cpu->halted = 1;
+}
+
+static void jmp(q1_cpu_t *cpu) {
+
+   const unsigned char func = cpu->opcode & 0x0F;
+   const unsigned char c_func = (func >> 0) & 1;
+   const unsigned char z_func = (func >> 1) & 1;
+   const unsigned char n_func = (func >> 2) & 1;
+   const unsigned char is_call = (func >> 3) & 1;
+
+   if((!c_func | cpu->c_flag) & (!z_func | cpu->z_flag)
+      & (!n_func | cpu->n_flag)) {
+      if(is_call) {
+         cpu->regxh = cpu->preg >> 8;
+         cpu->regxl = cpu->preg & 0xFF;
+      }
+      cpu->preg = cpu->operand;
+   }
+}
+
+static void invalid(q1_cpu_t *cpu) {
+   const unsigned char func = cpu->opcode & 0x0F;
+   if(cpu->log) {
+      switch(cpu->opcode >> 4) {
+      case 1:
+         fprintf(cpu->log, "ERROR: invalid LS instruction: %u\n",
+            (unsigned int)func);
+         break;
+      case 2:
+         fprintf(cpu->log, "ERROR: invalid MATH instruction: %u\n",
+            (unsigned int)func);
+         break;
+      case 3:
+         fprintf(cpu->log, "ERROR: invalid MISC instruction: %u\n",
+            (unsigned int)func);
+         break;
+      default:
+         fprintf(cpu->log, "ERROR: invalid instruction class: %u\n",
+            (unsigned int)(cpu->opcode >> 4));
+         break;
+      }
+   }
+   cpu->faulted = 1;
+}
+
+static const InstructionFunc ls_class[16] = {
+   ldb, ldc, lxh, lxl, stb, stc, sxh, sxl, sta
+};
+
+static const InstructionFunc math_class[16] = {
+   and, or, shl, shr, add, inc, dec, not, clr
+};
+
+static const InstructionFunc misc_class[16] = {
+   mab, mac, sax, sbx, scx, lbx, lcx, ret, hlt
+};
+
+static void j_inst(q1_cpu_t *cpu) {
+   cpu->operand = (unsigned short)cpu->memory[cpu->preg++] << 8;
+   cpu->operand |= cpu->memory[cpu->preg++];
+   jmp(cpu);
+}
+
+static void ls_inst(q1_cpu_t *cpu, unsigned char func) {
+   InstructionFunc inst = ls_class[func];
+   cpu->operand = (unsigned short)cpu->memory[cpu->preg++] << 8;
+   cpu->operand |= cpu->memory[cpu->preg++];
+   if(inst) {
+      (inst)(cpu);
+   } else {
+      invalid(cpu);
+   }
+}
+
+static void math_inst(q1_cpu_t *cpu, unsigned char func) {
+   InstructionFunc inst = math_class[func];
+   if(inst) {
+      (inst)(cpu);
+   } else {
+      invalid(cpu);
+   }
+}
+
+static void misc_inst(q1_cpu_t *cpu, unsigned char func) {
+   InstructionFunc inst = misc_class[func];
+   if(inst) {
+      (inst)(cpu);
+   } else {
+      invalid(cpu);
+   }
+}
+
+/* Execute the next instruction. */
+static void next(q1_cpu_t *cpu) {
+
+   const unsigned char opcode = cpu->memory[cpu->preg];
+   const unsigned char inst_class = opcode >> 4;
+   const unsigned char inst_func = opcode & 0x0F;
+
+   cpu->opcode = opcode;
+   ++cpu->preg;
+
+   switch(inst_class) {
+   case 0:     // Jump
+      j_inst(cpu);
+      cpu->clocks += 7 * 3;
+      break;
+   case 1:     // Load/Store
+      ls_inst(cpu, inst_func);
+      cpu->clocks += 7 * 3;
+      break;
+   case 2:     // Math
+      math_inst(cpu, inst_func);
+      cpu->clocks += 3 * 3;
+      break;
+   case 3:     // Misc
+      misc_inst(cpu, inst_func);
+      cpu->clocks += 3 * 3;
+      break;
+   default:
+      invalid(cpu);
+      break;
+   }
+
+   ++cpu->steps;
+
+}
+
+/* Run up to count instructions with the reference interpreter. */
+void Q1RunInterp(q1_cpu_t *cpu, unsigned long long count) {
+   for(; count; --count) {
+      next(cpu);
+      if(cpu->halted | cpu->faulted) {
+         break;
+      }
+   }
+}
+
+/* Run up to count instructions with the reference interpreter,
+ * stopping at execution breakpoints. */
+static void RunInterpBreak(q1_cpu_t *cpu, unsigned long long count) {
+   const unsigned char *const breaks = cpu->breaks;
+   for(; count; --count) {
+      if((breaks[cpu->preg] & Q1_BREAK_EXEC) && Q1StopAtBreak(cpu)) {
+         break;
+      }
+      next(cpu);
+      if(cpu->halted | cpu->faulted) {
+         break;
+      }
+   }
+}
+
+/* Run up to count instructions with the reference interpreter,
+ * recording each in the profile, the trace and the history and stopping
+ * at breakpoints and watchpoints. */
+static void RunRecord(q1_cpu_t *cpu, unsigned long long count) {
+
+   unsigned long long clocks;
+   unsigned short pc;
+   unsigned char op;
+   int taken;
+
+   for(; count; --count) {
+      if(AT_BREAK(cpu)) {
+         break;
+      }
+      pc = cpu->preg;
+      op = cpu->memory[pc];
+      taken = op < 0x10 && ((!(op & 1)) | cpu->c_flag)
+            & ((!(op & 2)) | cpu->z_flag) & ((!(op & 4)) | cpu->n_flag);
+      clocks = cpu->clocks;
+      next(cpu);
+      if(cpu->profile) {
+         Q1ProfileRecord(cpu, pc, cpu->clocks - clocks, taken);
+      }
+      if(cpu->trace) {
+         Q1TraceRecord(cpu, pc);
+      }
+      if(cpu->history) {
+         Q1HistoryRecord(cpu);
+      }
+      if(cpu->watch_count && CheckWatch(cpu)) {
+         break;
+      }
+      if(cpu->halted | cpu->faulted) {
+         break;
+      }
+   }
+
+}
+
+/* Stop the run if the instruction just executed read or wrote a
+ * watched address. Returns nonzero if stopped. */
+int CheckWatch(q1_cpu_t *cpu) {
+
+   unsigned char kind;
+   unsigned short addr;
+
+   switch(cpu->opcode) {
+   case 0x10: case 0x11: case 0x12: case 0x13:
+      kind = Q1_WATCH_READ;
+      addr = cpu->operand;
+      break;
+   case 0x14: case 0x15: case 0x16: case 0x17: case 0x18:
+      kind = Q1_WATCH_WRITE;
+      addr = cpu->operand;
+      break;
+   case 0x32: case 0x33: case 0x34:
+      kind = Q1_WATCH_WRITE;
+      addr = (cpu->regxh << 8) | cpu->regxl;
+      break;
+   case 0x35: case 0x36:
+      kind = Q1_WATCH_READ;
+      addr = (cpu->regxh << 8) | cpu->regxl;
+      break;
+   default:
+      return 0;
+   }
+   if(!(cpu->breaks[addr] & kind)) {
+      return 0;
+   }
+   cpu->stopped = 1;
+   cpu->stop_kind = kind;
+   cpu->stop_addr = addr;
+   return 1;
+
+}
+
+int Q1StopAtBreak(q1_cpu_t *cpu) {
+   if(cpu->stop_kind == Q1_BREAK_EXEC && cpu->stop_addr == cpu->preg
+      && cpu->stop_steps == cpu->steps) {
+      return 0;
+   }
+   cpu->stopped = 1;
+   cpu->stop_kind = Q1_BREAK_EXEC;
+   cpu->stop_addr = cpu->preg;
+   cpu->stop_steps = cpu->steps;
+   return 1;
+}
+
+#ifdef THREADED_ENABLED
+
+/* Run up to count instructions with a direct-threaded interpreter,
+ * ignoring or stopping at execution breakpoints. */
+#define THREADED_NAME      RunThreaded
+#define THREADED_BREAKS    0
+#include "q1threaded.h"
+#undef THREADED_NAME
+#undef THREADED_BREAKS
+
+#define THREADED_NAME      RunThreadedBreak
+#define THREADED_BREAKS    1
+#include "q1threaded.h"
+#undef THREADED_NAME
+#undef THREADED_BREAKS
+
+#endif /* THREADED_ENABLED */
+
+/* Predecode the instruction at addr. */
+static void Decode(q1_cpu_t *cpu, unsigned short addr) {
+
+   DecodedType *dp = &cpu->decoded[addr];
+   const unsigned char op = cpu->memory[addr];
+   const unsigned char func = op & 0x0F;
+   unsigned short pc = addr + 1;
+
+   dp->opcode = op;
+   dp->operand = 0;
+   switch(op >> 4) {
+   case 0:     // Jump
+      dp->func = jmp;
+      dp->clocks = 7 * 3;
+      break;
+   case 1:     // Load/Store
+      dp->func = ls_class[func] ? ls_class[func] : invalid;
+      dp->clocks = 7 * 3;
+      break;
+   case 2:     // Math
+      dp->func = math_class[func] ? math_class[func] : invalid;
+      dp->clocks = 3 * 3;
+      break;
+   case 3:     // Misc
+      dp->func = misc_class[func] ? misc_class[func] : invalid;
+      dp->clocks = 3 * 3;
+      break;
+   default:
+      dp->func = invalid;
+      dp->clocks = 0;
+      break;
+   }
+   if((op >> 4) < 2) {
+      dp->operand = (unsigned short)cpu->memory[pc++] << 8;
+      dp->operand |= cpu->memory[pc++];
+   }
+   dp->next = pc;
+
+   cpu->decode_dirty[addr >> 3] &= ~(1 << (addr & 7));
+
+}
+
+/* Run up to count instructions using predecoded instructions. */
+static void RunCached(q1_cpu_t *cpu, unsigned long long count) {
+
+   const DecodedType *dp;
+   unsigned short pc;
+
+   for(; count; --count) {
+      pc = cpu->preg;
+      if(cpu->decode_dirty[pc >> 3] & (1 << (pc & 7))) {
+         Decode(cpu, pc);
+      }
+      dp = &cpu->decoded[pc];
+      cpu->opcode = dp->opcode;
+      cpu->operand = dp->operand;
+      cpu->preg = dp->next;
+      (dp->func)(cpu);
+      cpu->clocks += dp->clocks;
+      ++cpu->steps;
+      if(cpu->halted | cpu->faulted) {
+         break;
+      }
+   }
+
+}
+
+/* Run up to count instructions using predecoded instructions,
+ * stopping at execution breakpoints. */
+static void RunCachedBreak(q1_cpu_t *cpu, unsigned long long count) {
+
+   const unsigned char *const breaks = cpu->breaks;
+   const DecodedType *dp;
+   unsigned short pc;
+
+   for(; count; --count) {
+      pc = cpu->preg;
+      if((breaks[pc] & Q1_BREAK_EXEC) && Q1StopAtBreak(cpu)) {
+         break;
+      }
+      if(cpu->decode_dirty[pc >> 3] & (1 << (pc & 7))) {
+         Decode(cpu, pc);
+      }
+      dp = &cpu->decoded[pc];
+      cpu->opcode = dp->opcode;
+      cpu->operand = dp->operand;
+      cpu->preg = dp->next;
+      (dp->func)(cpu);
+      cpu->clocks += dp->clocks;
+      ++cpu->steps;
+      if(cpu->halted | cpu->faulted) {
+         break;
+      }
+   }
+
+}
+
+/* Release a translated block.
+ * The predecoded entries it used are marked dirty as well since native
+ * code only reports stores to bytes covered by a block.
+ */
+static void FreeBlock(q1_cpu_t *cpu, BlockType *bp) {
+   BlockCacheType *cp = cpu->cache;
+   unsigned short addr;
+   unsigned short x;
+   for(x = 0; x < bp->length; x++) {
+      addr = bp->start + x;
+      --cp->code_map[addr];
+      cpu->decode_dirty[addr >> 3] |= 1 << (addr & 7);
+   }
+   cp->block_map[bp->start] = NULL;
+   if(cpu->jit_map) {
+      cpu->jit_map[bp->start] = NULL;
+   }
+   bp->valid = 0;
+   bp->next_free = cp->free_blocks;
+   cp->free_blocks = bp;
+}
+
+/* Release all translated blocks.
+ * Blocks are allocated in order after a flush, so only the blocks below
+ * used_blocks need to be visited. This keeps resetting a machine that
+ * ran a small program cheap. Blocks above used_blocks are still linked
+ * in order from the last flush.
+ */
+void Q1FlushBlocks(q1_cpu_t *cpu) {
+   BlockCacheType *cp = cpu->cache;
+   BlockType *bp;
+   unsigned short x;
+   unsigned int i;
+   for(i = 0; i < cp->used_blocks; i++) {
+      bp = &cp->blocks[i];
+      if(bp->valid) {
+         for(x = 0; x < bp->length; x++) {
+            --cp->code_map[(unsigned short)(bp->start + x)];
+         }
+         cp->block_map[bp->start] = NULL;
+         if(cpu->jit_map) {
+            cpu->jit_map[bp->start] = NULL;
+         }
+         bp->valid = 0;
+      }
+      bp->next_free = i + 1 < MAX_BLOCKS ? &cp->blocks[i + 1] : NULL;
+   }
+   cp->used_blocks = 0;
+   cp->free_blocks = &cp->blocks[0];
+   memset(cpu->decode_dirty, 0xFF, (1 << 16) / 8);
+#ifdef JIT_ENABLED
+   Q1JitFlush(cpu);
+#endif
+}
+
+/* Invalidate the translated blocks covering addr. */
+void InvalidateBlocks(q1_cpu_t *cpu, unsigned short addr) {
+   BlockType *bp;
+   unsigned short start;
+   int x;
+   for(x = 0; x < MAX_BLOCK_BYTES; x++) {
+      start = addr - x;
+      bp = cpu->cache->block_map[start];
+      if(bp && x < bp->length) {
+         FreeBlock(cpu, bp);
+      }
+   }
+}
+
+/* Translate the block starting at addr. */
+BlockType *Q1TranslateBlock(q1_cpu_t *cpu, unsigned short addr) {
+
+   BlockCacheType *cp = cpu->cache;
+   BlockType *bp;
+   MicroOpType *op;
+   const DecodedType *dp;
+   unsigned short pc;
+   unsigned short clocks_total;
+
+   if(!cp->free_blocks) {
+      Q1FlushBlocks(cpu);
+   }
+   bp = cp->free_blocks;
+   cp->free_blocks = bp->next_free;
+   if(bp - cp->blocks >= cp->used_blocks) {
+      cp->used_blocks = bp - cp->blocks + 1;
+   }
+
+   pc = addr;
+   clocks_total = 0;
+   bp->count = 0;
+   for(;;) {
+      if(cpu->decode_dirty[pc >> 3] & (1 << (pc & 7))) {
+         Decode(cpu, pc);
+      }
+      dp = &cpu->decoded[pc];
+      op = &bp->ops[bp->count++];
+      op->opcode = dp->opcode;
+      op->operand = dp->operand;
+      op->next = dp->next;
+      clocks_total += dp->clocks;
+      op->clocks = clocks_total;
+      pc = dp->next;
+      if(dp->func == jmp || dp->func == ret || dp->func == hlt
+         || dp->func == invalid || bp->count == MAX_BLOCK_OPS) {
+         break;
+      }
+      if(cpu->break_count && (cpu->breaks[pc] & Q1_BREAK_EXEC)) {
+         break;
+      }
+   }
+
+   bp->start = addr;
+   bp->length = pc - addr;
+   for(pc = 0; pc < bp->length; pc++) {
+      ++cp->code_map[(unsigned short)(addr + pc)];
+   }
+   bp->taken = NULL;
+   bp->fall = NULL;
+   bp->hits = 0;
+   bp->native = NULL;
+   bp->valid = 1;
+   cp->block_map[addr] = bp;
+
+   return bp;
+
+}
+
+/* Run up to count instructions using translated blocks. */
+void Q1RunBlocks(q1_cpu_t *cpu, unsigned long long count) {
+
+   BlockCacheType *cp = cpu->cache;
+   BlockType *bp;
+   BlockType *next;
+   BlockType **link;
+   const MicroOpType *op;
+   const MicroOpType *end;
+   unsigned short executed;
+
+   bp = NULL;
+   while(count) {
+
+      if(AT_BREAK(cpu)) {
+         return;
+      }
+      if(bp == NULL) {
+         bp = cp->block_map[cpu->preg];
+         if(bp == NULL) {
+            bp = Q1TranslateBlock(cpu, cpu->preg);
+         }
+      }
+      if(bp->count > count) {
+         Q1RunInterp(cpu, count);
+         return;
+      }
+
+      end = &bp->ops[bp->count];
+      for(op = bp->ops; op != end; op++) {
+         cpu->operand = op->operand;
+         switch(op->opcode) {
+         case 0x00: case 0x01: case 0x02: case 0x03:
+         case 0x04: case 0x05: case 0x06: case 0x07:
+         case 0x08: case 0x09: case 0x0A: case 0x0B:
+         case 0x0C: case 0x0D: case 0x0E: case 0x0F:
+            cpu->opcode = op->opcode;
+            cpu->preg = op->next;
+            jmp(cpu);
+            goto done;
+         case 0x10:  ldb(cpu);   break;
+         case 0x11:  ldc(cpu);   break;
+         case 0x12:  lxh(cpu);   break;
+         case 0x13:  lxl(cpu);   break;
+         case 0x14:  stb(cpu);   goto stored;
+         case 0x15:  stc(cpu);   goto stored;
+         case 0x16:  sxh(cpu);   goto stored;
+         case 0x17:  sxl(cpu);   goto stored;
+         case 0x18:  sta(cpu);   goto stored;
+         case 0x20:  and(cpu);   break;
+         case 0x21:  or(cpu);    break;
+         case 0x22:  shl(cpu);   break;
+         case 0x23:  shr(cpu);   break;
+         case 0x24:  add(cpu);   break;
+         case 0x25:  inc(cpu);   break;
+         case 0x26:  dec(cpu);   break;
+         case 0x27:  not(cpu);   break;
+         case 0x28:  clr(cpu);   break;
+         case 0x30:  mab(cpu);   break;
+         case 0x31:  mac(cpu);   break;
+         case 0x32:  sax(cpu);   goto stored;
+         case 0x33:  sbx(cpu);   goto stored;
+         case 0x34:  scx(cpu);   goto stored;
+         case 0x35:  lbx(cpu);   break;
+         case 0x36:  lcx(cpu);   break;
+         case 0x37:
+            ret(cpu);
+            goto done;
+         case 0x38:
+            hlt(cpu);
+            cpu->preg = op->next;
+            goto done;
+         default:
+            cpu->opcode = op->opcode;
+            cpu->preg = op->next;
+            invalid(cpu);
+            goto done;
+         }
+         continue;
+stored:
+         /* Leave the block if the store modified it. */
+         if(!bp->valid) {
+            executed = op - bp->ops + 1;
+            cpu->clocks += op->clocks;
+            cpu->steps += executed;
+            count -= executed;
+            cpu->preg = op->next;
+            bp = NULL;
+            break;
+         }
+      }
+      if(bp == NULL) {
+         continue;
+      }
+      cpu->preg = end[-1].next;
+
+done:
+      cpu->clocks += end[-1].clocks;
+      cpu->steps += bp->count;
+      count -= bp->count;
+      if(cpu->halted | cpu->faulted) {
+         return;
+      }
+
+      /* Follow (or create) the link to the next block. */
+      link = cpu->preg == end[-1].next ? &bp->fall : &bp->taken;
+      next = *link;
+      if(next == NULL || !next->valid || next->start != cpu->preg) {
+         next = cp->block_map[cpu->preg];
+         if(next == NULL) {
+            next = Q1TranslateBlock(cpu, cpu->preg);
+         }
+         *link = next;
+      }
+      bp = next;
+
+   }
+
+}
+
+/* Each engine has a second entry point used while execution
+ * breakpoints are set, so a run without them never looks them up. */
+static const struct {
+   const char *name;
+   EngineFunc func;
+   EngineFunc break_func;
+   unsigned char decoded;
+   unsigned char blocks;
+} ENGINES[Q1_ENGINE_COUNT] = {
+   { "interp",    Q1RunInterp,   RunInterpBreak,   0, 0 },
+#ifdef THREADED_ENABLED
+   { "threaded",  RunThreaded,   RunThreadedBreak, 0, 0 },
+#else
+   { "threaded",  NULL,          NULL,             0, 0 },
+#endif
+   { "cached",    RunCached,     RunCachedBreak,   1, 0 },
+   { "block",     Q1RunBlocks,   Q1RunBlocks,      1, 1 },
+#ifdef JIT_ENABLED
+   { "jit",       Q1RunJit,      Q1RunJit,         1, 1 }
+#else
+   { "jit",       NULL,          NULL,             1, 1 }
+#endif
+};
+
+/* Allocate the caches needed by the current engine.
+ * Falls back to the interpreter if there is not enough memory. */
+static EngineFunc PrepareEngine(q1_cpu_t *cpu) {
+   if(ENGINES[cpu->engine].decoded && !cpu->decoded) {
+      cpu->decoded = malloc(sizeof(DecodedType) << 16);
+      cpu->decode_dirty = malloc((1 << 16) / 8);
+      if(!cpu->decoded || !cpu->decode_dirty) {
+         free(cpu->decoded);
+         free(cpu->decode_dirty);
+         cpu->decoded = NULL;
+         cpu->decode_dirty = NULL;
+         cpu->engine = Q1_ENGINE_INTERP;
+      } else {
+         memset(cpu->decode_dirty, 0xFF, (1 << 16) / 8);
+      }
+   }
+   if(ENGINES[cpu->engine].blocks && !cpu->cache) {
+      cpu->cache = calloc(1, sizeof(BlockCacheType));
+      if(!cpu->cache) {
+         cpu->engine = Q1_ENGINE_CACHED;
+      } else {
+         cpu->cache->used_blocks = MAX_BLOCKS;
+         Q1FlushBlocks(cpu);
+      }
+   }
+   return ENGINES[cpu->engine].func;
+}
+
+q1_cpu_t *q1_create(void) {
+   q1_cpu_t *cpu = malloc(sizeof(q1_cpu_t));
+   if(cpu) {
+      memset(cpu, 0, offsetof(q1_cpu_t, memory));
+      cpu->engine = Q1_ENGINE_INTERP;
+      cpu->log = stderr;
+      q1_reset(cpu);
+   }
+   return cpu;
+}
+
+void q1_destroy(q1_cpu_t *cpu) {
+   if(cpu) {
+#ifdef JIT_ENABLED
+      Q1JitFree(cpu);
+#endif
+      free(cpu->cache);
+      free(cpu->decoded);
+      free(cpu->decode_dirty);
+      free(cpu->breaks);
+      free(cpu);
+   }
+}
+
+void q1_reset(q1_cpu_t *cpu) {
+   cpu->rega = 0xFF;
+   cpu->regb = 0xFF;
+   cpu->regc = 0xFF;
+   cpu->regxh = 0xFF;
+   cpu->regxl = 0xFF;
+   cpu->c_flag = 1;
+   cpu->z_flag = 1;
+   cpu->n_flag = 1;
+   cpu->preg = 0;
+   cpu->halted = 0;
+   cpu->faulted = 0;
+   cpu->clocks = 0;
+   cpu->steps = 0;
+   cpu->snapshot = 0;
+   memset(cpu->memory, 0xFF, sizeof(cpu->memory));
+   if(cpu->cache) {
+      Q1FlushBlocks(cpu);
+   } else if(cpu->decode_dirty) {
+      memset(cpu->decode_dirty, 0xFF, (1 << 16) / 8);
+   }
+}
+
+size_t q1_load(q1_cpu_t *cpu, unsigned short addr,
+               const void *data, size_t size) {
+   const size_t avail = sizeof(cpu->memory) - addr;
+   if(size > avail) {
+      size = avail;
+   }
+   memcpy(&cpu->memory[addr], data, size);
+   if(size > 0) {
+      memset(&cpu->pages[addr >> 8], 1,
+             ((addr + size - 1) >> 8) - (addr >> 8) + 1);
+   }
+   if(cpu->cache) {
+      Q1FlushBlocks(cpu);
+   } else if(cpu->decode_dirty) {
+      memset(cpu->decode_dirty, 0xFF, (1 << 16) / 8);
+   }
+   return size;
+}
+
+q1_status_t q1_step(q1_cpu_t *cpu) {
+   return q1_run(cpu, 1);
+}
+
+q1_status_t q1_run(q1_cpu_t *cpu, unsigned long long budget) {
+
+   EngineFunc func;
+
+   if(cpu->halted) {
+      return Q1_HALTED;
+   }
+
+   func = NULL;
+   if(!(cpu->profile || cpu->trace || cpu->history || cpu->watch_count)) {
+      func = PrepareEngine(cpu);
+      if(cpu->break_count) {
+         func = ENGINES[cpu->engine].break_func;
+      }
+   }
+   if(func == NULL) {
+      func = RunRecord;
+   }
+   cpu->faulted = 0;
+   cpu->stopped = 0;
+   if(budget) {
+      (func)(cpu, budget);
+   } else {
+      while(!(cpu->halted | cpu->faulted | cpu->stopped)) {
+         (func)(cpu, 1 << 20);
+      }
+   }
+
+   if(cpu->halted) {
+      return Q1_HALTED;
+   } else if(cpu->faulted) {
+      return Q1_FAULT;
+   } else if(cpu->stopped) {
+      return Q1_BREAK;
+   } else {
+      return Q1_RUNNING;
+   }
+
+}
+
+q1_status_t q1_run_limits(q1_cpu_t *cpu, unsigned long long max_steps,
+                          unsigned long long max_clocks) {
+
+   q1_status_t status;
+   unsigned long long count;
+
+   /* No instruction takes more than 21 clocks. */
+   for(;;) {
+      if(max_steps && cpu->steps >= max_steps) {
+         return Q1_RUNNING;
+      }
+      if(max_clocks && cpu->clocks >= max_clocks) {
+         return Q1_RUNNING;
+      }
+      count = 1 << 16;
+      if(max_steps && max_steps - cpu->steps < count) {
+         count = max_steps - cpu->steps;
+      }
+      if(max_clocks && (max_clocks - cpu->clocks) / 21 < count) {
+         count = (max_clocks - cpu->clocks) / 21;
+         if(count == 0) {
+            count = 1;
+         }
+      }
+      status = q1_run(cpu, count);
+      if(status != Q1_RUNNING) {
+         return status;
+      }
+   }
+
+}
+
+int q1_set_engine(q1_cpu_t *cpu, q1_engine_t engine) {
+   if(engine >= Q1_ENGINE_COUNT || !ENGINES[engine].func) {
+      return 0;
+   }
+   cpu->engine = engine;
+   return 1;
+}
+
+q1_engine_t q1_get_engine(const q1_cpu_t *cpu) {
+   return cpu->engine;
+}
+
+int q1_find_engine(const char *name, q1_engine_t *engine) {
+   int x;
+   for(x = 0; x < Q1_ENGINE_COUNT; x++) {
+      if(ENGINES[x].func && !strcmp(name, ENGINES[x].name)) {
+         *engine = (q1_engine_t)x;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+const char *q1_engine_name(q1_engine_t engine) {
+   if(engine >= Q1_ENGINE_COUNT || !ENGINES[engine].func) {
+      return NULL;
+   }
+   return ENGINES[engine].name;
+}
+
+void q1_get_regs(const q1_cpu_t *cpu, q1_regs_t *regs) {
+   regs->a = cpu->rega;
+   regs->b = cpu->regb;
+   regs->c = cpu->regc;
+   regs->x = ((unsigned short)cpu->regxh << 8) | cpu->regxl;
+   regs->pc = cpu->preg;
+   regs->c_flag = cpu->c_flag;
+   regs->z_flag = cpu->z_flag;
+   regs->n_flag = cpu->n_flag;
+}
+
+void q1_set_regs(q1_cpu_t *cpu, const q1_regs_t *regs) {
+   cpu->rega = regs->a;
+   cpu->regb = regs->b;
+   cpu->regc = regs->c;
+   cpu->regxh = regs->x >> 8;
+   cpu->regxl = regs->x & 0xFF;
+   cpu->preg = regs->pc;
+   cpu->c_flag = regs->c_flag != 0;
+   cpu->z_flag = regs->z_flag != 0;
+   cpu->n_flag = regs->n_flag != 0;
+}
+
+const unsigned char *q1_memory(const q1_cpu_t *cpu) {
+   return cpu->memory;
+}
+
+unsigned char q1_read(const q1_cpu_t *cpu, unsigned short addr) {
+   return cpu->memory[addr];
+}
+
+void q1_write(q1_cpu_t *cpu, unsigned short addr, unsigned char value) {
+   Store(cpu, addr, value);
+}
+
+unsigned long long q1_clocks(const q1_cpu_t *cpu) {
+   return cpu->clocks;
+}
+
+unsigned long long q1_steps(const q1_cpu_t *cpu) {
+   return cpu->steps;
+}
+
+int q1_halted(const q1_cpu_t *cpu) {
+   return cpu->halted;
+}
+
+void q1_set_log(q1_cpu_t *cpu, FILE *log) {
+   cpu->log = log;
+}
+
+int q1_set_break(q1_cpu_t *cpu, unsigned short addr, unsigned int flags) {
+
+   unsigned int old;
+
+   if(cpu->breaks == NULL) {
+      if(flags == 0) {
+         return 1;
+      }
+      cpu->breaks = calloc(1, 1 << 16);
+      if(cpu->breaks == NULL) {
+         return 0;
+      }
+   }
+
+   old = cpu->breaks[addr];
+   flags &= Q1_BREAK_EXEC | Q1_WATCH_READ | Q1_WATCH_WRITE;
+   cpu->breaks[addr] = flags;
+   cpu->break_count += (flags & Q1_BREAK_EXEC) != 0;
+   cpu->break_count -= (old & Q1_BREAK_EXEC) != 0;
+   cpu->watch_count += (flags & ~Q1_BREAK_EXEC) != 0;
+   cpu->watch_count -= (old & ~Q1_BREAK_EXEC) != 0;
+
+   /* Translated code running through a new breakpoint is split there. */
+   if((flags & ~old & Q1_BREAK_EXEC) && cpu->decoded) {
+      Q1InvalidateCode(cpu, addr);
+   }
+   return 1;
+
+}
+
+unsigned int q1_get_break(const q1_cpu_t *cpu, unsigned short addr) {
+   return cpu->breaks ? cpu->breaks[addr] : 0;
+}
+
+unsigned int q1_break_reason(const q1_cpu_t *cpu, unsigned short *addr) {
+   *addr = cpu->stop_addr;
+   return cpu->stop_kind;
+}
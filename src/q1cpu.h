@@ -0,0 +1,165 @@
+/* Internal definitions shared by the Q1 simulator library sources. */
+
+#ifndef Q1CPU_H
+#define Q1CPU_H
+
+#include "q1.h"
+
+#if defined(__GNUC__) && !defined(NO_THREADED)
+#  define THREADED_ENABLED
+#endif
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+#  define JIT_ENABLED
+#endif
+
+typedef void (*InstructionFunc)(q1_cpu_t *cpu);
+
+/* Predecoded instructions.
+ * An entry is valid only if its bit in decode_dirty is clear. Stores set
+ * the bits of every instruction that could overlap the modified byte.
+ */
+typedef struct {
+   InstructionFunc func;
+   unsigned short operand;
+   unsigned short next;
+   unsigned char opcode;
+   unsigned char clocks;
+} DecodedType;
+
+/* Translated basic blocks.
+ * A block is a straight-line run of instructions ending at a jump, ret,
+ * hlt, an invalid instruction or MAX_BLOCK_OPS instructions. Blocks are
+ * linked to the blocks that followed them so loops stay out of the
+ * dispatcher. code_map counts the blocks covering each byte so a store
+ * to translated code invalidates exactly the blocks it overlaps.
+ */
+#define MAX_BLOCK_OPS   32
+#define MAX_BLOCK_BYTES (MAX_BLOCK_OPS * 3)
+#define MAX_BLOCKS      4096
+
+typedef struct {
+   unsigned short operand;
+   unsigned short next;
+   unsigned short clocks;     /* Clocks from block start through this op. */
+   unsigned char opcode;
+} MicroOpType;
+
+typedef struct BlockType {
+   struct BlockType *taken;
+   struct BlockType *fall;
+   struct BlockType *next_free;
+   unsigned short start;
+   unsigned short length;
+   unsigned short count;
+   unsigned char valid;
+   unsigned int hits;
+   void *native;
+   MicroOpType ops[MAX_BLOCK_OPS];
+} BlockType;
+
+typedef struct {
+   BlockType blocks[MAX_BLOCKS];
+   BlockType *free_blocks;
+   unsigned int used_blocks;  /* Blocks allocated since the last flush. */
+   BlockType *block_map[1 << 16];
+   unsigned char code_map[1 << 16];
+} BlockCacheType;
+
+typedef struct JitType JitType;
+
+struct q1_cpu {
+
+   /* Registers. */
+   unsigned char rega, regb, regc;
+   unsigned char z_flag, c_flag, n_flag;
+   unsigned char regxh, regxl;
+   unsigned short preg;
+   unsigned char halted;
+   unsigned char faulted;
+
+   /* Current instruction. */
+   unsigned char opcode;
+   unsigned short operand;
+
+   unsigned long long clocks;
+   unsigned long long steps;
+
+   q1_engine_t engine;
+   FILE *log;
+
+   /* Engine caches, allocated on first use. */
+   DecodedType *decoded;
+   unsigned char *decode_dirty;
+   BlockCacheType *cache;
+   JitType *jit;
+   void **jit_map;
+
+   /* Snapshot the dirty pages are relative to (0 for none). */
+   unsigned long long snapshot;
+
+   /* Profile recording each instruction, if any. */
+   q1_profile_t *profile;
+
+   /* Trace recording each instruction, if any. */
+   q1_trace_t *trace;
+
+   /* History checkpointing the run, if any. */
+   q1_history_t *history;
+
+   /* Q1_BREAK_* and Q1_WATCH_* flags for each address, allocated on
+    * first use, and the number of addresses with each kind set. */
+   unsigned char *breaks;
+   unsigned int break_count;
+   unsigned int watch_count;
+
+   /* Why the last run stopped at a point. An execution breakpoint is
+    * passed over if the machine is still where it stopped. */
+   unsigned char stopped;
+   unsigned char stop_kind;
+   unsigned short stop_addr;
+   unsigned long long stop_steps;
+
+   unsigned char memory[1 << 16];
+
+   /* Nonzero for each 256-byte page of memory written since the last
+    * snapshot was saved or restored. The JIT addresses this from the
+    * memory pointer, so it must follow memory. */
+   unsigned char pages[256];
+
+};
+
+/* Engine entry points run up to count instructions. */
+typedef void (*EngineFunc)(q1_cpu_t *cpu, unsigned long long count);
+
+void Q1RunInterp(q1_cpu_t *cpu, unsigned long long count);
+void Q1RunBlocks(q1_cpu_t *cpu, unsigned long long count);
+BlockType *Q1TranslateBlock(q1_cpu_t *cpu, unsigned short addr);
+void Q1FlushBlocks(q1_cpu_t *cpu);
+void Q1InvalidateCode(q1_cpu_t *cpu, unsigned short addr);
+
+/* Record an instruction at pc that has just been executed. */
+void Q1ProfileRecord(q1_cpu_t *cpu, unsigned short pc,
+                     unsigned int clocks, int taken);
+
+/* Record an instruction at pc that has just been executed. */
+void Q1TraceRecord(q1_cpu_t *cpu, unsigned short pc);
+
+/* Record an instruction that has just been executed. */
+void Q1HistoryRecord(q1_cpu_t *cpu);
+
+/* Return nonzero, stopping the run, if there is an execution breakpoint
+ * at the PC that should not be passed over. */
+int Q1StopAtBreak(q1_cpu_t *cpu);
+
+#define AT_BREAK(cpu) \
+   ((cpu)->break_count && ((cpu)->breaks[(cpu)->preg] & Q1_BREAK_EXEC) \
+    && Q1StopAtBreak(cpu))
+
+#ifdef JIT_ENABLED
+void Q1RunJit(q1_cpu_t *cpu, unsigned long long count);
+void Q1JitFlush(q1_cpu_t *cpu);
+void Q1JitFree(q1_cpu_t *cpu);
+#endif
+
+#endif /* Q1CPU_H */
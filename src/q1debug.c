@@ -0,0 +1,698 @@
+/* Debugger for q1sim.
+ *
+ * Breakpoints and watchpoints are set in the machine (q1_set_break), so
+ * a run only stops at the addresses they name. Conditions are kept here
+ * and checked only when a run stops at their point; if the condition is
+ * false the run carries on.
+ */
+
+#include "q1debug.h"
+#include "q1dis.h"
+#include "q1sym.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LINE     1024
+#define MAX_WORDS    8
+
+/* Registers and flags a condition can test. */
+typedef enum {
+   REG_A,
+   REG_B,
+   REG_C,
+   REG_X,
+   REG_PC,
+   REG_CF,
+   REG_ZF,
+   REG_NF
+} RegisterType;
+
+typedef enum {
+   OP_EQ,
+   OP_NE,
+   OP_LT,
+   OP_LE,
+   OP_GT,
+   OP_GE
+} CompareType;
+
+/* A breakpoint or watchpoint with its condition, if any. */
+typedef struct {
+   unsigned short addr;
+   unsigned int kind;
+   int conditional;
+   RegisterType reg;
+   CompareType op;
+   unsigned int value;
+} PointType;
+
+static const char *REGISTER_NAMES[] = {
+   "a", "b", "c", "x", "pc", "cf", "zf", "nf"
+};
+
+static const char *COMPARE_NAMES[] = {
+   "==", "!=", "<", "<=", ">", ">="
+};
+
+static q1_cpu_t *cpu;
+static q1_history_t *history;
+static PointType *points;
+static unsigned int point_count;
+static unsigned int point_max;
+
+/* Why the last command failed and the word at fault. */
+static const char *error;
+static const char *error_word;
+
+static int Execute(char **words, unsigned int count);
+static void DisplayHelp();
+static void DisplayRegisters();
+static void DisplayLocation();
+static void DisplayStop(q1_status_t status);
+static void DisplayPoints();
+static int AddPoint(unsigned short addr, unsigned int kind,
+                    char **words, unsigned int count);
+static void DeletePoints(unsigned short addr, unsigned int kind);
+static const PointType *FindPoint(unsigned short addr, unsigned int kind);
+static int CheckCondition(const PointType *pp);
+static q1_status_t Resume(unsigned long long budget);
+static void Continue(unsigned long long limit);
+static void Step(unsigned long long count);
+static void Dump(unsigned short addr, unsigned int count);
+static void List(unsigned short addr, unsigned int count);
+static int SetRegister(const char *name, unsigned int value);
+static int ParseAddress(const char *str, unsigned short *addr);
+static int ParseNumber(const char *str, unsigned long long *value);
+static int ParseRegister(const char *str, RegisterType *reg);
+static int Invalid(const char *what, const char *word);
+static unsigned int GetRegister(RegisterType reg);
+static int NeedHistory();
+
+int RunDebugger(q1_cpu_t *machine, FILE *in) {
+
+   const int interactive = isatty(fileno(in));
+   char line[MAX_LINE];
+   char *words[MAX_WORDS];
+   unsigned int count;
+   unsigned int line_number;
+   int errors;
+   char *p;
+   int rc;
+
+   cpu = machine;
+   errors = 0;
+   line_number = 0;
+   DisplayLocation();
+   for(;;) {
+
+      if(interactive) {
+         printf("(q1) ");
+         fflush(stdout);
+      }
+      if(!fgets(line, sizeof(line), in)) {
+         break;
+      }
+      ++line_number;
+
+      /* Split the line into words, ignoring comments. */
+      p = strchr(line, '#');
+      if(p) {
+         *p = 0;
+      }
+      count = 0;
+      for(p = strtok(line, " \t\r\n"); p && count < MAX_WORDS;
+          p = strtok(NULL, " \t\r\n")) {
+         words[count++] = p;
+      }
+      if(count == 0) {
+         continue;
+      }
+
+      error = "invalid command";
+      error_word = words[0];
+      rc = Execute(words, count);
+      if(rc < 0) {
+         break;
+      }
+      if(rc == 0 && interactive) {
+         printf("%s: %s\n", error, error_word);
+      } else if(rc == 0) {
+         fprintf(stderr, "ERROR: line %u: %s: %s\n",
+            line_number, error, error_word);
+         ++errors;
+      }
+      fflush(stdout);
+
+   }
+
+   q1_set_history(cpu, NULL);
+   q1_history_destroy(history);
+   history = NULL;
+   free(points);
+   points = NULL;
+   point_count = 0;
+   point_max = 0;
+   return errors > 0;
+
+}
+
+/* Execute a command. Returns 1 on success, 0 on error and -1 to quit. */
+int Execute(char **words, unsigned int count) {
+
+   const char *cmd = words[0];
+   unsigned long long value = 0;
+   unsigned long long first, end;
+   unsigned short addr = 0;
+   unsigned int kind;
+
+   if(!strcmp(cmd, "quit") || !strcmp(cmd, "q")) {
+      return -1;
+   } else if(!strcmp(cmd, "help") || !strcmp(cmd, "h")) {
+      DisplayHelp();
+   } else if(!strcmp(cmd, "break") || !strcmp(cmd, "b")) {
+      if(count < 2 || !ParseAddress(words[1], &addr)) {
+         return 0;
+      }
+      return AddPoint(addr, Q1_BREAK_EXEC, &words[2], count - 2);
+   } else if(!strcmp(cmd, "watch") || !strcmp(cmd, "w")) {
+      if(count < 2 || !ParseAddress(words[1], &addr)) {
+         return 0;
+      }
+      kind = Q1_WATCH_WRITE;
+      if(count > 2 && strcmp(words[2], "if")) {
+         if(!strcmp(words[2], "r")) {
+            kind = Q1_WATCH_READ;
+         } else if(!strcmp(words[2], "rw")) {
+            kind = Q1_WATCH_READ | Q1_WATCH_WRITE;
+         } else if(strcmp(words[2], "w")) {
+            return 0;
+         }
+         return AddPoint(addr, kind, &words[3], count - 3);
+      }
+      return AddPoint(addr, kind, &words[2], count - 2);
+   } else if(!strcmp(cmd, "delete") || !strcmp(cmd, "d")) {
+      if(count > 1 && !ParseAddress(words[1], &addr)) {
+         return 0;
+      }
+      DeletePoints(addr, count > 1 ? 0 : ~0U);
+   } else if(!strcmp(cmd, "info") || !strcmp(cmd, "i")) {
+      DisplayPoints();
+   } else if(!strcmp(cmd, "continue") || !strcmp(cmd, "c")) {
+      if(count > 1 && !ParseNumber(words[1], &value)) {
+         return 0;
+      }
+      Continue(value);
+   } else if(!strcmp(cmd, "step") || !strcmp(cmd, "s")) {
+      value = 1;
+      if(count > 1 && !ParseNumber(words[1], &value)) {
+         return 0;
+      }
+      Step(value);
+   } else if(!strcmp(cmd, "regs") || !strcmp(cmd, "r")) {
+      DisplayRegisters();
+   } else if(!strcmp(cmd, "x")) {
+      value = 16;
+      if(count < 2 || !ParseAddress(words[1], &addr)
+         || (count > 2 && !ParseNumber(words[2], &value))) {
+         return 0;
+      }
+      Dump(addr, (unsigned int)value);
+   } else if(!strcmp(cmd, "list") || !strcmp(cmd, "l")) {
+      value = 8;
+      addr = (unsigned short)GetRegister(REG_PC);
+      if(count > 1 && !ParseAddress(words[1], &addr)) {
+         return 0;
+      }
+      if(count > 2 && !ParseNumber(words[2], &value)) {
+         return 0;
+      }
+      List(addr, (unsigned int)value);
+   } else if(!strcmp(cmd, "set")) {
+      if(count != 3 || !ParseNumber(words[2], &value)
+         || !SetRegister(words[1], (unsigned int)value)) {
+         return 0;
+      }
+   } else if(!strcmp(cmd, "poke")) {
+      if(count != 3 || !ParseAddress(words[1], &addr)
+         || !ParseNumber(words[2], &value) || value > 0xFF) {
+         return 0;
+      }
+      q1_write(cpu, addr, (unsigned char)value);
+   } else if(!strcmp(cmd, "record")) {
+      if(count > 1 && !ParseNumber(words[1], &value)) {
+         return 0;
+      }
+      q1_set_history(cpu, NULL);
+      q1_history_destroy(history);
+      history = q1_history_create((unsigned int)value);
+      if(history == NULL) {
+         printf("out of memory\n");
+         return 0;
+      }
+      q1_set_history(cpu, history);
+      printf("recording from step %llu\n", q1_steps(cpu));
+   } else if(!strcmp(cmd, "back")) {
+      value = 1;
+      if(!NeedHistory() || (count > 1 && !ParseNumber(words[1], &value))) {
+         return 0;
+      }
+      q1_history_range(history, &first, &end);
+      if(value > q1_steps(cpu) - first) {
+         value = q1_steps(cpu) - first;
+      }
+      q1_history_seek(cpu, q1_steps(cpu) - value);
+      DisplayLocation();
+   } else if(!strcmp(cmd, "goto")) {
+      if(!NeedHistory() || count != 2 || !ParseNumber(words[1], &value)) {
+         return 0;
+      }
+      if(!q1_history_seek(cpu, value)) {
+         q1_history_range(history, &first, &end);
+         printf("step %llu was not recorded (%llu to %llu)\n",
+            value, first, end);
+         return 0;
+      }
+      DisplayLocation();
+   } else if(!strcmp(cmd, "lastwrite")) {
+      if(!NeedHistory() || count != 2 || !ParseAddress(words[1], &addr)) {
+         return 0;
+      }
+      if(!q1_history_last_write(cpu, addr, &value)) {
+         printf("no write to %04x was recorded\n", addr);
+         return 1;
+      }
+      DisplayLocation();
+   } else {
+      return 0;
+   }
+   return 1;
+
+}
+
+void DisplayHelp() {
+   printf("break <addr> [if <cond>]     Stop before the instruction at addr\n");
+   printf("watch <addr> [r|w|rw] [if <cond>]\n");
+   printf("                             Stop after addr is read or written\n");
+   printf("delete [addr]                Remove the points at addr or all\n");
+   printf("info                         List breakpoints and watchpoints\n");
+   printf("continue [n]                 Run until stopped (at most n steps)\n");
+   printf("step [n]                     Execute n instructions\n");
+   printf("regs                         Show the registers\n");
+   printf("x <addr> [n]                 Show n bytes of memory\n");
+   printf("list [addr] [n]              Disassemble n instructions\n");
+   printf("set <reg> <value>            Set a, b, c, x, pc, cf, zf or nf\n");
+   printf("poke <addr> <value>          Write a byte of memory\n");
+   printf("record [interval]            Record history from here\n");
+   printf("back [n]                     Go back n instructions\n");
+   printf("goto <step>                  Go to a recorded step\n");
+   printf("lastwrite <addr>             Go back to the last write to addr\n");
+   printf("quit                         Leave the debugger\n");
+   printf("An address is a label, label+offset or hex, as shown.\n");
+   printf("A condition is <reg> <op> <value> with op ==, !=, <, <=, > "
+          "or >=.\n");
+}
+
+void DisplayRegisters() {
+   q1_regs_t regs;
+   q1_get_regs(cpu, &regs);
+   printf("pc %04x a %02x b %02x c %02x x %04x flags %c%c%c "
+      "step %llu clocks %llu\n",
+      regs.pc, regs.a, regs.b, regs.c, regs.x,
+      regs.c_flag ? 'C' : '-', regs.z_flag ? 'Z' : '-',
+      regs.n_flag ? 'N' : '-', q1_steps(cpu), q1_clocks(cpu));
+}
+
+/* Show the step and the next instruction. */
+void DisplayLocation() {
+   char addr[64];
+   char inst[64];
+   q1_regs_t regs;
+   q1_get_regs(cpu, &regs);
+   FormatAddress(addr, sizeof(addr), regs.pc);
+   Disassemble(inst, sizeof(inst), q1_memory(cpu), regs.pc);
+   printf("%llu  %s  %s\n", q1_steps(cpu), addr, inst);
+}
+
+/* Show why a run stopped and where. */
+void DisplayStop(q1_status_t status) {
+
+   char addr[64];
+   unsigned short stop_addr;
+   unsigned int kind;
+
+   switch(status) {
+   case Q1_HALTED:
+      printf("halted\n");
+      break;
+   case Q1_FAULT:
+      printf("invalid instruction\n");
+      break;
+   case Q1_BREAK:
+      kind = q1_break_reason(cpu, &stop_addr);
+      FormatAddress(addr, sizeof(addr), stop_addr);
+      if(kind == Q1_BREAK_EXEC) {
+         printf("breakpoint at %s\n", addr);
+      } else {
+         printf("%s of %s (now %02x)\n",
+            kind == Q1_WATCH_READ ? "read" : "write", addr,
+            q1_read(cpu, stop_addr));
+      }
+      break;
+   default:
+      break;
+   }
+   DisplayLocation();
+
+}
+
+void DisplayPoints() {
+
+   char addr[64];
+   const PointType *pp;
+   unsigned int x;
+
+   for(x = 0; x < point_count; x++) {
+      pp = &points[x];
+      FormatAddress(addr, sizeof(addr), pp->addr);
+      if(pp->kind == Q1_BREAK_EXEC) {
+         printf("break %s", addr);
+      } else {
+         printf("watch %s %s%s", addr,
+            (pp->kind & Q1_WATCH_READ) ? "r" : "",
+            (pp->kind & Q1_WATCH_WRITE) ? "w" : "");
+      }
+      if(pp->conditional) {
+         printf(" if %s %s %u", REGISTER_NAMES[pp->reg],
+            COMPARE_NAMES[pp->op], pp->value);
+      }
+      printf("\n");
+   }
+
+}
+
+/* Add a point, replacing any of the same kind at addr. words holds an
+ * optional "if <reg> <op> <value>". Returns 0 on error. */
+int AddPoint(unsigned short addr, unsigned int kind,
+             char **words, unsigned int count) {
+
+   PointType point;
+   PointType *pp;
+   unsigned long long value;
+   unsigned int max;
+   unsigned int x;
+
+   point.addr = addr;
+   point.kind = kind;
+   point.conditional = 0;
+   if(count > 0) {
+      if(count != 4 || strcmp(words[0], "if")
+         || !ParseRegister(words[1], &point.reg)
+         || !ParseNumber(words[3], &value)) {
+         return 0;
+      }
+      for(x = 0; x <= OP_GE; x++) {
+         if(!strcmp(words[2], COMPARE_NAMES[x])) {
+            break;
+         }
+      }
+      if(x > OP_GE) {
+         return 0;
+      }
+      point.op = (CompareType)x;
+      point.value = (unsigned int)value;
+      point.conditional = 1;
+   }
+
+   DeletePoints(addr, kind);
+   if(point_count == point_max) {
+      max = point_max ? point_max * 2 : 16;
+      pp = realloc(points, max * sizeof(PointType));
+      if(pp == NULL) {
+         printf("out of memory\n");
+         return 0;
+      }
+      points = pp;
+      point_max = max;
+   }
+   if(!q1_set_break(cpu, addr, q1_get_break(cpu, addr) | kind)) {
+      printf("out of memory\n");
+      return 0;
+   }
+   points[point_count++] = point;
+   return 1;
+
+}
+
+/* Remove the points at addr that share a kind with kind (~0 removes
+ * every point, 0 every point at addr). */
+void DeletePoints(unsigned short addr, unsigned int kind) {
+   unsigned int x = 0;
+   while(x < point_count) {
+      if(kind == ~0U || (points[x].addr == addr
+                         && (kind == 0 || (points[x].kind & kind)))) {
+         q1_set_break(cpu, points[x].addr,
+            q1_get_break(cpu, points[x].addr) & ~points[x].kind);
+         points[x] = points[--point_count];
+      } else {
+         ++x;
+      }
+   }
+}
+
+const PointType *FindPoint(unsigned short addr, unsigned int kind) {
+   unsigned int x;
+   for(x = 0; x < point_count; x++) {
+      if(points[x].addr == addr && (points[x].kind & kind)) {
+         return &points[x];
+      }
+   }
+   return NULL;
+}
+
+int CheckCondition(const PointType *pp) {
+   const unsigned int value = GetRegister(pp->reg);
+   if(!pp->conditional) {
+      return 1;
+   }
+   switch(pp->op) {
+   case OP_EQ: return value == pp->value;
+   case OP_NE: return value != pp->value;
+   case OP_LT: return value < pp->value;
+   case OP_LE: return value <= pp->value;
+   case OP_GT: return value > pp->value;
+   default:    return value >= pp->value;
+   }
+}
+
+/* Run up to budget instructions (0 for no limit). A breakpoint at the
+ * PC stops the first attempt without executing anything; running again
+ * passes over it. */
+q1_status_t Resume(unsigned long long budget) {
+   const unsigned long long start = q1_steps(cpu);
+   unsigned short addr;
+   q1_status_t status = q1_run(cpu, budget);
+   if(status == Q1_BREAK && q1_steps(cpu) == start
+      && q1_break_reason(cpu, &addr) == Q1_BREAK_EXEC) {
+      status = q1_run(cpu, budget);
+   }
+   return status;
+}
+
+/* Run until a point whose condition holds, a halt, a fault or limit
+ * instructions (0 for no limit). */
+void Continue(unsigned long long limit) {
+
+   const unsigned long long start = q1_steps(cpu);
+   const PointType *pp;
+   q1_status_t status;
+   unsigned short addr;
+   unsigned int kind;
+
+   for(;;) {
+      status = Resume(limit ? limit - (q1_steps(cpu) - start) : 0);
+      if(status != Q1_BREAK) {
+         break;
+      }
+      kind = q1_break_reason(cpu, &addr);
+      pp = FindPoint(addr, kind);
+      if(pp == NULL || CheckCondition(pp)) {
+         break;
+      }
+      if(limit && q1_steps(cpu) - start >= limit) {
+         status = Q1_RUNNING;
+         break;
+      }
+   }
+   DisplayStop(status);
+
+}
+
+/* Execute count instructions, stopping early at a watchpoint. */
+void Step(unsigned long long count) {
+   q1_status_t status = Q1_RUNNING;
+   unsigned short addr;
+   for(; count; --count) {
+      status = Resume(1);
+      if(status == Q1_BREAK
+         && q1_break_reason(cpu, &addr) == Q1_BREAK_EXEC) {
+         status = Q1_RUNNING;
+      }
+      if(status != Q1_RUNNING) {
+         break;
+      }
+   }
+   DisplayStop(status);
+}
+
+void Dump(unsigned short addr, unsigned int count) {
+   const unsigned char *memory = q1_memory(cpu);
+   unsigned int x;
+   for(x = 0; x < count && addr + x < (1 << 16); x++) {
+      if((x & 15) == 0) {
+         printf("%s%04x:", x ? "\n" : "", addr + x);
+      }
+      printf(" %02x", (unsigned int)memory[addr + x]);
+   }
+   printf("\n");
+}
+
+void List(unsigned short addr, unsigned int count) {
+   const unsigned char *memory = q1_memory(cpu);
+   char label[64];
+   char inst[64];
+   const SymbolType *sp;
+   unsigned int size;
+   unsigned int x;
+   for(x = 0; x < count; x++) {
+      sp = FindSymbol(addr);
+      if(sp && sp->addr == addr) {
+         printf("%s:\n", sp->name);
+      }
+      FormatAddress(label, sizeof(label), addr);
+      size = Disassemble(inst, sizeof(inst), memory, addr);
+      printf("%c %04x  %-20s %s\n",
+         (q1_get_break(cpu, addr) & Q1_BREAK_EXEC) ? '*' : ' ',
+         addr, label, inst);
+      addr += size;
+   }
+}
+
+/* Set a register or flag. Returns 0 if the name is not known. */
+int SetRegister(const char *name, unsigned int value) {
+   RegisterType reg;
+   q1_regs_t regs;
+   if(!ParseRegister(name, &reg)) {
+      return 0;
+   }
+   q1_get_regs(cpu, &regs);
+   switch(reg) {
+   case REG_A:    regs.a = (unsigned char)value;   break;
+   case REG_B:    regs.b = (unsigned char)value;   break;
+   case REG_C:    regs.c = (unsigned char)value;   break;
+   case REG_X:    regs.x = (unsigned short)value;  break;
+   case REG_PC:   regs.pc = (unsigned short)value; break;
+   case REG_CF:   regs.c_flag = value != 0;        break;
+   case REG_ZF:   regs.z_flag = value != 0;        break;
+   default:       regs.n_flag = value != 0;        break;
+   }
+   q1_set_regs(cpu, &regs);
+   return 1;
+}
+
+/* Parse an address as it is shown: a label, a label and a decimal
+ * offset ("loop+3") or hex with an optional $ or 0x. A label is tried
+ * first, so one spelled like a hex number hides the number. */
+int ParseAddress(const char *str, unsigned short *addr) {
+
+   char name[MAX_LINE];
+   const char *digits;
+   const char *plus;
+   unsigned long value;
+   char *end;
+
+   if(LookupSymbol(str, addr)) {
+      return 1;
+   }
+
+   plus = strrchr(str, '+');
+   if(plus != NULL && plus != str) {
+      memcpy(name, str, plus - str);
+      name[plus - str] = 0;
+      value = strtoul(plus + 1, &end, 10);
+      if(end != plus + 1 && *end == 0 && value <= 0xFFFF
+         && LookupSymbol(name, addr)) {
+         *addr += (unsigned short)value;
+         return 1;
+      }
+   }
+
+   digits = str[0] == '$' ? &str[1] : str;
+   value = strtoul(digits, &end, 16);
+   if(end != digits && *end == 0 && value <= 0xFFFF) {
+      *addr = (unsigned short)value;
+      return 1;
+   }
+   return Invalid("invalid address", str);
+
+}
+
+/* Parse a count or value: decimal, or hex with $ or 0x. */
+int ParseNumber(const char *str, unsigned long long *value) {
+   char *end;
+   if(str[0] == '$') {
+      *value = strtoull(&str[1], &end, 16);
+      if(end != &str[1] && *end == 0) {
+         return 1;
+      }
+   } else {
+      *value = strtoull(str, &end, 0);
+      if(end != str && *end == 0) {
+         return 1;
+      }
+   }
+   return Invalid("invalid number", str);
+}
+
+int ParseRegister(const char *str, RegisterType *reg) {
+   unsigned int x;
+   for(x = 0; x <= REG_NF; x++) {
+      if(!strcmp(str, REGISTER_NAMES[x])) {
+         *reg = (RegisterType)x;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+unsigned int GetRegister(RegisterType reg) {
+   q1_regs_t regs;
+   q1_get_regs(cpu, &regs);
+   switch(reg) {
+   case REG_A:    return regs.a;
+   case REG_B:    return regs.b;
+   case REG_C:    return regs.c;
+   case REG_X:    return regs.x;
+   case REG_PC:   return regs.pc;
+   case REG_CF:   return regs.c_flag;
+   case REG_ZF:   return regs.z_flag;
+   default:       return regs.n_flag;
+   }
+}
+
+/* Check that history is being recorded. Returns 0 if not. */
+int NeedHistory() {
+   if(history == NULL) {
+      printf("not recording; use record first\n");
+      return 0;
+   }
+   return 1;
+}
+
+/* Note why a command failed. Returns 0. */
+int Invalid(const char *what, const char *word) {
+   error = what;
+   error_word = word;
+   return 0;
+}
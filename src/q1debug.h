@@ -0,0 +1,19 @@
+/* Debugger for q1sim.
+ *
+ * Commands are read one per line, so a debugging session can be
+ * scripted by redirecting a file to q1sim -debug. Addresses are shown
+ * with the symbols loaded by LoadSymbols and are read back in the same
+ * form: a label, a label and an offset, or hex.
+ */
+
+#ifndef Q1DEBUG_H
+#define Q1DEBUG_H
+
+#include "q1.h"
+
+/* Run commands from in until quit or the end of the input, prompting
+ * if in is a terminal. Returns nonzero if a command failed while
+ * reading from a file. */
+int RunDebugger(q1_cpu_t *cpu, FILE *in);
+
+#endif /* Q1DEBUG_H */
@@ -0,0 +1,52 @@
+/* Disassembly for q1sim and q1trace. */
+
+#include "q1dis.h"
+#include "q1sym.h"
+
+#include <stdio.h>
+
+static const char *NAMES[0x40] = {
+   "j",   "jc",  "jz",  "jcz", "jn",  "jcn", "jzn", "jczn",
+   "c",   "cc",  "cz",  "ccz", "cn",  "ccn", "czn", "cczn",
+   "ldb", "ldc", "lxh", "lxl", "stb", "stc", "sxh", "sxl",
+   "sta", NULL,  NULL,  NULL,  NULL,  NULL,  NULL,  NULL,
+   "and", "or",  "shl", "shr", "add", "inc", "dec", "not",
+   "clr", NULL,  NULL,  NULL,  NULL,  NULL,  NULL,  NULL,
+   "mab", "mac", "sax", "sbx", "scx", "lbx", "lcx", "ret",
+   "hlt", NULL,  NULL,  NULL,  NULL,  NULL,  NULL,  NULL
+};
+
+const char *InstructionName(unsigned char opcode) {
+   return opcode < 0x40 ? NAMES[opcode] : NULL;
+}
+
+/* J and LS class instructions are followed by a 2-byte operand. */
+unsigned int InstructionSize(unsigned char opcode) {
+   return opcode < 0x20 ? 3 : 1;
+}
+
+void FormatInstruction(char *buffer, size_t size, unsigned char opcode,
+                       unsigned short operand) {
+   const char *name = InstructionName(opcode);
+   char addr[64];
+   if(name == NULL) {
+      snprintf(buffer, size, "db    $%02x", (unsigned int)opcode);
+   } else if(opcode < 0x20) {
+      FormatAddress(addr, sizeof(addr), operand);
+      snprintf(buffer, size, "%-5s %s", name, addr);
+   } else {
+      snprintf(buffer, size, "%s", name);
+   }
+}
+
+unsigned int Disassemble(char *buffer, size_t size,
+                         const unsigned char *memory, unsigned short addr) {
+   const unsigned char opcode = memory[addr];
+   unsigned short operand = 0;
+   if(InstructionSize(opcode) == 3) {
+      operand = (unsigned short)memory[(unsigned short)(addr + 1)] << 8;
+      operand |= memory[(unsigned short)(addr + 2)];
+   }
+   FormatInstruction(buffer, size, opcode, operand);
+   return InstructionSize(opcode);
+}
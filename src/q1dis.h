@@ -0,0 +1,23 @@
+/* Disassembly for q1sim and q1trace. Addresses are shown with the
+ * symbols loaded by LoadSymbols. */
+
+#ifndef Q1DIS_H
+#define Q1DIS_H
+
+#include <stddef.h>
+
+/* Return the name of an opcode or NULL if it is not valid. */
+const char *InstructionName(unsigned char opcode);
+
+/* Return the size in bytes of an instruction with an opcode. */
+unsigned int InstructionSize(unsigned char opcode);
+
+/* Format an instruction as its name and operand. */
+void FormatInstruction(char *buffer, size_t size, unsigned char opcode,
+                       unsigned short operand);
+
+/* Format the instruction at addr in memory. Returns its size. */
+unsigned int Disassemble(char *buffer, size_t size,
+                         const unsigned char *memory, unsigned short addr);
+
+#endif /* Q1DIS_H */
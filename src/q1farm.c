@@ -0,0 +1,568 @@
+/* Farm mode for the Q1 simulator.
+ *
+ * A manifest lists jobs, one per line:
+ *
+ *    <file> [-a n] [-b n] [-c n] [-steps n] [-clocks n]
+ *
+ * Register values may be ranges ("-b 0:255"), in which case the line
+ * expands to one job for every combination of values. Blank lines and
+ * lines starting with '#' are ignored. Each program is loaded once and
+ * shared by every worker.
+ *
+ * Jobs are numbered in manifest order and split evenly between the
+ * workers. Each worker owns one machine and runs its jobs from the
+ * front of its range; an idle worker steals the back half of the
+ * range of another worker. Results are written as JSON lines in
+ * completion order and carry the job number.
+ *
+ * In lockstep mode each worker runs up to Q1_BATCH_LANES consecutive
+ * jobs from the same manifest line at a time with a q1_batch_t.
+ */
+
+#include "q1farm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Output is buffered per worker and written when the buffer fills or
+ * FLUSH_NS have passed since the last write. */
+#define OUTPUT_SIZE  (1 << 16)
+#define FLUSH_NS     100000000ULL
+
+#define MAX_LINE     1024
+
+typedef struct {
+   int image;
+   unsigned char lo[3], hi[3];      /* A, B and C ranges. */
+   unsigned long long max_steps;
+   unsigned long long max_clocks;
+   unsigned long long first;        /* Number of the first job. */
+   unsigned long long count;
+} EntryType;
+
+typedef struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   unsigned long long next;         /* Jobs [next, end) are queued. */
+   unsigned long long end;
+   unsigned int index;
+   q1_cpu_t *cpu;
+   q1_snapshot_t *start;            /* cpu with the image loaded. */
+   q1_batch_t *batch;               /* Used instead of cpu in lockstep. */
+   int image;                       /* Image loaded in start or batch. */
+   unsigned char *dump;
+   char *output;
+   size_t used;
+   size_t line_max;
+   unsigned long long last_flush;
+} WorkerType;
+
+static const FarmOptionsType *options;
+static EntryType *entries;
+static unsigned int entry_count;
+static WorkerType *workers;
+static unsigned int worker_count;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *STATUS_NAMES[] = { "budget", "halted", "fault" };
+
+static int ParseManifest(const char *manifest);
+static int ParseEntry(char *line, const char *manifest,
+                      unsigned int line_number);
+static int ParseRange(const char *str, unsigned char *lo, unsigned char *hi);
+static void *FarmWorker(void *arg);
+static unsigned int TakeJobs(WorkerType *wp, unsigned long long *first,
+                             unsigned int limit);
+static const EntryType *FindEntry(unsigned long long job);
+static void SetInputs(const EntryType *ep, unsigned long long job,
+                      q1_regs_t *regs);
+static void RunJob(WorkerType *wp, unsigned long long job);
+static void RunBatch(WorkerType *wp, unsigned long long first,
+                     unsigned int count);
+static void WriteResult(WorkerType *wp, unsigned long long job,
+                        const ImageType *ip, const q1_regs_t *input,
+                        q1_status_t status, unsigned long long steps,
+                        unsigned long long clocks, const q1_regs_t *regs,
+                        const unsigned char *dump);
+static void FlushOutput(WorkerType *wp);
+static unsigned long long GetTime();
+
+int RunFarm(const char *manifest, const FarmOptionsType *opts) {
+
+   unsigned long long total;
+   unsigned long long start;
+   unsigned int name_max;
+   unsigned int started;
+   unsigned int x;
+   long cores;
+   int rc;
+
+   options = opts;
+   if(!ParseManifest(manifest)) {
+      FreeImages();
+      return -1;
+   }
+
+   total = 0;
+   name_max = 0;
+   for(x = 0; x < entry_count; x++) {
+      total += entries[x].count;
+   }
+   for(x = 0; x < entry_count; x++) {
+      if(strlen(GetImage(entries[x].image)->name) > name_max) {
+         name_max = strlen(GetImage(entries[x].image)->name);
+      }
+   }
+
+   worker_count = options->threads;
+   if(worker_count == 0) {
+      cores = sysconf(_SC_NPROCESSORS_ONLN);
+      worker_count = cores > 0 ? (unsigned int)cores : 1;
+   }
+   if(worker_count > total) {
+      worker_count = total > 0 ? (unsigned int)total : 1;
+   }
+
+   workers = calloc(worker_count, sizeof(WorkerType));
+   if(workers == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      FreeImages();
+      return -1;
+   }
+
+   rc = 0;
+   start = 0;
+   for(x = 0; x < worker_count; x++) {
+      WorkerType *wp = &workers[x];
+      pthread_mutex_init(&wp->lock, NULL);
+      wp->index = x;
+      wp->next = start;
+      start += total / worker_count + (x < total % worker_count);
+      wp->end = start;
+      wp->line_max = 512 + name_max * 6 + options->dump_count * 2;
+      wp->output = malloc(OUTPUT_SIZE + wp->line_max * Q1_BATCH_LANES);
+      wp->dump = malloc(options->dump_count + 1);
+      wp->image = -1;
+      if(options->lockstep) {
+         wp->batch = q1_batch_create();
+      } else {
+         wp->cpu = q1_create();
+         wp->start = q1_snapshot_create();
+      }
+      if(wp->output == NULL || wp->dump == NULL
+         || (wp->batch == NULL && (wp->cpu == NULL || wp->start == NULL))) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         rc = -1;
+         worker_count = x + 1;
+         break;
+      }
+      if(wp->cpu) {
+         q1_set_engine(wp->cpu, options->engine);
+         q1_set_log(wp->cpu, NULL);
+      }
+   }
+
+   if(rc == 0) {
+      /* Jobs queued for a thread that could not be created are stolen
+       * by the others. */
+      started = 0;
+      for(x = 0; x < worker_count; x++) {
+         if(pthread_create(&workers[x].thread, NULL, FarmWorker,
+                           &workers[x])) {
+            break;
+         }
+         ++started;
+      }
+      if(started == 0) {
+         fprintf(stderr, "ERROR: could not create thread\n");
+         rc = -1;
+      }
+      for(x = 0; x < started; x++) {
+         pthread_join(workers[x].thread, NULL);
+      }
+   }
+
+   for(x = 0; x < worker_count; x++) {
+      q1_destroy(workers[x].cpu);
+      q1_snapshot_destroy(workers[x].start);
+      q1_batch_destroy(workers[x].batch);
+      free(workers[x].dump);
+      free(workers[x].output);
+      pthread_mutex_destroy(&workers[x].lock);
+   }
+   free(workers);
+   free(entries);
+   FreeImages();
+
+   return rc;
+
+}
+
+/* Read the manifest and load each program it names once. */
+int ParseManifest(const char *manifest) {
+
+   FILE *fd;
+   char line[MAX_LINE];
+   unsigned int line_number;
+   unsigned int max_entries;
+   unsigned long long total;
+   char *p;
+
+   fd = fopen(manifest, "r");
+   if(fd == NULL) {
+      fprintf(stderr, "ERROR: could not open %s\n", manifest);
+      return 0;
+   }
+
+   max_entries = 0;
+   entry_count = 0;
+   entries = NULL;
+   total = 0;
+   line_number = 0;
+   while(fgets(line, sizeof(line), fd)) {
+      ++line_number;
+      p = line;
+      while(*p == ' ' || *p == '\t') {
+         ++p;
+      }
+      if(*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+         continue;
+      }
+      if(entry_count == max_entries) {
+         max_entries = max_entries ? max_entries * 2 : 64;
+         entries = realloc(entries, max_entries * sizeof(EntryType));
+         if(entries == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            fclose(fd);
+            return 0;
+         }
+      }
+      if(!ParseEntry(p, manifest, line_number)) {
+         fclose(fd);
+         return 0;
+      }
+      entries[entry_count].first = total;
+      total += entries[entry_count].count;
+      ++entry_count;
+   }
+
+   fclose(fd);
+   return 1;
+
+}
+
+/* Parse a manifest line. */
+int ParseEntry(char *line, const char *manifest, unsigned int line_number) {
+
+   EntryType *ep = &entries[entry_count];
+   const char *name;
+   char *token;
+   char *arg;
+   int x;
+
+   name = strtok(line, " \t\r\n");
+   ep->image = LoadImage(name, options->format);
+   if(ep->image < 0) {
+      return 0;
+   }
+
+   ep->lo[0] = ep->hi[0] = options->regs.a;
+   ep->lo[1] = ep->hi[1] = options->regs.b;
+   ep->lo[2] = ep->hi[2] = options->regs.c;
+   ep->max_steps = options->max_steps;
+   ep->max_clocks = options->max_clocks;
+
+   while((token = strtok(NULL, " \t\r\n")) != NULL) {
+      arg = strtok(NULL, " \t\r\n");
+      if(arg == NULL) {
+         fprintf(stderr, "ERROR: %s:%u: missing value for %s\n",
+            manifest, line_number, token);
+         return 0;
+      }
+      if(!strcmp(token, "-a")) {
+         x = ParseRange(arg, &ep->lo[0], &ep->hi[0]);
+      } else if(!strcmp(token, "-b")) {
+         x = ParseRange(arg, &ep->lo[1], &ep->hi[1]);
+      } else if(!strcmp(token, "-c")) {
+         x = ParseRange(arg, &ep->lo[2], &ep->hi[2]);
+      } else if(!strcmp(token, "-steps")) {
+         ep->max_steps = strtoull(arg, NULL, 0);
+         x = 1;
+      } else if(!strcmp(token, "-clocks")) {
+         ep->max_clocks = strtoull(arg, NULL, 0);
+         x = 1;
+      } else {
+         fprintf(stderr, "ERROR: %s:%u: invalid option: %s\n",
+            manifest, line_number, token);
+         return 0;
+      }
+      if(!x) {
+         fprintf(stderr, "ERROR: %s:%u: invalid range: %s\n",
+            manifest, line_number, arg);
+         return 0;
+      }
+   }
+
+   ep->count = 1;
+   for(x = 0; x < 3; x++) {
+      ep->count *= ep->hi[x] - ep->lo[x] + 1;
+   }
+
+   return 1;
+
+}
+
+/* Parse a register value or an inclusive range "lo:hi". */
+int ParseRange(const char *str, unsigned char *lo, unsigned char *hi) {
+   char *end;
+   unsigned long first, last;
+   first = strtoul(str, &end, 0);
+   last = first;
+   if(*end == ':') {
+      last = strtoul(end + 1, &end, 0);
+   }
+   if(*end != 0 || first > 255 || last > 255 || first > last) {
+      return 0;
+   }
+   *lo = (unsigned char)first;
+   *hi = (unsigned char)last;
+   return 1;
+}
+
+void *FarmWorker(void *arg) {
+   WorkerType *wp = (WorkerType*)arg;
+   unsigned long long job;
+   unsigned int count;
+   const unsigned int limit = wp->batch ? Q1_BATCH_LANES : 1;
+   wp->last_flush = GetTime();
+   while((count = TakeJobs(wp, &job, limit)) > 0) {
+      if(wp->batch) {
+         RunBatch(wp, job, count);
+      } else {
+         RunJob(wp, job);
+      }
+      if(wp->used >= OUTPUT_SIZE || GetTime() - wp->last_flush >= FLUSH_NS) {
+         FlushOutput(wp);
+      }
+   }
+   FlushOutput(wp);
+   return NULL;
+}
+
+/* Get up to limit consecutive jobs from one manifest entry, stealing
+ * from another worker if out of jobs. Returns the number of jobs taken,
+ * which is 0 when all jobs have been started. */
+unsigned int TakeJobs(WorkerType *wp, unsigned long long *first,
+                      unsigned int limit) {
+
+   const EntryType *ep;
+   WorkerType *victim;
+   unsigned long long mid;
+   unsigned long long count;
+   unsigned long long end;
+   unsigned int x;
+
+   pthread_mutex_lock(&wp->lock);
+   if(wp->next >= wp->end) {
+      pthread_mutex_unlock(&wp->lock);
+      mid = 0;
+      end = 0;
+      for(x = 1; x < worker_count; x++) {
+         victim = &workers[(wp->index + x) % worker_count];
+         pthread_mutex_lock(&victim->lock);
+         if(victim->next < victim->end) {
+            mid = victim->end - (victim->end - victim->next + 1) / 2;
+            end = victim->end;
+            victim->end = mid;
+            pthread_mutex_unlock(&victim->lock);
+            break;
+         }
+         pthread_mutex_unlock(&victim->lock);
+      }
+      if(x == worker_count) {
+         return 0;
+      }
+      /* Nothing steals from an empty range, so this is safe to set. */
+      pthread_mutex_lock(&wp->lock);
+      wp->next = mid;
+      wp->end = end;
+   }
+
+   *first = wp->next;
+   ep = FindEntry(wp->next);
+   end = ep->first + ep->count;
+   end = end < wp->end ? end : wp->end;
+   count = end - wp->next;
+   count = count < limit ? count : limit;
+   wp->next += count;
+   pthread_mutex_unlock(&wp->lock);
+
+   return (unsigned int)count;
+
+}
+
+/* Find the manifest entry for a job. */
+const EntryType *FindEntry(unsigned long long job) {
+   unsigned int lo, hi, mid;
+   lo = 0;
+   hi = entry_count;
+   while(hi - lo > 1) {
+      mid = (lo + hi) / 2;
+      if(entries[mid].first <= job) {
+         lo = mid;
+      } else {
+         hi = mid;
+      }
+   }
+   return &entries[lo];
+}
+
+/* Set the input registers for a job. */
+void SetInputs(const EntryType *ep, unsigned long long job, q1_regs_t *regs) {
+   unsigned long long index = job - ep->first;
+   regs->a = ep->lo[0] + index % (ep->hi[0] - ep->lo[0] + 1);
+   index /= ep->hi[0] - ep->lo[0] + 1;
+   regs->b = ep->lo[1] + index % (ep->hi[1] - ep->lo[1] + 1);
+   index /= ep->hi[1] - ep->lo[1] + 1;
+   regs->c = ep->lo[2] + index;
+}
+
+/* Run a job on the worker's machine. */
+void RunJob(WorkerType *wp, unsigned long long job) {
+
+   const EntryType *ep = FindEntry(job);
+   const ImageType *ip = GetImage(ep->image);
+   q1_cpu_t *cpu = wp->cpu;
+   q1_regs_t regs, input;
+   q1_status_t status;
+
+   /* Restoring the snapshot only copies the pages the last job wrote
+    * and keeps translated code that was not modified. */
+   if(wp->image != ep->image) {
+      q1_reset(cpu);
+      q1_load(cpu, ip->start, ip->data, ip->size);
+      q1_snapshot_save(cpu, wp->start);
+      wp->image = ep->image;
+   } else {
+      q1_snapshot_restore(cpu, wp->start);
+   }
+   q1_get_regs(cpu, &regs);
+   SetInputs(ep, job, &regs);
+   q1_set_regs(cpu, &regs);
+   input = regs;
+
+   status = q1_run_limits(cpu, ep->max_steps, ep->max_clocks);
+
+   q1_get_regs(cpu, &regs);
+   WriteResult(wp, job, ip, &input, status, q1_steps(cpu), q1_clocks(cpu),
+      &regs, q1_memory(cpu) + options->dump_start);
+
+}
+
+/* Run consecutive jobs from one manifest entry in lockstep. */
+void RunBatch(WorkerType *wp, unsigned long long first, unsigned int count) {
+
+   const EntryType *ep = FindEntry(first);
+   const ImageType *ip = GetImage(ep->image);
+   q1_batch_t *batch = wp->batch;
+   q1_regs_t regs;
+   q1_regs_t inputs[Q1_BATCH_LANES];
+   unsigned int lane;
+   unsigned int x;
+
+   if(wp->image != ep->image) {
+      q1_batch_load(batch, ip->start, ip->data, ip->size);
+      wp->image = ep->image;
+   } else {
+      q1_batch_reset(batch);
+   }
+   for(lane = 0; lane < count; lane++) {
+      q1_batch_get_regs(batch, lane, &inputs[lane]);
+      SetInputs(ep, first + lane, &inputs[lane]);
+      q1_batch_set_regs(batch, lane, &inputs[lane]);
+   }
+
+   q1_batch_run(batch, count, ep->max_steps, ep->max_clocks);
+
+   for(lane = 0; lane < count; lane++) {
+      q1_batch_get_regs(batch, lane, &regs);
+      for(x = 0; x < options->dump_count; x++) {
+         wp->dump[x] = q1_batch_read(batch, lane, options->dump_start + x);
+      }
+      WriteResult(wp, first + lane, ip, &inputs[lane],
+         q1_batch_status(batch, lane), q1_batch_steps(batch, lane),
+         q1_batch_clocks(batch, lane), &regs, wp->dump);
+   }
+
+}
+
+/* Append the result of a job to the worker's output. */
+void WriteResult(WorkerType *wp, unsigned long long job,
+                 const ImageType *ip, const q1_regs_t *input,
+                 q1_status_t status, unsigned long long steps,
+                 unsigned long long clocks, const q1_regs_t *regs,
+                 const unsigned char *dump) {
+
+   char *out;
+   const char *p;
+   unsigned int x;
+
+   out = &wp->output[wp->used];
+   out += sprintf(out, "{\"job\":%llu,\"file\":\"", job);
+   for(p = ip->name; *p; p++) {
+      if(*p == '"' || *p == '\\') {
+         *out++ = '\\';
+         *out++ = *p;
+      } else if((unsigned char)*p < 0x20) {
+         out += sprintf(out, "\\u%04x", (unsigned int)(unsigned char)*p);
+      } else {
+         *out++ = *p;
+      }
+   }
+   out += sprintf(out, "\",\"input\":{\"a\":%u,\"b\":%u,\"c\":%u},",
+      (unsigned int)input->a, (unsigned int)input->b,
+      (unsigned int)input->c);
+   out += sprintf(out, "\"status\":\"%s\",", STATUS_NAMES[status]);
+   out += sprintf(out, "\"instructions\":%llu,\"clocks\":%llu,",
+      steps, clocks);
+   out += sprintf(out, "\"pc\":%u,\"a\":%u,\"b\":%u,\"c\":%u,\"x\":%u,",
+      (unsigned int)regs->pc, (unsigned int)regs->a, (unsigned int)regs->b,
+      (unsigned int)regs->c, (unsigned int)regs->x);
+   out += sprintf(out, "\"flags\":{\"c\":%u,\"z\":%u,\"n\":%u}",
+      (unsigned int)regs->c_flag, (unsigned int)regs->z_flag,
+      (unsigned int)regs->n_flag);
+   if(options->dump_count > 0) {
+      out += sprintf(out, ",\"memory\":{\"start\":%u,\"data\":\"",
+         options->dump_start);
+      for(x = 0; x < options->dump_count; x++) {
+         out += sprintf(out, "%02x", (unsigned int)dump[x]);
+      }
+      out += sprintf(out, "\"}");
+   }
+   out += sprintf(out, "}\n");
+
+   wp->used = out - wp->output;
+
+}
+
+/* Write the buffered results of a worker. */
+void FlushOutput(WorkerType *wp) {
+   if(wp->used > 0) {
+      pthread_mutex_lock(&output_lock);
+      fwrite(wp->output, 1, wp->used, options->output);
+      fflush(options->output);
+      pthread_mutex_unlock(&output_lock);
+      wp->used = 0;
+   }
+   wp->last_flush = GetTime();
+}
+
+/* Get a monotonic time in nanoseconds. */
+unsigned long long GetTime() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,26 @@
+/* Farm mode: run many programs and register seeds in parallel. */
+
+#ifndef Q1FARM_H
+#define Q1FARM_H
+
+#include "q1.h"
+#include "q1image.h"
+
+typedef struct {
+   unsigned int threads;            /* Worker threads (0 for one per core). */
+   q1_engine_t engine;
+   int lockstep;                    /* Run jobs in q1_batch_t lanes. */
+   FormatType format;               /* Format of the programs. */
+   q1_regs_t regs;                  /* Registers not set by the manifest. */
+   unsigned long long max_steps;    /* Default budgets (0 for none). */
+   unsigned long long max_clocks;
+   unsigned int dump_start;
+   unsigned int dump_count;
+   FILE *output;
+} FarmOptionsType;
+
+/* Run every job in a manifest, writing one JSON object per line to
+ * options->output as jobs complete. Returns 0 on success. */
+int RunFarm(const char *manifest, const FarmOptionsType *options);
+
+#endif /* Q1FARM_H */
@@ -0,0 +1,677 @@
+/* GDB remote serial protocol server for q1sim.
+ *
+ * Breakpoints (Z0 and Z1) and watchpoints (Z2 to Z4) are set in the
+ * machine with q1_set_break, so neither kind writes to memory. While
+ * continuing, the machine runs in slices of RUN_SLICE instructions and
+ * the connection is polled for an interrupt between slices.
+ */
+
+#include "q1gdb.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_PACKET   4096
+#define RUN_SLICE    (1 << 20)
+#define REG_COUNT    6
+
+/* Signals in stop replies. */
+#define SIGNAL_INT   2
+#define SIGNAL_ILL   4
+#define SIGNAL_TRAP  5
+
+static const char TARGET_XML[] =
+   "<?xml version=\"1.0\"?>"
+   "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+   "<target version=\"1.0\">"
+   "<feature name=\"org.q1.core\">"
+   "<reg name=\"a\" bitsize=\"8\" type=\"uint8\"/>"
+   "<reg name=\"b\" bitsize=\"8\" type=\"uint8\"/>"
+   "<reg name=\"c\" bitsize=\"8\" type=\"uint8\"/>"
+   "<reg name=\"x\" bitsize=\"16\" type=\"data_ptr\"/>"
+   "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+   "<reg name=\"flags\" bitsize=\"8\" type=\"uint8\"/>"
+   "</feature>"
+   "</target>";
+
+/* Size in bytes of each register. */
+static const unsigned int REG_SIZES[REG_COUNT] = { 1, 1, 1, 2, 2, 1 };
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static q1_cpu_t *cpu;
+static int in_fd;
+static int out_fd;
+
+static unsigned char input[MAX_PACKET];
+static size_t input_pos;
+static size_t input_len;
+
+static int Listen(const char *port);
+static int Serve();
+static int ReadByte();
+static int InputPending();
+static int ReadPacket(char *packet);
+static int WritePacket(const char *packet);
+static int WriteAll(const char *data, size_t size);
+static int Execute(char *packet, char *reply);
+static void StopReply(char *reply, q1_status_t status);
+static q1_status_t Resume(unsigned long long budget);
+static q1_status_t Continue(int *interrupted);
+static void ReadRegisters(char *reply);
+static int WriteRegisters(const char *data);
+static unsigned int GetRegister(const q1_regs_t *regs, unsigned int reg);
+static void SetRegister(q1_regs_t *regs, unsigned int reg,
+                        unsigned int value);
+static int ChangePoint(const char *args, int insert);
+static void ReadFeatures(const char *args, char *reply);
+static char *FormatHex(char *dest, unsigned int value, unsigned int bytes);
+static int ParseHex(const char **str, unsigned long *value);
+static int HexValue(char ch);
+
+int RunGdbServer(q1_cpu_t *machine, const char *port) {
+
+   int fd;
+   int rc;
+
+   cpu = machine;
+   input_pos = 0;
+   input_len = 0;
+   signal(SIGPIPE, SIG_IGN);
+
+   if(!strcmp(port, "-")) {
+      in_fd = 0;
+      out_fd = 1;
+      return Serve();
+   }
+
+   fd = Listen(port);
+   if(fd < 0) {
+      return -1;
+   }
+   rc = Serve();
+   close(fd);
+   return rc;
+
+}
+
+/* Wait for one connection on localhost. Returns the connected socket or
+ * -1 on error. */
+int Listen(const char *port) {
+
+   struct sockaddr_in addr;
+   unsigned long number;
+   char *end;
+   int server;
+   int fd;
+   int on = 1;
+
+   number = strtoul(port, &end, 10);
+   if(end == port || *end || number == 0 || number > 0xFFFF) {
+      fprintf(stderr, "ERROR: invalid port: %s\n", port);
+      return -1;
+   }
+
+   server = socket(AF_INET, SOCK_STREAM, 0);
+   if(server < 0) {
+      fprintf(stderr, "ERROR: could not create socket\n");
+      return -1;
+   }
+   setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((unsigned short)number);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if(bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(server, 1) < 0) {
+      fprintf(stderr, "ERROR: could not listen on port %lu\n", number);
+      close(server);
+      return -1;
+   }
+
+   fprintf(stderr, "waiting for gdb on localhost:%lu\n", number);
+   fd = accept(server, NULL, NULL);
+   close(server);
+   if(fd < 0) {
+      fprintf(stderr, "ERROR: could not accept a connection\n");
+      return -1;
+   }
+   in_fd = fd;
+   out_fd = fd;
+   return fd;
+
+}
+
+/* Answer packets until the debugger detaches or disconnects. */
+int Serve() {
+
+   char packet[MAX_PACKET];
+   char reply[MAX_PACKET * 2 + 16];
+   int rc;
+
+   for(;;) {
+      if(!ReadPacket(packet)) {
+         return 0;
+      }
+      rc = Execute(packet, reply);
+      if(rc < 0) {
+         return 0;
+      }
+      if(!WritePacket(reply)) {
+         fprintf(stderr, "ERROR: lost connection to gdb\n");
+         return -1;
+      }
+      if(rc == 0) {
+         return 0;
+      }
+   }
+
+}
+
+/* Return the next byte from the debugger or -1 at the end. */
+int ReadByte() {
+   ssize_t count;
+   if(input_pos == input_len) {
+      do {
+         count = read(in_fd, input, sizeof(input));
+      } while(count < 0 && errno == EINTR);
+      if(count <= 0) {
+         return -1;
+      }
+      input_pos = 0;
+      input_len = (size_t)count;
+   }
+   return input[input_pos++];
+}
+
+/* Check for input without waiting. */
+int InputPending() {
+   struct pollfd pfd;
+   if(input_pos < input_len) {
+      return 1;
+   }
+   pfd.fd = in_fd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   return poll(&pfd, 1, 0) > 0;
+}
+
+/* Read a packet, acknowledging it. Stray acknowledgements and
+ * interrupts are skipped. Returns 0 at the end of the input. */
+int ReadPacket(char *packet) {
+
+   unsigned int sum;
+   unsigned int len;
+   int check;
+   int ch;
+
+   for(;;) {
+
+      do {
+         ch = ReadByte();
+         if(ch < 0) {
+            return 0;
+         }
+      } while(ch != '$');
+
+      sum = 0;
+      len = 0;
+      for(;;) {
+         ch = ReadByte();
+         if(ch < 0) {
+            return 0;
+         } else if(ch == '#') {
+            break;
+         }
+         sum += (unsigned int)ch;
+         if(len + 1 < MAX_PACKET) {
+            packet[len++] = (char)ch;
+         }
+      }
+      packet[len] = 0;
+
+      ch = ReadByte();
+      check = ReadByte();
+      if(ch < 0 || check < 0) {
+         return 0;
+      }
+      if(HexValue((char)ch) * 16 + HexValue((char)check)
+         == (int)(sum & 0xFF)) {
+         return WriteAll("+", 1);
+      }
+      if(!WriteAll("-", 1)) {
+         return 0;
+      }
+
+   }
+
+}
+
+/* Send a packet and wait for it to be acknowledged, resending it if
+ * the debugger asks. Returns 0 if the connection is lost. */
+int WritePacket(const char *packet) {
+
+   char *buffer;
+   const size_t len = strlen(packet);
+   unsigned int sum = 0;
+   size_t x;
+   int ch;
+
+   buffer = malloc(len + 4);
+   if(buffer == NULL) {
+      return 0;
+   }
+   buffer[0] = '$';
+   for(x = 0; x < len; x++) {
+      sum += (unsigned char)packet[x];
+      buffer[x + 1] = packet[x];
+   }
+   buffer[len + 1] = '#';
+   buffer[len + 2] = HEX_DIGITS[(sum >> 4) & 0xF];
+   buffer[len + 3] = HEX_DIGITS[sum & 0xF];
+
+   do {
+      if(!WriteAll(buffer, len + 4)) {
+         ch = -1;
+         break;
+      }
+      ch = ReadByte();
+   } while(ch == '-');
+   free(buffer);
+   return ch >= 0;
+
+}
+
+int WriteAll(const char *data, size_t size) {
+   ssize_t count;
+   while(size > 0) {
+      count = write(out_fd, data, size);
+      if(count <= 0) {
+         return 0;
+      }
+      data += count;
+      size -= (size_t)count;
+   }
+   return 1;
+}
+
+/* Handle a packet, filling in the reply (empty if not supported).
+ * Returns 1 to carry on, 0 to end the session after the reply and -1 to
+ * end it without one. */
+int Execute(char *packet, char *reply) {
+
+   const char *args = &packet[1];
+   unsigned long addr, len, value;
+   q1_regs_t regs;
+   q1_status_t status;
+   unsigned short stop_addr;
+   int interrupted;
+   unsigned long x;
+   char *p;
+
+   reply[0] = 0;
+   switch(packet[0]) {
+   case '?':
+      StopReply(reply, q1_halted(cpu) ? Q1_HALTED : Q1_RUNNING);
+      break;
+   case 'g':
+      ReadRegisters(reply);
+      break;
+   case 'G':
+      strcpy(reply, WriteRegisters(args) ? "OK" : "E01");
+      break;
+   case 'p':
+      if(!ParseHex(&args, &value) || value >= REG_COUNT) {
+         strcpy(reply, "E01");
+         break;
+      }
+      q1_get_regs(cpu, &regs);
+      *FormatHex(reply, GetRegister(&regs, (unsigned int)value),
+                 REG_SIZES[value]) = 0;
+      break;
+   case 'P':
+      if(!ParseHex(&args, &x) || x >= REG_COUNT || *args++ != '='
+         || !ParseHex(&args, &value)) {
+         strcpy(reply, "E01");
+         break;
+      }
+      q1_get_regs(cpu, &regs);
+      SetRegister(&regs, (unsigned int)x, (unsigned int)value);
+      q1_set_regs(cpu, &regs);
+      strcpy(reply, "OK");
+      break;
+   case 'm':
+      if(!ParseHex(&args, &addr) || *args++ != ','
+         || !ParseHex(&args, &len) || addr > 0xFFFF) {
+         strcpy(reply, "E01");
+         break;
+      }
+      if(len > MAX_PACKET / 2) {
+         len = MAX_PACKET / 2;
+      }
+      if(len > 0x10000 - addr) {
+         len = 0x10000 - addr;
+      }
+      p = reply;
+      for(x = 0; x < len; x++) {
+         p = FormatHex(p, q1_read(cpu, (unsigned short)(addr + x)), 1);
+      }
+      *p = 0;
+      break;
+   case 'M':
+      if(!ParseHex(&args, &addr) || *args++ != ','
+         || !ParseHex(&args, &len) || *args++ != ':'
+         || addr + len > 0x10000 || strlen(args) != len * 2) {
+         strcpy(reply, "E01");
+         break;
+      }
+      for(x = 0; x < len * 2; x++) {
+         if(HexValue(args[x]) < 0) {
+            break;
+         }
+      }
+      if(x < len * 2) {
+         strcpy(reply, "E01");
+         break;
+      }
+      for(x = 0; x < len; x++) {
+         value = HexValue(args[x * 2]) * 16 + HexValue(args[x * 2 + 1]);
+         q1_write(cpu, (unsigned short)(addr + x), (unsigned char)value);
+      }
+      strcpy(reply, "OK");
+      break;
+   case 'c':
+   case 's':
+      if(*args) {
+         if(!ParseHex(&args, &addr)) {
+            strcpy(reply, "E01");
+            break;
+         }
+         q1_get_regs(cpu, &regs);
+         regs.pc = (unsigned short)addr;
+         q1_set_regs(cpu, &regs);
+      }
+      if(packet[0] == 's') {
+         status = Resume(1);
+         if(status == Q1_BREAK
+            && q1_break_reason(cpu, &stop_addr) == Q1_BREAK_EXEC) {
+            status = Q1_RUNNING;
+         }
+         StopReply(reply, status);
+      } else {
+         status = Continue(&interrupted);
+         if(interrupted) {
+            sprintf(reply, "S%02x", SIGNAL_INT);
+         } else {
+            StopReply(reply, status);
+         }
+      }
+      break;
+   case 'Z':
+   case 'z':
+      x = (unsigned long)ChangePoint(args, packet[0] == 'Z');
+      if(x == 1) {
+         strcpy(reply, "OK");
+      } else if(x == 0) {
+         strcpy(reply, "E01");
+      }
+      break;
+   case 'H':
+      strcpy(reply, "OK");
+      break;
+   case 'q':
+      if(!strncmp(args, "Supported", 9)) {
+         sprintf(reply, "PacketSize=%x;qXfer:features:read+", MAX_PACKET);
+      } else if(!strncmp(args, "Xfer:features:read:", 19)) {
+         ReadFeatures(&args[19], reply);
+      } else if(!strcmp(args, "Attached")) {
+         strcpy(reply, "1");
+      } else if(!strcmp(args, "C")) {
+         strcpy(reply, "QC1");
+      }
+      break;
+   case 'D':
+      strcpy(reply, "OK");
+      return 0;
+   case 'k':
+      return -1;
+   default:
+      break;
+   }
+   return 1;
+
+}
+
+/* Describe why the machine stopped. */
+void StopReply(char *reply, q1_status_t status) {
+
+   unsigned short addr;
+   unsigned int kind;
+   const char *name;
+
+   switch(status) {
+   case Q1_HALTED:
+      strcpy(reply, "W00");
+      break;
+   case Q1_FAULT:
+      sprintf(reply, "S%02x", SIGNAL_ILL);
+      break;
+   case Q1_BREAK:
+      kind = q1_break_reason(cpu, &addr);
+      if(kind == Q1_BREAK_EXEC) {
+         sprintf(reply, "S%02x", SIGNAL_TRAP);
+         break;
+      }
+      if((q1_get_break(cpu, addr) & (Q1_WATCH_READ | Q1_WATCH_WRITE))
+         == (Q1_WATCH_READ | Q1_WATCH_WRITE)) {
+         name = "awatch";
+      } else {
+         name = kind == Q1_WATCH_READ ? "rwatch" : "watch";
+      }
+      sprintf(reply, "T%02x%s:%04x;", SIGNAL_TRAP, name, addr);
+      break;
+   default:
+      sprintf(reply, "S%02x", SIGNAL_TRAP);
+      break;
+   }
+
+}
+
+/* Run up to budget instructions. A breakpoint at the PC stops the first
+ * attempt without executing anything; running again passes over it. */
+q1_status_t Resume(unsigned long long budget) {
+   const unsigned long long start = q1_steps(cpu);
+   unsigned short addr;
+   q1_status_t status = q1_run(cpu, budget);
+   if(status == Q1_BREAK && q1_steps(cpu) == start
+      && q1_break_reason(cpu, &addr) == Q1_BREAK_EXEC) {
+      status = q1_run(cpu, budget);
+   }
+   return status;
+}
+
+/* Run until the machine stops or the debugger sends an interrupt. */
+q1_status_t Continue(int *interrupted) {
+   q1_status_t status;
+   int ch;
+   *interrupted = 0;
+   for(;;) {
+      status = Resume(RUN_SLICE);
+      if(status != Q1_RUNNING) {
+         return status;
+      }
+      while(InputPending()) {
+         ch = ReadByte();
+         if(ch < 0 || ch == 0x03) {
+            *interrupted = 1;
+            return status;
+         }
+      }
+   }
+}
+
+void ReadRegisters(char *reply) {
+   q1_regs_t regs;
+   unsigned int reg;
+   q1_get_regs(cpu, &regs);
+   for(reg = 0; reg < REG_COUNT; reg++) {
+      reply = FormatHex(reply, GetRegister(&regs, reg), REG_SIZES[reg]);
+   }
+   *reply = 0;
+}
+
+/* Set every register from a g packet reply. Returns 0 if malformed. */
+int WriteRegisters(const char *data) {
+   q1_regs_t regs;
+   unsigned int reg;
+   unsigned int value;
+   unsigned int x;
+   q1_get_regs(cpu, &regs);
+   for(reg = 0; reg < REG_COUNT; reg++) {
+      value = 0;
+      for(x = 0; x < REG_SIZES[reg] * 2; x++) {
+         if(HexValue(*data) < 0) {
+            return 0;
+         }
+         value = value * 16 + (unsigned int)HexValue(*data++);
+      }
+      SetRegister(&regs, reg, value);
+   }
+   q1_set_regs(cpu, &regs);
+   return 1;
+}
+
+unsigned int GetRegister(const q1_regs_t *regs, unsigned int reg) {
+   switch(reg) {
+   case 0:  return regs->a;
+   case 1:  return regs->b;
+   case 2:  return regs->c;
+   case 3:  return regs->x;
+   case 4:  return regs->pc;
+   default:
+      return regs->c_flag | (regs->z_flag << 1) | (regs->n_flag << 2);
+   }
+}
+
+void SetRegister(q1_regs_t *regs, unsigned int reg, unsigned int value) {
+   switch(reg) {
+   case 0:  regs->a = (unsigned char)value;     break;
+   case 1:  regs->b = (unsigned char)value;     break;
+   case 2:  regs->c = (unsigned char)value;     break;
+   case 3:  regs->x = (unsigned short)value;    break;
+   case 4:  regs->pc = (unsigned short)value;   break;
+   default:
+      regs->c_flag = value & 1;
+      regs->z_flag = (value >> 1) & 1;
+      regs->n_flag = (value >> 2) & 1;
+      break;
+   }
+}
+
+/* Insert or remove a point from "type,addr,kind". Breakpoints cover
+ * one address and watchpoints kind bytes. Returns 1 on success, 0 on
+ * error and -1 if the type is not supported. */
+int ChangePoint(const char *args, int insert) {
+
+   unsigned long type, addr, len;
+   unsigned int flags;
+   unsigned int old;
+   unsigned long x;
+
+   if(!ParseHex(&args, &type) || *args++ != ','
+      || !ParseHex(&args, &addr) || *args++ != ','
+      || !ParseHex(&args, &len) || addr > 0xFFFF) {
+      return 0;
+   }
+   switch(type) {
+   case 0:
+   case 1:
+      flags = Q1_BREAK_EXEC;
+      len = 1;
+      break;
+   case 2:  flags = Q1_WATCH_WRITE;                   break;
+   case 3:  flags = Q1_WATCH_READ;                    break;
+   case 4:  flags = Q1_WATCH_READ | Q1_WATCH_WRITE;   break;
+   default: return -1;
+   }
+
+   for(x = 0; x < len && addr + x <= 0xFFFF; x++) {
+      old = q1_get_break(cpu, (unsigned short)(addr + x));
+      if(!q1_set_break(cpu, (unsigned short)(addr + x),
+                       insert ? old | flags : old & ~flags)) {
+         return 0;
+      }
+   }
+   return 1;
+
+}
+
+/* Send part of target.xml for "annex:offset,length". */
+void ReadFeatures(const char *args, char *reply) {
+
+   const size_t size = sizeof(TARGET_XML) - 1;
+   unsigned long offset, len;
+
+   if(strncmp(args, "target.xml:", 11)) {
+      strcpy(reply, "E00");
+      return;
+   }
+   args += 11;
+   if(!ParseHex(&args, &offset) || *args++ != ','
+      || !ParseHex(&args, &len)) {
+      strcpy(reply, "E01");
+      return;
+   }
+   if(offset > size) {
+      offset = size;
+   }
+   if(len > size - offset) {
+      len = size - offset;
+   }
+   if(len > MAX_PACKET - 1) {
+      len = MAX_PACKET - 1;
+   }
+   reply[0] = offset + len < size ? 'm' : 'l';
+   memcpy(&reply[1], &TARGET_XML[offset], len);
+   reply[len + 1] = 0;
+
+}
+
+/* Write a value as hex, high byte first. Returns the end. */
+char *FormatHex(char *dest, unsigned int value, unsigned int bytes) {
+   while(bytes > 0) {
+      --bytes;
+      *dest++ = HEX_DIGITS[(value >> (bytes * 8 + 4)) & 0xF];
+      *dest++ = HEX_DIGITS[(value >> (bytes * 8)) & 0xF];
+   }
+   return dest;
+}
+
+/* Parse a hex number, advancing str. Returns 0 if there is none. */
+int ParseHex(const char **str, unsigned long *value) {
+   const char *start = *str;
+   *value = 0;
+   while(HexValue(**str) >= 0) {
+      *value = *value * 16 + (unsigned long)HexValue(**str);
+      ++*str;
+   }
+   return *str != start;
+}
+
+int HexValue(char ch) {
+   if(ch >= '0' && ch <= '9') {
+      return ch - '0';
+   } else if(ch >= 'a' && ch <= 'f') {
+      return ch - 'a' + 10;
+   } else if(ch >= 'A' && ch <= 'F') {
+      return ch - 'A' + 10;
+   }
+   return -1;
+}
@@ -0,0 +1,18 @@
+/* GDB remote serial protocol server for q1sim.
+ *
+ * Registers are numbered a, b, c, x, pc and flags (bit 0 C, bit 1 Z,
+ * bit 2 N). x and pc are sent high byte first, as they are stored in
+ * Q1 memory. The layout is also sent as target.xml.
+ */
+
+#ifndef Q1GDB_H
+#define Q1GDB_H
+
+#include "q1.h"
+
+/* Serve one debugger connection on localhost:port, or on stdin and
+ * stdout if port is "-", until it detaches or disconnects. Returns 0
+ * on success. */
+int RunGdbServer(q1_cpu_t *cpu, const char *port);
+
+#endif /* Q1GDB_H */
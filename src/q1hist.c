@@ -0,0 +1,442 @@
+/* Q1 simulator library: execution history.
+ *
+ * A checkpoint is taken every interval instructions. Each holds the
+ * registers and counters and the pages written since the checkpoint
+ * before it; the first holds all of memory. The checkpoints holding a
+ * page are listed in order, so memory at any checkpoint is rebuilt
+ * with a binary search per page. A machine is moved to any step by
+ * rebuilding the checkpoint at or before it and running forward from
+ * there, which takes fewer than interval instructions.
+ *
+ * Each saved page also has a bitmap of the bytes stored to in the
+ * interval before its checkpoint, so the last write to an address is
+ * found by replaying only the interval that made it.
+ */
+
+#include "q1cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_INTERVAL   4096
+
+typedef struct {
+   unsigned char rega, regb, regc;
+   unsigned char z_flag, c_flag, n_flag;
+   unsigned char regxh, regxl;
+   unsigned short preg;
+   unsigned char halted;
+   unsigned char faulted;
+   unsigned long long clocks;
+} CheckpointType;
+
+/* A page as it was at a checkpoint. */
+typedef struct {
+   unsigned int checkpoint;
+   size_t offset;             /* Offset of the contents in data. */
+   unsigned char written[32]; /* Bytes stored to since the last one. */
+} VersionType;
+
+typedef struct {
+   VersionType *versions;
+   unsigned int count;
+   unsigned int max;
+} PageType;
+
+struct q1_history {
+
+   unsigned int interval;
+
+   /* Checkpoint n is at step first + n * interval. */
+   unsigned long long first;
+   CheckpointType *checkpoints;
+   unsigned int count;
+   unsigned int max;
+
+   PageType pages[256];
+   unsigned char *data;
+   size_t data_size;
+   size_t data_max;
+
+   unsigned long long end;    /* Last step that can be reached. */
+   int failed;                /* Out of memory; end no longer grows. */
+
+   /* The checkpoint the machine last passed and the pages and bytes
+    * written since then. */
+   unsigned int current;
+   unsigned char dirty[256];
+   unsigned char written[256][32];
+
+   /* Last store to watch while searching, if watching. */
+   int watching;
+   unsigned short watch;
+   int found;
+   unsigned long long found_step;
+
+};
+
+static void Clear(q1_history_t *hist);
+static void ClearDirty(q1_history_t *hist);
+static int AddCheckpoint(q1_history_t *hist, q1_cpu_t *cpu);
+static int AddVersion(q1_history_t *hist, unsigned int page,
+                      const unsigned char *memory);
+static unsigned int FindVersion(const PageType *pp, unsigned int index);
+static int WasWritten(const VersionType *vp, unsigned short addr);
+static void Restore(q1_cpu_t *cpu, q1_history_t *hist, unsigned int index);
+static void Replay(q1_cpu_t *cpu, unsigned long long step);
+
+q1_history_t *q1_history_create(unsigned int interval) {
+   q1_history_t *hist = malloc(sizeof(q1_history_t));
+   if(hist) {
+      memset(hist, 0, sizeof(q1_history_t));
+      hist->interval = interval ? interval : DEFAULT_INTERVAL;
+   }
+   return hist;
+}
+
+void q1_history_destroy(q1_history_t *hist) {
+   if(hist) {
+      Clear(hist);
+      free(hist);
+   }
+}
+
+void q1_set_history(q1_cpu_t *cpu, q1_history_t *hist) {
+   cpu->history = hist;
+   if(hist) {
+      Clear(hist);
+      hist->first = cpu->steps;
+      hist->end = cpu->steps;
+      if(!AddCheckpoint(hist, cpu)) {
+         cpu->history = NULL;
+      }
+   }
+}
+
+void q1_history_range(const q1_history_t *hist, unsigned long long *first,
+                      unsigned long long *end) {
+   *first = hist->first;
+   *end = hist->end;
+}
+
+int q1_history_seek(q1_cpu_t *cpu, unsigned long long step) {
+
+   q1_history_t *hist = cpu->history;
+   unsigned long long index;
+
+   if(hist == NULL || step < hist->first || step > hist->end) {
+      return 0;
+   }
+
+   /* Run forward if the target is ahead in the same interval. */
+   index = (step - hist->first) / hist->interval;
+   if(index >= hist->count) {
+      index = hist->count - 1;
+   }
+   if(cpu->steps > step
+      || cpu->steps < hist->first + index * hist->interval) {
+      Restore(cpu, hist, (unsigned int)index);
+   }
+   Replay(cpu, step);
+   return 1;
+
+}
+
+int q1_history_last_write(q1_cpu_t *cpu, unsigned short addr,
+                          unsigned long long *step) {
+
+   q1_history_t *hist = cpu->history;
+   const PageType *pp;
+   const VersionType *vp;
+   const unsigned long long start = cpu->steps;
+   unsigned int index;
+   unsigned int version;
+
+   if(hist == NULL || start <= hist->first || start > hist->end) {
+      return 0;
+   }
+
+   hist->watching = 1;
+   hist->watch = addr;
+   hist->found = 0;
+
+   /* The interval holding the machine is replayed up to where it is.
+    * Of the earlier intervals only the last that stored to addr is
+    * replayed. Version 0 holds the first checkpoint, which has no
+    * interval before it. */
+   index = (unsigned int)((start - 1 - hist->first) / hist->interval);
+   Restore(cpu, hist, index);
+   Replay(cpu, start);
+   pp = &hist->pages[addr >> 8];
+   version = FindVersion(pp, index);
+   for(; !hist->found && version > 0; version--) {
+      vp = &pp->versions[version];
+      if(WasWritten(vp, addr)) {
+         index = vp->checkpoint - 1;
+         Restore(cpu, hist, index);
+         Replay(cpu, hist->first + (index + 1ULL) * hist->interval);
+      }
+   }
+   hist->watching = 0;
+
+   q1_history_seek(cpu, hist->found ? hist->found_step : start);
+   if(hist->found) {
+      *step = hist->found_step;
+   }
+   return hist->found;
+
+}
+
+void Q1HistoryRecord(q1_cpu_t *cpu) {
+
+   q1_history_t *hist = cpu->history;
+   unsigned int addr;
+   unsigned long long next;
+
+   switch(cpu->opcode) {
+   case 0x14: case 0x15: case 0x16: case 0x17: case 0x18:
+      addr = cpu->operand;
+      break;
+   case 0x32: case 0x33: case 0x34:
+      addr = (cpu->regxh << 8) | cpu->regxl;
+      break;
+   default:
+      addr = 1 << 16;
+      break;
+   }
+   if(addr < (1 << 16)) {
+      hist->dirty[addr >> 8] = 1;
+      hist->written[addr >> 8][(addr >> 3) & 31] |= 1 << (addr & 7);
+      if(hist->watching && addr == hist->watch) {
+         hist->found = 1;
+         hist->found_step = cpu->steps - 1;
+      }
+   }
+
+   if(hist->failed) {
+      return;
+   }
+   if(cpu->steps > hist->end) {
+      hist->end = cpu->steps;
+   }
+   next = hist->first + (hist->current + 1ULL) * hist->interval;
+   if(cpu->steps == next) {
+      if(hist->current + 1 == hist->count && !AddCheckpoint(hist, cpu)) {
+         hist->failed = 1;
+         return;
+      }
+      ++hist->current;
+      ClearDirty(hist);
+   }
+
+}
+
+/* Release all checkpoints. */
+void Clear(q1_history_t *hist) {
+   unsigned int page;
+   for(page = 0; page < 256; page++) {
+      free(hist->pages[page].versions);
+      hist->pages[page].versions = NULL;
+      hist->pages[page].count = 0;
+      hist->pages[page].max = 0;
+   }
+   free(hist->checkpoints);
+   free(hist->data);
+   hist->checkpoints = NULL;
+   hist->count = 0;
+   hist->max = 0;
+   hist->data = NULL;
+   hist->data_size = 0;
+   hist->data_max = 0;
+   hist->failed = 0;
+   hist->current = 0;
+   hist->watching = 0;
+   memset(hist->dirty, 0, sizeof(hist->dirty));
+   memset(hist->written, 0, sizeof(hist->written));
+}
+
+/* Forget the pages and bytes written since the last checkpoint. */
+void ClearDirty(q1_history_t *hist) {
+   unsigned int page;
+   for(page = 0; page < 256; page++) {
+      if(hist->dirty[page]) {
+         memset(hist->written[page], 0, sizeof(hist->written[page]));
+         hist->dirty[page] = 0;
+      }
+   }
+}
+
+/* Add a checkpoint with the pages written since the last one, or all
+ * pages if it is the first. Returns 0 if out of memory. */
+int AddCheckpoint(q1_history_t *hist, q1_cpu_t *cpu) {
+
+   CheckpointType *cp;
+   unsigned int page;
+   unsigned int max;
+
+   if(hist->count == hist->max) {
+      max = hist->max ? hist->max * 2 : 64;
+      cp = realloc(hist->checkpoints, max * sizeof(CheckpointType));
+      if(cp == NULL) {
+         return 0;
+      }
+      hist->checkpoints = cp;
+      hist->max = max;
+   }
+
+   for(page = 0; page < 256; page++) {
+      if((hist->count == 0 || hist->dirty[page])
+         && !AddVersion(hist, page, cpu->memory)) {
+         return 0;
+      }
+   }
+
+   cp = &hist->checkpoints[hist->count++];
+   cp->rega = cpu->rega;
+   cp->regb = cpu->regb;
+   cp->regc = cpu->regc;
+   cp->z_flag = cpu->z_flag;
+   cp->c_flag = cpu->c_flag;
+   cp->n_flag = cpu->n_flag;
+   cp->regxh = cpu->regxh;
+   cp->regxl = cpu->regxl;
+   cp->preg = cpu->preg;
+   cp->halted = cpu->halted;
+   cp->faulted = cpu->faulted;
+   cp->clocks = cpu->clocks;
+   return 1;
+
+}
+
+/* Save a page for the checkpoint being added. Returns 0 if out of
+ * memory. */
+int AddVersion(q1_history_t *hist, unsigned int page,
+               const unsigned char *memory) {
+
+   PageType *pp = &hist->pages[page];
+   VersionType *versions;
+   unsigned char *data;
+   unsigned int max;
+   size_t data_max;
+
+   if(pp->count == pp->max) {
+      max = pp->max ? pp->max * 2 : 4;
+      versions = realloc(pp->versions, max * sizeof(VersionType));
+      if(versions == NULL) {
+         return 0;
+      }
+      pp->versions = versions;
+      pp->max = max;
+   }
+   if(hist->data_size + 256 > hist->data_max) {
+      data_max = hist->data_max ? hist->data_max * 2 : (1 << 16);
+      data = realloc(hist->data, data_max);
+      if(data == NULL) {
+         return 0;
+      }
+      hist->data = data;
+      hist->data_max = data_max;
+   }
+
+   memcpy(&hist->data[hist->data_size], &memory[page << 8], 256);
+   pp->versions[pp->count].checkpoint = hist->count;
+   pp->versions[pp->count].offset = hist->data_size;
+   memcpy(pp->versions[pp->count].written, hist->written[page], 32);
+   ++pp->count;
+   hist->data_size += 256;
+   return 1;
+
+}
+
+/* Return the last version of a page at or before a checkpoint. Every
+ * page has a version at checkpoint 0. */
+unsigned int FindVersion(const PageType *pp, unsigned int index) {
+   unsigned int low = 0;
+   unsigned int high = pp->count - 1;
+   unsigned int mid;
+   while(low < high) {
+      mid = (low + high + 1) / 2;
+      if(pp->versions[mid].checkpoint <= index) {
+         low = mid;
+      } else {
+         high = mid - 1;
+      }
+   }
+   return low;
+}
+
+/* Check if a version's interval stored to addr. */
+int WasWritten(const VersionType *vp, unsigned short addr) {
+   return (vp->written[(addr >> 3) & 31] >> (addr & 7)) & 1;
+}
+
+/* Return a machine to a checkpoint. As with snapshots, translated code
+ * is kept unless a byte it covers changed. */
+void Restore(q1_cpu_t *cpu, q1_history_t *hist, unsigned int index) {
+
+   const CheckpointType *cp = &hist->checkpoints[index];
+   const PageType *pp;
+   const unsigned char *data;
+   unsigned int page;
+   unsigned int start;
+   unsigned int x;
+
+   cpu->rega = cp->rega;
+   cpu->regb = cp->regb;
+   cpu->regc = cp->regc;
+   cpu->z_flag = cp->z_flag;
+   cpu->c_flag = cp->c_flag;
+   cpu->n_flag = cp->n_flag;
+   cpu->regxh = cp->regxh;
+   cpu->regxl = cp->regxl;
+   cpu->preg = cp->preg;
+   cpu->halted = cp->halted;
+   cpu->faulted = cp->faulted;
+   cpu->clocks = cp->clocks;
+   cpu->steps = hist->first + (unsigned long long)index * hist->interval;
+
+   for(page = 0; page < 256; page++) {
+      pp = &hist->pages[page];
+      data = &hist->data[pp->versions[FindVersion(pp, index)].offset];
+      start = page << 8;
+      if(!memcmp(&cpu->memory[start], data, 256)) {
+         continue;
+      }
+      cpu->pages[page] = 1;
+      if(cpu->decoded) {
+         for(x = 0; x < 256; x++) {
+            if(cpu->memory[start + x] != data[x]) {
+               cpu->memory[start + x] = data[x];
+               Q1InvalidateCode(cpu, start + x);
+            }
+         }
+      } else {
+         memcpy(&cpu->memory[start], data, 256);
+      }
+   }
+
+   hist->current = index;
+   ClearDirty(hist);
+
+}
+
+/* Run forward to a step, which was reached before, without recording
+ * it in a profile or trace or stopping at breakpoints. */
+void Replay(q1_cpu_t *cpu, unsigned long long step) {
+
+   q1_profile_t *profile = cpu->profile;
+   q1_trace_t *trace = cpu->trace;
+   const unsigned int break_count = cpu->break_count;
+   const unsigned int watch_count = cpu->watch_count;
+
+   cpu->profile = NULL;
+   cpu->trace = NULL;
+   cpu->break_count = 0;
+   cpu->watch_count = 0;
+   while(cpu->steps < step && q1_run(cpu, step - cpu->steps) != Q1_HALTED);
+   cpu->profile = profile;
+   cpu->trace = trace;
+   cpu->break_count = break_count;
+   cpu->watch_count = watch_count;
+
+}
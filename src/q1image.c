@@ -0,0 +1,576 @@
+/* Program images for q1sim.
+ *
+ * Raw images are mapped and used in place. Other formats are mapped,
+ * parsed into a 64 KiB buffer and trimmed to the addresses they set.
+ * The cache is not locked, so images must be loaded before worker
+ * threads start; after that they are only read.
+ */
+
+#include "q1image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_IMAGE    0xFFFF
+
+/* Columns of the bytes on a listing line: "AAAA BB BB BB    source". */
+#define LIST_BYTES   5
+#define LIST_SOURCE  20
+
+/* Segment files; see asmq1. */
+#define SEG_MAGIC    "Q1SG"
+#define SEG_VERSION  1
+#define SEG_HEADER   12
+
+static const char *FORMAT_NAMES[] = {
+   "auto", "raw", "hex", "list", "ihex", "seg"
+};
+
+static ImageType *images;
+static unsigned int image_count;
+
+static int ReadFile(ImageType *ip);
+static int ParseHex(ImageType *ip, const char *text, size_t size);
+static int ParseList(ImageType *ip, const char *text, size_t size);
+static int ParseIntelHex(ImageType *ip, const char *text, size_t size);
+static int ParseSegments(ImageType *ip, const unsigned char *data,
+                         size_t size);
+static void SetRange(ImageType *ip, unsigned int first, unsigned int last);
+static unsigned int GetNumber(const unsigned char *data, unsigned int bytes);
+static int HexDigit(char ch);
+static FormatType GuessFormat(const char *name);
+
+int FindFormat(const char *name, FormatType *format) {
+   int x;
+   for(x = FORMAT_AUTO; x <= FORMAT_SEG; x++) {
+      if(!strcmp(name, FORMAT_NAMES[x])) {
+         *format = (FormatType)x;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+int LoadImage(const char *name, FormatType format) {
+
+   ImageType *ip;
+   const char *text;
+   size_t size;
+   unsigned int x;
+   int rc;
+
+   if(format == FORMAT_AUTO) {
+      format = GuessFormat(name);
+   }
+   for(x = 0; x < image_count; x++) {
+      if(images[x].format == format && !strcmp(images[x].name, name)) {
+         return (int)x;
+      }
+   }
+
+   if((image_count & (image_count - 1)) == 0) {
+      ip = realloc(images, (image_count ? image_count * 2 : 1)
+                   * sizeof(ImageType));
+      if(ip == NULL) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         return -1;
+      }
+      images = ip;
+   }
+
+   ip = &images[image_count];
+   memset(ip, 0, sizeof(ImageType));
+   ip->name = strdup(name);
+   ip->format = format;
+   if(ip->name == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return -1;
+   }
+   if(!ReadFile(ip)) {
+      free(ip->name);
+      return -1;
+   }
+
+   if(format == FORMAT_RAW) {
+      if(ip->size > MAX_IMAGE) {
+         fprintf(stderr, "WARN: input file too large: %s\n", name);
+         ip->size = MAX_IMAGE;
+      }
+      return (int)image_count++;
+   }
+
+   /* Parse the text, then drop it. */
+   text = (const char*)ip->data;
+   size = ip->size;
+   ip->data = NULL;
+   ip->size = 0;
+   ip->buffer = malloc(1 << 16);
+   if(ip->buffer == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      rc = 0;
+   } else if(format == FORMAT_HEX) {
+      rc = ParseHex(ip, text, size);
+   } else if(format == FORMAT_IHEX) {
+      rc = ParseIntelHex(ip, text, size);
+   } else if(format == FORMAT_SEG) {
+      rc = ParseSegments(ip, (const unsigned char*)text, size);
+   } else {
+      rc = ParseList(ip, text, size);
+   }
+   if(ip->map) {
+      munmap(ip->map, ip->map_size);
+      ip->map = NULL;
+   } else {
+      free((void*)text);
+   }
+   if(!rc) {
+      free(ip->buffer);
+      free(ip->name);
+      return -1;
+   }
+
+   return (int)image_count++;
+
+}
+
+const ImageType *GetImage(int index) {
+   return &images[index];
+}
+
+void FreeImages() {
+   unsigned int x;
+   for(x = 0; x < image_count; x++) {
+      if(images[x].map) {
+         munmap(images[x].map, images[x].map_size);
+      }
+      free(images[x].buffer);
+      free(images[x].name);
+   }
+   free(images);
+   images = NULL;
+   image_count = 0;
+}
+
+/* Map a file, or read it in one piece if it cannot be mapped.
+ * Sets data and size. */
+int ReadFile(ImageType *ip) {
+
+   struct stat st;
+   unsigned char *buffer;
+   unsigned char *temp;
+   size_t max_size;
+   ssize_t count;
+   int fd;
+
+   fd = open(ip->name, O_RDONLY);
+   if(fd < 0) {
+      fprintf(stderr, "ERROR: could not open %s\n", ip->name);
+      return 0;
+   }
+
+   if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      ip->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(ip->map != MAP_FAILED) {
+         ip->map_size = st.st_size;
+         ip->data = ip->map;
+         ip->size = st.st_size;
+         close(fd);
+         return 1;
+      }
+      ip->map = NULL;
+   }
+
+   /* Pipes and devices. */
+   max_size = 1 << 16;
+   buffer = malloc(max_size);
+   ip->size = 0;
+   count = 0;
+   while(buffer != NULL) {
+      count = read(fd, buffer + ip->size, max_size - ip->size);
+      if(count <= 0) {
+         break;
+      }
+      ip->size += count;
+      if(ip->size == max_size) {
+         max_size *= 2;
+         temp = realloc(buffer, max_size);
+         if(temp == NULL) {
+            free(buffer);
+         }
+         buffer = temp;
+      }
+   }
+   close(fd);
+   if(buffer == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return 0;
+   }
+   if(count < 0) {
+      fprintf(stderr, "ERROR: could not read %s\n", ip->name);
+      free(buffer);
+      return 0;
+   }
+
+   /* Raw images keep the buffer; text is freed after parsing. */
+   if(ip->format == FORMAT_RAW) {
+      ip->buffer = buffer;
+   }
+   ip->data = buffer;
+   return 1;
+
+}
+
+/* Parse asmq1 hex output: one byte per line starting at address 0. */
+int ParseHex(ImageType *ip, const char *text, size_t size) {
+
+   const char *end = text + size;
+   unsigned int line_number;
+   unsigned int value;
+   unsigned int digits;
+   int digit;
+
+   line_number = 0;
+   while(text < end) {
+      ++line_number;
+      while(text < end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+         ++text;
+      }
+      value = 0;
+      digits = 0;
+      while(text < end && (digit = HexDigit(*text)) >= 0) {
+         value = (value << 4) | digit;
+         ++digits;
+         ++text;
+      }
+      while(text < end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+         ++text;
+      }
+      if((text < end && *text != '\n') || digits > 2) {
+         fprintf(stderr, "ERROR: %s:%u: invalid hex byte\n",
+            ip->name, line_number);
+         return 0;
+      }
+      ++text;
+      if(digits == 0) {
+         continue;
+      }
+      if(ip->size == MAX_IMAGE) {
+         fprintf(stderr, "WARN: input file too large: %s\n", ip->name);
+         break;
+      }
+      ip->buffer[ip->size++] = (unsigned char)value;
+   }
+
+   ip->data = ip->buffer;
+   return 1;
+
+}
+
+/* Parse an asmq1 listing, loading each byte at its listed address.
+ * Lines that do not start with an address hold source text only. */
+int ParseList(ImageType *ip, const char *text, size_t size) {
+
+   const char *end = text + size;
+   const char *line;
+   size_t len;
+   unsigned int first, last;
+   unsigned int addr;
+   unsigned int col;
+   int hi, lo;
+   int x;
+
+   memset(ip->buffer, 0xFF, 1 << 16);
+   first = 1 << 16;
+   last = 0;
+   while(text < end) {
+
+      line = text;
+      while(text < end && *text != '\n') {
+         ++text;
+      }
+      len = text - line;
+      ++text;
+
+      if(len < LIST_BYTES || line[4] != ' ') {
+         continue;
+      }
+      addr = 0;
+      for(x = 0; x < 4; x++) {
+         hi = HexDigit(line[x]);
+         if(hi < 0) {
+            break;
+         }
+         addr = (addr << 4) | hi;
+      }
+      if(x < 4) {
+         continue;
+      }
+
+      /* Bytes are two digits separated by spaces. */
+      col = LIST_BYTES;
+      for(;;) {
+         while(col < LIST_SOURCE && col < len && line[col] == ' ') {
+            ++col;
+         }
+         if(col + 2 > LIST_SOURCE || col + 2 > len) {
+            break;
+         }
+         hi = HexDigit(line[col]);
+         lo = HexDigit(line[col + 1]);
+         if(hi < 0 || lo < 0 || (col + 2 < len && line[col + 2] != ' ')) {
+            break;
+         }
+         if(addr >= (1 << 16)) {
+            fprintf(stderr, "WARN: input file too large: %s\n", ip->name);
+            break;
+         }
+         ip->buffer[addr] = (unsigned char)((hi << 4) | lo);
+         first = addr < first ? addr : first;
+         last = addr > last ? addr : last;
+         ++addr;
+         col += 2;
+      }
+
+   }
+
+   SetRange(ip, first, last);
+   return 1;
+
+}
+
+/* Parse Intel HEX. Only data and end of file records set memory;
+ * start address records are ignored and extended addresses must be 0.
+ */
+int ParseIntelHex(ImageType *ip, const char *text, size_t size) {
+
+   const char *end = text + size;
+   unsigned char record[5 + 255];
+   unsigned int line_number;
+   unsigned int first, last;
+   unsigned int count;
+   unsigned int addr;
+   unsigned int sum;
+   unsigned int x;
+   int hi, lo;
+
+   memset(ip->buffer, 0xFF, 1 << 16);
+   first = 1 << 16;
+   last = 0;
+   line_number = 1;
+   while(text < end) {
+
+      while(text < end && (*text == '\r' || *text == '\n')) {
+         line_number += *text == '\n';
+         ++text;
+      }
+      if(text == end) {
+         break;
+      }
+
+      /* Decode the record: count, address (2), type, data, checksum. */
+      if(*text != ':') {
+         goto invalid;
+      }
+      ++text;
+      count = 5;
+      sum = 0;
+      for(x = 0; x < count; x++) {
+         if(end - text < 2) {
+            goto invalid;
+         }
+         hi = HexDigit(text[0]);
+         lo = HexDigit(text[1]);
+         if(hi < 0 || lo < 0) {
+            goto invalid;
+         }
+         record[x] = (unsigned char)((hi << 4) | lo);
+         sum += record[x];
+         text += 2;
+         if(x == 0) {
+            count += record[0];
+         }
+      }
+      if((sum & 0xFF) != 0) {
+         fprintf(stderr, "ERROR: %s:%u: checksum mismatch\n",
+            ip->name, line_number);
+         return 0;
+      }
+      while(text < end && *text != '\n') {
+         if(*text != '\r' && *text != ' ' && *text != '\t') {
+            goto invalid;
+         }
+         ++text;
+      }
+
+      count = record[0];
+      addr = (record[1] << 8) | record[2];
+      switch(record[3]) {
+      case 0x00:
+         if(addr + count > (1 << 16)) {
+            fprintf(stderr, "WARN: input file too large: %s\n", ip->name);
+            count = (1 << 16) - addr;
+         }
+         if(count > 0) {
+            memcpy(&ip->buffer[addr], &record[4], count);
+            first = addr < first ? addr : first;
+            last = addr + count - 1 > last ? addr + count - 1 : last;
+         }
+         break;
+      case 0x01:
+         SetRange(ip, first, last);
+         return 1;
+      case 0x02:
+      case 0x04:
+         for(x = 0; x < count; x++) {
+            if(record[4 + x] != 0) {
+               fprintf(stderr, "ERROR: %s:%u: address out of range\n",
+                  ip->name, line_number);
+               return 0;
+            }
+         }
+         break;
+      case 0x03:
+      case 0x05:
+         break;
+      default:
+         goto invalid;
+      }
+
+   }
+
+   SetRange(ip, first, last);
+   return 1;
+
+invalid:
+   fprintf(stderr, "ERROR: %s:%u: invalid Intel HEX record\n",
+      ip->name, line_number);
+   return 0;
+
+}
+
+/* Load the segments of an asmq1 segment file. The symbols are checked
+ * but not kept. */
+int ParseSegments(ImageType *ip, const unsigned char *data, size_t size) {
+
+   const unsigned char *end = data + size;
+   unsigned int first, last;
+   unsigned int segments;
+   unsigned int symbols;
+   unsigned int start;
+   unsigned int len;
+   unsigned int x;
+
+   if(size < SEG_HEADER || memcmp(data, SEG_MAGIC, 4)) {
+      fprintf(stderr, "ERROR: %s: not a segment file\n", ip->name);
+      return 0;
+   }
+   if(data[4] != SEG_VERSION) {
+      fprintf(stderr, "ERROR: %s: unsupported segment file version %u\n",
+         ip->name, data[4]);
+      return 0;
+   }
+   segments = GetNumber(&data[6], 2);
+   symbols = GetNumber(&data[8], 4);
+   data += SEG_HEADER;
+
+   memset(ip->buffer, 0xFF, 1 << 16);
+   first = 1 << 16;
+   last = 0;
+   for(x = 0; x < segments; x++) {
+      if(end - data < 6) {
+         goto truncated;
+      }
+      start = GetNumber(&data[0], 2);
+      len = GetNumber(&data[2], 4);
+      data += 6;
+      if((size_t)(end - data) < len) {
+         goto truncated;
+      }
+      if(start + len > (1 << 16)) {
+         fprintf(stderr, "WARN: input file too large: %s\n", ip->name);
+         memcpy(&ip->buffer[start], data, (1 << 16) - start);
+      } else {
+         memcpy(&ip->buffer[start], data, len);
+      }
+      data += len;
+      if(len > 0) {
+         first = start < first ? start : first;
+         last = start + len - 1 > last ? start + len - 1 : last;
+      }
+   }
+
+   for(x = 0; x < symbols; x++) {
+      if(end - data < 4) {
+         goto truncated;
+      }
+      len = GetNumber(&data[2], 2);
+      data += 4;
+      if((size_t)(end - data) < len) {
+         goto truncated;
+      }
+      data += len;
+   }
+
+   if(last > 0xFFFF) {
+      last = 0xFFFF;
+   }
+   SetRange(ip, first, last);
+   return 1;
+
+truncated:
+   fprintf(stderr, "ERROR: %s: truncated segment file\n", ip->name);
+   return 0;
+
+}
+
+/* Trim an image parsed into the buffer to the addresses it set. */
+void SetRange(ImageType *ip, unsigned int first, unsigned int last) {
+   if(first <= last) {
+      ip->start = (unsigned short)first;
+      ip->size = last - first + 1;
+   }
+   ip->data = ip->buffer + ip->start;
+}
+
+/* Read a little endian number. */
+unsigned int GetNumber(const unsigned char *data, unsigned int bytes) {
+   unsigned int result = 0;
+   while(bytes > 0) {
+      --bytes;
+      result = (result << 8) | data[bytes];
+   }
+   return result;
+}
+
+int HexDigit(char ch) {
+   if(ch >= '0' && ch <= '9') {
+      return ch - '0';
+   } else if(ch >= 'A' && ch <= 'F') {
+      return ch - 'A' + 10;
+   } else if(ch >= 'a' && ch <= 'f') {
+      return ch - 'a' + 10;
+   } else {
+      return -1;
+   }
+}
+
+/* Choose a format from the extension of a file name. */
+FormatType GuessFormat(const char *name) {
+   const char *ext = strrchr(name, '.');
+   if(ext != NULL && !strcmp(ext, ".hex")) {
+      return FORMAT_HEX;
+   } else if(ext != NULL && (!strcmp(ext, ".lst") || !strcmp(ext, ".list"))) {
+      return FORMAT_LIST;
+   } else if(ext != NULL && (!strcmp(ext, ".ihx") || !strcmp(ext, ".ihex"))) {
+      return FORMAT_IHEX;
+   } else if(ext != NULL && !strcmp(ext, ".seg")) {
+      return FORMAT_SEG;
+   } else {
+      return FORMAT_RAW;
+   }
+}
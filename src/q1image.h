@@ -0,0 +1,48 @@
+/* Program images for q1sim.
+ *
+ * Images are loaded once by name and shared, read-only, by every
+ * machine that runs them.
+ */
+
+#ifndef Q1IMAGE_H
+#define Q1IMAGE_H
+
+#include <stddef.h>
+
+typedef enum {
+   FORMAT_AUTO,      /* Choose from the file name extension. */
+   FORMAT_RAW,       /* asmq1 -raw: bytes starting at address 0. */
+   FORMAT_HEX,       /* asmq1 -hex: one byte per line. */
+   FORMAT_LIST,      /* asmq1 -list: bytes at the listed addresses. */
+   FORMAT_IHEX,      /* asmq1 -ihex: Intel HEX records. */
+   FORMAT_SEG        /* asmq1 -seg: binary segments and symbols. */
+} FormatType;
+
+/* Memory outside data is left in the power-on state (0xFF), including
+ * any gaps between the addresses in a listing or between segments. */
+typedef struct {
+   char *name;
+   FormatType format;
+   const unsigned char *data;
+   unsigned short start;      /* Load address of data[0]. */
+   size_t size;
+   void *map;                 /* Mapped file holding data, if any. */
+   size_t map_size;
+   unsigned char *buffer;     /* Allocated memory holding data, if any. */
+} ImageType;
+
+/* Look up a format by name ("auto", "raw", "hex", "list", "ihex" or
+ * "seg").
+ * Returns 0 if the name is unknown. */
+int FindFormat(const char *name, FormatType *format);
+
+/* Return the index of an image, loading it if it has not been loaded
+ * with this format before. Returns -1 on error. */
+int LoadImage(const char *name, FormatType format);
+
+const ImageType *GetImage(int index);
+
+/* Release all images. */
+void FreeImages();
+
+#endif /* Q1IMAGE_H */
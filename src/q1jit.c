@@ -0,0 +1,656 @@
+/* Q1 simulator library: x86-64 translation of hot blocks. */
+
+#include "q1cpu.h"
+
+#ifdef JIT_ENABLED
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* x86-64 code generation.
+ * Native blocks keep the Q1 state pinned in host registers:
+ *    r12d = A, r13d = B, r14d = C, r15d = X (XH:XL), ebx = flags
+ *    (bit 0 = C, bit 1 = Z, bit 2 = N, matching the J-class condition
+ *    bits), rbp = memory, r10 = code_map, r11 = jit_map, r8 = clocks,
+ *    r9 = remaining instruction budget and rdi = the JitContextType.
+ * Generated code never calls back into C, so every exit goes through
+ * the exit trampoline, which saves the state into the context and returns.
+ */
+#define JIT_SIZE        (16 << 20)
+#define JIT_BLOCK_MAX   8192
+#define JIT_THRESHOLD   8
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define REG_A  R12
+#define REG_B  R13
+#define REG_C  R14
+#define REG_X  R15
+
+typedef enum {
+   EXIT_BRANCH,      /* Next block is not compiled. */
+   EXIT_BUDGET,      /* Not enough budget for the next block. */
+   EXIT_STORE,       /* A store hit translated code. */
+   EXIT_HALT,        /* hlt executed. */
+   EXIT_INTERP       /* Next instruction must be interpreted. */
+} JitExitType;
+
+typedef struct {
+   unsigned char *memory;
+   unsigned char *code_map;
+   void **jit_map;
+   unsigned long long clocks;
+   unsigned long long budget;
+   unsigned int a, b, c, x, flags;
+   unsigned int pc;
+   unsigned int addr;
+   unsigned int reason;
+} JitContextType;
+
+#define CTX(field) ((int)offsetof(JitContextType, field))
+
+/* Dirty page flags relative to the memory pointer. */
+#define PAGES ((int)(offsetof(q1_cpu_t, pages) - offsetof(q1_cpu_t, memory)))
+
+/* Per-machine code buffer. */
+struct JitType {
+   unsigned char *buffer;
+   size_t used;
+   size_t base;
+   unsigned char *exit;
+   void (*enter)(JitContextType *ctx, void *code);
+   void *map[1 << 16];  /* Native code for the block at each address. */
+};
+
+static void Emit8(JitType *jp, unsigned char value) {
+   jp->buffer[jp->used++] = value;
+}
+
+static void Emit32(JitType *jp, unsigned int value) {
+   memcpy(&jp->buffer[jp->used], &value, 4);
+   jp->used += 4;
+}
+
+/* Emit an instruction with a register operand. */
+static void EmitRR(JitType *jp, int wide, const char *op, int reg, int rm) {
+   Emit8(jp, 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3));
+   while(*op) {
+      Emit8(jp, (unsigned char)*op++);
+   }
+   Emit8(jp, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Emit an instruction with a [base + index * (1 << scale) + disp]
+ * memory operand. index < 0 means no index. */
+static void EmitMem(JitType *jp, int wide, const char *op, int reg, int base,
+                    int index, int scale, int disp) {
+   const int x = index < 0 ? 0 : index >> 3;
+   Emit8(jp, 0x40 | (wide << 3) | ((reg >> 3) << 2) | (x << 1) | (base >> 3));
+   while(*op) {
+      Emit8(jp, (unsigned char)*op++);
+   }
+   if(index < 0) {
+      Emit8(jp, 0x80 | ((reg & 7) << 3) | (base & 7));
+      if((base & 7) == 4) {
+         Emit8(jp, 0x24);
+      }
+   } else {
+      Emit8(jp, 0x80 | ((reg & 7) << 3) | 4);
+      Emit8(jp, (scale << 6) | ((index & 7) << 3) | (base & 7));
+   }
+   Emit32(jp, (unsigned int)disp);
+}
+
+static void EmitMovImm(JitType *jp, int reg, unsigned int value) {
+   Emit8(jp, 0x40 | (reg >> 3));
+   Emit8(jp, 0xB8 + (reg & 7));
+   Emit32(jp, value);
+}
+
+/* Emit a jump or conditional jump (cc = 0x8x) with a rel32 to patch. */
+static size_t EmitJump(JitType *jp, unsigned char cc) {
+   if(cc) {
+      Emit8(jp, 0x0F);
+      Emit8(jp, cc);
+   } else {
+      Emit8(jp, 0xE9);
+   }
+   Emit32(jp, 0);
+   return jp->used - 4;
+}
+
+static void PatchJump(JitType *jp, size_t pos, size_t target) {
+   const int rel = (int)(target - (pos + 4));
+   memcpy(&jp->buffer[pos], &rel, 4);
+}
+
+static void EmitAddClocks(JitType *jp, unsigned int value) {
+   if(value) {
+      EmitRR(jp, 1, "\x81", 0, R8);
+      Emit32(jp, value);
+   }
+}
+
+/* Leave native code with eax = PC. */
+static void EmitExit(JitType *jp, JitExitType reason) {
+   EmitMem(jp, 0, "\xC7", 0, RDI, -1, 0, CTX(reason));
+   Emit32(jp, reason);
+   PatchJump(jp, EmitJump(jp, 0), jp->exit - jp->buffer);
+}
+
+/* Continue at a constant address, directly if it is compiled. */
+static void EmitBranch(JitType *jp, unsigned short target) {
+   EmitMem(jp, 1, "\x8B", RCX, R11, -1, 0, target * 8);
+   EmitRR(jp, 1, "\x85", RCX, RCX);
+   Emit8(jp, 0x74);                     /* jz +3 */
+   Emit8(jp, 0x03);
+   EmitRR(jp, 0, "\xFF", 4, RCX);       /* jmp rcx */
+   EmitMovImm(jp, RAX, target);
+   EmitExit(jp, EXIT_BRANCH);
+}
+
+/* Set A and the flags from eax (result) and edx (carry). */
+static void EmitResult(JitType *jp, int live_flags) {
+   EmitRR(jp, 0, "\x89", RAX, REG_A);
+   if(live_flags) {
+      EmitRR(jp, 0, "\x31", RCX, RCX);
+      EmitRR(jp, 0, "\x85", RAX, RAX);
+      EmitRR(jp, 0, "\x0F\x94", 0, RCX);         /* sete cl */
+      EmitMem(jp, 0, "\x8D", RDX, RDX, RCX, 1, 0);
+      EmitRR(jp, 0, "\xC1", 5, RAX);             /* shr eax, 7 */
+      Emit8(jp, 7);
+      EmitMem(jp, 0, "\x8D", RBX, RDX, RAX, 2, 0);
+   }
+}
+
+/* Split the result of a 9-bit operation in eax into eax and edx. */
+static void EmitCarry(JitType *jp, int bit) {
+   EmitRR(jp, 0, "\x89", RAX, RDX);
+   EmitRR(jp, 0, "\xC1", 5, RDX);
+   Emit8(jp, bit);
+   EmitRR(jp, 0, "\x0F\xB6", RAX, RAX);
+}
+
+/* Generate the entry and exit trampolines. */
+static void CompileTrampolines(JitType *jp) {
+
+   static const int SAVED[] = { RBX, RBP, R12, R13, R14, R15 };
+   int x;
+
+   jp->enter = (void (*)(JitContextType*, void*))jp->buffer;
+   for(x = 0; x < 6; x++) {
+      if(SAVED[x] >= 8) {
+         Emit8(jp, 0x41);
+      }
+      Emit8(jp, 0x50 + (SAVED[x] & 7));
+   }
+   EmitMem(jp, 0, "\x8B", REG_A, RDI, -1, 0, CTX(a));
+   EmitMem(jp, 0, "\x8B", REG_B, RDI, -1, 0, CTX(b));
+   EmitMem(jp, 0, "\x8B", REG_C, RDI, -1, 0, CTX(c));
+   EmitMem(jp, 0, "\x8B", REG_X, RDI, -1, 0, CTX(x));
+   EmitMem(jp, 0, "\x8B", RBX, RDI, -1, 0, CTX(flags));
+   EmitMem(jp, 1, "\x8B", RBP, RDI, -1, 0, CTX(memory));
+   EmitMem(jp, 1, "\x8B", R10, RDI, -1, 0, CTX(code_map));
+   EmitMem(jp, 1, "\x8B", R11, RDI, -1, 0, CTX(jit_map));
+   EmitMem(jp, 1, "\x8B", R8, RDI, -1, 0, CTX(clocks));
+   EmitMem(jp, 1, "\x8B", R9, RDI, -1, 0, CTX(budget));
+   EmitRR(jp, 0, "\xFF", 4, RSI);                /* jmp rsi */
+
+   jp->exit = &jp->buffer[jp->used];
+   EmitMem(jp, 0, "\x89", RAX, RDI, -1, 0, CTX(pc));
+   EmitMem(jp, 0, "\x89", REG_A, RDI, -1, 0, CTX(a));
+   EmitMem(jp, 0, "\x89", REG_B, RDI, -1, 0, CTX(b));
+   EmitMem(jp, 0, "\x89", REG_C, RDI, -1, 0, CTX(c));
+   EmitMem(jp, 0, "\x89", REG_X, RDI, -1, 0, CTX(x));
+   EmitMem(jp, 0, "\x89", RBX, RDI, -1, 0, CTX(flags));
+   EmitMem(jp, 1, "\x89", R8, RDI, -1, 0, CTX(clocks));
+   EmitMem(jp, 1, "\x89", R9, RDI, -1, 0, CTX(budget));
+   for(x = 5; x >= 0; x--) {
+      if(SAVED[x] >= 8) {
+         Emit8(jp, 0x41);
+      }
+      Emit8(jp, 0x58 + (SAVED[x] & 7));
+   }
+   Emit8(jp, 0xC3);
+
+   jp->base = jp->used;
+
+}
+
+/* Allocate the code buffer. Returns 0 if executable memory is not
+ * available. */
+static int JitInit(q1_cpu_t *cpu) {
+   JitType *jp;
+   void *buffer;
+   jp = malloc(sizeof(JitType));
+   if(jp == NULL) {
+      return 0;
+   }
+   buffer = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(buffer == MAP_FAILED) {
+      if(cpu->log) {
+         fprintf(cpu->log, "WARN: JIT unavailable, using block engine\n");
+      }
+      free(jp);
+      return 0;
+   }
+   jp->buffer = buffer;
+   jp->used = 0;
+   memset(jp->map, 0, sizeof(jp->map));
+   CompileTrampolines(jp);
+   cpu->jit = jp;
+   cpu->jit_map = jp->map;
+   return 1;
+}
+
+/* Discard all native code.
+ * Map entries are cleared along with their blocks in Q1FlushBlocks. */
+void Q1JitFlush(q1_cpu_t *cpu) {
+   JitType *jp = cpu->jit;
+   if(jp) {
+      jp->used = jp->base;
+   }
+}
+
+/* Release the code buffer. */
+void Q1JitFree(q1_cpu_t *cpu) {
+   JitType *jp = cpu->jit;
+   if(jp) {
+      munmap(jp->buffer, JIT_SIZE);
+      free(jp);
+      cpu->jit = NULL;
+      cpu->jit_map = NULL;
+   }
+}
+
+/* Compile a translated block to native code.
+ * Returns 0 if the code buffer was full, in which case all blocks have
+ * been flushed.
+ */
+static int CompileBlock(q1_cpu_t *cpu, BlockType *bp) {
+
+   JitType *jp = cpu->jit;
+   const MicroOpType *op;
+   size_t store_jumps[MAX_BLOCK_OPS];
+   size_t budget_jump;
+   size_t fall_jump;
+   unsigned char func;
+   unsigned char mask;
+   int live_flags[MAX_BLOCK_OPS];
+   int flags_needed;
+   int x;
+
+   if(jp->used + JIT_BLOCK_MAX > JIT_SIZE) {
+      Q1FlushBlocks(cpu);
+      return 0;
+   }
+
+   /* Flags are only observable at the end of the block or when a store
+    * leaves the block early, so only compute them there. */
+   flags_needed = 1;
+   for(x = bp->count - 1; x >= 0; x--) {
+      op = &bp->ops[x];
+      live_flags[x] = 0;
+      store_jumps[x] = 0;
+      switch(op->opcode >> 4) {
+      case 1:
+         if(op->opcode >= 0x14) {
+            flags_needed = 1;
+         }
+         break;
+      case 2:
+         live_flags[x] = flags_needed;
+         flags_needed = 0;
+         break;
+      case 3:
+         if(op->opcode >= 0x32 && op->opcode <= 0x34) {
+            flags_needed = 1;
+         }
+         break;
+      default:
+         break;
+      }
+   }
+
+   bp->native = &jp->buffer[jp->used];
+
+   /* Check the budget. */
+   EmitRR(jp, 1, "\x81", 5, R9);                 /* sub r9, count */
+   Emit32(jp, bp->count);
+   budget_jump = EmitJump(jp, 0x82);             /* jc */
+
+   for(x = 0; x < bp->count; x++) {
+      op = &bp->ops[x];
+      func = op->opcode & 0x0F;
+      switch(op->opcode) {
+      case 0x00: case 0x01: case 0x02: case 0x03:
+      case 0x04: case 0x05: case 0x06: case 0x07:
+      case 0x08: case 0x09: case 0x0A: case 0x0B:
+      case 0x0C: case 0x0D: case 0x0E: case 0x0F:
+         EmitAddClocks(jp, op->clocks);
+         mask = func & 7;
+         fall_jump = 0;
+         if(mask) {
+            EmitRR(jp, 0, "\x89", RBX, RAX);
+            EmitRR(jp, 0, "\x83", 4, RAX);       /* and eax, mask */
+            Emit8(jp, mask);
+            EmitRR(jp, 0, "\x83", 7, RAX);       /* cmp eax, mask */
+            Emit8(jp, mask);
+            fall_jump = EmitJump(jp, 0x85);      /* jne */
+         }
+         if(func & 8) {
+            EmitMovImm(jp, REG_X, op->next);
+         }
+         EmitBranch(jp, op->operand);
+         if(fall_jump) {
+            PatchJump(jp, fall_jump, jp->used);
+            EmitBranch(jp, op->next);
+         }
+         break;
+      case 0x10:  /* ldb */
+         EmitMem(jp, 0, "\x0F\xB6", REG_B, RBP, -1, 0, op->operand);
+         break;
+      case 0x11:  /* ldc */
+         EmitMem(jp, 0, "\x0F\xB6", REG_C, RBP, -1, 0, op->operand);
+         break;
+      case 0x12:  /* lxh */
+         EmitMem(jp, 0, "\x0F\xB6", RAX, RBP, -1, 0, op->operand);
+         EmitRR(jp, 0, "\xC1", 4, RAX);          /* shl eax, 8 */
+         Emit8(jp, 8);
+         EmitRR(jp, 0, "\x0F\xB6", REG_X, REG_X);
+         EmitRR(jp, 0, "\x09", RAX, REG_X);
+         break;
+      case 0x13:  /* lxl */
+         EmitMem(jp, 0, "\x0F\xB6", RAX, RBP, -1, 0, op->operand);
+         EmitRR(jp, 0, "\x81", 4, REG_X);        /* and r15d, 0xFF00 */
+         Emit32(jp, 0xFF00);
+         EmitRR(jp, 0, "\x09", RAX, REG_X);
+         break;
+      case 0x14:  /* stb */
+      case 0x15:  /* stc */
+      case 0x16:  /* sxh */
+      case 0x17:  /* sxl */
+      case 0x18:  /* sta */
+         switch(op->opcode) {
+         case 0x14:  func = REG_B;  break;
+         case 0x15:  func = REG_C;  break;
+         case 0x17:  func = REG_X;  break;
+         case 0x18:  func = REG_A;  break;
+         default:
+            EmitRR(jp, 0, "\x89", REG_X, RAX);
+            EmitRR(jp, 0, "\xC1", 5, RAX);       /* shr eax, 8 */
+            Emit8(jp, 8);
+            func = RAX;
+            break;
+         }
+         EmitMem(jp, 0, "\x88", func, RBP, -1, 0, op->operand);
+         EmitMem(jp, 0, "\xC6", 0, RBP, -1, 0, PAGES + (op->operand >> 8));
+         Emit8(jp, 1);
+         EmitMem(jp, 0, "\x80", 7, R10, -1, 0, op->operand);
+         Emit8(jp, 0);
+         store_jumps[x] = EmitJump(jp, 0x85);
+         break;
+      case 0x20:  /* and */
+      case 0x21:  /* or */
+         EmitRR(jp, 0, "\x89", REG_B, RAX);
+         EmitRR(jp, 0, op->opcode == 0x20 ? "\x21" : "\x09", REG_C, RAX);
+         EmitRR(jp, 0, "\x31", RDX, RDX);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x22:  /* shl */
+         EmitRR(jp, 0, "\x89", REG_B, RAX);
+         EmitRR(jp, 0, "\x01", RAX, RAX);
+         EmitCarry(jp, 8);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x23:  /* shr */
+         EmitRR(jp, 0, "\x89", REG_B, RDX);
+         EmitRR(jp, 0, "\x83", 4, RDX);          /* and edx, 1 */
+         Emit8(jp, 1);
+         EmitRR(jp, 0, "\x89", REG_B, RAX);
+         EmitRR(jp, 0, "\xC1", 5, RAX);          /* shr eax, 1 */
+         Emit8(jp, 1);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x24:  /* add */
+         EmitRR(jp, 0, "\x89", REG_B, RAX);
+         EmitRR(jp, 0, "\x01", REG_C, RAX);
+         EmitCarry(jp, 8);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x25:  /* inc */
+         EmitMem(jp, 0, "\x8D", RAX, REG_B, -1, 0, 1);
+         EmitCarry(jp, 8);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x26:  /* dec */
+         EmitMem(jp, 0, "\x8D", RAX, REG_B, -1, 0, -1);
+         EmitCarry(jp, 31);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x27:  /* not */
+         EmitRR(jp, 0, "\x89", REG_B, RAX);
+         EmitRR(jp, 0, "\x81", 6, RAX);          /* xor eax, 0xFF */
+         Emit32(jp, 0xFF);
+         EmitRR(jp, 0, "\x31", RDX, RDX);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x28:  /* clr */
+         EmitRR(jp, 0, "\x31", RAX, RAX);
+         EmitRR(jp, 0, "\x31", RDX, RDX);
+         EmitResult(jp, live_flags[x]);
+         break;
+      case 0x30:  /* mab */
+         EmitRR(jp, 0, "\x89", REG_A, REG_B);
+         break;
+      case 0x31:  /* mac */
+         EmitRR(jp, 0, "\x89", REG_A, REG_C);
+         break;
+      case 0x32:  /* sax */
+      case 0x33:  /* sbx */
+      case 0x34:  /* scx */
+         func = op->opcode == 0x32 ? REG_A
+              : op->opcode == 0x33 ? REG_B : REG_C;
+         EmitMem(jp, 0, "\x88", func, RBP, REG_X, 0, 0);
+         EmitRR(jp, 0, "\x89", REG_X, RAX);
+         EmitRR(jp, 0, "\xC1", 5, RAX);          /* shr eax, 8 */
+         Emit8(jp, 8);
+         EmitMem(jp, 0, "\xC6", 0, RBP, RAX, 0, PAGES);
+         Emit8(jp, 1);
+         EmitMem(jp, 0, "\x80", 7, R10, REG_X, 0, 0);
+         Emit8(jp, 0);
+         store_jumps[x] = EmitJump(jp, 0x85);
+         break;
+      case 0x35:  /* lbx */
+         EmitMem(jp, 0, "\x0F\xB6", REG_B, RBP, REG_X, 0, 0);
+         break;
+      case 0x36:  /* lcx */
+         EmitMem(jp, 0, "\x0F\xB6", REG_C, RBP, REG_X, 0, 0);
+         break;
+      case 0x37:  /* ret */
+         EmitAddClocks(jp, op->clocks);
+         EmitRR(jp, 0, "\x89", REG_X, RAX);
+         EmitMem(jp, 1, "\x8B", RCX, R11, RAX, 3, 0);
+         EmitRR(jp, 1, "\x85", RCX, RCX);
+         Emit8(jp, 0x74);                        /* jz +3 */
+         Emit8(jp, 0x03);
+         EmitRR(jp, 0, "\xFF", 4, RCX);          /* jmp rcx */
+         EmitExit(jp, EXIT_BRANCH);
+         break;
+      case 0x38:  /* hlt */
+         EmitAddClocks(jp, op->clocks);
+         EmitMovImm(jp, RAX, op->next);
+         EmitExit(jp, EXIT_HALT);
+         break;
+      default:
+         /* Let the interpreter report the invalid instruction. */
+         EmitAddClocks(jp, x > 0 ? bp->ops[x - 1].clocks : 0);
+         EmitRR(jp, 1, "\x83", 0, R9);           /* add r9, 1 */
+         Emit8(jp, 1);
+         EmitMovImm(jp, RAX, x > 0 ? bp->ops[x - 1].next : bp->start);
+         EmitExit(jp, EXIT_INTERP);
+         break;
+      }
+   }
+
+   /* Block ended without a control transfer. */
+   op = &bp->ops[bp->count - 1];
+   switch(op->opcode >> 4) {
+   case 0:
+      break;
+   case 3:
+      if(op->opcode >= 0x37) {
+         break;
+      }
+      /* Fall through */
+   case 1:
+   case 2:
+      EmitAddClocks(jp, op->clocks);
+      EmitBranch(jp, op->next);
+      break;
+   default:
+      break;
+   }
+
+   /* Out-of-line exits. */
+   PatchJump(jp, budget_jump, jp->used);
+   EmitRR(jp, 1, "\x81", 0, R9);                 /* add r9, count */
+   Emit32(jp, bp->count);
+   EmitMovImm(jp, RAX, bp->start);
+   EmitExit(jp, EXIT_BUDGET);
+   for(x = 0; x < bp->count; x++) {
+      if(store_jumps[x]) {
+         op = &bp->ops[x];
+         PatchJump(jp, store_jumps[x], jp->used);
+         EmitAddClocks(jp, op->clocks);
+         if(x + 1 < bp->count) {
+            EmitRR(jp, 1, "\x81", 0, R9);
+            Emit32(jp, bp->count - x - 1);
+         }
+         if(op->opcode >> 4 == 1) {
+            EmitMem(jp, 0, "\xC7", 0, RDI, -1, 0, CTX(addr));
+            Emit32(jp, op->operand);
+         } else {
+            EmitMem(jp, 0, "\x89", REG_X, RDI, -1, 0, CTX(addr));
+         }
+         EmitMovImm(jp, RAX, op->next);
+         EmitExit(jp, EXIT_STORE);
+      }
+   }
+
+   jp->map[bp->start] = bp->native;
+   return 1;
+
+}
+
+/* Run up to count instructions, compiling hot blocks to native code. */
+void Q1RunJit(q1_cpu_t *cpu, unsigned long long count) {
+
+   JitContextType ctx;
+   BlockType *bp;
+   unsigned long long start;
+
+   if(cpu->jit == NULL && !JitInit(cpu)) {
+      Q1RunBlocks(cpu, count);
+      return;
+   }
+
+   ctx.memory = cpu->memory;
+   ctx.code_map = cpu->cache->code_map;
+   ctx.jit_map = cpu->jit_map;
+   while(count) {
+
+      if(AT_BREAK(cpu)) {
+         return;
+      }
+      bp = cpu->cache->block_map[cpu->preg];
+      if(bp == NULL) {
+         bp = Q1TranslateBlock(cpu, cpu->preg);
+      }
+      if(bp->count > count) {
+         Q1RunInterp(cpu, count);
+         return;
+      }
+
+      /* Blocks at breakpoints are never compiled, so native code always
+       * leaves through the dispatcher before reaching one. */
+      if(bp->native == NULL) {
+         if(++bp->hits >= JIT_THRESHOLD && !(cpu->break_count
+               && (cpu->breaks[bp->start] & Q1_BREAK_EXEC))) {
+            CompileBlock(cpu, bp);
+         } else {
+            start = cpu->steps;
+            Q1RunBlocks(cpu, bp->count);
+            count -= cpu->steps - start;
+            if(cpu->halted | cpu->faulted) {
+               return;
+            }
+         }
+         continue;
+      }
+
+      ctx.a = cpu->rega;
+      ctx.b = cpu->regb;
+      ctx.c = cpu->regc;
+      ctx.x = ((unsigned int)cpu->regxh << 8) | cpu->regxl;
+      ctx.flags = cpu->c_flag | (cpu->z_flag << 1) | (cpu->n_flag << 2);
+      ctx.clocks = cpu->clocks;
+      ctx.budget = count;
+      (cpu->jit->enter)(&ctx, bp->native);
+      cpu->rega = ctx.a;
+      cpu->regb = ctx.b;
+      cpu->regc = ctx.c;
+      cpu->regxh = ctx.x >> 8;
+      cpu->regxl = ctx.x & 0xFF;
+      cpu->c_flag = ctx.flags & 1;
+      cpu->z_flag = (ctx.flags >> 1) & 1;
+      cpu->n_flag = (ctx.flags >> 2) & 1;
+      cpu->clocks = ctx.clocks;
+      cpu->steps += count - ctx.budget;
+      count = ctx.budget;
+      cpu->preg = ctx.pc;
+
+      switch(ctx.reason) {
+      case EXIT_BUDGET:
+         if(!AT_BREAK(cpu)) {
+            Q1RunInterp(cpu, count);
+         }
+         return;
+      case EXIT_STORE:
+         Q1InvalidateCode(cpu, ctx.addr);
+         break;
+      case EXIT_HALT:
+         cpu->halted = 1;
+         return;
+      case EXIT_INTERP:
+         Q1RunInterp(cpu, 1);
+         --count;
+         if(cpu->halted | cpu->faulted) {
+            return;
+         }
+         break;
+      default:
+         break;
+      }
+
+   }
+
+}
+
+#endif /* JIT_ENABLED */
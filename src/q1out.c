@@ -0,0 +1,205 @@
+/* Output files written by asmq1 and ldq1. */
+
+#include "q1out.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static void WriteIntelHex(OutputType *out, const OutputImageType *image,
+                          unsigned int start, unsigned int size);
+static void WriteSegments(OutputType *out, const OutputImageType *image);
+static void WriteSymbols(OutputType *out, const OutputImageType *image);
+static void FlushOutput(OutputType *out);
+static void WriteAll(OutputType *out, const void *data, size_t len);
+
+int OpenOutput(OutputType *out, const char *name) {
+   out->name = name;
+   out->used = 0;
+   out->failed = 0;
+   out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   return out->fd >= 0;
+}
+
+int CloseOutput(OutputType *out) {
+   FlushOutput(out);
+   if(close(out->fd) != 0) {
+      out->failed = 1;
+   }
+   out->fd = -1;
+   return !out->failed;
+}
+
+void WriteImage(OutputType *out, const OutputImageType *image,
+                q1_asm_format_t format) {
+
+   unsigned int x;
+
+   switch(format) {
+   case Q1_ASM_RAW:
+      OutputBytes(out, image->data, image->end);
+      break;
+   case Q1_ASM_HEX:
+      for(x = 0; x < image->end; x++) {
+         OutputHex(out, image->data[x], 2);
+         OutputChar(out, '\n');
+      }
+      break;
+   case Q1_ASM_IHEX:
+      for(x = 0; x < image->segment_count; x++) {
+         WriteIntelHex(out, image, image->segments[x].start,
+                       image->segments[x].size);
+      }
+      OutputBytes(out, ":00000001FF\n", 12);
+      break;
+   case Q1_ASM_SEG:
+      WriteSegments(out, image);
+      break;
+   case Q1_ASM_SYMBOLS:
+      WriteSymbols(out, image);
+      break;
+   default:
+      break;
+   }
+
+}
+
+/* Write Intel HEX data records for part of the image. */
+void WriteIntelHex(OutputType *out, const OutputImageType *image,
+                   unsigned int start, unsigned int size) {
+
+   unsigned int addr;
+   unsigned int count;
+   unsigned int sum;
+   unsigned int x;
+
+   for(addr = start; addr < start + size; addr += count) {
+      count = start + size - addr;
+      count = count > IHEX_RECORD_SIZE ? IHEX_RECORD_SIZE : count;
+      sum = count + (addr >> 8) + addr;
+      OutputChar(out, ':');
+      OutputHex(out, count, 2);
+      OutputHex(out, addr, 4);
+      OutputHex(out, 0, 2);
+      for(x = 0; x < count; x++) {
+         OutputHex(out, image->data[addr + x], 2);
+         sum += image->data[addr + x];
+      }
+      OutputHex(out, -sum, 2);
+      OutputChar(out, '\n');
+   }
+
+}
+
+/* Write the image as a segment file with its symbols. */
+void WriteSegments(OutputType *out, const OutputImageType *image) {
+
+   const OutputSymbolType *sp;
+   unsigned int x;
+   size_t len;
+
+   OutputBytes(out, SEG_MAGIC, 4);
+   OutputNumber(out, SEG_VERSION, 1);
+   OutputNumber(out, 0, 1);
+   OutputNumber(out, image->segment_count, 2);
+   OutputNumber(out, image->symbol_count, 4);
+
+   for(x = 0; x < image->segment_count; x++) {
+      OutputNumber(out, image->segments[x].start, 2);
+      OutputNumber(out, image->segments[x].size, 4);
+      OutputBytes(out, &image->data[image->segments[x].start],
+                  image->segments[x].size);
+   }
+
+   for(x = 0; x < image->symbol_count; x++) {
+      sp = &image->symbols[x];
+      len = strlen(sp->name);
+      OutputNumber(out, sp->addr, 2);
+      OutputNumber(out, len, 2);
+      OutputBytes(out, sp->name, len);
+   }
+
+}
+
+/* Write the symbols of the image as text. */
+void WriteSymbols(OutputType *out, const OutputImageType *image) {
+
+   const OutputSymbolType *sp;
+   unsigned int x;
+
+   for(x = 0; x < image->symbol_count; x++) {
+      sp = &image->symbols[x];
+      OutputHex(out, sp->addr, 4);
+      OutputChar(out, ' ');
+      OutputBytes(out, sp->name, strlen(sp->name));
+      OutputChar(out, '\n');
+   }
+
+}
+
+void OutputBytes(OutputType *out, const void *data, size_t len) {
+   if(out->used + len > OUTPUT_BLOCK_SIZE) {
+      FlushOutput(out);
+   }
+   if(len >= OUTPUT_BLOCK_SIZE) {
+      WriteAll(out, data, len);
+   } else {
+      memcpy(&out->buffer[out->used], data, len);
+      out->used += len;
+   }
+}
+
+void OutputChar(OutputType *out, char ch) {
+   if(out->used == OUTPUT_BLOCK_SIZE) {
+      FlushOutput(out);
+   }
+   out->buffer[out->used++] = ch;
+}
+
+void OutputHex(OutputType *out, unsigned int value, unsigned int digits) {
+
+   static const char HEX_DIGITS[] = "0123456789ABCDEF";
+   char *ptr;
+
+   if(out->used + digits > OUTPUT_BLOCK_SIZE) {
+      FlushOutput(out);
+   }
+   ptr = &out->buffer[out->used];
+   out->used += digits;
+   while(digits > 0) {
+      --digits;
+      ptr[digits] = HEX_DIGITS[value & 0xF];
+      value >>= 4;
+   }
+
+}
+
+void OutputNumber(OutputType *out, unsigned int value, unsigned int bytes) {
+   while(bytes > 0) {
+      OutputChar(out, (char)value);
+      value >>= 8;
+      --bytes;
+   }
+}
+
+void FlushOutput(OutputType *out) {
+   WriteAll(out, out->buffer, out->used);
+   out->used = 0;
+}
+
+void WriteAll(OutputType *out, const void *data, size_t len) {
+
+   const char *ptr = data;
+   ssize_t count;
+
+   while(len > 0 && !out->failed) {
+      count = write(out->fd, ptr, len);
+      if(count < 0) {
+         out->failed = 1;
+      } else {
+         ptr += count;
+         len -= count;
+      }
+   }
+
+}
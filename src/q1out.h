@@ -0,0 +1,105 @@
+/* Output files written by asmq1 and ldq1.
+ *
+ * Output is collected in a buffer and written with write(2).
+ */
+
+#ifndef Q1OUT_H
+#define Q1OUT_H
+
+#include "q1asm.h"
+
+#include <stddef.h>
+
+#define IMAGE_SIZE         (1 << 16)
+#define OUTPUT_BLOCK_SIZE  (1 << 16)
+
+/* An output file. */
+typedef struct {
+   const char *name;
+   int fd;
+   size_t used;
+   int failed;
+   char buffer[OUTPUT_BLOCK_SIZE];
+} OutputType;
+
+/* A run of bytes at consecutive addresses. */
+typedef struct {
+   unsigned int start;
+   unsigned int size;
+} SegmentType;
+
+/* A label written to segment output. */
+typedef struct {
+   const char *name;
+   unsigned int addr;
+} OutputSymbolType;
+
+/* A program to write. Addresses that are not in a segment hold 0xFF,
+ * the power-on state of memory. */
+typedef struct {
+   const unsigned char *data;       /* IMAGE_SIZE bytes. */
+   unsigned int end;                /* One past the last address used. */
+   const SegmentType *segments;
+   unsigned int segment_count;
+   const OutputSymbolType *symbols;
+   unsigned int symbol_count;
+} OutputImageType;
+
+/* Data bytes per Intel HEX record. */
+#define IHEX_RECORD_SIZE   32
+
+/* Segment output: a header, the segments and the symbol table.
+ * Numbers are little endian.
+ *    header:  "Q1SG", version (1), 0, segment count (2), symbol count (4)
+ *    segment: load address (2), size (4), bytes
+ *    symbol:  address (2), name length (2), name
+ */
+#define SEG_MAGIC          "Q1SG"
+#define SEG_VERSION        1
+
+/* Relocatable objects from asmq1 -c, linked by ldq1.
+ * An object is one section that may be loaded at any address that is a
+ * multiple of its alignment. Numbers are little endian.
+ *    header:     "Q1OB", version (1), 0, segment count (2), section
+ *                size (4), alignment (4), symbol count (4),
+ *                relocation count (4)
+ *    segment:    offset (4), size (4), bytes
+ *    symbol:     defined (1), offset (4), name length (2), name
+ *    relocation: offset (4), kind (1), symbol (4), addend (4)
+ * Symbols that are not defined are external. A relocation adds the
+ * address of a symbol, or of the section if the symbol is OBJ_SECTION,
+ * to its addend and stores the low byte (OBJ_BYTE) or both bytes, high
+ * byte first (OBJ_WORD), at its offset.
+ */
+#define OBJ_MAGIC          "Q1OB"
+#define OBJ_VERSION        1
+#define OBJ_BYTE           1
+#define OBJ_WORD           2
+#define OBJ_SECTION        0xFFFFFFFFU
+
+/* Open a file for output. Returns 0 on error. */
+int OpenOutput(OutputType *out, const char *name);
+
+/* Flush and close an output file. Returns 0 if it could not be
+ * written. */
+int CloseOutput(OutputType *out);
+
+void OutputBytes(OutputType *out, const void *data, size_t len);
+void OutputChar(OutputType *out, char ch);
+
+/* Output a number as upper case hex digits. */
+void OutputHex(OutputType *out, unsigned int value, unsigned int digits);
+
+/* Output a little endian binary number. */
+void OutputNumber(OutputType *out, unsigned int value, unsigned int bytes);
+
+/* Symbol files list one label per line: its address as four hex
+ * digits, a space and its name. */
+
+/* Write an image as raw, hex, Intel HEX or segment output, or write
+ * its symbols. Raw and hex output start at address 0 and fill gaps
+ * with 0xFF. */
+void WriteImage(OutputType *out, const OutputImageType *image,
+                q1_asm_format_t format);
+
+#endif /* Q1OUT_H */
@@ -0,0 +1,180 @@
+/* Q1 simulator library: profiles. */
+
+#include "q1cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Calls nested deeper than this are counted in the caller. */
+#define MAX_DEPTH    256
+
+/* A call path. The calls made from a path are a list through sibling
+ * starting at child; 0 ends the list since path 0 is never a call. */
+typedef struct {
+   unsigned int parent;
+   unsigned int child;
+   unsigned int sibling;
+   unsigned short addr;
+   unsigned long long clocks;
+} PathType;
+
+/* A call that has not returned. */
+typedef struct {
+   unsigned int path;         /* Path of the caller. */
+   unsigned short ret;        /* Address after the call. */
+} FrameType;
+
+struct q1_profile {
+   unsigned long long counts[1 << 16];
+   unsigned long long clocks[1 << 16];
+   unsigned long long taken[1 << 16];
+   PathType *paths;
+   unsigned int path_count;
+   unsigned int path_max;
+   unsigned int path;         /* Current path. */
+   FrameType frames[MAX_DEPTH];
+   unsigned int depth;
+   int started;
+};
+
+static unsigned int EnterPath(q1_profile_t *prof, unsigned short addr);
+
+q1_profile_t *q1_profile_create(void) {
+   q1_profile_t *prof = malloc(sizeof(q1_profile_t));
+   if(prof) {
+      prof->path_max = 64;
+      prof->paths = malloc(prof->path_max * sizeof(PathType));
+      if(!prof->paths) {
+         free(prof);
+         return NULL;
+      }
+      q1_profile_clear(prof);
+   }
+   return prof;
+}
+
+void q1_profile_destroy(q1_profile_t *prof) {
+   if(prof) {
+      free(prof->paths);
+      free(prof);
+   }
+}
+
+void q1_profile_clear(q1_profile_t *prof) {
+   memset(prof->counts, 0, sizeof(prof->counts));
+   memset(prof->clocks, 0, sizeof(prof->clocks));
+   memset(prof->taken, 0, sizeof(prof->taken));
+   memset(&prof->paths[0], 0, sizeof(PathType));
+   prof->path_count = 1;
+   prof->path = 0;
+   prof->depth = 0;
+   prof->started = 0;
+}
+
+void q1_set_profile(q1_cpu_t *cpu, q1_profile_t *prof) {
+   cpu->profile = prof;
+}
+
+void Q1ProfileRecord(q1_cpu_t *cpu, unsigned short pc,
+                     unsigned int clocks, int taken) {
+
+   q1_profile_t *prof = cpu->profile;
+   unsigned int x;
+
+   if(!prof->started) {
+      prof->paths[0].addr = pc;
+      prof->started = 1;
+   }
+   ++prof->counts[pc];
+   prof->clocks[pc] += clocks;
+   prof->paths[prof->path].clocks += clocks;
+
+   if(taken) {
+      ++prof->taken[pc];
+      if((cpu->opcode & 0x08) && prof->depth < MAX_DEPTH) {
+         prof->frames[prof->depth].path = prof->path;
+         prof->frames[prof->depth].ret = pc + 3;
+         ++prof->depth;
+         prof->path = EnterPath(prof, cpu->operand);
+      }
+   } else if(cpu->opcode == 0x37) {
+      /* Returning past calls that never returned closes them too. */
+      for(x = prof->depth; x > 0; x--) {
+         if(prof->frames[x - 1].ret == cpu->preg) {
+            prof->depth = x - 1;
+            prof->path = prof->frames[x - 1].path;
+            break;
+         }
+      }
+   }
+
+}
+
+/* Return the path for a call to addr from the current path, adding it
+ * if this is the first such call. If out of memory the call is counted
+ * in the caller. */
+unsigned int EnterPath(q1_profile_t *prof, unsigned short addr) {
+
+   PathType *pp;
+   PathType *paths;
+   unsigned int index;
+
+   for(index = prof->paths[prof->path].child; index;
+       index = prof->paths[index].sibling) {
+      if(prof->paths[index].addr == addr) {
+         return index;
+      }
+   }
+
+   if(prof->path_count == prof->path_max) {
+      paths = realloc(prof->paths, prof->path_max * 2 * sizeof(PathType));
+      if(!paths) {
+         return prof->path;
+      }
+      prof->paths = paths;
+      prof->path_max *= 2;
+   }
+   index = prof->path_count++;
+   pp = &prof->paths[index];
+   pp->parent = prof->path;
+   pp->child = 0;
+   pp->sibling = prof->paths[prof->path].child;
+   pp->addr = addr;
+   pp->clocks = 0;
+   prof->paths[prof->path].child = index;
+   return index;
+
+}
+
+unsigned long long q1_profile_count(const q1_profile_t *prof,
+                                    unsigned short addr) {
+   return prof->counts[addr];
+}
+
+unsigned long long q1_profile_clocks(const q1_profile_t *prof,
+                                     unsigned short addr) {
+   return prof->clocks[addr];
+}
+
+unsigned long long q1_profile_taken(const q1_profile_t *prof,
+                                    unsigned short addr) {
+   return prof->taken[addr];
+}
+
+unsigned int q1_profile_path_count(const q1_profile_t *prof) {
+   return prof->path_count;
+}
+
+int q1_profile_path(const q1_profile_t *prof, unsigned int index,
+                    unsigned int *parent, unsigned short *addr,
+                    unsigned long long *clocks) {
+   const PathType *pp;
+   if(index >= prof->path_count) {
+      return 0;
+   }
+   pp = &prof->paths[index];
+   *parent = pp->parent;
+   *addr = pp->addr;
+   *clocks = pp->clocks;
+   return 1;
+}
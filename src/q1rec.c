@@ -0,0 +1,459 @@
+/* Q1 simulator library: execution traces.
+ *
+ * Records are written to blocks in a ring. When a block fills it is
+ * handed to a writer thread, which packs it and writes it out while the
+ * machine fills the next block. The two semaphores count the blocks
+ * that are full and those that are free, so neither side takes a lock;
+ * the machine only waits if the writer falls a whole ring behind.
+ */
+
+#include "q1cpu.h"
+#include "q1rec.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SIZE    8
+
+#define HASH_BITS    12
+
+typedef struct {
+   unsigned char type;
+   unsigned int size;
+   unsigned int count;
+   unsigned long long step;
+   unsigned short pc;
+   unsigned char a, b, c;
+   unsigned short x;
+   unsigned char flags;
+   unsigned char data[BLOCK_SIZE];
+} BufferType;
+
+struct q1_trace {
+
+   FILE *fd;
+   pthread_t thread;
+   sem_t full;
+   sem_t empty;
+   BufferType ring[RING_SIZE];
+   unsigned int head;         /* Next block for the machine. */
+   unsigned int tail;         /* Next block for the writer. */
+   BufferType *current;       /* Block taken from the ring, if any. */
+   int failed;                /* Set by the writer. */
+
+   /* State after the last record. */
+   unsigned long long steps;
+   unsigned short pc;         /* Address after the last instruction. */
+   unsigned char a, b, c;
+   unsigned short x;
+   unsigned char flags;
+
+};
+
+static void *WriteBlocks(void *arg);
+static void WriteBlock(q1_trace_t *trace, const BufferType *buf,
+                       unsigned char *packed);
+static BufferType *BeginBlock(q1_trace_t *trace, unsigned char type);
+static void EndBlock(q1_trace_t *trace);
+static unsigned char *PutNumber(unsigned char *p, unsigned long long value,
+                                unsigned int size);
+static unsigned char *PutSequence(unsigned char *dest,
+                                  const unsigned char *literals,
+                                  size_t count, unsigned int offset,
+                                  size_t match);
+static unsigned char *PutLength(unsigned char *dest, size_t length);
+static int GetLength(const unsigned char **src, const unsigned char *end,
+                     size_t *length);
+
+q1_trace_t *q1_trace_open(const char *name) {
+
+   q1_trace_t *trace;
+
+   trace = malloc(sizeof(q1_trace_t));
+   if(trace == NULL) {
+      return NULL;
+   }
+   trace->fd = fopen(name, "wb");
+   if(trace->fd == NULL) {
+      free(trace);
+      return NULL;
+   }
+   trace->head = 0;
+   trace->tail = 0;
+   trace->current = NULL;
+   trace->failed = 0;
+   trace->steps = 0;
+   if(fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace->fd)
+         != TRACE_MAGIC_SIZE) {
+      trace->failed = 1;
+   }
+
+   sem_init(&trace->full, 0, 0);
+   sem_init(&trace->empty, 0, RING_SIZE);
+   if(pthread_create(&trace->thread, NULL, WriteBlocks, trace)) {
+      sem_destroy(&trace->full);
+      sem_destroy(&trace->empty);
+      fclose(trace->fd);
+      free(trace);
+      return NULL;
+   }
+   return trace;
+
+}
+
+int q1_trace_close(q1_trace_t *trace) {
+
+   int result;
+
+   EndBlock(trace);
+   BeginBlock(trace, BLOCK_END);
+   EndBlock(trace);
+   pthread_join(trace->thread, NULL);
+
+   result = !trace->failed;
+   if(fclose(trace->fd)) {
+      result = 0;
+   }
+   sem_destroy(&trace->full);
+   sem_destroy(&trace->empty);
+   free(trace);
+   return result;
+
+}
+
+void q1_set_trace(q1_cpu_t *cpu, q1_trace_t *trace) {
+
+   BufferType *buf;
+
+   if(cpu->trace) {
+      EndBlock(cpu->trace);
+   }
+   cpu->trace = trace;
+   if(trace == NULL) {
+      return;
+   }
+
+   EndBlock(trace);
+   trace->steps = cpu->steps;
+   trace->pc = cpu->preg;
+   trace->a = cpu->rega;
+   trace->b = cpu->regb;
+   trace->c = cpu->regc;
+   trace->x = (cpu->regxh << 8) | cpu->regxl;
+   trace->flags = (cpu->c_flag ? TRACE_FLAG_C : 0)
+                | (cpu->z_flag ? TRACE_FLAG_Z : 0)
+                | (cpu->n_flag ? TRACE_FLAG_N : 0);
+   buf = BeginBlock(trace, BLOCK_STATE);
+   memcpy(buf->data, cpu->memory, sizeof(cpu->memory));
+   buf->size = sizeof(cpu->memory);
+   EndBlock(trace);
+
+}
+
+void Q1TraceRecord(q1_cpu_t *cpu, unsigned short pc) {
+
+   q1_trace_t *trace = cpu->trace;
+   BufferType *buf = trace->current;
+   const unsigned char opcode = cpu->opcode;
+   const unsigned short x = (cpu->regxh << 8) | cpu->regxl;
+   const unsigned char flags = (cpu->c_flag ? TRACE_FLAG_C : 0)
+                             | (cpu->z_flag ? TRACE_FLAG_Z : 0)
+                             | (cpu->n_flag ? TRACE_FLAG_N : 0);
+   unsigned char *start;
+   unsigned char *p;
+
+   if(buf == NULL || buf->size > BLOCK_SIZE - MAX_RECORD) {
+      EndBlock(trace);
+      buf = BeginBlock(trace, BLOCK_STEPS);
+   }
+
+   start = &buf->data[buf->size];
+   p = start + 1;
+   *start = 0;
+   if(pc != trace->pc) {
+      *start |= TRACE_PC;
+      p = PutNumber(p, pc, 2);
+   }
+   if(cpu->rega != trace->a) {
+      *start |= TRACE_A;
+      *p++ = cpu->rega;
+      trace->a = cpu->rega;
+   }
+   if(cpu->regb != trace->b) {
+      *start |= TRACE_B;
+      *p++ = cpu->regb;
+      trace->b = cpu->regb;
+   }
+   if(cpu->regc != trace->c) {
+      *start |= TRACE_C;
+      *p++ = cpu->regc;
+      trace->c = cpu->regc;
+   }
+   if(x != trace->x) {
+      *start |= TRACE_X;
+      p = PutNumber(p, x, 2);
+      trace->x = x;
+   }
+   if(flags != trace->flags) {
+      *start |= TRACE_FLAGS;
+      *p++ = flags;
+      trace->flags = flags;
+   }
+   *p++ = opcode;
+   if(opcode < 0x20) {
+      p = PutNumber(p, cpu->operand, 2);
+      trace->pc = pc + 3;
+   } else {
+      trace->pc = pc + 1;
+   }
+
+   buf->size = p - buf->data;
+   ++buf->count;
+   ++trace->steps;
+
+}
+
+/* Take the next free block from the ring, starting it at the current
+ * state. */
+BufferType *BeginBlock(q1_trace_t *trace, unsigned char type) {
+   BufferType *buf = &trace->ring[trace->head];
+   sem_wait(&trace->empty);
+   trace->current = buf;
+   buf->type = type;
+   buf->size = 0;
+   buf->count = 0;
+   buf->step = trace->steps;
+   buf->pc = trace->pc;
+   buf->a = trace->a;
+   buf->b = trace->b;
+   buf->c = trace->c;
+   buf->x = trace->x;
+   buf->flags = trace->flags;
+   return buf;
+}
+
+/* Hand the block taken by BeginBlock to the writer. */
+void EndBlock(q1_trace_t *trace) {
+   if(trace->current) {
+      trace->current = NULL;
+      trace->head = (trace->head + 1) % RING_SIZE;
+      sem_post(&trace->full);
+   }
+}
+
+/* Writer thread. */
+void *WriteBlocks(void *arg) {
+
+   q1_trace_t *trace = (q1_trace_t*)arg;
+   unsigned char *packed;
+   BufferType *buf;
+   int done;
+
+   packed = malloc(LZ_BOUND(BLOCK_SIZE));
+   do {
+      sem_wait(&trace->full);
+      buf = &trace->ring[trace->tail];
+      WriteBlock(trace, buf, packed);
+      done = buf->type == BLOCK_END;
+      trace->tail = (trace->tail + 1) % RING_SIZE;
+      sem_post(&trace->empty);
+   } while(!done);
+   free(packed);
+   return NULL;
+
+}
+
+/* Pack and write a block. Blocks are still taken from the ring after
+ * an error so the machine never waits on a writer that has stopped. */
+void WriteBlock(q1_trace_t *trace, const BufferType *buf,
+                unsigned char *packed) {
+
+   unsigned char header[BLOCK_HEADER_SIZE];
+   const unsigned char *data;
+   unsigned char *p;
+   size_t size;
+
+   if(trace->failed || packed == NULL) {
+      trace->failed = 1;
+      return;
+   }
+
+   data = buf->data;
+   size = Q1Pack(buf->data, buf->size, packed);
+   if(size < buf->size) {
+      data = packed;
+   } else {
+      size = buf->size;
+   }
+
+   p = header;
+   *p++ = buf->type;
+   p = PutNumber(p, buf->size, 4);
+   p = PutNumber(p, size, 4);
+   p = PutNumber(p, buf->count, 4);
+   p = PutNumber(p, buf->step, 8);
+   p = PutNumber(p, buf->pc, 2);
+   *p++ = buf->a;
+   *p++ = buf->b;
+   *p++ = buf->c;
+   p = PutNumber(p, buf->x, 2);
+   *p++ = buf->flags;
+
+   if(fwrite(header, 1, sizeof(header), trace->fd) != sizeof(header)
+      || fwrite(data, 1, size, trace->fd) != size) {
+      trace->failed = 1;
+   }
+
+}
+
+/* Store a little endian number. */
+unsigned char *PutNumber(unsigned char *p, unsigned long long value,
+                         unsigned int size) {
+   unsigned int x;
+   for(x = 0; x < size; x++) {
+      *p++ = (unsigned char)(value >> (x * 8));
+   }
+   return p;
+}
+
+/* Each 4-byte string is looked up in a table of where it was last seen;
+ * if the bytes there match, the match is extended as far as it goes. */
+size_t Q1Pack(const unsigned char *src, size_t size, unsigned char *dest) {
+
+   unsigned int table[1 << HASH_BITS];
+   unsigned char *p;
+   unsigned int value;
+   unsigned int hash;
+   size_t anchor;
+   size_t match;
+   size_t ref;
+   size_t x;
+
+   memset(table, 0, sizeof(table));
+   p = dest;
+   anchor = 0;
+   x = 0;
+   while(x + LZ_MIN_MATCH <= size) {
+      value = src[x] | (src[x + 1] << 8) | (src[x + 2] << 16)
+            | ((unsigned int)src[x + 3] << 24);
+      hash = (value * 2654435761u) >> (32 - HASH_BITS);
+      ref = table[hash];
+      table[hash] = x + 1;
+      if(ref == 0 || x - (ref - 1) > 0xFFFF
+         || memcmp(&src[ref - 1], &src[x], LZ_MIN_MATCH)) {
+         ++x;
+         continue;
+      }
+      --ref;
+      match = LZ_MIN_MATCH;
+      while(x + match < size && src[ref + match] == src[x + match]) {
+         ++match;
+      }
+      p = PutSequence(p, &src[anchor], x - anchor, x - ref, match);
+      x += match;
+      anchor = x;
+   }
+   p = PutSequence(p, &src[anchor], size - anchor, 0, 0);
+   return p - dest;
+
+}
+
+/* Write a sequence. A match of 0 ends the data. */
+unsigned char *PutSequence(unsigned char *dest,
+                           const unsigned char *literals,
+                           size_t count, unsigned int offset,
+                           size_t match) {
+
+   unsigned char *token = dest++;
+
+   *token = (count < 15 ? count : 15) << 4;
+   if(count >= 15) {
+      dest = PutLength(dest, count - 15);
+   }
+   memcpy(dest, literals, count);
+   dest += count;
+   if(match) {
+      dest = PutNumber(dest, offset, 2);
+      match -= LZ_MIN_MATCH;
+      *token |= match < 15 ? match : 15;
+      if(match >= 15) {
+         dest = PutLength(dest, match - 15);
+      }
+   }
+   return dest;
+
+}
+
+unsigned char *PutLength(unsigned char *dest, size_t length) {
+   while(length >= 255) {
+      *dest++ = 255;
+      length -= 255;
+   }
+   *dest++ = (unsigned char)length;
+   return dest;
+}
+
+size_t Q1Unpack(const unsigned char *src, size_t size,
+                unsigned char *dest, size_t max) {
+
+   const unsigned char *end = src + size;
+   unsigned char token;
+   size_t offset;
+   size_t count;
+   size_t used;
+
+   used = 0;
+   while(src < end) {
+
+      token = *src++;
+      count = token >> 4;
+      if(count == 15 && !GetLength(&src, end, &count)) {
+         return 0;
+      }
+      if(count > (size_t)(end - src) || count > max - used) {
+         return 0;
+      }
+      memcpy(&dest[used], src, count);
+      src += count;
+      used += count;
+      if(src == end) {
+         break;
+      }
+
+      if(end - src < 2) {
+         return 0;
+      }
+      offset = src[0] | (src[1] << 8);
+      src += 2;
+      count = token & 15;
+      if(count == 15 && !GetLength(&src, end, &count)) {
+         return 0;
+      }
+      count += LZ_MIN_MATCH;
+      if(offset == 0 || offset > used || count > max - used) {
+         return 0;
+      }
+      while(count--) {
+         dest[used] = dest[used - offset];
+         ++used;
+      }
+
+   }
+   return used;
+
+}
+
+int GetLength(const unsigned char **src, const unsigned char *end,
+              size_t *length) {
+   unsigned char value;
+   do {
+      if(*src == end) {
+         return 0;
+      }
+      value = *(*src)++;
+      *length += value;
+   } while(value == 255);
+   return 1;
+}
@@ -0,0 +1,85 @@
+/* Trace files, shared by the recorder in libq1sim and q1trace.
+ *
+ * A trace starts with TRACE_MAGIC and is followed by blocks, each a
+ * header and then packed bytes. Numbers are little endian.
+ *
+ *    type        1 byte: BLOCK_STATE, BLOCK_STEPS or BLOCK_END
+ *    raw size    4 bytes: size of the unpacked data
+ *    packed size 4 bytes: equal to raw size if the data is not packed
+ *    count       4 bytes: instructions in the block
+ *    step        8 bytes: instructions before the block
+ *    pc          2 bytes: PC at the start of the block
+ *    a, b, c     3 bytes
+ *    x           2 bytes
+ *    flags       1 byte: TRACE_FLAG_C, TRACE_FLAG_Z and TRACE_FLAG_N
+ *
+ * A BLOCK_STATE block holds all 64 KiB of memory. One is written when
+ * a trace is attached to a machine, and the registers in its header
+ * are those of the machine at that point.
+ *
+ * A BLOCK_STEPS block holds one record per instruction. Each record is
+ * a byte of TRACE_* bits, the fields given by those bits in the order
+ * of the bits, the opcode and, for opcodes below 0x20, the operand.
+ * Register fields are the values after the instruction; any register
+ * without a bit is unchanged. The PC is only given if it is not the
+ * address after the previous instruction, so only the targets of
+ * taken jumps, calls and rets carry it. Stores are not recorded: their
+ * address is the operand or X and their value a register, which the
+ * reader has. The header gives the registers before the first record,
+ * so every block can be read without the blocks before it.
+ *
+ * A BLOCK_END block ends the trace; its step is the total instruction
+ * count.
+ *
+ * Packed data is a series of sequences, each a token byte, literal
+ * bytes, a 2-byte offset and a match to copy from that many bytes back.
+ * The high 4 bits of the token are the literal count and the low 4 bits
+ * the match length less LZ_MIN_MATCH; 15 in either is followed by bytes
+ * to add to it up to and including the first that is not 255. The last
+ * sequence has only literals.
+ */
+
+#ifndef Q1REC_H
+#define Q1REC_H
+
+#include <stddef.h>
+
+#define TRACE_MAGIC        "Q1TR\001"
+#define TRACE_MAGIC_SIZE   5
+
+#define BLOCK_STATE        'M'
+#define BLOCK_STEPS        'I'
+#define BLOCK_END          'E'
+
+#define BLOCK_HEADER_SIZE  29
+#define BLOCK_SIZE         (1 << 16)
+
+/* Record bits. */
+#define TRACE_PC     0x01
+#define TRACE_A      0x02
+#define TRACE_B      0x04
+#define TRACE_C      0x08
+#define TRACE_X      0x10
+#define TRACE_FLAGS  0x20
+
+/* Flag bits. */
+#define TRACE_FLAG_C 0x01
+#define TRACE_FLAG_Z 0x02
+#define TRACE_FLAG_N 0x04
+
+/* Largest record: bits, PC, A, B, C, X, flags, opcode and operand. */
+#define MAX_RECORD   12
+
+#define LZ_MIN_MATCH 4
+#define LZ_BOUND(size)  ((size) + (size) / 255 + 16)
+
+/* Pack size bytes into dest, which must hold LZ_BOUND(size) bytes.
+ * Returns the packed size. */
+size_t Q1Pack(const unsigned char *src, size_t size, unsigned char *dest);
+
+/* Unpack size bytes into dest, which holds max bytes.
+ * Returns the unpacked size or 0 if the data is invalid. */
+size_t Q1Unpack(const unsigned char *src, size_t size,
+                unsigned char *dest, size_t max);
+
+#endif /* Q1REC_H */
@@ -0,0 +1,223 @@
+/* Profile reports for q1sim.
+ *
+ * A loop is closed by a jump back to an earlier address. Its head, the
+ * target of that jump, is reached once per iteration: by the jump, or
+ * on entry. The entries are the other arrivals at the head, or if the
+ * loop is only entered past its head, the times the jump fell through.
+ */
+
+#include "q1report.h"
+#include "q1sym.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME     256
+
+/* Clocks and instructions for an address or a label. */
+typedef struct {
+   unsigned short addr;
+   unsigned long long clocks;
+   unsigned long long count;
+} SpotType;
+
+static unsigned int GetSpots(const q1_profile_t *prof, SpotType *spots,
+                             int by_label);
+static void WriteSpots(FILE *fd, SpotType *spots, unsigned int count,
+                       unsigned long long total, int by_label);
+static void WriteLoops(FILE *fd, const q1_profile_t *prof,
+                       const unsigned char *memory);
+static int CompareSpots(const void *a, const void *b);
+static double Percent(unsigned long long part, unsigned long long total);
+
+void WriteProfile(FILE *fd, const q1_profile_t *prof,
+                  const unsigned char *memory) {
+
+   SpotType *spots;
+   unsigned long long clocks;
+   unsigned long long count;
+   unsigned int x;
+
+   clocks = 0;
+   count = 0;
+   for(x = 0; x < (1 << 16); x++) {
+      clocks += q1_profile_clocks(prof, x);
+      count += q1_profile_count(prof, x);
+   }
+   fprintf(fd, "instructions %llu\n", count);
+   fprintf(fd, "clocks %llu\n", clocks);
+
+   spots = malloc((1 << 16) * sizeof(SpotType));
+   if(spots == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return;
+   }
+
+   fprintf(fd, "\nlabels\n");
+   WriteSpots(fd, spots, GetSpots(prof, spots, 1), clocks, 1);
+
+   fprintf(fd, "\naddresses\n");
+   WriteSpots(fd, spots, GetSpots(prof, spots, 0), clocks, 0);
+
+   free(spots);
+
+   fprintf(fd, "\nloops\n");
+   WriteLoops(fd, prof, memory);
+
+}
+
+/* Collect the addresses executed, or their totals under each label, in
+ * address order. Returns the number of spots. */
+unsigned int GetSpots(const q1_profile_t *prof, SpotType *spots,
+                      int by_label) {
+
+   const SymbolType *sp;
+   const SymbolType *last;
+   SpotType *spot;
+   unsigned int count;
+   unsigned int x;
+
+   count = 0;
+   spot = NULL;
+   last = NULL;
+   for(x = 0; x < (1 << 16); x++) {
+      if(q1_profile_count(prof, x) == 0) {
+         continue;
+      }
+      sp = FindSymbol(x);
+      if(!by_label || spot == NULL || sp != last) {
+         spot = &spots[count++];
+         spot->addr = by_label && sp ? sp->addr : x;
+         spot->clocks = 0;
+         spot->count = 0;
+         last = sp;
+      }
+      spot->clocks += q1_profile_clocks(prof, x);
+      spot->count += q1_profile_count(prof, x);
+   }
+   return count;
+
+}
+
+void WriteSpots(FILE *fd, SpotType *spots, unsigned int count,
+                unsigned long long total, int by_label) {
+
+   char name[MAX_NAME];
+   unsigned int x;
+
+   qsort(spots, count, sizeof(SpotType), CompareSpots);
+   fprintf(fd, "%14s %7s %14s  %s\n", "clocks", "%",
+      by_label ? "instructions" : "count",
+      by_label ? "label" : "address");
+   for(x = 0; x < count; x++) {
+      if(by_label && FindSymbol(spots[x].addr) == NULL) {
+         strcpy(name, "-");
+      } else {
+         FormatAddress(name, sizeof(name), spots[x].addr);
+      }
+      fprintf(fd, "%14llu %6.2f%% %14llu  ", spots[x].clocks,
+         Percent(spots[x].clocks, total), spots[x].count);
+      if(by_label) {
+         fprintf(fd, "%s\n", name);
+      } else {
+         fprintf(fd, "%04x %s\n", (unsigned int)spots[x].addr, name);
+      }
+   }
+
+}
+
+void WriteLoops(FILE *fd, const q1_profile_t *prof,
+                const unsigned char *memory) {
+
+   char head_name[MAX_NAME];
+   char jump_name[MAX_NAME];
+   unsigned long long taken;
+   unsigned long long arrivals;
+   unsigned long long entries;
+   unsigned int head;
+   unsigned int x;
+
+   fprintf(fd, "%14s %14s %10s  %s\n", "iterations", "entries", "average",
+      "head (jump)");
+   for(x = 0; x < (1 << 16); x++) {
+      taken = q1_profile_taken(prof, x);
+      if(taken == 0 || memory[x] >= 0x08) {
+         continue;
+      }
+      head = (memory[(x + 1) & 0xFFFF] << 8) | memory[(x + 2) & 0xFFFF];
+      if(head > x) {
+         continue;
+      }
+      arrivals = q1_profile_count(prof, head);
+      if(arrivals > taken) {
+         entries = arrivals - taken;
+      } else if(q1_profile_count(prof, x) > taken) {
+         entries = q1_profile_count(prof, x) - taken;
+      } else {
+         entries = 1;
+      }
+      FormatAddress(head_name, sizeof(head_name), head);
+      FormatAddress(jump_name, sizeof(jump_name), x);
+      fprintf(fd, "%14llu %14llu %10.2f  %s (%s)\n", taken + entries,
+         entries, (double)(taken + entries) / entries, head_name,
+         jump_name);
+   }
+
+}
+
+void WriteStacks(FILE *fd, const q1_profile_t *prof) {
+
+   char name[MAX_NAME];
+   unsigned int *frames;
+   unsigned long long clocks;
+   unsigned long long ignored;
+   unsigned int count;
+   unsigned int depth;
+   unsigned int parent;
+   unsigned short addr;
+   unsigned int x;
+
+   count = q1_profile_path_count(prof);
+   frames = malloc(count * sizeof(unsigned int));
+   if(frames == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return;
+   }
+
+   for(x = 0; x < count; x++) {
+      q1_profile_path(prof, x, &parent, &addr, &clocks);
+      if(clocks == 0) {
+         continue;
+      }
+      depth = 0;
+      frames[depth++] = x;
+      while(frames[depth - 1] != 0) {
+         q1_profile_path(prof, frames[depth - 1], &parent, &addr, &ignored);
+         frames[depth++] = parent;
+      }
+      while(depth > 0) {
+         --depth;
+         q1_profile_path(prof, frames[depth], &parent, &addr, &ignored);
+         FormatAddress(name, sizeof(name), addr);
+         fprintf(fd, "%s%c", name, depth ? ';' : ' ');
+      }
+      fprintf(fd, "%llu\n", clocks);
+   }
+
+   free(frames);
+
+}
+
+/* Most clocks first, then in address order. */
+int CompareSpots(const void *a, const void *b) {
+   const SpotType *sa = (const SpotType*)a;
+   const SpotType *sb = (const SpotType*)b;
+   if(sa->clocks != sb->clocks) {
+      return sa->clocks > sb->clocks ? -1 : 1;
+   }
+   return (int)sa->addr - (int)sb->addr;
+}
+
+double Percent(unsigned long long part, unsigned long long total) {
+   return total ? part * 100.0 / total : 0.0;
+}
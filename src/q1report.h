@@ -0,0 +1,19 @@
+/* Profile reports for q1sim. Addresses are shown with the symbols
+ * loaded by LoadSymbols. */
+
+#ifndef Q1REPORT_H
+#define Q1REPORT_H
+
+#include "q1.h"
+
+/* Write the clocks spent under each label and at each address, most
+ * first, and the trip counts of the loops. memory is used to find the
+ * targets of the jumps that close loops. */
+void WriteProfile(FILE *fd, const q1_profile_t *prof,
+                  const unsigned char *memory);
+
+/* Write the call paths as collapsed stacks for flamegraph.pl: one line
+ * per path with its frames separated by ';' and its clocks. */
+void WriteStacks(FILE *fd, const q1_profile_t *prof);
+
+#endif /* Q1REPORT_H */
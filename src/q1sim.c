@@ -2,407 +2,717 @@
  * Joe Wingbermuehle
  * 20080528
  *
- * To compile:
- *    gcc -O2 -Wall -o q1sim q1sim.c
- *
+ * This is the command line front end for the simulator library
+ * (see q1.h).
  */
 
+#include "q1.h"
+#include "q1debug.h"
+#include "q1farm.h"
+#include "q1gdb.h"
+#include "q1image.h"
+#include "q1report.h"
+#include "q1sym.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 /* Size of the hex dump to display. */
 #define MAX_LINES 24
 #define BYTES_PER_LINE (8 * 2)
 
-/* Registers and memory. */
-static unsigned char rega, regb, regc;
-static unsigned char z_flag, c_flag, n_flag;
-static unsigned char regxh, regxl;
-static unsigned short preg;
-static unsigned char halted;
-static unsigned char opcode;
-static unsigned short operand;
-static unsigned char memory[1 << 16];
-
-static unsigned int clocks;
+/* The machine being simulated and, in diff mode, the interpreter it is
+ * checked against. */
+static q1_cpu_t *cpu;
+static q1_cpu_t *reference;
+
+/* Run options. */
+static int batch_mode;
+static int json_output;
+static unsigned long long max_steps;
+static unsigned long long max_clocks;
+static unsigned long long display_steps;
+static unsigned int display_ms;
+static unsigned int dump_start;
+static unsigned int dump_count;
+
+static FormatType format;
+
+static const char *farm_file;
+static const char *output_file;
+static unsigned int farm_threads;
+static int lockstep;
+
+static int diff_mode;
+static int debug_mode;
+
+/* Port for the gdb server ("-" for stdin and stdout). */
+static const char *gdb_port;
+static int show_time;
+static double run_seconds;
+
+/* Profile output files ("-" for stdout). */
+static const char *profile_file;
+static const char *stacks_file;
+
+/* Trace output file. */
+static const char *trace_file;
+
+/* Address whose last write to rewind to, if any. */
+static const char *last_write;
+
+/* Reasons for a run to stop. */
+typedef enum {
+   STOP_HALTED,
+   STOP_FAULT,
+   STOP_BUDGET,
+   STOP_DIVERGED,
+   STOP_WRITE
+} StopType;
+
+static const char *STOP_NAMES[] = {
+   "halted", "fault", "budget", "diverged", "write"
+};
 
 static void DisplayState();
+static void DisplayResult(StopType reason);
+static void DisplayUsage(const char *name);
+static unsigned long long ParseNumber(const char *str);
+static StopType Run();
+static int Farm(q1_engine_t engine, const q1_regs_t *regs);
+static int RunDiff(unsigned long long count, q1_status_t *status);
+static int WriteReport(const char *name, const q1_profile_t *prof,
+                       int stacks);
+static int RewindToWrite(StopType *reason);
+
+/* Run up to count instructions with the selected engine, then run the
+ * same number with the interpreter and compare. Returns 0 on a mismatch.
+ */
+int RunDiff(unsigned long long count, q1_status_t *status) {
+
+   const unsigned char *expected;
+   const unsigned char *actual;
+   q1_regs_t before, after;
+   unsigned long long steps;
+   unsigned int x;
+
+   *status = q1_run(cpu, count);
+   steps = q1_steps(cpu) - q1_steps(reference);
+   if(steps > 0) {
+      q1_run(reference, steps);
+   }
+   q1_get_regs(reference, &before);
+   q1_get_regs(cpu, &after);
+
+   if(memcmp(&before, &after, sizeof(q1_regs_t))
+      || q1_clocks(reference) != q1_clocks(cpu)
+      || q1_steps(reference) != q1_steps(cpu)
+      || q1_halted(reference) != q1_halted(cpu)) {
+      fprintf(stderr, "ERROR: engine diverged from interpreter "
+         "after instruction %llu\n", q1_steps(cpu));
+      fprintf(stderr, "         pc   a   b   c  x    flags clocks\n");
+      fprintf(stderr, "interp:  %04x %02x  %02x  %02x  %04x %u%u%u   %llu\n",
+         before.pc, before.a, before.b, before.c, before.x,
+         before.c_flag, before.z_flag, before.n_flag, q1_clocks(reference));
+      fprintf(stderr, "engine:  %04x %02x  %02x  %02x  %04x %u%u%u   %llu\n",
+         after.pc, after.a, after.b, after.c, after.x,
+         after.c_flag, after.z_flag, after.n_flag, q1_clocks(cpu));
+      return 0;
+   }
+   expected = q1_memory(reference);
+   actual = q1_memory(cpu);
+   if(memcmp(expected, actual, 1 << 16)) {
+      for(x = 0; expected[x] == actual[x]; x++);
+      fprintf(stderr, "ERROR: engine diverged from interpreter "
+         "after instruction %llu\n", q1_steps(cpu));
+      fprintf(stderr, "memory[%04x]: interp %02x, engine %02x\n",
+         x, expected[x], actual[x]);
+      return 0;
+   }
 
-static void ldb() {
-   regb = memory[operand];
-}
-
-static void ldc() {
-   regc = memory[operand];
-}
-
-static void lxh() {
-   regxh = memory[operand];
-}
-
-static void lxl() {
-   regxl = memory[operand];
-}
-
-static void stb() {
-   memory[operand] = regb;
-}
-
-static void stc() {
-   memory[operand] = regc;
-}
-
-static void sxh() {
-   memory[operand] = regxh;
-}
-
-static void sxl() {
-   memory[operand] = regxl;
-}
-
-static void sta() {
-   memory[operand] = rega;
-}
-
-static void and() {
-   rega = regb & regc;
-   c_flag = 0;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void or() {
-   rega = regb | regc;
-   c_flag = 0;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void shl() {
-   rega = regb << 1;
-   c_flag = regb >> 7;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void shr() {
-   rega = regb >> 1;
-   c_flag = regb & 1;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void add() {
-   unsigned short temp = regb + regc;
-   rega = (unsigned char)temp;
-   c_flag = temp > 255;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void inc() {
-   rega = regb + 1;
-   c_flag = regb == 255;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void dec() {
-   rega = regb - 1;
-   c_flag = regb == 0;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
-
-static void not() {
-   rega = ~regb;
-   c_flag = 0;
-   z_flag = rega == 0;
-   n_flag = rega >> 7;
-}
+   return 1;
 
-static void clr() {
-   rega = 0;
-   c_flag = 0;
-   z_flag = 1;
-   n_flag = 0;
 }
 
-static void mab() {
-   regb = rega;
-}
+/* Run until halted, or, in batch mode, until an invalid instruction is
+ * executed or a budget is exhausted. */
+StopType Run() {
 
-static void mac() {
-   regc = rega;
-}
+   struct timeval last_time, now;
+   unsigned long long next_display;
+   unsigned long long elapsed;
+   unsigned long long count;
+   unsigned long long steps;
+   unsigned long long clocks;
+   q1_status_t status;
 
-static void sax() {
-   memory[(regxh << 8) | regxl] = rega;
-}
+   next_display = display_steps;
+   gettimeofday(&last_time, NULL);
+   while(!q1_halted(cpu)) {
 
-static void sbx() {
-   memory[(regxh << 8) | regxl] = regb;
-}
+      if(!batch_mode) {
+         DisplayState();
+         usleep(100000);
+         q1_step(cpu);
+         continue;
+      }
 
-static void scx() {
-   memory[(regxh << 8) | regxl] = regc;
-}
+      steps = q1_steps(cpu);
+      clocks = q1_clocks(cpu);
+      if(max_steps && steps >= max_steps) {
+         return STOP_BUDGET;
+      }
+      if(max_clocks && clocks >= max_clocks) {
+         return STOP_BUDGET;
+      }
+      if(display_steps && steps >= next_display) {
+         DisplayState();
+         next_display = steps + display_steps;
+      }
+      if(display_ms) {
+         gettimeofday(&now, NULL);
+         elapsed = (now.tv_sec - last_time.tv_sec) * 1000ULL;
+         elapsed += now.tv_usec / 1000;
+         elapsed -= last_time.tv_usec / 1000;
+         if(elapsed >= display_ms) {
+            DisplayState();
+            last_time = now;
+         }
+      }
 
-static void lbx() {
-   regb = memory[(regxh << 8) | regxl];
-}
+      /* Run as many instructions as possible without passing a budget
+       * or display point. No instruction takes more than 21 clocks. */
+      count = diff_mode ? 1 << 10 : 1 << 16;
+      if(max_steps && max_steps - steps < count) {
+         count = max_steps - steps;
+      }
+      if(display_steps && next_display - steps < count) {
+         count = next_display - steps;
+      }
+      if(max_clocks && (max_clocks - clocks) / 21 < count) {
+         count = (max_clocks - clocks) / 21;
+         if(count == 0) {
+            count = 1;
+         }
+      }
+      if(diff_mode) {
+         if(!RunDiff(count, &status)) {
+            return STOP_DIVERGED;
+         }
+      } else {
+         status = q1_run(cpu, count);
+      }
+      if(status == Q1_FAULT) {
+         return STOP_FAULT;
+      }
 
-static void lcx() {
-   regc = memory[(regxh << 8) | regxl];
-}
+   }
 
-static void ret() {
-   preg = (regxh << 8) | regxl;
-}
+   return STOP_HALTED;
 
-static void hlt() {
-   halted = 1;
 }
 
-typedef void (*InstructionFunc)();
-
-static InstructionFunc ls_class[16] = {
-   ldb, ldc, lxh, lxl, stb, stc, sxh, sxl, sta
-};
-
-static InstructionFunc math_class[16] = {
-   and, or, shl, shr, add, inc, dec, not, clr
-};
-
-static InstructionFunc misc_class[16] = {
-   mab, mac, sax, sbx, scx, lbx, lcx, ret, hlt
-};
-
-static void j_inst(unsigned char func) {
-
-   const unsigned char c_func = (func >> 0) & 1;
-   const unsigned char z_func = (func >> 1) & 1;
-   const unsigned char n_func = (func >> 2) & 1;
-   const unsigned char is_call = (func >> 3) & 1;
+/* Run a farm manifest using the command line settings as defaults. */
+int Farm(q1_engine_t engine, const q1_regs_t *regs) {
 
-   operand = (unsigned short)memory[preg++] << 8;
-   operand |= memory[preg++];
+   FarmOptionsType options;
+   int rc;
 
-   if((!c_func | c_flag) & (!z_func | z_flag) & (!n_func | n_flag)) {
-      if(is_call) {
-         regxh = preg >> 8;
-         regxl = preg & 0xFF;
-      }
-      preg = operand;
+   if(diff_mode) {
+      fprintf(stderr, "ERROR: -diff cannot be used with -farm\n");
+      return -1;
    }
-}
 
-static void ls_inst(unsigned char func) {
-   void (*inst)() = ls_class[func];
-   operand = (unsigned short)memory[preg++] << 8;
-   operand |= memory[preg++];
-   if(inst) {
-      (inst)();
-   } else {
-      fprintf(stderr, "ERROR: invalid LS instruction: %u\n",
-         (unsigned int)func);
+   options.threads = farm_threads;
+   options.engine = engine;
+   options.lockstep = lockstep;
+   options.format = format;
+   options.regs = *regs;
+   options.max_steps = max_steps;
+   options.max_clocks = max_clocks;
+   options.dump_start = dump_start;
+   options.dump_count = dump_count;
+   options.output = stdout;
+   if(output_file != NULL) {
+      options.output = fopen(output_file, "w");
+      if(options.output == NULL) {
+         fprintf(stderr, "ERROR: could not open %s\n", output_file);
+         return -1;
+      }
    }
-}
 
-static void math_inst(unsigned char func) {
-   void (*inst)() = math_class[func];
-   if(inst) {
-      (inst)();
-   } else {
-      fprintf(stderr, "ERROR: invalid MATH instruction: %u\n",
-         (unsigned int)func);
-   }
-}
+   rc = RunFarm(farm_file, &options);
 
-static void misc_inst(unsigned char func) {
-   void (*inst)() = misc_class[func];
-   if(inst) {
-      (inst)();
-   } else {
-      fprintf(stderr, "ERROR: invalid MISC instruction: %u\n",
-         (unsigned int)func);
+   if(output_file != NULL) {
+      fclose(options.output);
    }
-}
+   q1_destroy(cpu);
 
-/* Execute the next instruction. */
-static void next() {
-
-   opcode = memory[preg];
-   const unsigned char inst_class = opcode >> 4;
-   const unsigned char inst_func = opcode & 0x0F;
-
-   ++preg;
-
-   switch(inst_class) {
-   case 0:     // Jump
-      j_inst(inst_func);
-      clocks += 7 * 3;
-      break;
-   case 1:     // Load/Store
-      ls_inst(inst_func);
-      clocks += 7 * 3;
-      break;
-   case 2:     // Math
-      math_inst(inst_func);
-      clocks += 3 * 3;
-      break;
-   case 3:     // Misc
-      misc_inst(inst_func);
-      clocks += 3 * 3;
-      break;
-   default:
-      fprintf(stderr, "ERROR: invalid instruction class: %u\n",
-         (unsigned int)inst_class);
-      break;
-   }
+   return rc;
 
 }
 
 int main(int argc, char *argv[]) {
 
-   FILE *fd;
+   const ImageType *ip;
    const char *file_name = NULL;
+   q1_profile_t *prof = NULL;
+   q1_trace_t *trace = NULL;
+   q1_history_t *hist = NULL;
+   q1_engine_t engine = Q1_ENGINE_INTERP;
+   q1_regs_t regs;
+   StopType reason;
+   struct timeval start_time, end_time;
    int x;
 
-   rega = 0xFF;
-   regb = 0xFF;
-   regc = 0xFF;
-   regxh = 0xFF;
-   regxl = 0xFF;
-   c_flag = 1;
-   z_flag = 1;
-   n_flag = 1;
+   cpu = q1_create();
+   if(cpu == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return -1;
+   }
+   q1_get_regs(cpu, &regs);
 
    for(x = 1; x < argc; x++) {
       if(!strcmp(argv[x], "-a") && x + 1 < argc) {
          ++x;
-         rega = (unsigned char)atoi(argv[x]);
+         regs.a = (unsigned char)atoi(argv[x]);
       } else if(!strcmp(argv[x], "-b") && x + 1 < argc) {
          ++x;
-         regb = (unsigned char)atoi(argv[x]);
+         regs.b = (unsigned char)atoi(argv[x]);
       } else if(!strcmp(argv[x], "-c") && x + 1 < argc) {
          ++x;
-         regc = (unsigned char)atoi(argv[x]);
+         regs.c = (unsigned char)atoi(argv[x]);
+      } else if(!strcmp(argv[x], "-engine") && x + 1 < argc) {
+         ++x;
+         lockstep = !strcmp(argv[x], "simd");
+         if(!lockstep && !q1_find_engine(argv[x], &engine)) {
+            fprintf(stderr, "ERROR: unknown engine: %s\n", argv[x]);
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-format") && x + 1 < argc) {
+         ++x;
+         if(!FindFormat(argv[x], &format)) {
+            fprintf(stderr, "ERROR: unknown format: %s\n", argv[x]);
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-farm") && x + 1 < argc) {
+         ++x;
+         farm_file = argv[x];
+      } else if(!strcmp(argv[x], "-threads") && x + 1 < argc) {
+         ++x;
+         farm_threads = (unsigned int)ParseNumber(argv[x]);
+      } else if(!strcmp(argv[x], "-sym") && x + 1 < argc) {
+         ++x;
+         if(!LoadSymbols(argv[x])) {
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-profile") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         profile_file = argv[x];
+      } else if(!strcmp(argv[x], "-stacks") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         stacks_file = argv[x];
+      } else if(!strcmp(argv[x], "-trace") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         trace_file = argv[x];
+      } else if(!strcmp(argv[x], "-lastwrite") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         last_write = argv[x];
+      } else if(!strcmp(argv[x], "-o") && x + 1 < argc) {
+         ++x;
+         output_file = argv[x];
+      } else if(!strcmp(argv[x], "-time")) {
+         batch_mode = 1;
+         show_time = 1;
+      } else if(!strcmp(argv[x], "-debug")) {
+         debug_mode = 1;
+      } else if(!strcmp(argv[x], "-gdb") && x + 1 < argc) {
+         ++x;
+         gdb_port = argv[x];
+      } else if(!strcmp(argv[x], "-diff")) {
+         batch_mode = 1;
+         diff_mode = 1;
+      } else if(!strcmp(argv[x], "-batch")) {
+         batch_mode = 1;
+      } else if(!strcmp(argv[x], "-json")) {
+         batch_mode = 1;
+         json_output = 1;
+      } else if(!strcmp(argv[x], "-steps") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         max_steps = ParseNumber(argv[x]);
+      } else if(!strcmp(argv[x], "-clocks") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         max_clocks = ParseNumber(argv[x]);
+      } else if(!strcmp(argv[x], "-every") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         display_steps = ParseNumber(argv[x]);
+      } else if(!strcmp(argv[x], "-interval") && x + 1 < argc) {
+         ++x;
+         batch_mode = 1;
+         display_ms = (unsigned int)ParseNumber(argv[x]);
+      } else if(!strcmp(argv[x], "-dump") && x + 2 < argc) {
+         batch_mode = 1;
+         dump_start = (unsigned int)ParseNumber(argv[x + 1]) & 0xFFFF;
+         dump_count = (unsigned int)ParseNumber(argv[x + 2]);
+         if(dump_count > (1 << 16) - dump_start) {
+            dump_count = (1 << 16) - dump_start;
+         }
+         x += 2;
       } else if(!strcmp(argv[x], "-h") || file_name != NULL) {
          if(strcmp(argv[x], "-h")) {
             fprintf(stderr, "ERROR: invalid or incomplete argument: %s\n",
                argv[x]);
          }
-         fprintf(stderr, "usage: %s [options] <filename>\n", argv[0]);
-         fprintf(stderr, "options:\n");
-         fprintf(stderr, "\t-a <number>\tValue for register A\n");
-         fprintf(stderr, "\t-b <number>\tValue for register B\n");
-         fprintf(stderr, "\t-c <number>\tValue for register C\n");
-         fprintf(stderr, "\t-h\t\tDisplay this message\n");
+         DisplayUsage(argv[0]);
          return -1;
       } else {
          file_name = argv[x];
       }
    }
 
+   if(farm_file != NULL) {
+      if(profile_file != NULL || stacks_file != NULL || trace_file != NULL
+         || last_write != NULL || debug_mode || gdb_port != NULL) {
+         fprintf(stderr, "ERROR: -profile, -stacks, -trace, -lastwrite, "
+            "-debug and -gdb cannot be used with -farm\n");
+         return -1;
+      }
+      return Farm(engine, &regs);
+   }
+   if(lockstep) {
+      fprintf(stderr, "ERROR: the simd engine requires -farm\n");
+      return -1;
+   }
+
+   if((debug_mode || gdb_port != NULL)
+      && (diff_mode || last_write != NULL)) {
+      fprintf(stderr, "ERROR: -diff and -lastwrite cannot be used "
+         "with -debug or -gdb\n");
+      return -1;
+   }
+   if(debug_mode && gdb_port != NULL) {
+      fprintf(stderr, "ERROR: -debug cannot be used with -gdb\n");
+      return -1;
+   }
+
    if(file_name == NULL) {
       fprintf(stderr, "ERROR: no file specified\n");
       return -1;
    }
 
-   fd = fopen(file_name, "rb");
-   if(fd == NULL) {
-      fprintf(stderr, "ERROR: could not open %s\n", file_name);
+   x = LoadImage(file_name, format);
+   if(x < 0) {
       return -1;
    }
+   ip = GetImage(x);
+   q1_load(cpu, ip->start, ip->data, ip->size);
+   q1_set_regs(cpu, &regs);
+   q1_set_engine(cpu, engine);
+
+   if(profile_file != NULL || stacks_file != NULL) {
+      prof = q1_profile_create();
+      if(prof == NULL) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         return -1;
+      }
+      q1_set_profile(cpu, prof);
+   }
+
+   if(trace_file != NULL) {
+      trace = q1_trace_open(trace_file);
+      if(trace == NULL) {
+         fprintf(stderr, "ERROR: could not open %s\n", trace_file);
+         return -1;
+      }
+      q1_set_trace(cpu, trace);
+   }
+
+   if(last_write != NULL) {
+      hist = q1_history_create(0);
+      if(hist == NULL) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         return -1;
+      }
+      q1_set_history(cpu, hist);
+   }
+
+   if(diff_mode) {
+      reference = q1_create();
+      if(reference == NULL) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         return -1;
+      }
+      q1_set_engine(reference, Q1_ENGINE_INTERP);
+      q1_set_log(reference, NULL);
+      q1_load(reference, ip->start, ip->data, ip->size);
+      q1_set_regs(reference, &regs);
+   }
+
+   if(debug_mode) {
+      x = RunDebugger(cpu, stdin) ? -1 : 0;
+   } else if(gdb_port != NULL) {
+      x = RunGdbServer(cpu, gdb_port) ? -1 : 0;
+   } else {
 
-   memset(memory, 0xFF, sizeof(memory));
+      gettimeofday(&start_time, NULL);
+      reason = Run();
+      gettimeofday(&end_time, NULL);
+      run_seconds = (end_time.tv_sec - start_time.tv_sec)
+                  + (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
 
-   preg = 0;
-   for(;;) {
-      x = fgetc(fd);
-      if(x == EOF) {
-         break;
+      x = reason == STOP_DIVERGED ? 1 : 0;
+      if(hist != NULL && !RewindToWrite(&reason)) {
+         x = -1;
       }
-      if(preg == 0xFFFF) {
-         fprintf(stderr, "WARN: input file too large\n");
-         break;
+
+      if(batch_mode) {
+         DisplayResult(reason);
       }
-      memory[preg++] = (unsigned char)x;
+
+   }
+
+   if(trace != NULL) {
+      q1_set_trace(cpu, NULL);
+      if(!q1_trace_close(trace)) {
+         fprintf(stderr, "ERROR: could not write %s\n", trace_file);
+         x = -1;
+      }
+   }
+   if(profile_file != NULL && !WriteReport(profile_file, prof, 0)) {
+      x = -1;
+   }
+   if(stacks_file != NULL && !WriteReport(stacks_file, prof, 1)) {
+      x = -1;
    }
 
-   fclose(fd);
+   q1_profile_destroy(prof);
+   q1_history_destroy(hist);
+   q1_destroy(reference);
+   q1_destroy(cpu);
+   FreeSymbols();
+
+   return x;
+
+}
+
+
+void DisplayUsage(const char *name) {
+   fprintf(stderr, "usage: %s [options] <filename>\n", name);
+   fprintf(stderr, "options:\n");
+   fprintf(stderr, "\t-a <number>\tValue for register A\n");
+   fprintf(stderr, "\t-b <number>\tValue for register B\n");
+   fprintf(stderr, "\t-c <number>\tValue for register C\n");
+   fprintf(stderr, "\t-engine <name>\tExecution engine (interp, threaded,\n");
+   fprintf(stderr, "\t\t\tcached, block, jit, simd with -farm)\n");
+   fprintf(stderr, "\t-format <name>\tInput format (raw, hex, list, ihex,\n");
+   fprintf(stderr, "\t\t\tseg; default: from the file extension)\n");
+   fprintf(stderr, "\t-farm <file>\tRun the jobs in a manifest in parallel\n");
+   fprintf(stderr, "\t-threads <n>\tWorker threads for -farm (default: all)\n");
+   fprintf(stderr, "\t-o <file>\tWrite -farm results to a file\n");
+   fprintf(stderr, "\t-sym <file>\tLoad labels from an asmq1 symbol file\n");
+   fprintf(stderr, "\t-profile <file>\tWrite a profile (- for stdout)\n");
+   fprintf(stderr, "\t-stacks <file>\tWrite call stacks for flamegraph.pl\n");
+   fprintf(stderr, "\t-trace <file>\tRecord every instruction for q1trace\n");
+   fprintf(stderr, "\t-lastwrite <addr>\tShow the state before the last\n");
+   fprintf(stderr, "\t\t\twrite to addr\n");
+   fprintf(stderr, "\t-time\t\tReport run time and instructions per second\n");
+   fprintf(stderr, "\t-debug\t\tRun debugger commands from stdin\n");
+   fprintf(stderr, "\t-gdb <port>\tServe gdb on a local port (- for stdio)\n");
+   fprintf(stderr, "\t-diff\t\tCheck the engine against the interpreter\n");
+   fprintf(stderr, "\t-batch\t\tRun without display and print the result\n");
+   fprintf(stderr, "\t-json\t\tPrint the result as JSON (implies -batch)\n");
+   fprintf(stderr, "\t-steps <n>\tStop after n instructions\n");
+   fprintf(stderr, "\t-clocks <n>\tStop after n clocks\n");
+   fprintf(stderr, "\t-every <n>\tDisplay state every n instructions\n");
+   fprintf(stderr, "\t-interval <ms>\tDisplay state every ms milliseconds\n");
+   fprintf(stderr, "\t-dump <addr> <n>\tInclude n bytes of memory in result\n");
+   fprintf(stderr, "\t-h\t\tDisplay this message\n");
+}
+
+/* Write the profile report or the collapsed stacks to a file.
+ * Returns 0 on error. */
+int WriteReport(const char *name, const q1_profile_t *prof, int stacks) {
+
+   FILE *fd;
+   int rc;
+
+   fd = strcmp(name, "-") ? fopen(name, "w") : stdout;
+   if(fd == NULL) {
+      fprintf(stderr, "ERROR: could not open %s\n", name);
+      return 0;
+   }
+   if(stacks) {
+      WriteStacks(fd, prof);
+   } else {
+      WriteProfile(fd, prof, q1_memory(cpu));
+   }
+   rc = fd == stdout ? fflush(fd) == 0 : fclose(fd) == 0;
+   if(!rc) {
+      fprintf(stderr, "ERROR: could not write %s\n", name);
+   }
+   return rc;
+
+}
+
+/* Move the machine back to just before the last write to the -lastwrite
+ * address. Returns 0 if the address is invalid. */
+int RewindToWrite(StopType *reason) {
 
-   clocks = 0;
-   preg = 0;
-   halted = 0;
-   while(!halted) {
-      DisplayState();
-      next();
+   unsigned long long step;
+   unsigned short addr;
+   char *end;
+
+   if(!LookupSymbol(last_write, &addr)) {
+      step = strtoull(last_write, &end, 0);
+      if(end == last_write || *end || step > 0xFFFF) {
+         fprintf(stderr, "ERROR: invalid address: %s\n", last_write);
+         return 0;
+      }
+      addr = (unsigned short)step;
+   }
+   if(q1_history_last_write(cpu, addr, &step)) {
+      *reason = STOP_WRITE;
+   } else {
+      fprintf(stderr, "no write to %04x\n", addr);
    }
+   return 1;
+
+}
+
+unsigned long long ParseNumber(const char *str) {
+   return strtoull(str, NULL, 0);
+}
+
+/* Display the final state in a machine-readable form. */
+void DisplayResult(StopType reason) {
+
+   const unsigned char *memory = q1_memory(cpu);
+   const unsigned long long steps = q1_steps(cpu);
+   const unsigned long long clocks = q1_clocks(cpu);
+   q1_regs_t regs;
+   unsigned int x;
+
+   q1_get_regs(cpu, &regs);
 
-   return 0;
+   if(json_output) {
+      printf("{\"status\":\"%s\",", STOP_NAMES[reason]);
+      printf("\"instructions\":%llu,\"clocks\":%llu,", steps, clocks);
+      printf("\"pc\":%u,\"a\":%u,\"b\":%u,\"c\":%u,\"x\":%u,",
+         (unsigned int)regs.pc, (unsigned int)regs.a, (unsigned int)regs.b,
+         (unsigned int)regs.c, (unsigned int)regs.x);
+      printf("\"flags\":{\"c\":%u,\"z\":%u,\"n\":%u}",
+         (unsigned int)regs.c_flag, (unsigned int)regs.z_flag,
+         (unsigned int)regs.n_flag);
+      if(show_time) {
+         printf(",\"seconds\":%.6f,\"rate\":%.0f", run_seconds,
+            run_seconds > 0 ? steps / run_seconds : 0.0);
+      }
+      if(dump_count > 0) {
+         printf(",\"memory\":{\"start\":%u,\"data\":\"", dump_start);
+         for(x = 0; x < dump_count; x++) {
+            printf("%02x", (unsigned int)memory[dump_start + x]);
+         }
+         printf("\"}");
+      }
+      printf("}\n");
+   } else {
+      printf("status %s\n", STOP_NAMES[reason]);
+      printf("instructions %llu\n", steps);
+      printf("clocks %llu\n", clocks);
+      printf("pc %u\n", (unsigned int)regs.pc);
+      printf("a %u\n", (unsigned int)regs.a);
+      printf("b %u\n", (unsigned int)regs.b);
+      printf("c %u\n", (unsigned int)regs.c);
+      printf("x %u\n", (unsigned int)regs.x);
+      printf("flags %c%c%c\n", regs.c_flag ? 'C' : '-',
+         regs.z_flag ? 'Z' : '-', regs.n_flag ? 'N' : '-');
+      if(show_time) {
+         printf("seconds %.6f\n", run_seconds);
+         printf("rate %.0f\n", run_seconds > 0 ? steps / run_seconds : 0.0);
+      }
+      for(x = 0; x < dump_count; x++) {
+         if((x & (BYTES_PER_LINE - 1)) == 0) {
+            printf("%smemory %04x:", x ? "\n" : "", dump_start + x);
+         }
+         printf(" %02x", (unsigned int)memory[dump_start + x]);
+      }
+      if(dump_count > 0) {
+         printf("\n");
+      }
+   }
 
 }
 
-static void DisplayByte(unsigned char byte) {
+static void DisplayByte(FILE *fd, unsigned char byte) {
    int x;
    for(x = 0; x < 8; x++) {
       if(byte & (1 << (7 - x))) {
-         printf("o");
+         fprintf(fd, "o");
       } else {
-         printf("-");
+         fprintf(fd, "-");
       }
    }
 }
 
-static void DisplayWord(unsigned short word) {
-   DisplayByte((unsigned char)(word >> 8));
-   printf(" ");
-   DisplayByte((unsigned char)word);
+static void DisplayWord(FILE *fd, unsigned short word) {
+   DisplayByte(fd, (unsigned char)(word >> 8));
+   fprintf(fd, " ");
+   DisplayByte(fd, (unsigned char)word);
 }
 
+/* Display the registers and memory. With -json this goes to stderr so
+ * that stdout holds only the result. */
 void DisplayState() {
 
+   FILE *fd = json_output ? stderr : stdout;
+   const unsigned char *memory = q1_memory(cpu);
+   q1_regs_t regs;
    unsigned int x, y;
 
-   printf("\033[2J\033[;H");
-   printf("CLOCKS: %u\n", clocks);
+   q1_get_regs(cpu, &regs);
 
-   printf("PC: "); DisplayWord(preg);
-   printf("       %u\n", (unsigned int)preg);
+   fprintf(fd, "\033[2J\033[;H");
+   fprintf(fd, "CLOCKS: %llu\n", q1_clocks(cpu));
 
-   printf("A:           "); DisplayByte(rega);
-   printf(c_flag ? " C " : "   ");
-   printf(z_flag ? "Z " : "  ");
-   printf(n_flag ? "N " : "  ");
-   printf("%u\n", (unsigned int)rega);
+   fprintf(fd, "PC: "); DisplayWord(fd, regs.pc);
+   fprintf(fd, "       %u\n", (unsigned int)regs.pc);
 
-   printf("B:           "); DisplayByte(regb);
-   printf("       %u\n", (unsigned int)regb);
+   fprintf(fd, "A:           "); DisplayByte(fd, regs.a);
+   fprintf(fd, regs.c_flag ? " C " : "   ");
+   fprintf(fd, regs.z_flag ? "Z " : "  ");
+   fprintf(fd, regs.n_flag ? "N " : "  ");
+   fprintf(fd, "%u\n", (unsigned int)regs.a);
 
-   printf("C:           "); DisplayByte(regc);
-   printf("       %u\n", (unsigned int)regc);
+   fprintf(fd, "B:           "); DisplayByte(fd, regs.b);
+   fprintf(fd, "       %u\n", (unsigned int)regs.b);
 
-   printf("X:  "); DisplayByte(regxh); printf(" ");
-                   DisplayByte(regxl);
-   printf("       %u\n", ((unsigned int)regxh << 8) | regxl);
+   fprintf(fd, "C:           "); DisplayByte(fd, regs.c);
+   fprintf(fd, "       %u\n", (unsigned int)regs.c);
+
+   fprintf(fd, "X:  "); DisplayWord(fd, regs.x);
+   fprintf(fd, "       %u\n", (unsigned int)regs.x);
 
    x = 0;
    while(x < BYTES_PER_LINE * (MAX_LINES - 9)) {
-      printf("%04x:", x);
+      fprintf(fd, "%04x:", x);
       for(y = 0; y < BYTES_PER_LINE; y++, x++) {
          if((y & 7) == 0) {
-            printf(" ");
+            fprintf(fd, " ");
          }
-         printf("%02x ", (unsigned int)memory[x]);
+         fprintf(fd, "%02x ", (unsigned int)memory[x]);
       }
-      printf("\n");
+      fprintf(fd, "\n");
    }
 
-   usleep(100000);
-
 }
 
@@ -0,0 +1,127 @@
+/* Q1 simulator library: machine snapshots. */
+
+#include "q1cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct q1_snapshot {
+   unsigned long long serial;       /* Changes each time it is saved. */
+   unsigned char rega, regb, regc;
+   unsigned char z_flag, c_flag, n_flag;
+   unsigned char regxh, regxl;
+   unsigned short preg;
+   unsigned char halted;
+   unsigned char faulted;
+   unsigned long long clocks;
+   unsigned long long steps;
+   unsigned char memory[1 << 16];
+};
+
+/* Serials are shared by all machines so a machine never mistakes
+ * another snapshot for the one its dirty pages are relative to. */
+static unsigned long long next_serial = 0;
+
+static void RestorePage(q1_cpu_t *cpu, const q1_snapshot_t *snap,
+                        unsigned int page);
+
+q1_snapshot_t *q1_snapshot_create(void) {
+   q1_snapshot_t *snap = malloc(sizeof(q1_snapshot_t));
+   if(snap) {
+      snap->serial = 0;
+   }
+   return snap;
+}
+
+void q1_snapshot_destroy(q1_snapshot_t *snap) {
+   free(snap);
+}
+
+void q1_snapshot_save(q1_cpu_t *cpu, q1_snapshot_t *snap) {
+
+   unsigned int page;
+
+   snap->rega = cpu->rega;
+   snap->regb = cpu->regb;
+   snap->regc = cpu->regc;
+   snap->z_flag = cpu->z_flag;
+   snap->c_flag = cpu->c_flag;
+   snap->n_flag = cpu->n_flag;
+   snap->regxh = cpu->regxh;
+   snap->regxl = cpu->regxl;
+   snap->preg = cpu->preg;
+   snap->halted = cpu->halted;
+   snap->faulted = cpu->faulted;
+   snap->clocks = cpu->clocks;
+   snap->steps = cpu->steps;
+
+   /* If the snapshot was last saved from or restored to this machine
+    * only the pages written since then differ. */
+   if(snap->serial != 0 && snap->serial == cpu->snapshot) {
+      for(page = 0; page < 256; page++) {
+         if(cpu->pages[page]) {
+            memcpy(&snap->memory[page << 8], &cpu->memory[page << 8], 256);
+         }
+      }
+   } else {
+      memcpy(snap->memory, cpu->memory, sizeof(snap->memory));
+   }
+
+   snap->serial = __atomic_add_fetch(&next_serial, 1, __ATOMIC_RELAXED);
+   cpu->snapshot = snap->serial;
+   memset(cpu->pages, 0, sizeof(cpu->pages));
+
+}
+
+void q1_snapshot_restore(q1_cpu_t *cpu, const q1_snapshot_t *snap) {
+
+   const int partial = snap->serial != 0 && snap->serial == cpu->snapshot;
+   unsigned int page;
+
+   cpu->rega = snap->rega;
+   cpu->regb = snap->regb;
+   cpu->regc = snap->regc;
+   cpu->z_flag = snap->z_flag;
+   cpu->c_flag = snap->c_flag;
+   cpu->n_flag = snap->n_flag;
+   cpu->regxh = snap->regxh;
+   cpu->regxl = snap->regxl;
+   cpu->preg = snap->preg;
+   cpu->halted = snap->halted;
+   cpu->faulted = snap->faulted;
+   cpu->clocks = snap->clocks;
+   cpu->steps = snap->steps;
+
+   for(page = 0; page < 256; page++) {
+      if(!partial || cpu->pages[page]) {
+         RestorePage(cpu, snap, page);
+      }
+   }
+
+   cpu->snapshot = snap->serial;
+   memset(cpu->pages, 0, sizeof(cpu->pages));
+
+}
+
+/* Copy a page back from a snapshot.
+ * Translated code is kept unless a byte it covers changed, so programs
+ * that are restored and run again do not have to be translated again.
+ */
+void RestorePage(q1_cpu_t *cpu, const q1_snapshot_t *snap,
+                 unsigned int page) {
+
+   const unsigned int start = page << 8;
+   unsigned int x;
+
+   if(cpu->decoded) {
+      for(x = start; x < start + 256; x++) {
+         if(cpu->memory[x] != snap->memory[x]) {
+            cpu->memory[x] = snap->memory[x];
+            Q1InvalidateCode(cpu, x);
+         }
+      }
+   } else {
+      memcpy(&cpu->memory[start], &snap->memory[start], 256);
+   }
+
+}
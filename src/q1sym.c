@@ -0,0 +1,161 @@
+/* Symbol files for q1sim.
+ *
+ * Symbols are kept sorted by address so that the label before an
+ * address can be found with a binary search.
+ */
+
+#include "q1sym.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE     1024
+
+typedef struct {
+   SymbolType symbol;
+   unsigned int order;        /* Position in the files loaded. */
+} EntryType;
+
+static EntryType *symbols;
+static unsigned int symbol_count;
+static unsigned int symbol_max;
+
+static int CompareEntries(const void *a, const void *b);
+
+int LoadSymbols(const char *name) {
+
+   FILE *fd;
+   char line[MAX_LINE];
+   unsigned int line_number;
+   unsigned long addr;
+   EntryType *ep;
+   unsigned int max;
+   char *p;
+   char *end;
+   size_t len;
+
+   fd = fopen(name, "r");
+   if(fd == NULL) {
+      fprintf(stderr, "ERROR: could not open %s\n", name);
+      return 0;
+   }
+
+   line_number = 0;
+   while(fgets(line, sizeof(line), fd)) {
+      ++line_number;
+      len = strcspn(line, "\r\n");
+      line[len] = 0;
+      if(len == 0) {
+         continue;
+      }
+      addr = strtoul(line, &end, 16);
+      p = end;
+      while(*p == ' ' || *p == '\t') {
+         ++p;
+      }
+      if(end == line || p == end || *p == 0 || addr > 0xFFFF) {
+         fprintf(stderr, "ERROR: %s:%u: invalid symbol\n", name,
+            line_number);
+         fclose(fd);
+         return 0;
+      }
+      if(symbol_count == symbol_max) {
+         max = symbol_max ? symbol_max * 2 : 256;
+         ep = realloc(symbols, max * sizeof(EntryType));
+         if(ep == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            fclose(fd);
+            return 0;
+         }
+         symbols = ep;
+         symbol_max = max;
+      }
+      ep = &symbols[symbol_count];
+      ep->symbol.name = strdup(p);
+      ep->symbol.addr = (unsigned short)addr;
+      ep->order = symbol_count;
+      if(ep->symbol.name == NULL) {
+         fprintf(stderr, "ERROR: out of memory\n");
+         fclose(fd);
+         return 0;
+      }
+      ++symbol_count;
+   }
+
+   fclose(fd);
+   qsort(symbols, symbol_count, sizeof(EntryType), CompareEntries);
+   return 1;
+
+}
+
+int CompareEntries(const void *a, const void *b) {
+   const EntryType *ea = (const EntryType*)a;
+   const EntryType *eb = (const EntryType*)b;
+   if(ea->symbol.addr != eb->symbol.addr) {
+      return ea->symbol.addr < eb->symbol.addr ? -1 : 1;
+   }
+   return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+const SymbolType *FindSymbol(unsigned short addr) {
+
+   unsigned int low, high, mid;
+
+   /* Find the first symbol after addr. */
+   low = 0;
+   high = symbol_count;
+   while(low < high) {
+      mid = (low + high) / 2;
+      if(symbols[mid].symbol.addr <= addr) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+   if(low == 0) {
+      return NULL;
+   }
+
+   /* Use the first of the symbols at the address before it. */
+   addr = symbols[low - 1].symbol.addr;
+   while(low > 1 && symbols[low - 2].symbol.addr == addr) {
+      --low;
+   }
+   return &symbols[low - 1].symbol;
+
+}
+
+int LookupSymbol(const char *name, unsigned short *addr) {
+   unsigned int x;
+   for(x = 0; x < symbol_count; x++) {
+      if(!strcmp(symbols[x].symbol.name, name)) {
+         *addr = symbols[x].symbol.addr;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+void FormatAddress(char *buffer, size_t size, unsigned short addr) {
+   const SymbolType *sp = FindSymbol(addr);
+   if(sp == NULL) {
+      snprintf(buffer, size, "%04x", (unsigned int)addr);
+   } else if(sp->addr == addr) {
+      snprintf(buffer, size, "%s", sp->name);
+   } else {
+      snprintf(buffer, size, "%s+%u", sp->name,
+         (unsigned int)(addr - sp->addr));
+   }
+}
+
+void FreeSymbols() {
+   unsigned int x;
+   for(x = 0; x < symbol_count; x++) {
+      free(symbols[x].symbol.name);
+   }
+   free(symbols);
+   symbols = NULL;
+   symbol_count = 0;
+   symbol_max = 0;
+}
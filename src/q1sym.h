@@ -0,0 +1,35 @@
+/* Symbol files for q1sim.
+ *
+ * A symbol file from asmq1 -sym or ldq1 -sym names the labels of a
+ * program so that addresses can be shown as a label and an offset.
+ */
+
+#ifndef Q1SYM_H
+#define Q1SYM_H
+
+#include <stddef.h>
+
+typedef struct {
+   char *name;
+   unsigned short addr;
+} SymbolType;
+
+/* Load a symbol file, adding to any symbols already loaded.
+ * Returns 0 on error. */
+int LoadSymbols(const char *name);
+
+/* Return the last symbol at or before addr, or NULL if there is none.
+ * Of several symbols at one address the first in the file is used. */
+const SymbolType *FindSymbol(unsigned short addr);
+
+/* Look up the address of a symbol by name. Returns 0 if not found. */
+int LookupSymbol(const char *name, unsigned short *addr);
+
+/* Format an address as "label", "label+offset" or, without a symbol,
+ * four hex digits. */
+void FormatAddress(char *buffer, size_t size, unsigned short addr);
+
+/* Release all symbols. */
+void FreeSymbols();
+
+#endif /* Q1SYM_H */
@@ -0,0 +1,154 @@
+/* Body of the direct-threaded interpreter.
+ *
+ * q1cpu.c includes this once for each variant, defining THREADED_NAME
+ * as the function to define and THREADED_BREAKS as 1 for the variant
+ * that stops at execution breakpoints or 0 for the variant that ignores
+ * them. The machine state is kept in locals and each handler dispatches
+ * the next instruction itself through a table of labels indexed by the
+ * opcode. The breakpoint variant adds 256 to the index if the PC has a
+ * breakpoint, so the check costs a load but no branch.
+ */
+
+static void THREADED_NAME(q1_cpu_t *cpu, unsigned long long count) {
+
+   static void *const TABLE[512] = {
+      [0x00 ... 0xFF] = &&trap,
+      [0x00 ... 0x0F] = &&op_j,
+      [0x10] = &&op_ldb,   [0x11] = &&op_ldc,   [0x12] = &&op_lxh,
+      [0x13] = &&op_lxl,   [0x14] = &&op_stb,   [0x15] = &&op_stc,
+      [0x16] = &&op_sxh,   [0x17] = &&op_sxl,   [0x18] = &&op_sta,
+      [0x20] = &&op_and,   [0x21] = &&op_or,    [0x22] = &&op_shl,
+      [0x23] = &&op_shr,   [0x24] = &&op_add,   [0x25] = &&op_inc,
+      [0x26] = &&op_dec,   [0x27] = &&op_not,   [0x28] = &&op_clr,
+      [0x30] = &&op_mab,   [0x31] = &&op_mac,   [0x32] = &&op_sax,
+      [0x33] = &&op_sbx,   [0x34] = &&op_scx,   [0x35] = &&op_lbx,
+      [0x36] = &&op_lcx,   [0x37] = &&op_ret,   [0x38] = &&op_hlt,
+      [0x100 ... 0x1FF] = &&check
+   };
+
+   const unsigned char *const breaks = cpu->breaks;
+   unsigned char *const memory = cpu->memory;
+   unsigned char a = cpu->rega;
+   unsigned char b = cpu->regb;
+   unsigned char c = cpu->regc;
+   unsigned short x = ((unsigned short)cpu->regxh << 8) | cpu->regxl;
+   unsigned char cf = cpu->c_flag;
+   unsigned char zf = cpu->z_flag;
+   unsigned char nf = cpu->n_flag;
+   unsigned short pc = cpu->preg;
+   unsigned short addr;
+   unsigned long long clk = cpu->clocks;
+   unsigned long long left = count;
+   unsigned char op;
+
+#define OPERAND() \
+   addr = ((unsigned short)memory[(unsigned short)(pc + 1)] << 8) \
+        | memory[(unsigned short)(pc + 2)]
+#define RESULT(value, carry) \
+   a = (value); cf = (carry); zf = a == 0; nf = a >> 7
+#define DISPATCH() \
+   op = memory[pc]; \
+   goto *TABLE[THREADED_BREAKS \
+      ? op | ((breaks[pc] & Q1_BREAK_EXEC) != 0) << 8 : op]
+#define NEXT(length, cycles) \
+   pc += (length); clk += (cycles); \
+   if(--left == 0) goto done; \
+   DISPATCH()
+
+   if(left == 0) {
+      return;
+   }
+   DISPATCH();
+
+check:
+   cpu->preg = pc;
+   cpu->steps += count - left;
+   count = left;
+   if(Q1StopAtBreak(cpu)) {
+      goto done;
+   }
+   goto *TABLE[op];
+
+op_j:
+   OPERAND();
+   pc += 3;
+   if(((!(op & 1)) | cf) & ((!(op & 2)) | zf) & ((!(op & 4)) | nf)) {
+      if(op & 8) {
+         x = pc;
+      }
+      pc = addr;
+   }
+   NEXT(0, 7 * 3);
+op_ldb:  OPERAND(); b = memory[addr];                    NEXT(3, 7 * 3);
+op_ldc:  OPERAND(); c = memory[addr];                    NEXT(3, 7 * 3);
+op_lxh:  OPERAND(); x = (x & 0x00FF) | (memory[addr] << 8); NEXT(3, 7 * 3);
+op_lxl:  OPERAND(); x = (x & 0xFF00) | memory[addr];     NEXT(3, 7 * 3);
+op_stb:  OPERAND(); Store(cpu, addr, b);                 NEXT(3, 7 * 3);
+op_stc:  OPERAND(); Store(cpu, addr, c);                 NEXT(3, 7 * 3);
+op_sxh:  OPERAND(); Store(cpu, addr, x >> 8);            NEXT(3, 7 * 3);
+op_sxl:  OPERAND(); Store(cpu, addr, x & 0xFF);          NEXT(3, 7 * 3);
+op_sta:  OPERAND(); Store(cpu, addr, a);                 NEXT(3, 7 * 3);
+op_and:  RESULT(b & c, 0);                               NEXT(1, 3 * 3);
+op_or:   RESULT(b | c, 0);                               NEXT(1, 3 * 3);
+op_shl:  RESULT(b << 1, b >> 7);                         NEXT(1, 3 * 3);
+op_shr:  RESULT(b >> 1, b & 1);                          NEXT(1, 3 * 3);
+op_add:  RESULT(b + c, (b + c) > 255);                   NEXT(1, 3 * 3);
+op_inc:  RESULT(b + 1, b == 255);                        NEXT(1, 3 * 3);
+op_dec:  RESULT(b - 1, b == 0);                          NEXT(1, 3 * 3);
+op_not:  RESULT(~b, 0);                                  NEXT(1, 3 * 3);
+op_clr:  RESULT(0, 0);                                   NEXT(1, 3 * 3);
+op_mab:  b = a;                                          NEXT(1, 3 * 3);
+op_mac:  c = a;                                          NEXT(1, 3 * 3);
+op_sax:  Store(cpu, x, a);                               NEXT(1, 3 * 3);
+op_sbx:  Store(cpu, x, b);                               NEXT(1, 3 * 3);
+op_scx:  Store(cpu, x, c);                               NEXT(1, 3 * 3);
+op_lbx:  b = memory[x];                                  NEXT(1, 3 * 3);
+op_lcx:  c = memory[x];                                  NEXT(1, 3 * 3);
+op_ret:  pc = x;                                         NEXT(0, 3 * 3);
+
+op_hlt:
+   cpu->halted = 1;
+   pc += 1;
+   clk += 3 * 3;
+   --left;
+   goto done;
+
+trap:
+   cpu->opcode = op;
+   invalid(cpu);
+   switch(op >> 4) {
+   case 1:
+      pc += 3;
+      clk += 7 * 3;
+      break;
+   case 2:
+   case 3:
+      pc += 1;
+      clk += 3 * 3;
+      break;
+   default:
+      pc += 1;
+      break;
+   }
+   --left;
+
+#undef OPERAND
+#undef RESULT
+#undef DISPATCH
+#undef NEXT
+
+done:
+   cpu->rega = a;
+   cpu->regb = b;
+   cpu->regc = c;
+   cpu->regxh = x >> 8;
+   cpu->regxl = x & 0xFF;
+   cpu->c_flag = cf;
+   cpu->z_flag = zf;
+   cpu->n_flag = nf;
+   cpu->preg = pc;
+   cpu->clocks = clk;
+   cpu->steps += count - left;
+
+}
+
@@ -0,0 +1,706 @@
+/* Trace analyzer for the Q1 Computer.
+ *
+ * Reads traces written by q1sim -trace (see q1rec.h) one block at a
+ * time, so memory use does not depend on the length of the trace.
+ * Blocks before the first step of interest are skipped using their
+ * headers alone, without being read or unpacked.
+ */
+
+#include "q1dis.h"
+#include "q1rec.h"
+#include "q1sym.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An instruction read from a trace. */
+typedef struct {
+   unsigned long long step;   /* Instructions before this one. */
+   unsigned short pc;
+   unsigned char opcode;
+   unsigned short operand;
+   unsigned char bits;        /* TRACE_* bits of the changed fields. */
+   unsigned char a, b, c;     /* Registers after the instruction. */
+   unsigned short x;
+   unsigned char flags;
+   int stored;                /* Nonzero if the instruction stored. */
+   unsigned short store_addr;
+   unsigned char store_value;
+} StepType;
+
+typedef struct {
+
+   const char *name;
+   FILE *fd;
+
+   /* Header of the current block. */
+   unsigned char type;
+   unsigned int raw_size;
+   unsigned int packed_size;
+   unsigned int count;
+   unsigned long long first;
+
+   unsigned char *packed;
+   unsigned char data[BLOCK_SIZE];
+   size_t size;
+   size_t pos;
+   unsigned int left;         /* Records left in the current block. */
+   int ended;
+
+   /* State after the last instruction read. */
+   unsigned long long step;
+   unsigned short pc;         /* Address after the last instruction. */
+   unsigned char a, b, c;
+   unsigned short x;
+   unsigned char flags;
+
+   /* Memory from the last state block, kept only for replay. */
+   unsigned char *memory;
+
+   /* Totals for info. */
+   unsigned long long blocks;
+   unsigned long long raw_bytes;
+   unsigned long long file_bytes;
+
+} TraceType;
+
+static void DisplayUsage(const char *name);
+static int ParseAddress(const char *str, unsigned short *addr);
+static int ParseCount(const char *str, unsigned long long *value);
+static int Info(TraceType *tp);
+static int List(TraceType *tp, unsigned long long from,
+                unsigned long long count, int use_pc, unsigned short pc,
+                int use_write, unsigned short write);
+static int Diff(TraceType *tp, TraceType *other);
+static int Replay(TraceType *tp, unsigned long long to,
+                  const char *output_name);
+static void PrintStep(const StepType *sp);
+static void PrintRegisters(unsigned short pc, unsigned char a,
+                           unsigned char b, unsigned char c,
+                           unsigned short x, unsigned char flags);
+static int OpenTrace(TraceType *tp, const char *name, int keep_memory);
+static void CloseTrace(TraceType *tp);
+static int ReadHeader(TraceType *tp);
+static int ReadData(TraceType *tp);
+static int SkipData(TraceType *tp);
+static int NextStep(TraceType *tp, unsigned long long from, StepType *sp);
+static int SameStep(const StepType *a, const StepType *b);
+static unsigned long long GetNumber(const unsigned char *p,
+                                    unsigned int size);
+
+int main(int argc, char *argv[]) {
+
+   TraceType *traces[2];
+   const char *names[2];
+   const char *command;
+   const char *output_name = NULL;
+   unsigned long long from = 0;
+   unsigned long long count = 0;
+   unsigned long long to = 0;
+   unsigned short pc = 0;
+   unsigned short write = 0;
+   int use_pc = 0;
+   int use_write = 0;
+   int use_to = 0;
+   unsigned int name_count = 0;
+   unsigned int needed;
+   int result;
+   int x;
+
+   if(argc < 2) {
+      DisplayUsage(argv[0]);
+      return -1;
+   }
+   command = argv[1];
+   if(!strcmp(command, "-h")) {
+      DisplayUsage(argv[0]);
+      return 0;
+   }
+
+   /* Symbols are loaded as they are seen so that -pc and -write can
+    * name labels from a -sym given before them. */
+   for(x = 2; x < argc; x++) {
+      if(!strcmp(argv[x], "-sym") && x + 1 < argc) {
+         ++x;
+         if(!LoadSymbols(argv[x])) {
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-from") && x + 1 < argc) {
+         ++x;
+         if(!ParseCount(argv[x], &from)) {
+            DisplayUsage(argv[0]);
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-count") && x + 1 < argc) {
+         ++x;
+         if(!ParseCount(argv[x], &count)) {
+            DisplayUsage(argv[0]);
+            return -1;
+         }
+      } else if(!strcmp(argv[x], "-to") && x + 1 < argc) {
+         ++x;
+         if(!ParseCount(argv[x], &to)) {
+            DisplayUsage(argv[0]);
+            return -1;
+         }
+         use_to = 1;
+      } else if(!strcmp(argv[x], "-pc") && x + 1 < argc) {
+         ++x;
+         if(!ParseAddress(argv[x], &pc)) {
+            fprintf(stderr, "ERROR: invalid address: %s\n", argv[x]);
+            return -1;
+         }
+         use_pc = 1;
+      } else if(!strcmp(argv[x], "-write") && x + 1 < argc) {
+         ++x;
+         if(!ParseAddress(argv[x], &write)) {
+            fprintf(stderr, "ERROR: invalid address: %s\n", argv[x]);
+            return -1;
+         }
+         use_write = 1;
+      } else if(!strcmp(argv[x], "-o") && x + 1 < argc) {
+         ++x;
+         output_name = argv[x];
+      } else if(argv[x][0] == '-' || name_count == 2) {
+         DisplayUsage(argv[0]);
+         return -1;
+      } else {
+         names[name_count++] = argv[x];
+      }
+   }
+
+   needed = strcmp(command, "diff") ? 1 : 2;
+   if(name_count != needed) {
+      DisplayUsage(argv[0]);
+      return -1;
+   }
+   for(x = 0; x < name_count; x++) {
+      traces[x] = malloc(sizeof(TraceType));
+      if(traces[x] == NULL
+         || !OpenTrace(traces[x], names[x], !strcmp(command, "replay"))) {
+         return -1;
+      }
+   }
+
+   if(!strcmp(command, "info")) {
+      result = Info(traces[0]);
+   } else if(!strcmp(command, "list")) {
+      result = List(traces[0], from, count, use_pc, pc, use_write, write);
+   } else if(!strcmp(command, "diff")) {
+      result = Diff(traces[0], traces[1]);
+   } else if(!strcmp(command, "replay")) {
+      result = Replay(traces[0], use_to ? to : ~0ULL, output_name);
+   } else {
+      DisplayUsage(argv[0]);
+      result = -1;
+   }
+
+   for(x = 0; x < name_count; x++) {
+      CloseTrace(traces[x]);
+      free(traces[x]);
+   }
+   FreeSymbols();
+   return result;
+
+}
+
+void DisplayUsage(const char *name) {
+   fprintf(stderr, "usage: %s <command> [options] <trace>\n", name);
+   fprintf(stderr, "commands:\n");
+   fprintf(stderr, "\tinfo\t\tShow the size and final state of a trace\n");
+   fprintf(stderr, "\tlist\t\tList the instructions in a trace\n");
+   fprintf(stderr, "\tdiff\t\tFind where two traces diverge "
+      "(takes two traces)\n");
+   fprintf(stderr, "\treplay\t\tShow the machine state at a step\n");
+   fprintf(stderr, "options:\n");
+   fprintf(stderr, "\t-sym <file>\tLoad labels from an asmq1 symbol file\n");
+   fprintf(stderr, "\t-from <n>\tStart listing at step n\n");
+   fprintf(stderr, "\t-count <n>\tList at most n instructions\n");
+   fprintf(stderr, "\t-pc <addr>\tList only instructions at addr\n");
+   fprintf(stderr, "\t-write <addr>\tList only stores to addr\n");
+   fprintf(stderr, "\t-to <n>\t\tReplay the first n steps "
+      "(default all)\n");
+   fprintf(stderr, "\t-o <file>\tWrite the replayed memory to file\n");
+}
+
+/* Parse a number or a label. Returns 0 on error. */
+int ParseAddress(const char *str, unsigned short *addr) {
+   unsigned long value;
+   char *end;
+   value = strtoul(str, &end, 0);
+   if(end != str && *end == 0 && value <= 0xFFFF) {
+      *addr = (unsigned short)value;
+      return 1;
+   }
+   return LookupSymbol(str, addr);
+}
+
+int ParseCount(const char *str, unsigned long long *value) {
+   char *end;
+   *value = strtoull(str, &end, 0);
+   return end != str && *end == 0;
+}
+
+/* Show the totals and final registers, reading only block headers. */
+int Info(TraceType *tp) {
+
+   unsigned long long first = 0;
+   int have_first = 0;
+
+   for(;;) {
+      if(!ReadHeader(tp)) {
+         return -1;
+      }
+      if(tp->type == BLOCK_END) {
+         break;
+      }
+      if(!have_first) {
+         first = tp->first;
+         have_first = 1;
+      }
+      if(!SkipData(tp)) {
+         return -1;
+      }
+   }
+
+   printf("instructions %llu\n", tp->first - first);
+   printf("first step   %llu\n", first);
+   printf("blocks       %llu\n", tp->blocks);
+   printf("raw bytes    %llu\n", tp->raw_bytes);
+   printf("file bytes   %llu\n", tp->file_bytes);
+   if(tp->first > first) {
+      printf("bytes/step   %.2f\n",
+         (double)tp->file_bytes / (double)(tp->first - first));
+   }
+   PrintRegisters(tp->pc, tp->a, tp->b, tp->c, tp->x, tp->flags);
+   return 0;
+
+}
+
+/* List count instructions (0 for all) starting at step from. */
+int List(TraceType *tp, unsigned long long from,
+         unsigned long long count, int use_pc, unsigned short pc,
+         int use_write, unsigned short write) {
+
+   StepType step;
+   unsigned long long listed = 0;
+   int rc;
+
+   while((rc = NextStep(tp, from, &step)) > 0) {
+      if(use_pc && step.pc != pc) {
+         continue;
+      }
+      if(use_write && !(step.stored && step.store_addr == write)) {
+         continue;
+      }
+      PrintStep(&step);
+      ++listed;
+      if(listed == count) {
+         break;
+      }
+   }
+   return rc < 0 ? -1 : 0;
+
+}
+
+/* Compare two traces step by step. Returns 1 if they differ. */
+int Diff(TraceType *tp, TraceType *other) {
+
+   StepType a, b;
+   int ra, rb;
+
+   for(;;) {
+      ra = NextStep(tp, 0, &a);
+      rb = NextStep(other, 0, &b);
+      if(ra < 0 || rb < 0) {
+         return -1;
+      }
+      if(ra == 0 && rb == 0) {
+         printf("traces match (%llu instructions)\n", tp->step);
+         return 0;
+      }
+      if(ra == 0 || rb == 0) {
+         printf("%s ends after %llu instructions\n",
+            ra == 0 ? tp->name : other->name,
+            ra == 0 ? tp->step : other->step);
+         PrintStep(ra == 0 ? &b : &a);
+         return 1;
+      }
+      if(!SameStep(&a, &b)) {
+         printf("traces diverge at step %llu\n", a.step);
+         printf("%s:\n", tp->name);
+         PrintStep(&a);
+         PrintRegisters(a.pc, a.a, a.b, a.c, a.x, a.flags);
+         printf("%s:\n", other->name);
+         PrintStep(&b);
+         PrintRegisters(b.pc, b.a, b.b, b.c, b.x, b.flags);
+         return 1;
+      }
+   }
+
+}
+
+/* Apply the first to steps to the memory of the last state block
+ * before them, then show the registers and, with output_name, write
+ * the memory. */
+int Replay(TraceType *tp, unsigned long long to, const char *output_name) {
+
+   StepType step;
+   FILE *fd;
+   int rc = 0;
+
+   /* A trace starts with the state of the machine it was attached to. */
+   if(!ReadHeader(tp)) {
+      return -1;
+   }
+   if(tp->type != BLOCK_STATE) {
+      fprintf(stderr, "ERROR: %s has no machine state\n", tp->name);
+      return -1;
+   }
+   if(!ReadData(tp)) {
+      return -1;
+   }
+
+   while(tp->step < to && (rc = NextStep(tp, 0, &step)) > 0) {
+      if(step.stored) {
+         tp->memory[step.store_addr] = step.store_value;
+      }
+   }
+   if(rc < 0) {
+      return -1;
+   }
+
+   printf("step %llu\n", tp->step);
+   PrintRegisters(tp->pc, tp->a, tp->b, tp->c, tp->x, tp->flags);
+
+   if(output_name != NULL) {
+      fd = fopen(output_name, "wb");
+      if(fd == NULL) {
+         fprintf(stderr, "ERROR: could not open %s\n", output_name);
+         return -1;
+      }
+      if(fwrite(tp->memory, 1, BLOCK_SIZE, fd) != BLOCK_SIZE) {
+         fprintf(stderr, "ERROR: could not write %s\n", output_name);
+         fclose(fd);
+         return -1;
+      }
+      if(fclose(fd)) {
+         fprintf(stderr, "ERROR: could not write %s\n", output_name);
+         return -1;
+      }
+   }
+   return 0;
+
+}
+
+/* Print a step with the registers it changed and what it stored. */
+void PrintStep(const StepType *sp) {
+
+   char addr[64];
+   char inst[64];
+
+   FormatAddress(addr, sizeof(addr), sp->pc);
+   FormatInstruction(inst, sizeof(inst), sp->opcode, sp->operand);
+   printf("%12llu  %-20s %-26s", sp->step, addr, inst);
+   if(sp->bits & TRACE_A) {
+      printf(" a=%02X", sp->a);
+   }
+   if(sp->bits & TRACE_B) {
+      printf(" b=%02X", sp->b);
+   }
+   if(sp->bits & TRACE_C) {
+      printf(" c=%02X", sp->c);
+   }
+   if(sp->bits & TRACE_X) {
+      printf(" x=%04X", sp->x);
+   }
+   if(sp->bits & TRACE_FLAGS) {
+      printf(" flags=%c%c%c",
+         (sp->flags & TRACE_FLAG_C) ? 'C' : '-',
+         (sp->flags & TRACE_FLAG_Z) ? 'Z' : '-',
+         (sp->flags & TRACE_FLAG_N) ? 'N' : '-');
+   }
+   if(sp->stored) {
+      printf(" [%04X]=%02X", sp->store_addr, sp->store_value);
+   }
+   printf("\n");
+
+}
+
+/* Print registers, with the flags as C, Z and N or - for each. */
+void PrintRegisters(unsigned short pc, unsigned char a, unsigned char b,
+                    unsigned char c, unsigned short x, unsigned char flags) {
+   printf("pc %04X a %02X b %02X c %02X x %04X flags %c%c%c\n",
+      pc, a, b, c, x,
+      (flags & TRACE_FLAG_C) ? 'C' : '-',
+      (flags & TRACE_FLAG_Z) ? 'Z' : '-',
+      (flags & TRACE_FLAG_N) ? 'N' : '-');
+}
+
+/* Open a trace, keeping memory for replay if keep_memory is set.
+ * Returns 0 on error. */
+int OpenTrace(TraceType *tp, const char *name, int keep_memory) {
+
+   unsigned char magic[TRACE_MAGIC_SIZE];
+
+   memset(tp, 0, sizeof(TraceType));
+   tp->name = name;
+   tp->fd = fopen(name, "rb");
+   if(tp->fd == NULL) {
+      fprintf(stderr, "ERROR: could not open %s\n", name);
+      return 0;
+   }
+   if(fread(magic, 1, sizeof(magic), tp->fd) != sizeof(magic)
+      || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+      fprintf(stderr, "ERROR: %s is not a Q1 trace\n", name);
+      fclose(tp->fd);
+      tp->fd = NULL;
+      return 0;
+   }
+   tp->packed = malloc(LZ_BOUND(BLOCK_SIZE));
+   if(keep_memory) {
+      tp->memory = malloc(BLOCK_SIZE);
+   }
+   if(tp->packed == NULL || (keep_memory && tp->memory == NULL)) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return 0;
+   }
+   tp->file_bytes = TRACE_MAGIC_SIZE;
+   return 1;
+
+}
+
+void CloseTrace(TraceType *tp) {
+   if(tp->fd) {
+      fclose(tp->fd);
+   }
+   free(tp->packed);
+   free(tp->memory);
+}
+
+/* Read the next block header, setting the state from it.
+ * Returns 0 on error. */
+int ReadHeader(TraceType *tp) {
+
+   unsigned char header[BLOCK_HEADER_SIZE];
+   const unsigned char *p = header;
+
+   if(fread(header, 1, sizeof(header), tp->fd) != sizeof(header)) {
+      fprintf(stderr, "ERROR: %s is truncated\n", tp->name);
+      return 0;
+   }
+   tp->type = *p++;
+   tp->raw_size = GetNumber(p, 4);        p += 4;
+   tp->packed_size = GetNumber(p, 4);     p += 4;
+   tp->count = GetNumber(p, 4);           p += 4;
+   tp->first = GetNumber(p, 8);           p += 8;
+   tp->pc = GetNumber(p, 2);              p += 2;
+   tp->a = *p++;
+   tp->b = *p++;
+   tp->c = *p++;
+   tp->x = GetNumber(p, 2);               p += 2;
+   tp->flags = *p++;
+   tp->step = tp->first;
+
+   if((tp->type != BLOCK_STATE && tp->type != BLOCK_STEPS
+       && tp->type != BLOCK_END)
+      || tp->raw_size > BLOCK_SIZE || tp->packed_size > tp->raw_size
+      || (tp->type == BLOCK_STATE && tp->raw_size != BLOCK_SIZE)) {
+      fprintf(stderr, "ERROR: %s has an invalid block\n", tp->name);
+      return 0;
+   }
+
+   ++tp->blocks;
+   tp->raw_bytes += tp->raw_size;
+   tp->file_bytes += BLOCK_HEADER_SIZE + tp->packed_size;
+   return 1;
+
+}
+
+/* Read and unpack the data of the current block. Returns 0 on error. */
+int ReadData(TraceType *tp) {
+
+   unsigned char *dest = tp->data;
+
+   if(tp->type == BLOCK_STATE && tp->memory) {
+      dest = tp->memory;
+   }
+   if(tp->packed_size == tp->raw_size) {
+      if(fread(dest, 1, tp->raw_size, tp->fd) != tp->raw_size) {
+         fprintf(stderr, "ERROR: %s is truncated\n", tp->name);
+         return 0;
+      }
+   } else if(fread(tp->packed, 1, tp->packed_size, tp->fd)
+                != tp->packed_size) {
+      fprintf(stderr, "ERROR: %s is truncated\n", tp->name);
+      return 0;
+   } else if(Q1Unpack(tp->packed, tp->packed_size, dest, BLOCK_SIZE)
+                != tp->raw_size) {
+      fprintf(stderr, "ERROR: %s has an invalid block\n", tp->name);
+      return 0;
+   }
+   tp->size = tp->raw_size;
+   tp->pos = 0;
+   return 1;
+
+}
+
+int SkipData(TraceType *tp) {
+   if(fseek(tp->fd, tp->packed_size, SEEK_CUR)) {
+      fprintf(stderr, "ERROR: %s is truncated\n", tp->name);
+      return 0;
+   }
+   return 1;
+}
+
+/* Read the next step at or after from.
+ * Returns 1 for a step, 0 at the end of the trace and -1 on error. */
+int NextStep(TraceType *tp, unsigned long long from, StepType *sp) {
+
+   const unsigned char *p;
+   const unsigned char *end;
+   unsigned char bits;
+   unsigned int length;
+
+   for(;;) {
+
+      while(tp->left == 0) {
+         if(tp->ended) {
+            return 0;
+         }
+         if(!ReadHeader(tp)) {
+            return -1;
+         }
+         if(tp->type == BLOCK_END) {
+            tp->ended = 1;
+            return 0;
+         }
+         if(tp->type == BLOCK_STATE) {
+            if(tp->memory) {
+               if(!ReadData(tp)) {
+                  return -1;
+               }
+            } else if(!SkipData(tp)) {
+               return -1;
+            }
+         } else if(tp->first + tp->count <= from) {
+            if(!SkipData(tp)) {
+               return -1;
+            }
+            tp->step = tp->first + tp->count;
+         } else {
+            if(!ReadData(tp)) {
+               return -1;
+            }
+            tp->left = tp->count;
+         }
+      }
+
+      p = &tp->data[tp->pos];
+      end = &tp->data[tp->size];
+      bits = *p++;
+      length = ((bits & TRACE_PC) ? 2 : 0) + ((bits & TRACE_A) ? 1 : 0)
+             + ((bits & TRACE_B) ? 1 : 0) + ((bits & TRACE_C) ? 1 : 0)
+             + ((bits & TRACE_X) ? 2 : 0) + ((bits & TRACE_FLAGS) ? 1 : 0)
+             + 1;
+      if(p + length > end) {
+         fprintf(stderr, "ERROR: %s has an invalid record\n", tp->name);
+         return -1;
+      }
+
+      sp->step = tp->step;
+      sp->bits = bits;
+      sp->pc = tp->pc;
+      if(bits & TRACE_PC) {
+         sp->pc = GetNumber(p, 2);
+         p += 2;
+      }
+      if(bits & TRACE_A) {
+         tp->a = *p++;
+      }
+      if(bits & TRACE_B) {
+         tp->b = *p++;
+      }
+      if(bits & TRACE_C) {
+         tp->c = *p++;
+      }
+      if(bits & TRACE_X) {
+         tp->x = GetNumber(p, 2);
+         p += 2;
+      }
+      if(bits & TRACE_FLAGS) {
+         tp->flags = *p++;
+      }
+      sp->opcode = *p++;
+      sp->operand = 0;
+      tp->pc = sp->pc + 1;
+      if(sp->opcode < 0x20) {
+         if(p + 2 > end) {
+            fprintf(stderr, "ERROR: %s has an invalid record\n", tp->name);
+            return -1;
+         }
+         sp->operand = GetNumber(p, 2);
+         p += 2;
+         tp->pc = sp->pc + 3;
+      }
+      tp->pos = p - tp->data;
+      --tp->left;
+      ++tp->step;
+
+      sp->a = tp->a;
+      sp->b = tp->b;
+      sp->c = tp->c;
+      sp->x = tp->x;
+      sp->flags = tp->flags;
+
+      /* Stores leave the registers as they were, so the value is the
+       * register after the instruction. */
+      sp->stored = 1;
+      switch(sp->opcode) {
+      case 0x14:  sp->store_addr = sp->operand; sp->store_value = sp->b;
+                  break;
+      case 0x15:  sp->store_addr = sp->operand; sp->store_value = sp->c;
+                  break;
+      case 0x16:  sp->store_addr = sp->operand;
+                  sp->store_value = sp->x >> 8;
+                  break;
+      case 0x17:  sp->store_addr = sp->operand;
+                  sp->store_value = sp->x & 0xFF;
+                  break;
+      case 0x18:  sp->store_addr = sp->operand; sp->store_value = sp->a;
+                  break;
+      case 0x32:  sp->store_addr = sp->x; sp->store_value = sp->a;
+                  break;
+      case 0x33:  sp->store_addr = sp->x; sp->store_value = sp->b;
+                  break;
+      case 0x34:  sp->store_addr = sp->x; sp->store_value = sp->c;
+                  break;
+      default:    sp->stored = 0;
+                  break;
+      }
+
+      if(sp->step >= from) {
+         return 1;
+      }
+
+   }
+
+}
+
+/* Compare two steps, ignoring which registers are marked as changed
+ * since that depends on where each trace was started. */
+int SameStep(const StepType *a, const StepType *b) {
+   return a->step == b->step && a->pc == b->pc && a->opcode == b->opcode
+       && a->operand == b->operand && a->a == b->a && a->b == b->b
+       && a->c == b->c && a->x == b->x && a->flags == b->flags;
+}
+
+unsigned long long GetNumber(const unsigned char *p, unsigned int size) {
+   unsigned long long value = 0;
+   unsigned int x;
+   for(x = 0; x < size; x++) {
+      value |= (unsigned long long)p[x] << (x * 8);
+   }
+   return value;
+}
@@ -0,0 +1,28 @@
+; Store to flag once, then count to 65536 in lo and hi, which share
+; its page, so every checkpoint interval writes to that page.
+; "q1sim -lastwrite flag" must find the store at step 1.
+start:
+   ldb   one
+   stb   flag
+loop:
+   ldb   lo
+   inc
+   sta   lo
+   jc    carry
+   j     loop
+carry:
+   ldb   hi
+   inc
+   sta   hi
+   jc    done
+   j     loop
+done:
+   hlt
+one:
+   db    1
+flag:
+   db    0
+lo:
+   db    0
+hi:
+   db    0